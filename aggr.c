@@ -0,0 +1,468 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "aggr.h"
+#include "stats.h"
+
+#define TAG "Aggregation:"
+
+/* Load factor of the probe table, the window is written out early above  */
+#define AGGR_MAX_LOAD_PCT 75
+#define AGGR_OUT_BUF_SIZE (256*1024)
+#define AGGR_SUBSCRIBER_ID_SIZE (64+1)
+
+/* Unused key fields are zero, keys are hashed and compared as 64-bit words  */
+struct aggr_key_t {
+   char subscriber_id[AGGR_SUBSCRIBER_ID_SIZE];
+   uint8_t pad[7];
+   int32_t service_id;
+   int32_t protocol_id;
+   int32_t package_id;
+   uint32_t client_net;
+};
+
+struct aggr_entry_t {
+   struct aggr_key_t key;
+   uint32_t turs;
+   uint64_t upstream;
+   uint64_t downstream;
+   uint64_t duration_ms;
+};
+
+/* Probe table: 8 bytes per slot, entries are dense in insertion order  */
+struct aggr_slot_t {
+   uint32_t hash;
+   /* Entry index + 1, 0 - free slot  */
+   uint32_t idx;
+};
+
+struct rdr_aggr_ctx_t {
+   unsigned keys;
+   unsigned client_prefix;
+   uint32_t client_mask;
+   unsigned window_s;
+   unsigned entries_size;
+   char *out_fname;
+   int verbose;
+
+   FILE *out;
+   char *out_buf;
+
+   struct aggr_slot_t *slots;
+   unsigned slots_mask;
+   struct aggr_entry_t *entries;
+   unsigned entries_cnt;
+
+   /* Open window: start, local arrival of its last TUR  */
+   int open;
+   time_t window;
+   unsigned long long last_us;
+
+   struct {
+      unsigned long long turs;
+      unsigned long long late_turs;
+      unsigned long long rollups;
+      unsigned long long windows;
+      unsigned long long early_flushes;
+      unsigned long long write_errors;
+   } stats;
+};
+
+struct rdr_aggr_ctx_t *rdr_aggr_init()
+{
+   struct rdr_aggr_ctx_t *ctx;
+
+   assert(sizeof(struct aggr_key_t) % sizeof(uint64_t) == 0);
+
+   ctx = (struct rdr_aggr_ctx_t *)calloc(1, sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->window_s = RDR_AGGR_DEFAULT_WINDOW_S;
+   ctx->entries_size = RDR_AGGR_DEFAULT_ENTRIES;
+   ctx->client_prefix = 32;
+   ctx->client_mask = 0xffffffff;
+
+   return ctx;
+}
+
+int rdr_aggr_set_keys(struct rdr_aggr_ctx_t *ctx, const char *keys, FILE *err_stream)
+{
+   char *str, *p, *endptr, *last;
+   char *window, *entries;
+   unsigned long val;
+   int res;
+
+   assert(ctx);
+   assert(keys);
+
+   str = strdup(keys);
+   if (str == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+      return -1;
+   }
+
+   res = -1;
+   ctx->keys = 0;
+   window = strchr(str, '/');
+   entries = NULL;
+   if (window != NULL) {
+      *window++ = '\0';
+      entries = strchr(window, '/');
+      if (entries != NULL)
+	 *entries++ = '\0';
+   }
+
+   for (p = strtok_r(str, ",", &last); p != NULL; p = strtok_r(NULL, ",", &last)) {
+      if (strcmp(p, "subscriber") == 0)
+	 ctx->keys |= RDR_AGGR_KEY_SUBSCRIBER;
+      else if (strcmp(p, "service") == 0)
+	 ctx->keys |= RDR_AGGR_KEY_SERVICE;
+      else if (strcmp(p, "protocol") == 0)
+	 ctx->keys |= RDR_AGGR_KEY_PROTOCOL;
+      else if (strcmp(p, "package") == 0)
+	 ctx->keys |= RDR_AGGR_KEY_PACKAGE;
+      else if (strncmp(p, "client", 6) == 0 && (p[6] == '\0' || (p[6] == ':'))) {
+	 ctx->keys |= RDR_AGGR_KEY_CLIENT;
+	 ctx->client_prefix = 32;
+	 if (p[6] == ':') {
+	    val = strtoul(p + 7, &endptr, 10);
+	    if (*endptr != '\0' || (val > 32) || (p[7] == '\0')) {
+	       if (err_stream != NULL) fprintf(err_stream, "%s wrong client prefix `%s`\n", TAG, p);
+	       goto done;
+	    }
+	    ctx->client_prefix = (unsigned)val;
+	 }
+	 ctx->client_mask = ctx->client_prefix == 0 ? 0 : 0xffffffff << (32 - ctx->client_prefix);
+      }else {
+	 if (err_stream != NULL) fprintf(err_stream, "%s unknown key `%s`, expected subscriber, "
+	       "service, protocol, package or client[:len]\n", TAG, p);
+	 goto done;
+      }
+   }
+
+   if (ctx->keys == 0) {
+      if (err_stream != NULL) fprintf(err_stream, "%s no keys in `%s`\n", TAG, keys);
+      goto done;
+   }
+
+   if (window != NULL) {
+      val = strtoul(window, &endptr, 10);
+      if (*endptr != '\0' || (val == 0) || (val > 86400)) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong window `%s`\n", TAG, window);
+	 goto done;
+      }
+      ctx->window_s = (unsigned)val;
+   }
+
+   if (entries != NULL) {
+      val = strtoul(entries, &endptr, 10);
+      if (*endptr != '\0' || (val < 1024) || (val > (1ul << 24))) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong table size `%s`\n", TAG, entries);
+	 goto done;
+      }
+      ctx->entries_size = (unsigned)val;
+   }
+
+   res = 0;
+
+done:
+   free(str);
+   return res;
+}
+
+int rdr_aggr_set_output(struct rdr_aggr_ctx_t *ctx, const char *fname, FILE *err_stream)
+{
+   assert(ctx);
+   assert(fname);
+
+   free(ctx->out_fname);
+   ctx->out_fname = strdup(fname);
+   if (ctx->out_fname == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+      return -1;
+   }
+
+   return 0;
+}
+
+int rdr_aggr_is_enabled(struct rdr_aggr_ctx_t *ctx)
+{
+   return ctx->keys != 0;
+}
+
+unsigned rdr_aggr_keys(struct rdr_aggr_ctx_t *ctx)
+{
+   return ctx->keys;
+}
+
+int rdr_aggr_start(struct rdr_aggr_ctx_t *ctx, int verbose)
+{
+   unsigned slots;
+
+   assert(ctx);
+
+   ctx->verbose = verbose;
+   if (!rdr_aggr_is_enabled(ctx))
+      return 0;
+
+   /* Probe table is a power of 2 with the entries under AGGR_MAX_LOAD_PCT  */
+   for (slots = 1024; (unsigned long long)slots * AGGR_MAX_LOAD_PCT / 100 < ctx->entries_size; slots *= 2)
+      ;
+   ctx->slots_mask = slots - 1;
+   ctx->slots = calloc(slots, sizeof(*ctx->slots));
+   ctx->entries = malloc((size_t)ctx->entries_size * sizeof(*ctx->entries));
+   if (ctx->slots == NULL || (ctx->entries == NULL)) {
+      fprintf(stderr, "%s malloc() error\n", TAG);
+      return -1;
+   }
+   /* Fault in the pages now, not on the first TURs  */
+   memset(ctx->entries, 0, (size_t)ctx->entries_size * sizeof(*ctx->entries));
+
+   if (ctx->out_fname == NULL || (strcmp(ctx->out_fname, "-") == 0))
+      ctx->out = stdout;
+   else {
+      ctx->out = fopen(ctx->out_fname, "a");
+      if (ctx->out == NULL) {
+	 fprintf(stderr, "%s fopen(%s) error: %s\n", TAG, ctx->out_fname, strerror(errno));
+	 return -1;
+      }
+      ctx->out_buf = malloc(AGGR_OUT_BUF_SIZE);
+      if (ctx->out_buf != NULL)
+	 setvbuf(ctx->out, ctx->out_buf, _IOFBF, AGGR_OUT_BUF_SIZE);
+   }
+
+   if (verbose)
+      fprintf(stderr, "%s %u s windows, %u entries, writing to %s\n", TAG,
+	    ctx->window_s, ctx->entries_size, ctx->out == stdout ? "stdout" : ctx->out_fname);
+
+   return 0;
+}
+
+static inline uint32_t key_hash(const struct aggr_key_t *key)
+{
+   uint64_t h, w;
+   size_t i;
+
+   h = 0xcbf29ce484222325ull;
+   for (i=0; i < sizeof(*key); i += sizeof(w)) {
+      memcpy(&w, (const uint8_t *)key + i, sizeof(w));
+      h = (h ^ w) * 0x100000001b3ull;
+      h ^= h >> 29;
+   }
+
+   return (uint32_t)(h ^ (h >> 32));
+}
+
+static void write_entry(struct rdr_aggr_ctx_t *ctx, const struct aggr_entry_t *e)
+{
+   FILE *out;
+   struct in_addr client;
+
+   out = ctx->out;
+   fprintf(out, "ts=%lu window=%u", (unsigned long)ctx->window, ctx->window_s);
+   if (ctx->keys & RDR_AGGR_KEY_SUBSCRIBER)
+      fprintf(out, " subscriber_id=%s", e->key.subscriber_id);
+   if (ctx->keys & RDR_AGGR_KEY_SERVICE)
+      fprintf(out, " service_id=%i", e->key.service_id);
+   if (ctx->keys & RDR_AGGR_KEY_PROTOCOL)
+      fprintf(out, " protocol_id=%i", e->key.protocol_id);
+   if (ctx->keys & RDR_AGGR_KEY_PACKAGE)
+      fprintf(out, " package_id=%i", e->key.package_id);
+   if (ctx->keys & RDR_AGGR_KEY_CLIENT) {
+      client.s_addr = e->key.client_net;
+      fprintf(out, " client=%s/%u", inet_ntoa(client), ctx->client_prefix);
+   }
+   fprintf(out, " turs=%u upstream=%llu downstream=%llu duration_ms=%llu\n",
+	 e->turs, (unsigned long long)e->upstream, (unsigned long long)e->downstream,
+	 (unsigned long long)e->duration_ms);
+}
+
+/* Writes out and empties the table  */
+static void flush_window(struct rdr_aggr_ctx_t *ctx)
+{
+   unsigned i;
+
+   if (ctx->entries_cnt == 0)
+      return;
+
+   for (i=0; i < ctx->entries_cnt; ++i)
+      write_entry(ctx, &ctx->entries[i]);
+   if (fflush(ctx->out) != 0)
+      ctx->stats.write_errors += 1;
+
+   ctx->stats.rollups += ctx->entries_cnt;
+   memset(ctx->slots, 0, (size_t)(ctx->slots_mask + 1) * sizeof(*ctx->slots));
+   ctx->entries_cnt = 0;
+}
+
+void rdr_aggr_add(struct rdr_aggr_ctx_t *ctx, const struct rdr_aggr_tur_t *tur)
+{
+   struct aggr_key_t key;
+   struct aggr_entry_t *e;
+   struct aggr_slot_t *slot;
+   time_t window;
+   uint32_t hash;
+   unsigned i;
+
+   if (ctx->slots == NULL)
+      return;
+
+   ctx->stats.turs += 1;
+
+   /* REPORT_TIME below window_s is window 0, a window like the others  */
+   window = tur->report_time - tur->report_time % ctx->window_s;
+   if (!ctx->open || (window > ctx->window)) {
+      flush_window(ctx);
+      if (ctx->open)
+	 ctx->stats.windows += 1;
+      ctx->window = window;
+      ctx->open = 1;
+   }else if (window < ctx->window)
+      ctx->stats.late_turs += 1;
+   ctx->last_us = tur->arrival_us;
+
+   memset(&key, 0, sizeof(key));
+   if ((ctx->keys & RDR_AGGR_KEY_SUBSCRIBER) && (tur->subscriber_id != NULL))
+      strncpy(key.subscriber_id, tur->subscriber_id, sizeof(key.subscriber_id) - 1);
+   if (ctx->keys & RDR_AGGR_KEY_SERVICE)
+      key.service_id = tur->service_id;
+   if (ctx->keys & RDR_AGGR_KEY_PROTOCOL)
+      key.protocol_id = tur->protocol_id;
+   if (ctx->keys & RDR_AGGR_KEY_PACKAGE)
+      key.package_id = tur->package_id;
+   if (ctx->keys & RDR_AGGR_KEY_CLIENT)
+      key.client_net = tur->client_ip & htonl(ctx->client_mask);
+
+   hash = key_hash(&key);
+   for (i = hash & ctx->slots_mask; ; i = (i + 1) & ctx->slots_mask) {
+      slot = &ctx->slots[i];
+      if (slot->idx == 0)
+	 break;
+      if (slot->hash == hash
+	    && (memcmp(&ctx->entries[slot->idx - 1].key, &key, sizeof(key)) == 0))
+	 break;
+   }
+
+   if (slot->idx == 0) {
+      if (ctx->entries_cnt == ctx->entries_size) {
+	 /* Table is full: write out what we have, continue the window  */
+	 flush_window(ctx);
+	 ctx->stats.early_flushes += 1;
+	 for (i = hash & ctx->slots_mask; ctx->slots[i].idx != 0; i = (i + 1) & ctx->slots_mask)
+	    ;
+	 slot = &ctx->slots[i];
+      }
+      e = &ctx->entries[ctx->entries_cnt++];
+      e->key = key;
+      e->turs = 0;
+      e->upstream = 0;
+      e->downstream = 0;
+      e->duration_ms = 0;
+      slot->hash = hash;
+      slot->idx = ctx->entries_cnt;
+   }else
+      e = &ctx->entries[slot->idx - 1];
+
+   e->turs += 1;
+   e->upstream += tur->upstream_volume;
+   e->downstream += tur->downstream_volume;
+   e->duration_ms += tur->millisec_duration;
+}
+
+void rdr_aggr_flush_idle(struct rdr_aggr_ctx_t *ctx, unsigned long long now_us)
+{
+   if (ctx->slots == NULL || !ctx->open)
+      return;
+
+   if (now_us >= ctx->last_us + 1000000ull * ctx->window_s) {
+      flush_window(ctx);
+      ctx->stats.windows += 1;
+      ctx->open = 0;
+   }
+}
+
+void rdr_aggr_destroy(struct rdr_aggr_ctx_t *ctx)
+{
+   if (ctx == NULL)
+      return;
+
+   if (ctx->slots != NULL && (ctx->out != NULL))
+      flush_window(ctx);
+
+   if (ctx->out != NULL && (ctx->out != stdout)) {
+      if (fclose(ctx->out) != 0)
+	 perror("fclose() error");
+   }else if (ctx->out != NULL)
+      fflush(ctx->out);
+
+   free(ctx->out_buf);
+   free(ctx->slots);
+   free(ctx->entries);
+   free(ctx->out_fname);
+   free(ctx);
+}
+
+void rdr_aggr_print_stats(struct rdr_aggr_ctx_t *ctx, FILE *stream)
+{
+   assert(ctx);
+   assert(stream);
+
+   if (ctx->slots == NULL)
+      return;
+
+#define PRINT_AGGR_METRIC(_name, _type, _help, _val) \
+   stats_print_header(stream, "rdr2netflow_aggr_" _name, _type, _help); \
+   fprintf(stream, "rdr2netflow_aggr_" _name " %llu\n", (unsigned long long)(_val));
+
+   PRINT_AGGR_METRIC("turs_total", "counter",
+	 "TURs summed into the rollups", ctx->stats.turs)
+   PRINT_AGGR_METRIC("late_turs_total", "counter",
+	 "TURs of an already written window, summed into the open one", ctx->stats.late_turs)
+   PRINT_AGGR_METRIC("rollups_total", "counter",
+	 "Rollup lines written", ctx->stats.rollups)
+   PRINT_AGGR_METRIC("windows_total", "counter",
+	 "Closed windows", ctx->stats.windows)
+   PRINT_AGGR_METRIC("early_flushes_total", "counter",
+	 "Windows written out early because the table was full", ctx->stats.early_flushes)
+   PRINT_AGGR_METRIC("write_errors_total", "counter",
+	 "Rollup output write errors", ctx->stats.write_errors)
+   PRINT_AGGR_METRIC("entries", "gauge",
+	 "Keys in the open window", ctx->entries_cnt)
+
+#undef PRINT_AGGR_METRIC
+}
@@ -0,0 +1,85 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _AGGR_H
+#define _AGGR_H
+
+#define RDR_AGGR_DEFAULT_WINDOW_S 300
+#define RDR_AGGR_DEFAULT_ENTRIES 65536
+
+/* Key fields  */
+#define RDR_AGGR_KEY_SUBSCRIBER 0x01
+#define RDR_AGGR_KEY_SERVICE    0x02
+#define RDR_AGGR_KEY_PROTOCOL   0x04
+#define RDR_AGGR_KEY_PACKAGE    0x08
+#define RDR_AGGR_KEY_CLIENT     0x10
+
+struct rdr_aggr_tur_t {
+   const char *subscriber_id;
+   int service_id;
+   int protocol_id;
+   int package_id;
+   /* Network byte order  */
+   in_addr_t client_ip;
+   time_t report_time;
+   unsigned millisec_duration;
+   unsigned long long upstream_volume;
+   unsigned long long downstream_volume;
+   /* Local arrival, stats_monotonic_us()  */
+   unsigned long long arrival_us;
+};
+
+/*
+ * TURs are summed by the key over fixed windows of REPORT_TIME. A window
+ * is written out as one line per key when a TUR of a later window
+ * arrives, when no TURs arrive for one more window, or on exit:
+ *
+ * ts=<window start> window=<sec> <key>=<value>... turs=N upstream=N downstream=N duration_ms=N
+ *
+ * Late TURs are summed into the open window. If the table is full, the
+ * window is written out early and continues in an empty table, so the
+ * same key may be written more than once per window: consumers sum them.
+ */
+struct rdr_aggr_ctx_t *rdr_aggr_init();
+/* Writes out the open window  */
+void rdr_aggr_destroy(struct rdr_aggr_ctx_t *ctx);
+/* key[,key...][/sec[/entries]], keys: subscriber, service, protocol, package, client[:len]  */
+int rdr_aggr_set_keys(struct rdr_aggr_ctx_t *ctx, const char *keys, FILE *err_stream);
+/* "-" - stdout (default)  */
+int rdr_aggr_set_output(struct rdr_aggr_ctx_t *ctx, const char *fname, FILE *err_stream);
+int rdr_aggr_is_enabled(struct rdr_aggr_ctx_t *ctx);
+unsigned rdr_aggr_keys(struct rdr_aggr_ctx_t *ctx);
+
+int rdr_aggr_start(struct rdr_aggr_ctx_t *ctx, int verbose);
+void rdr_aggr_add(struct rdr_aggr_ctx_t *ctx, const struct rdr_aggr_tur_t *tur);
+/*
+ * Writes out the open window if no TURs arrived for a window. Local time:
+ * the SCE clock may lag
+ */
+void rdr_aggr_flush_idle(struct rdr_aggr_ctx_t *ctx, unsigned long long now_us);
+void rdr_aggr_print_stats(struct rdr_aggr_ctx_t *ctx, FILE *stream);
+
+#endif /* _AGGR_H  */
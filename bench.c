@@ -0,0 +1,553 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks of the framing, decoding and export hot paths.
+ *
+ * rdr2netflow.c is included directly to reach its static functions.
+ * Output is tab-separated, one line per benchmark:
+ *    benchmark  ops  ns_per_op  cycles_per_op  frames_per_s
+ * cycles_per_op is in stats_cycles() units: TSC ticks on x86, nanoseconds
+ * elsewhere.
+ */
+
+#define main rdr2netflow_main
+#include "rdr2netflow.c"
+#undef main
+
+#define BENCH_DEFAULT_FRAMES 10000
+#define BENCH_DEFAULT_TIME_S 0.5
+
+struct corpus_t {
+   uint8_t *data;
+   size_t size;
+
+   /* Frame offsets and sizes  */
+   size_t *frame_pos;
+   int *frame_size;
+   size_t frames_cnt;
+   size_t turs_cnt;
+};
+
+struct bench_t {
+   const char *name;
+   struct timespec start_ts;
+   unsigned long long start_cycles;
+};
+
+static double bench_time_s = BENCH_DEFAULT_TIME_S;
+
+/* Keeps results alive  */
+static volatile unsigned long long sink;
+
+static double elapsed_s(const struct timespec *start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void bench_start(struct bench_t *b, const char *name)
+{
+   b->name = name;
+   clock_gettime(CLOCK_MONOTONIC, &b->start_ts);
+   b->start_cycles = stats_cycles();
+}
+
+static int bench_done(const struct bench_t *b)
+{
+   return elapsed_s(&b->start_ts) >= bench_time_s;
+}
+
+/*
+ * ops - number of operations, frames - number of RDR frames processed by them
+ */
+static void bench_report(const struct bench_t *b, unsigned long long ops, unsigned long long frames)
+{
+   double elapsed;
+   unsigned long long cycles;
+
+   cycles = stats_cycles() - b->start_cycles;
+   elapsed = elapsed_s(&b->start_ts);
+
+   printf("%s\t%llu\t%.2f\t%.2f\t%.0f\n",
+	 b->name,
+	 ops,
+	 ops ? elapsed * 1e9 / ops : 0.0,
+	 ops ? (double)cycles / ops : 0.0,
+	 elapsed > 0 ? frames / elapsed : 0.0);
+   fflush(stdout);
+}
+
+static void fill_tur(struct rdr_packet_t *pkt, unsigned i)
+{
+   memset(pkt, 0, sizeof(*pkt));
+   pkt->header.ppc_num = 1;
+   pkt->header.tag = TRANSACTION_USAGE_RDR;
+   snprintf(pkt->rdr.transaction_usage.subscriber_id,
+	 sizeof(pkt->rdr.transaction_usage.subscriber_id), "subscriber%u", i % 50000);
+   pkt->rdr.transaction_usage.package_id = i % 16;
+   pkt->rdr.transaction_usage.service_id = i % 64;
+   pkt->rdr.transaction_usage.protocol_id = i % 128;
+   pkt->rdr.transaction_usage.server_ip.s_addr = htonl(0xc0000000 | ((i * 2654435761U) & 0xffffff));
+   pkt->rdr.transaction_usage.server_port = 80;
+   snprintf(pkt->rdr.transaction_usage.access_string,
+	 sizeof(pkt->rdr.transaction_usage.access_string), "www%u.example.com", i % 1000);
+   snprintf(pkt->rdr.transaction_usage.info_string,
+	 sizeof(pkt->rdr.transaction_usage.info_string), "/index%u.html", i % 100);
+   pkt->rdr.transaction_usage.client_ip.s_addr = htonl(0x0a000000 | (i & 0xffffff));
+   pkt->rdr.transaction_usage.client_port = 1024 + i % 60000;
+   pkt->rdr.transaction_usage.initiating_side = i % 4 == 0;
+   pkt->rdr.transaction_usage.report_time = 1350000000 + i;
+   pkt->rdr.transaction_usage.millisec_duration = i % 60000;
+   pkt->rdr.transaction_usage.session_upstream_volume = i % 100000;
+   pkt->rdr.transaction_usage.session_downstream_volume = i % 10000000;
+   pkt->rdr.transaction_usage.ip_protocol = 6;
+}
+
+static int corpus_add_frame(struct corpus_t *c, size_t pos, int size)
+{
+   struct rdr_packet_t pkt;
+
+   c->frame_pos[c->frames_cnt] = pos;
+   c->frame_size[c->frames_cnt] = size;
+   c->frames_cnt += 1;
+   if (decode_rdr_packet(&c->data[pos], size, &pkt) > 0
+	 && pkt.header.tag == TRANSACTION_USAGE_RDR)
+      c->turs_cnt += 1;
+
+   return 0;
+}
+
+static int corpus_generate(struct corpus_t *c, unsigned frames, unsigned tag)
+{
+   unsigned i;
+   size_t pos;
+   int size;
+   struct rdr_packet_t pkt;
+
+   c->data = (uint8_t *)malloc((size_t)frames * MAX_RDR_PACKET_SIZE);
+   c->frame_pos = (size_t *)malloc(frames * sizeof(c->frame_pos[0]));
+   c->frame_size = (int *)malloc(frames * sizeof(c->frame_size[0]));
+   if (c->data == NULL || c->frame_pos == NULL || c->frame_size == NULL) {
+      perror("malloc() error");
+      return -1;
+   }
+   c->frames_cnt = c->turs_cnt = 0;
+
+   pos = 0;
+   for (i=0; i < frames; ++i) {
+      fill_tur(&pkt, i);
+      pkt.header.tag = tag;
+      size = encode_rdr_packet(&pkt, &c->data[pos], MAX_RDR_PACKET_SIZE);
+      if (size <= 0) {
+	 fprintf(stderr, "encode_rdr_packet() error %i on frame %u\n", size, i);
+	 return -1;
+      }
+      corpus_add_frame(c, pos, size);
+      pos += size;
+   }
+   c->size = pos;
+
+   return 0;
+}
+
+/* Raw RDR stream recorded from SCE  */
+static int corpus_load(struct corpus_t *c, const char *fname)
+{
+   FILE *f;
+   long fsize;
+   size_t pos;
+
+   f = fopen(fname, "rb");
+   if (f == NULL) {
+      perror("fopen() error");
+      return -1;
+   }
+   fseek(f, 0, SEEK_END);
+   fsize = ftell(f);
+   fseek(f, 0, SEEK_SET);
+   if (fsize <= 0) {
+      fprintf(stderr, "Empty corpus %s\n", fname);
+      fclose(f);
+      return -1;
+   }
+
+   c->data = (uint8_t *)malloc(fsize);
+   c->frame_pos = (size_t *)malloc((fsize / 20 + 1) * sizeof(c->frame_pos[0]));
+   c->frame_size = (int *)malloc((fsize / 20 + 1) * sizeof(c->frame_size[0]));
+   if (c->data == NULL || c->frame_pos == NULL || c->frame_size == NULL) {
+      perror("malloc() error");
+      fclose(f);
+      return -1;
+   }
+   if (fread(c->data, 1, fsize, f) != (size_t)fsize) {
+      perror("fread() error");
+      fclose(f);
+      return -1;
+   }
+   fclose(f);
+   c->size = fsize;
+   c->frames_cnt = c->turs_cnt = 0;
+
+   pos = 0;
+   while (pos < c->size) {
+      int size = is_rdr_packet(&c->data[pos], c->size - pos);
+      if (size > 0) {
+	 corpus_add_frame(c, pos, size);
+	 pos += size;
+      }else
+	 pos += 1;
+   }
+
+   if (c->frames_cnt == 0) {
+      fprintf(stderr, "No RDR frames in %s\n", fname);
+      return -1;
+   }
+
+   return 0;
+}
+
+static void corpus_free(struct corpus_t *c)
+{
+   free(c->data);
+   free(c->frame_pos);
+   free(c->frame_size);
+}
+
+static struct rdr_session_ctx_t *new_session(struct ctx_t *ctx)
+{
+   struct rdr_session_ctx_t *session;
+   struct sockaddr_in remote_addr;
+
+   if (posix_memalign((void **)&session, STATS_CACHE_LINE_SIZE, session_size(ctx)) != 0)
+      return NULL;
+   memset(&remote_addr, 0, sizeof(remote_addr));
+   init_session(ctx, session, -1, &remote_addr);
+
+   return session;
+}
+
+/*
+ * UDP sink for the netflow datagrams. Nobody reads it: the kernel drops
+ * datagrams when the receive buffer is full
+ */
+static int init_netflow_sink(struct ctx_t *ctx)
+{
+   int s;
+   struct sockaddr_in addr;
+   socklen_t addrlen;
+
+   s = socket(PF_INET, SOCK_DGRAM, 0);
+   if (s < 0)
+      return -1;
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   addr.sin_port = 0;
+   if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      return -1;
+   addrlen = sizeof(addr);
+   if (getsockname(s, (struct sockaddr *)&addr, &addrlen) < 0)
+      return -1;
+
+   if (rdr_collector_add(ctx->collectors, "127.0.0.1", NULL) < 0)
+      return -1;
+   ctx->opts.dst_port = ntohs(addr.sin_port);
+   ctx->opts.verbose = 0;
+
+   return init_sending_socket(ctx);
+}
+
+static void bench_is_rdr_packet(const struct corpus_t *c)
+{
+   size_t i;
+   unsigned long long ops;
+   struct bench_t b;
+
+   bench_start(&b, "is_rdr_packet");
+   ops = 0;
+   do {
+      for (i=0; i < c->frames_cnt; ++i)
+	 sink += is_rdr_packet(&c->data[c->frame_pos[i]], c->size - c->frame_pos[i]);
+      ops += c->frames_cnt;
+   } while (!bench_done(&b));
+   bench_report(&b, ops, ops);
+}
+
+static void bench_decode_rdr_packet(const char *name, const struct corpus_t *c)
+{
+   size_t i;
+   unsigned long long ops;
+   struct bench_t b;
+   struct rdr_packet_t pkt;
+
+   bench_start(&b, name);
+   ops = 0;
+   do {
+      for (i=0; i < c->frames_cnt; ++i)
+	 sink += decode_rdr_packet(&c->data[c->frame_pos[i]], c->frame_size[i], &pkt);
+      ops += c->frames_cnt;
+   } while (!bench_done(&b));
+   bench_report(&b, ops, ops);
+}
+
+static void count_packet(void *arg, const struct rdr_packet_t *pkt,
+      const uint8_t *raw, size_t raw_size)
+{
+   unsigned long long *decoded;
+
+   decoded = (unsigned long long *)arg;
+   *decoded += 1;
+   sink += pkt->header.tag + raw[raw_size - 1];
+}
+
+static void bench_rdr_parser_feed(const struct corpus_t *c, size_t chunk_size)
+{
+   size_t pos, chunk;
+   unsigned long long ops, frames, decoded;
+   char name[80];
+   struct bench_t b;
+   struct rdr_parser_t *parser;
+
+   parser = malloc(sizeof(*parser));
+   if (parser == NULL)
+      return;
+   decoded = 0;
+   rdr_parser_init(parser, count_packet, &decoded);
+
+   snprintf(name, sizeof(name), "rdr_parser_feed/chunk%u", (unsigned)chunk_size);
+   bench_start(&b, name);
+   ops = frames = 0;
+   do {
+      for (pos = 0; pos < c->size; pos += chunk) {
+	 chunk = c->size - pos < chunk_size ? c->size - pos : chunk_size;
+	 rdr_parser_feed(parser, &c->data[pos], chunk);
+	 ops += 1;
+      }
+      frames += c->frames_cnt;
+   } while (!bench_done(&b));
+   bench_report(&b, ops, frames);
+   if (decoded != frames)
+      fprintf(stderr, "rdr_parser_feed: %llu of %llu frames decoded\n", decoded, frames);
+
+   free(parser);
+}
+
+static void free_ip_filter(struct ctx_t *ctx)
+{
+   while (ctx->opts.ip_filter != NULL) {
+      struct ipfilter_item_t *i;
+      i = ctx->opts.ip_filter;
+      ctx->opts.ip_filter = i->next;
+      free(i);
+   }
+}
+
+static void bench_is_ip_filtered(struct ctx_t *ctx, unsigned prefixes)
+{
+   unsigned i;
+   unsigned long long ops;
+   char name[80];
+   char net[40];
+   struct bench_t b;
+   in_addr_t ips[1024];
+
+   free_ip_filter(ctx);
+   for (i=0; i < prefixes; ++i) {
+      /* 172.16.0.0/12 split into /24s: never matches test IPs  */
+      snprintf(net, sizeof(net), "172.%u.%u.0/24", 16 + (i >> 8) % 16, i & 0xff);
+      if (ip_filter_add_networks(ctx, net) < 0)
+	 return;
+   }
+   for (i=0; i < sizeof(ips)/sizeof(ips[0]); ++i)
+      ips[i] = htonl(0x0a000000 | (i * 2654435761U >> 8));
+
+   snprintf(name, sizeof(name), "is_ip_filtered/%u", prefixes);
+   bench_start(&b, name);
+   ops = 0;
+   do {
+      for (i=0; i < sizeof(ips)/sizeof(ips[0]); i += 2)
+	 sink += is_ip_filtered(ctx, ips[i], ips[i+1]);
+      ops += sizeof(ips)/sizeof(ips[0]) / 2;
+   } while (!bench_done(&b));
+   bench_report(&b, ops, ops);
+
+   free_ip_filter(ctx);
+}
+
+/* The same as read_data(), but data is taken from the corpus  */
+static void feed_session(struct ctx_t *ctx, struct rdr_session_ctx_t *session,
+      const uint8_t *data, size_t data_size)
+{
+   size_t chunk;
+
+   while (data_size > 0) {
+      chunk = sizeof(session->buf) - session->pos;
+      if (chunk > data_size)
+	 chunk = data_size;
+      memcpy(&session->buf[session->pos], data, chunk);
+      session->pos += chunk;
+      data += chunk;
+      data_size -= chunk;
+      convert_rcvd_data(ctx, session);
+   }
+}
+
+static void bench_convert_rcvd_data(struct ctx_t *ctx, const struct corpus_t *c, size_t chunk_size)
+{
+   size_t pos, chunk;
+   unsigned long long ops, frames;
+   char name[80];
+   struct bench_t b;
+   struct rdr_session_ctx_t *session;
+
+   session = new_session(ctx);
+   if (session == NULL)
+      return;
+
+   snprintf(name, sizeof(name), "convert_rcvd_data/chunk%u", (unsigned)chunk_size);
+   bench_start(&b, name);
+   ops = frames = 0;
+   do {
+      for (pos = 0; pos < c->size; pos += chunk) {
+	 chunk = c->size - pos < chunk_size ? c->size - pos : chunk_size;
+	 feed_session(ctx, session, &c->data[pos], chunk);
+	 ops += 1;
+      }
+      frames += c->frames_cnt;
+   } while (!bench_done(&b));
+   bench_report(&b, ops, frames);
+
+   free(session);
+}
+
+/*
+ * flush - send datagrams to the sink, otherwise only records
+ * encoding is measured
+ */
+static void bench_handle_rdr_packet(struct ctx_t *ctx, const struct corpus_t *c, int flush)
+{
+   size_t i;
+   unsigned long long ops;
+   struct bench_t b;
+   struct rdr_session_ctx_t *session;
+
+   session = new_session(ctx);
+   if (session == NULL)
+      return;
+
+   bench_start(&b, flush ? "handle_rdr_packet/send" : "handle_rdr_packet/encode");
+   ops = 0;
+   do {
+      for (i=0; i < c->frames_cnt; ++i) {
+	 handle_rdr_packet(ctx, session, &c->data[c->frame_pos[i]], c->frame_size[i]);
+	 if (!flush)
+	    session->dgrams[0].records_count = 0;
+      }
+      ops += c->frames_cnt;
+   } while (!bench_done(&b));
+   bench_report(&b, ops, ops);
+
+   free(session);
+}
+
+int main(int argc, char *argv[])
+{
+   int c;
+   unsigned frames_cnt;
+   const char *corpus_fname;
+   struct ctx_t *ctx;
+   struct corpus_t tur_corpus, transaction_corpus;
+
+   frames_cnt = BENCH_DEFAULT_FRAMES;
+   corpus_fname = NULL;
+
+   while ((c = getopt(argc, argv, "f:n:t:h")) != -1) {
+      switch (c) {
+	 case 'f':
+	    corpus_fname = optarg;
+	    break;
+	 case 'n':
+	    frames_cnt = (unsigned)strtoul(optarg, NULL, 10);
+	    break;
+	 case 't':
+	    bench_time_s = strtod(optarg, NULL);
+	    break;
+	 default:
+	    fprintf(stderr, "Usage: bench [-f raw_rdr_file] [-n frames] [-t seconds_per_bench]\n");
+	    return 1;
+      }
+   }
+   if (frames_cnt == 0)
+      frames_cnt = BENCH_DEFAULT_FRAMES;
+
+   ctx = init_ctx();
+   assert(ctx);
+   if (init_netflow_sink(ctx) < 0) {
+      perror("netflow sink error");
+      return 1;
+   }
+
+   if (corpus_fname != NULL) {
+      if (corpus_load(&tur_corpus, corpus_fname) < 0)
+	 return 1;
+   }else {
+      if (corpus_generate(&tur_corpus, frames_cnt, TRANSACTION_USAGE_RDR) < 0)
+	 return 1;
+   }
+   if (corpus_generate(&transaction_corpus, frames_cnt, TRANSACTION_RDR) < 0)
+      return 1;
+
+   printf("# corpus: %s, %u frames, %u TURs, %lu bytes\n",
+	 corpus_fname ? corpus_fname : "generated",
+	 (unsigned)tur_corpus.frames_cnt, (unsigned)tur_corpus.turs_cnt,
+	 (unsigned long)tur_corpus.size);
+   printf("# cycles: %s\n", STATS_CYCLES_UNIT);
+   printf("benchmark\tops\tns_per_op\tcycles_per_op\tframes_per_s\n");
+
+   bench_is_rdr_packet(&tur_corpus);
+   bench_decode_rdr_packet("decode_rdr_packet/tur", &tur_corpus);
+   bench_decode_rdr_packet("decode_rdr_packet/transaction", &transaction_corpus);
+   bench_rdr_parser_feed(&tur_corpus, 1460);
+   bench_rdr_parser_feed(&tur_corpus, 65536);
+   bench_is_ip_filtered(ctx, 1);
+   bench_is_ip_filtered(ctx, 100);
+   bench_is_ip_filtered(ctx, 10000);
+   bench_convert_rcvd_data(ctx, &tur_corpus, 1);
+   bench_convert_rcvd_data(ctx, &tur_corpus, 100);
+   bench_convert_rcvd_data(ctx, &tur_corpus, 1460);
+   bench_convert_rcvd_data(ctx, &tur_corpus, 65536);
+   bench_handle_rdr_packet(ctx, &tur_corpus, 0);
+   bench_handle_rdr_packet(ctx, &tur_corpus, 1);
+
+   corpus_free(&tur_corpus);
+   corpus_free(&transaction_corpus);
+   free_ctx(ctx);
+
+   return 0;
+}
@@ -0,0 +1,647 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capfile.h"
+#include "recorder.h"
+
+#define TAG "Capture file:"
+
+#define PCAP_MAGIC      0xa1b2c3d4
+#define PCAP_MAGIC_NS   0xa1b23c4d
+#define PCAPNG_MAGIC    0x0a0d0d0a
+#define PCAP_HDR_SIZE   24
+#define PCAP_REC_HDR_SIZE 16
+
+#define LINKTYPE_NULL        0
+#define LINKTYPE_ETHERNET    1
+#define LINKTYPE_RAW         101
+#define LINKTYPE_LINUX_SLL   113
+#define LINKTYPE_IPV4        228
+#define LINKTYPE_LINUX_SLL2  276
+
+#define ETHERTYPE_IP    0x0800
+#define ETHERTYPE_VLAN  0x8100
+#define ETHERTYPE_QINQ  0x88a8
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+
+#define STREAMS_HASH_SIZE 1024
+
+struct tcp_seg_t {
+   uint32_t seq;
+   const uint8_t *data;
+   size_t size;
+};
+
+struct tcp_stream_t {
+   struct sockaddr_in src;
+   struct sockaddr_in dst;
+   struct tcp_stream_t *next;
+
+   void *user;
+   int has_seq;
+   uint32_t next_seq;
+
+   unsigned ooo_cnt;
+   struct tcp_seg_t ooo[CAPFILE_OOO_MAX];
+};
+
+struct capfile_ctx_t {
+   const char *fname;
+   FILE *err_stream;
+
+   const uint8_t *data;
+   size_t size;
+
+   int is_pcap;
+   int is_segment;
+   int swapped;
+   unsigned linktype;
+
+   capfile_open_f open_f;
+   capfile_data_f data_f;
+   capfile_close_f close_f;
+   void *cb_arg;
+
+   struct tcp_stream_t *streams[STREAMS_HASH_SIZE];
+
+   struct capfile_stats_t stats;
+};
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+   return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get_be32(const uint8_t *p)
+{
+   return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline uint32_t get_pcap32(const struct capfile_ctx_t *ctx, const uint8_t *p)
+{
+   uint32_t res;
+   memcpy(&res, p, sizeof(res));
+   return ctx->swapped ? __builtin_bswap32(res) : res;
+}
+
+struct capfile_ctx_t *capfile_open(const char *fname, FILE *err_stream)
+{
+   int fd;
+   struct stat st;
+   void *data;
+   uint32_t magic;
+   struct capfile_ctx_t *ctx;
+
+   assert(fname);
+
+   fd = open(fname, O_RDONLY);
+   if (fd < 0) {
+      if (err_stream)
+	 fprintf(err_stream, "%s %s: %s\n", TAG, fname, strerror(errno));
+      return NULL;
+   }
+
+   if (fstat(fd, &st) < 0) {
+      if (err_stream)
+	 fprintf(err_stream, "%s fstat() %s: %s\n", TAG, fname, strerror(errno));
+      close(fd);
+      return NULL;
+   }
+   if (st.st_size == 0) {
+      if (err_stream)
+	 fprintf(err_stream, "%s %s: empty file\n", TAG, fname);
+      close(fd);
+      return NULL;
+   }
+
+   data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) {
+      if (err_stream)
+	 fprintf(err_stream, "%s mmap() %s: %s\n", TAG, fname, strerror(errno));
+      return NULL;
+   }
+   /* One sequential pass  */
+   madvise(data, st.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+   ctx = calloc(1, sizeof(*ctx));
+   if (ctx == NULL) {
+      munmap(data, st.st_size);
+      return NULL;
+   }
+
+   ctx->fname = fname;
+   ctx->err_stream = err_stream;
+   ctx->data = data;
+   ctx->size = st.st_size;
+
+   if (ctx->size >= PCAP_HDR_SIZE) {
+      memcpy(&magic, ctx->data, sizeof(magic));
+      if (magic == PCAP_MAGIC || (magic == PCAP_MAGIC_NS)) {
+	 ctx->is_pcap = 1;
+      }else if (__builtin_bswap32(magic) == PCAP_MAGIC
+	    || (__builtin_bswap32(magic) == PCAP_MAGIC_NS)) {
+	 ctx->is_pcap = 1;
+	 ctx->swapped = 1;
+      }else if (magic == PCAPNG_MAGIC) {
+	 if (err_stream)
+	    fprintf(err_stream, "%s %s: pcapng is not supported, "
+		  "convert it with `editcap -F pcap`\n", TAG, fname);
+	 capfile_close(ctx);
+	 return NULL;
+      }
+   }
+
+   if (!ctx->is_pcap)
+      ctx->is_segment = rdr_segment_is_segment(ctx->data, ctx->size);
+
+   if (ctx->is_pcap)
+      ctx->linktype = get_pcap32(ctx, ctx->data + 20) & 0xffff;
+
+   return ctx;
+}
+
+static void free_streams(struct capfile_ctx_t *ctx)
+{
+   unsigned i;
+   struct tcp_stream_t *st;
+
+   for (i=0; i < STREAMS_HASH_SIZE; ++i) {
+      while (ctx->streams[i] != NULL) {
+	 st = ctx->streams[i];
+	 ctx->streams[i] = st->next;
+	 free(st);
+      }
+   }
+}
+
+void capfile_close(struct capfile_ctx_t *ctx)
+{
+   if (ctx == NULL)
+      return;
+   free_streams(ctx);
+   munmap((void *)ctx->data, ctx->size);
+   free(ctx);
+}
+
+int capfile_is_pcap(const struct capfile_ctx_t *ctx)
+{
+   return ctx->is_pcap;
+}
+
+int capfile_is_segment(const struct capfile_ctx_t *ctx)
+{
+   return ctx->is_segment;
+}
+
+size_t capfile_size(const struct capfile_ctx_t *ctx)
+{
+   return ctx->size;
+}
+
+const uint8_t *capfile_data(const struct capfile_ctx_t *ctx)
+{
+   return ctx->data;
+}
+
+const struct capfile_stats_t *capfile_stats(const struct capfile_ctx_t *ctx)
+{
+   return &ctx->stats;
+}
+
+static unsigned stream_hash(const struct sockaddr_in *src, const struct sockaddr_in *dst)
+{
+   uint32_t h;
+
+   h = src->sin_addr.s_addr ^ (dst->sin_addr.s_addr * 31)
+      ^ ((uint32_t)src->sin_port << 16 | dst->sin_port);
+   h ^= h >> 16;
+   h *= 0x45d9f3b;
+   h ^= h >> 16;
+
+   return h % STREAMS_HASH_SIZE;
+}
+
+static struct tcp_stream_t **find_stream(struct capfile_ctx_t *ctx,
+      const struct sockaddr_in *src, const struct sockaddr_in *dst)
+{
+   struct tcp_stream_t **pred;
+
+   pred = &ctx->streams[stream_hash(src, dst)];
+   while (*pred != NULL) {
+      if ((*pred)->src.sin_addr.s_addr == src->sin_addr.s_addr
+	    && ((*pred)->src.sin_port == src->sin_port)
+	    && ((*pred)->dst.sin_addr.s_addr == dst->sin_addr.s_addr)
+	    && ((*pred)->dst.sin_port == dst->sin_port))
+	 break;
+      pred = &(*pred)->next;
+   }
+
+   return pred;
+}
+
+/* seq is at or before next_seq  */
+static void deliver_inorder(struct capfile_ctx_t *ctx, struct tcp_stream_t *st,
+      uint32_t seq, const uint8_t *data, size_t size)
+{
+   uint32_t dup;
+
+   dup = st->next_seq - seq;
+   if (dup >= size) {
+      ctx->stats.retransmitted_bytes += size;
+      return;
+   }
+   ctx->stats.retransmitted_bytes += dup;
+   data += dup;
+   size -= dup;
+
+   ctx->data_f(ctx->cb_arg, st->user, data, size);
+   st->next_seq += size;
+}
+
+static void drain_ooo(struct capfile_ctx_t *ctx, struct tcp_stream_t *st)
+{
+   unsigned i;
+   struct tcp_seg_t seg;
+
+   i = 0;
+   while (i < st->ooo_cnt) {
+      if ((int32_t)(st->ooo[i].seq - st->next_seq) > 0) {
+	 i += 1;
+	 continue;
+      }
+      seg = st->ooo[i];
+      st->ooo[i] = st->ooo[--st->ooo_cnt];
+      deliver_inorder(ctx, st, seg.seq, seg.data, seg.size);
+      /* next_seq moved, rescan  */
+      i = 0;
+   }
+}
+
+/* Give up on the missing data: jump to the earliest queued segment  */
+static void skip_gap(struct capfile_ctx_t *ctx, struct tcp_stream_t *st)
+{
+   unsigned i, min;
+
+   assert(st->ooo_cnt > 0);
+
+   min = 0;
+   for (i=1; i < st->ooo_cnt; ++i) {
+      if ((int32_t)(st->ooo[i].seq - st->ooo[min].seq) < 0)
+	 min = i;
+   }
+
+   ctx->stats.gap_bytes += st->ooo[min].seq - st->next_seq;
+   st->next_seq = st->ooo[min].seq;
+   drain_ooo(ctx, st);
+}
+
+static void close_stream(struct capfile_ctx_t *ctx, struct tcp_stream_t **pred)
+{
+   struct tcp_stream_t *st;
+
+   st = *pred;
+   while (st->ooo_cnt > 0)
+      skip_gap(ctx, st);
+
+   if (ctx->close_f)
+      ctx->close_f(ctx->cb_arg, st->user);
+
+   *pred = st->next;
+   free(st);
+}
+
+static void handle_tcp_segment(struct capfile_ctx_t *ctx,
+      const struct sockaddr_in *src, const struct sockaddr_in *dst,
+      uint32_t seq, unsigned flags, const uint8_t *data, size_t size)
+{
+   struct tcp_stream_t **pred, *st;
+
+   pred = find_stream(ctx, src, dst);
+   st = *pred;
+
+   if ((flags & TCP_SYN) && (st != NULL)) {
+      /* New connection on the same ports  */
+      close_stream(ctx, pred);
+      st = NULL;
+   }
+
+   if (st == NULL) {
+      if (size == 0 && !(flags & TCP_SYN))
+	 return;
+      st = calloc(1, sizeof(*st));
+      if (st == NULL)
+	 return;
+      st->src = *src;
+      st->dst = *dst;
+      st->next = *pred;
+      st->user = ctx->open_f(ctx->cb_arg, src, dst);
+      ctx->stats.streams += 1;
+      *pred = st;
+   }
+
+   if (flags & TCP_SYN) {
+      st->has_seq = 1;
+      st->next_seq = seq + 1;
+      seq += 1;
+   }else if (!st->has_seq) {
+      /* Capture started in the middle of the connection  */
+      st->has_seq = 1;
+      st->next_seq = seq;
+   }
+
+   if (size > 0) {
+      ctx->stats.payload_bytes += size;
+      if ((int32_t)(seq - st->next_seq) <= 0) {
+	 deliver_inorder(ctx, st, seq, data, size);
+	 if (st->ooo_cnt > 0)
+	    drain_ooo(ctx, st);
+      }else {
+	 ctx->stats.ooo_segments += 1;
+	 while (st->ooo_cnt == CAPFILE_OOO_MAX)
+	    skip_gap(ctx, st);
+	 st->ooo[st->ooo_cnt].seq = seq;
+	 st->ooo[st->ooo_cnt].data = data;
+	 st->ooo[st->ooo_cnt].size = size;
+	 st->ooo_cnt += 1;
+      }
+   }
+
+   if (flags & (TCP_FIN | TCP_RST))
+      close_stream(ctx, pred);
+}
+
+static int handle_ipv4_packet(struct capfile_ctx_t *ctx, const uint8_t *pkt, size_t size)
+{
+   unsigned ihl, thl, total_len;
+   struct sockaddr_in src, dst;
+   const uint8_t *tcp;
+
+   if (size < 20 || ((pkt[0] >> 4) != 4))
+      return -1;
+
+   ihl = (pkt[0] & 0x0f) * 4;
+   total_len = get_be16(&pkt[2]);
+
+   /* Fragments, non-TCP, truncated by snaplen  */
+   if ((get_be16(&pkt[6]) & 0x3fff) != 0
+	 || (pkt[9] != IPPROTO_TCP)
+	 || (ihl < 20)
+	 || (total_len < ihl + 20)
+	 || (total_len > size))
+      return -1;
+
+   tcp = pkt + ihl;
+   thl = (tcp[12] >> 4) * 4;
+   if (thl < 20 || (ihl + thl > total_len))
+      return -1;
+
+   memset(&src, 0, sizeof(src));
+   src.sin_family = AF_INET;
+   memcpy(&src.sin_addr.s_addr, &pkt[12], 4);
+   src.sin_port = htons(get_be16(&tcp[0]));
+   dst = src;
+   memcpy(&dst.sin_addr.s_addr, &pkt[16], 4);
+   dst.sin_port = htons(get_be16(&tcp[2]));
+
+   handle_tcp_segment(ctx, &src, &dst, get_be32(&tcp[4]), tcp[13],
+	 tcp + thl, total_len - ihl - thl);
+
+   return 0;
+}
+
+static int handle_pcap_frame(struct capfile_ctx_t *ctx, const uint8_t *frame, size_t size)
+{
+   unsigned ethertype;
+
+   switch (ctx->linktype) {
+      case LINKTYPE_ETHERNET:
+	 if (size < 14)
+	    return -1;
+	 ethertype = get_be16(&frame[12]);
+	 frame += 14;
+	 size -= 14;
+	 while ((ethertype == ETHERTYPE_VLAN || (ethertype == ETHERTYPE_QINQ)) && size >= 4) {
+	    ethertype = get_be16(&frame[2]);
+	    frame += 4;
+	    size -= 4;
+	 }
+	 break;
+      case LINKTYPE_LINUX_SLL:
+	 if (size < 16)
+	    return -1;
+	 ethertype = get_be16(&frame[14]);
+	 frame += 16;
+	 size -= 16;
+	 break;
+      case LINKTYPE_LINUX_SLL2:
+	 if (size < 20)
+	    return -1;
+	 ethertype = get_be16(&frame[0]);
+	 frame += 20;
+	 size -= 20;
+	 break;
+      case LINKTYPE_NULL:
+	 if (size < 4)
+	    return -1;
+	 frame += 4;
+	 size -= 4;
+	 ethertype = ETHERTYPE_IP;
+	 break;
+      case LINKTYPE_RAW:
+      case LINKTYPE_IPV4:
+	 ethertype = ETHERTYPE_IP;
+	 break;
+      default:
+	 return -1;
+	 break;
+   }
+
+   if (ethertype != ETHERTYPE_IP)
+      return -1;
+
+   return handle_ipv4_packet(ctx, frame, size);
+}
+
+static int read_pcap(struct capfile_ctx_t *ctx)
+{
+   size_t p;
+   size_t incl_len;
+   unsigned i;
+
+   switch (ctx->linktype) {
+      case LINKTYPE_NULL:
+      case LINKTYPE_ETHERNET:
+      case LINKTYPE_RAW:
+      case LINKTYPE_LINUX_SLL:
+      case LINKTYPE_IPV4:
+      case LINKTYPE_LINUX_SLL2:
+	 break;
+      default:
+	 if (ctx->err_stream)
+	    fprintf(ctx->err_stream, "%s %s: unsupported link type %u\n",
+		  TAG, ctx->fname, ctx->linktype);
+	 return -1;
+   }
+
+   p = PCAP_HDR_SIZE;
+   while (p + PCAP_REC_HDR_SIZE <= ctx->size) {
+      incl_len = get_pcap32(ctx, ctx->data + p + 8);
+      p += PCAP_REC_HDR_SIZE;
+      if (incl_len > ctx->size - p) {
+	 if (ctx->err_stream)
+	    fprintf(ctx->err_stream, "%s %s: truncated at offset %lu\n",
+		  TAG, ctx->fname, (unsigned long)p);
+	 break;
+      }
+      ctx->stats.packets += 1;
+      if (handle_pcap_frame(ctx, ctx->data + p, incl_len) < 0)
+	 ctx->stats.skipped_packets += 1;
+      p += incl_len;
+   }
+
+   /* End of capture: flush what is left  */
+   for (i=0; i < STREAMS_HASH_SIZE; ++i) {
+      while (ctx->streams[i] != NULL)
+	 close_stream(ctx, &ctx->streams[i]);
+   }
+
+   return 0;
+}
+
+/* rdr2netflow -w segment: streams are keyed by SCE address  */
+static int read_segment(struct capfile_ctx_t *ctx)
+{
+   size_t p;
+   ssize_t rec_size;
+   unsigned i;
+   struct sockaddr_in none;
+   struct rdr_segment_rec_info_t rec;
+   struct tcp_stream_t **pred, *st;
+
+   memset(&none, 0, sizeof(none));
+   none.sin_family = AF_INET;
+
+   for (p = 0; p < ctx->size; p += rec_size) {
+      rec_size = rdr_segment_parse(ctx->data + p, ctx->size - p, &rec);
+      if (rec_size < 0) {
+	 if (ctx->err_stream)
+	    fprintf(ctx->err_stream, "%s %s: broken record at offset %lu\n",
+		  TAG, ctx->fname, (unsigned long)p);
+	 break;
+      }
+      ctx->stats.packets += 1;
+
+      pred = find_stream(ctx, &rec.src, &none);
+      st = *pred;
+      if ((rec.type == RDR_SEGMENT_REC_OPEN) && (st != NULL)) {
+	 close_stream(ctx, pred);
+	 st = NULL;
+      }
+
+      if (st == NULL && (rec.type != RDR_SEGMENT_REC_CLOSE)) {
+	 st = calloc(1, sizeof(*st));
+	 if (st == NULL)
+	    return -1;
+	 st->src = rec.src;
+	 st->dst = none;
+	 st->next = *pred;
+	 st->user = ctx->open_f(ctx->cb_arg, &rec.src, &none);
+	 ctx->stats.streams += 1;
+	 *pred = st;
+      }
+
+      switch (rec.type) {
+	 case RDR_SEGMENT_REC_DATA:
+	    ctx->stats.payload_bytes += rec.size;
+	    ctx->data_f(ctx->cb_arg, st->user, rec.data, rec.size);
+	    break;
+	 case RDR_SEGMENT_REC_CLOSE:
+	    if (st != NULL)
+	       close_stream(ctx, pred);
+	    break;
+	 default:
+	    break;
+      }
+   }
+
+   for (i=0; i < STREAMS_HASH_SIZE; ++i) {
+      while (ctx->streams[i] != NULL)
+	 close_stream(ctx, &ctx->streams[i]);
+   }
+
+   return 0;
+}
+
+int capfile_read(struct capfile_ctx_t *ctx, capfile_open_f open_f,
+      capfile_data_f data_f, capfile_close_f close_f, void *arg)
+{
+   void *stream;
+   struct sockaddr_in none;
+
+   assert(ctx);
+   assert(open_f);
+   assert(data_f);
+
+   ctx->open_f = open_f;
+   ctx->data_f = data_f;
+   ctx->close_f = close_f;
+   ctx->cb_arg = arg;
+
+   if (ctx->is_pcap)
+      return read_pcap(ctx);
+   if (ctx->is_segment)
+      return read_segment(ctx);
+
+   memset(&none, 0, sizeof(none));
+   none.sin_family = AF_INET;
+   stream = open_f(arg, &none, &none);
+   ctx->stats.streams = 1;
+   ctx->stats.payload_bytes = ctx->size;
+   data_f(arg, stream, ctx->data, ctx->size);
+   if (close_f)
+      close_f(arg, stream);
+
+   return 0;
+}
@@ -0,0 +1,68 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _CAPFILE_H
+#define _CAPFILE_H
+
+/*
+ * Recorded RDR streams: raw stream bytes, rdr2netflow -w segment or a pcap
+ * of the TCP stream(s). The file is mmap'ed, pcap TCP streams are
+ * reassembled per direction.
+ */
+
+/* Out-of-order segments kept per TCP stream before the gap is skipped  */
+#define CAPFILE_OOO_MAX 32
+
+struct capfile_stats_t {
+   unsigned long long packets;
+   unsigned long long skipped_packets;
+   unsigned long long streams;
+   unsigned long long payload_bytes;
+   unsigned long long retransmitted_bytes;
+   unsigned long long ooo_segments;
+   unsigned long long gap_bytes;
+};
+
+/*
+ * Callbacks. open_f returns the stream handle passed to data_f and
+ * close_f. Raw files are a single stream from 0.0.0.0:0
+ */
+typedef void *(*capfile_open_f)(void *arg, const struct sockaddr_in *src, const struct sockaddr_in *dst);
+typedef void (*capfile_data_f)(void *arg, void *stream, const uint8_t *data, size_t size);
+typedef void (*capfile_close_f)(void *arg, void *stream);
+
+struct capfile_ctx_t *capfile_open(const char *fname, FILE *err_stream);
+void capfile_close(struct capfile_ctx_t *ctx);
+int capfile_is_pcap(const struct capfile_ctx_t *ctx);
+int capfile_is_segment(const struct capfile_ctx_t *ctx);
+size_t capfile_size(const struct capfile_ctx_t *ctx);
+const uint8_t *capfile_data(const struct capfile_ctx_t *ctx);
+
+int capfile_read(struct capfile_ctx_t *ctx, capfile_open_f open_f,
+      capfile_data_f data_f, capfile_close_f close_f, void *arg);
+const struct capfile_stats_t *capfile_stats(const struct capfile_ctx_t *ctx);
+
+#endif /* _CAPFILE_H  */
@@ -0,0 +1,662 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#endif
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "netflow.h"
+#include "pacer.h"
+#include "collector.h"
+#include "hash.h"
+#include "stats.h"
+
+#define TAG "Collector:"
+
+/* Points of a collector on the hash ring  */
+#define COLLECTOR_RING_POINTS 1024
+
+struct collector_t {
+   struct sockaddr_in addr;
+   char name[32];
+   int s;
+   struct rdr_pacer_ctx_t *pacer;
+   /* SO_SNDBUF, 0 - not known yet  */
+   int snd_bufsize;
+   uint32_t flow_seq;
+
+   int up;
+   unsigned long long down_until_us;
+   unsigned errors;
+
+   struct {
+      unsigned long long dgrams;
+      unsigned long long records;
+      unsigned long long send_errors;
+      unsigned long long downs;
+   } stats;
+};
+
+struct ring_point_t {
+   uint32_t hash;
+   unsigned idx;
+};
+
+struct rdr_collector_ctx_t {
+   struct collector_t collectors[RDR_COLLECTOR_MAX];
+   unsigned cnt;
+
+   enum rdr_collector_policy_t policy;
+   unsigned failures;
+   unsigned down_s;
+   unsigned rr_next;
+
+   struct ring_point_t ring[RDR_COLLECTOR_MAX * COLLECTOR_RING_POINTS];
+   unsigned ring_size;
+
+   /* -E and -Q for the export queues  */
+   char *pacing;
+   char *retry;
+   int blocking;
+};
+
+struct rdr_collector_ctx_t *rdr_collector_init()
+{
+   struct rdr_collector_ctx_t *ctx;
+
+   ctx = (struct rdr_collector_ctx_t *)calloc(1, sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->policy = RDR_COLLECTOR_HASH;
+   ctx->failures = RDR_COLLECTOR_DEFAULT_FAILURES;
+   ctx->down_s = RDR_COLLECTOR_DEFAULT_DOWN_S;
+
+   return ctx;
+}
+
+void rdr_collector_destroy(struct rdr_collector_ctx_t *ctx)
+{
+   unsigned i;
+
+   if (ctx == NULL)
+      return;
+
+   for (i=0; i < ctx->cnt; ++i) {
+      if (ctx->collectors[i].s >= 0)
+	 close(ctx->collectors[i].s);
+      rdr_pacer_destroy(ctx->collectors[i].pacer);
+   }
+   free(ctx->pacing);
+   free(ctx->retry);
+   free(ctx);
+}
+
+int rdr_collector_add(struct rdr_collector_ctx_t *ctx, const char *addrports, FILE *err_stream)
+{
+   char *str, *p, *last, *port, *endptr;
+   unsigned long val;
+   struct collector_t *c;
+   int res;
+
+   assert(ctx);
+   assert(addrports);
+
+   str = strdup(addrports);
+   if (str == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+      return -1;
+   }
+
+   res = -1;
+   for (p = strtok_r(str, ",", &last); p != NULL; p = strtok_r(NULL, ",", &last)) {
+      if (ctx->cnt == RDR_COLLECTOR_MAX) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s more than %u collectors\n",
+	       TAG, RDR_COLLECTOR_MAX);
+	 goto done;
+      }
+      c = &ctx->collectors[ctx->cnt];
+      memset(c, 0, sizeof(*c));
+      c->s = -1;
+      c->addr.sin_family = AF_INET;
+
+      port = strchr(p, '/');
+      if (port != NULL) {
+	 *port++ = '\0';
+	 val = strtoul(port, &endptr, 10);
+	 if (*endptr != '\0' || (val == 0) || (val > 0xffff)) {
+	    if (err_stream != NULL) fprintf(err_stream, "%s wrong port `%s`\n", TAG, port);
+	    goto done;
+	 }
+	 c->addr.sin_port = htons((uint16_t)val);
+      }
+      if (inet_aton(p, &c->addr.sin_addr) <= 0) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong address `%s`\n", TAG, p);
+	 goto done;
+      }
+      ctx->cnt += 1;
+   }
+
+   res = 0;
+
+done:
+   free(str);
+   return res;
+}
+
+int rdr_collector_set_policy(struct rdr_collector_ctx_t *ctx, const char *policy, FILE *err_stream)
+{
+   const char *p;
+   char *endptr;
+   unsigned long val;
+   size_t len;
+
+   assert(ctx);
+   assert(policy);
+
+   len = strcspn(policy, "/");
+   if (len == 4 && (strncmp(policy, "hash", 4) == 0))
+      ctx->policy = RDR_COLLECTOR_HASH;
+   else if (len == 2 && (strncmp(policy, "rr", 2) == 0))
+      ctx->policy = RDR_COLLECTOR_ROUND_ROBIN;
+   else {
+      if (err_stream != NULL) fprintf(err_stream, "%s unknown policy `%s`, expected hash or rr\n",
+	    TAG, policy);
+      return -1;
+   }
+
+   endptr = (char *)policy + len;
+   if (*endptr == '/') {
+      p = endptr + 1;
+      val = strtoul(p, &endptr, 10);
+      if (endptr == p || (val == 0) || (val > 1000000) || (*endptr != '\0' && (*endptr != '/'))) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong failures `%s`\n", TAG, p);
+	 return -1;
+      }
+      ctx->failures = (unsigned)val;
+   }
+
+   if (*endptr == '/') {
+      p = endptr + 1;
+      val = strtoul(p, &endptr, 10);
+      if (endptr == p || (val == 0) || (val > 86400) || (*endptr != '\0')) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong down time `%s`\n", TAG, p);
+	 return -1;
+      }
+      ctx->down_s = (unsigned)val;
+   }
+
+   return 0;
+}
+
+/* Checks the option on a scratch queue, applied to every collector in rdr_collector_start()  */
+static int set_queue_option(char **dst, const char *val,
+      int (*set)(struct rdr_pacer_ctx_t *, const char *, FILE *), FILE *err_stream)
+{
+   struct rdr_pacer_ctx_t *pacer;
+   char *str;
+   int res;
+
+   pacer = rdr_pacer_init();
+   if (pacer == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s calloc() error\n", TAG);
+      return -1;
+   }
+   res = set(pacer, val, err_stream);
+   rdr_pacer_destroy(pacer);
+   if (res < 0)
+      return -1;
+
+   str = strdup(val);
+   if (str == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+      return -1;
+   }
+   free(*dst);
+   *dst = str;
+
+   return 0;
+}
+
+int rdr_collector_set_pacing(struct rdr_collector_ctx_t *ctx, const char *rate, FILE *err_stream)
+{
+   assert(ctx);
+   return set_queue_option(&ctx->pacing, rate, rdr_pacer_set_rate, err_stream);
+}
+
+int rdr_collector_set_retry(struct rdr_collector_ctx_t *ctx, const char *retry, FILE *err_stream)
+{
+   assert(ctx);
+   return set_queue_option(&ctx->retry, retry, rdr_pacer_set_retry, err_stream);
+}
+
+void rdr_collector_set_blocking(struct rdr_collector_ctx_t *ctx, int blocking)
+{
+   assert(ctx);
+   ctx->blocking = blocking;
+}
+
+unsigned rdr_collector_count(struct rdr_collector_ctx_t *ctx)
+{
+   return ctx->cnt;
+}
+
+int rdr_collector_is_queued(struct rdr_collector_ctx_t *ctx)
+{
+   return ctx->cnt != 0 && (ctx->collectors[0].pacer != NULL)
+      && rdr_pacer_is_enabled(ctx->collectors[0].pacer);
+}
+
+enum rdr_collector_policy_t rdr_collector_policy(struct rdr_collector_ctx_t *ctx)
+{
+   return ctx->policy;
+}
+
+static int cmp_ring_points(const void *a, const void *b)
+{
+   const struct ring_point_t *pa = (const struct ring_point_t *)a;
+   const struct ring_point_t *pb = (const struct ring_point_t *)b;
+
+   if (pa->hash != pb->hash)
+      return pa->hash < pb->hash ? -1 : 1;
+   return (int)pa->idx - (int)pb->idx;
+}
+
+/* Points depend on the address only: a collector keeps its clients when others are added  */
+static void build_ring(struct rdr_collector_ctx_t *ctx)
+{
+   unsigned i, j;
+   uint32_t seed;
+
+   ctx->ring_size = 0;
+   for (i=0; i < ctx->cnt; ++i) {
+      seed = hash_mix32(ctx->collectors[i].addr.sin_addr.s_addr)
+	 ^ hash_mix32(ctx->collectors[i].addr.sin_port + 0x9e3779b9u);
+      for (j=0; j < COLLECTOR_RING_POINTS; ++j) {
+	 ctx->ring[ctx->ring_size].hash = hash_mix32(seed + j * 0x9e3779b9u);
+	 ctx->ring[ctx->ring_size].idx = i;
+	 ctx->ring_size += 1;
+      }
+   }
+   qsort(ctx->ring, ctx->ring_size, sizeof(ctx->ring[0]), cmp_ring_points);
+}
+
+int rdr_collector_start(struct rdr_collector_ctx_t *ctx, unsigned default_port, int verbose)
+{
+   unsigned i;
+   struct collector_t *c;
+
+   assert(ctx);
+   assert(ctx->cnt != 0);
+
+   for (i=0; i < ctx->cnt; ++i) {
+      c = &ctx->collectors[i];
+      if (c->addr.sin_port == 0)
+	 c->addr.sin_port = htons((uint16_t)default_port);
+      snprintf(c->name, sizeof(c->name), "%s:%u", inet_ntoa(c->addr.sin_addr),
+	    (unsigned)ntohs(c->addr.sin_port));
+      c->up = 1;
+
+      if (verbose)
+	 fprintf(stderr, "Sending to %s\n", c->name);
+
+      c->s = socket(PF_INET, SOCK_DGRAM, 0);
+      if (c->s < 0) {
+	 perror("socket() on sending socket error");
+	 return -1;
+      }
+      if (connect(c->s, (struct sockaddr *)&c->addr, sizeof(c->addr)) < 0) {
+	 perror("connect() error");
+	 return -1;
+      }
+
+      c->pacer = rdr_pacer_init();
+      if (c->pacer == NULL) {
+	 fprintf(stderr, "%s calloc() error\n", TAG);
+	 return -1;
+      }
+      if ((ctx->pacing != NULL && (rdr_pacer_set_rate(c->pacer, ctx->pacing, stderr) < 0))
+	    || (ctx->retry != NULL && (rdr_pacer_set_retry(c->pacer, ctx->retry, stderr) < 0)))
+	 return -1;
+      rdr_pacer_set_blocking(c->pacer, ctx->blocking);
+      if (rdr_pacer_start(c->pacer, verbose && (i == 0)) < 0)
+	 return -1;
+   }
+
+   build_ring(ctx);
+
+   if (verbose && (ctx->cnt > 1))
+      fprintf(stderr, "%s %u collectors, %s, out for %u s after %u send() errors in a second\n",
+	    TAG, ctx->cnt, ctx->policy == RDR_COLLECTOR_HASH ? "consistent hash of the client address"
+	    : "round-robin datagrams", ctx->down_s, ctx->failures);
+
+   return 0;
+}
+
+int rdr_collector_socket(struct rdr_collector_ctx_t *ctx, unsigned idx)
+{
+   assert(idx < ctx->cnt);
+   return ctx->collectors[idx].s;
+}
+
+uint32_t rdr_collector_flow_seq(struct rdr_collector_ctx_t *ctx, unsigned idx)
+{
+   assert(idx < ctx->cnt);
+   return ctx->collectors[idx].flow_seq;
+}
+
+void rdr_collector_set_flow_seq(struct rdr_collector_ctx_t *ctx, unsigned idx, uint32_t flow_seq)
+{
+   assert(idx < ctx->cnt);
+   ctx->collectors[idx].flow_seq = flow_seq;
+}
+
+unsigned rdr_collector_by_addr(struct rdr_collector_ctx_t *ctx, uint32_t addr)
+{
+   uint32_t h;
+   unsigned lo, hi, mid, i, pos;
+
+   if (ctx->cnt <= 1)
+      return 0;
+
+   /* First point at or after the hash  */
+   h = hash_mix32(addr);
+   lo = 0;
+   hi = ctx->ring_size;
+   while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (ctx->ring[mid].hash < h)
+	 lo = mid + 1;
+      else
+	 hi = mid;
+   }
+
+   /* Skip the collectors that are out  */
+   for (i=0; i < ctx->ring_size; ++i) {
+      pos = (lo + i) % ctx->ring_size;
+      if (ctx->collectors[ctx->ring[pos].idx].up)
+	 return ctx->ring[pos].idx;
+   }
+
+   return ctx->ring[lo % ctx->ring_size].idx;
+}
+
+unsigned rdr_collector_next(struct rdr_collector_ctx_t *ctx)
+{
+   unsigned i, idx;
+
+   if (ctx->cnt <= 1)
+      return 0;
+
+   for (i=0; i < ctx->cnt; ++i) {
+      idx = ctx->rr_next;
+      ctx->rr_next = (ctx->rr_next + 1) % ctx->cnt;
+      if (ctx->collectors[idx].up)
+	 return idx;
+   }
+
+   return idx;
+}
+
+static unsigned count_errors(struct collector_t *c, unsigned errors)
+{
+   c->errors += errors;
+   c->stats.send_errors += errors;
+   return errors;
+}
+
+unsigned rdr_collector_send(struct rdr_collector_ctx_t *ctx, unsigned idx,
+      struct netflow_v5_export_dgram *dgram, size_t size, unsigned records)
+{
+   struct collector_t *c;
+   unsigned errors;
+
+   assert(idx < ctx->cnt);
+   c = &ctx->collectors[idx];
+
+   dgram->header.flow_seq = htonl(c->flow_seq);
+   c->flow_seq += records;
+
+   /* Queued datagrams dropped later are subtracted by rdr_collector_dropped()  */
+   if (rdr_pacer_is_enabled(c->pacer))
+      errors = rdr_pacer_send(c->pacer, c->s, dgram, size, records);
+   else if (send(c->s, dgram, size, 0) < 0)
+      return count_errors(c, 1);
+   else
+      errors = 0;
+   c->stats.dgrams += 1;
+   c->stats.records += records;
+
+   return count_errors(c, errors);
+}
+
+void rdr_collector_dropped(struct rdr_collector_ctx_t *ctx, unsigned long long *dgrams,
+      unsigned long long *records)
+{
+   unsigned i;
+
+   assert(ctx);
+   assert(dgrams);
+   assert(records);
+
+   *dgrams = *records = 0;
+   for (i=0; i < ctx->cnt; ++i) {
+      if (ctx->collectors[i].pacer != NULL)
+	 rdr_pacer_dropped(ctx->collectors[i].pacer, dgrams, records);
+   }
+}
+
+unsigned rdr_collector_step(struct rdr_collector_ctx_t *ctx)
+{
+   unsigned i, n, errors;
+   int err;
+
+   errors = 0;
+   err = 0;
+   for (i=0; i < ctx->cnt; ++i) {
+      n = count_errors(&ctx->collectors[i], rdr_pacer_step(ctx->collectors[i].pacer, ctx->collectors[i].s));
+      if (n != 0) {
+	 errors += n;
+	 err = errno;
+      }
+   }
+   if (errors != 0)
+      errno = err;
+
+   return errors;
+}
+
+long rdr_collector_next_us(struct rdr_collector_ctx_t *ctx)
+{
+   unsigned i;
+   long res, us;
+
+   res = -1;
+   for (i=0; i < ctx->cnt; ++i) {
+      us = rdr_pacer_next_us(ctx->collectors[i].pacer);
+      if (us >= 0 && (res < 0 || (us < res)))
+	 res = us;
+   }
+
+   return res;
+}
+
+unsigned rdr_collector_drain(struct rdr_collector_ctx_t *ctx)
+{
+   unsigned i, n, errors;
+   int err;
+
+   errors = 0;
+   err = 0;
+   for (i=0; i < ctx->cnt; ++i) {
+      if (ctx->collectors[i].s < 0 || (ctx->collectors[i].pacer == NULL))
+	 continue;
+      n = count_errors(&ctx->collectors[i], rdr_pacer_drain(ctx->collectors[i].pacer, ctx->collectors[i].s));
+      if (n != 0) {
+	 errors += n;
+	 err = errno;
+      }
+   }
+   if (errors != 0)
+      errno = err;
+
+   return errors;
+}
+
+unsigned rdr_collector_check(struct rdr_collector_ctx_t *ctx, unsigned long long now_us)
+{
+   unsigned i, changes;
+   struct collector_t *c;
+
+   changes = 0;
+   for (i=0; i < ctx->cnt; ++i) {
+      c = &ctx->collectors[i];
+      if (c->up && (ctx->cnt > 1) && (c->errors >= ctx->failures)) {
+	 c->up = 0;
+	 c->down_until_us = now_us + 1000000ull * ctx->down_s;
+	 c->stats.downs += 1;
+	 changes += 1;
+      }else if (!c->up && (now_us >= c->down_until_us)) {
+	 c->up = 1;
+	 changes += 1;
+      }
+      c->errors = 0;
+   }
+
+   return changes;
+}
+
+unsigned rdr_collector_up_count(struct rdr_collector_ctx_t *ctx)
+{
+   unsigned i, res;
+
+   res = 0;
+   for (i=0; i < ctx->cnt; ++i)
+      res += ctx->collectors[i].up ? 1 : 0;
+
+   return res;
+}
+
+static double socket_backlog(struct collector_t *c)
+{
+   int queued;
+   socklen_t optlen;
+
+   if (c->s < 0)
+      return 0;
+
+   if (c->snd_bufsize <= 0) {
+      optlen = sizeof(c->snd_bufsize);
+      if (getsockopt(c->s, SOL_SOCKET, SO_SNDBUF, &c->snd_bufsize, &optlen) < 0
+	    || (c->snd_bufsize <= 0))
+	 return 0;
+   }
+
+#if defined(SIOCOUTQ)
+   if (ioctl(c->s, SIOCOUTQ, &queued) < 0)
+      return 0;
+#elif defined(FIONWRITE)
+   if (ioctl(c->s, FIONWRITE, &queued) < 0)
+      return 0;
+#else
+   return 0;
+#endif
+
+   return (double)queued / c->snd_bufsize;
+}
+
+double rdr_collector_backlog(struct rdr_collector_ctx_t *ctx)
+{
+   unsigned i;
+   double res, backlog;
+
+   res = 0;
+   for (i=0; i < ctx->cnt; ++i) {
+      backlog = socket_backlog(&ctx->collectors[i]);
+      if (backlog > res)
+	 res = backlog;
+      backlog = rdr_pacer_backlog(ctx->collectors[i].pacer);
+      if (backlog > res)
+	 res = backlog;
+   }
+
+   return res;
+}
+
+#define PRINT_COLLECTOR_METRIC(_name, _type, _help, _field) \
+   stats_print_header(stream, "rdr2netflow_collector_" _name, _type, _help); \
+   for (i=0; i < ctx->cnt; ++i) \
+      fprintf(stream, "rdr2netflow_collector_" _name "{collector=\"%s\"} %llu\n", \
+	    ctx->collectors[i].name, (unsigned long long)ctx->collectors[i]._field)
+
+void rdr_collector_print_stats(struct rdr_collector_ctx_t *ctx, FILE *stream)
+{
+   unsigned i;
+   struct rdr_pacer_ctx_t *pacers[RDR_COLLECTOR_MAX];
+   unsigned long long dropped_dgrams[RDR_COLLECTOR_MAX], dropped_records[RDR_COLLECTOR_MAX];
+
+   assert(ctx);
+   assert(stream);
+
+   if (ctx->cnt == 0 || (ctx->collectors[0].pacer == NULL))
+      return;
+
+   for (i=0; i < ctx->cnt; ++i) {
+      dropped_dgrams[i] = dropped_records[i] = 0;
+      rdr_pacer_dropped(ctx->collectors[i].pacer, &dropped_dgrams[i], &dropped_records[i]);
+   }
+
+   PRINT_COLLECTOR_METRIC("up", "gauge", "Collector gets its share of the export", up);
+   stats_print_header(stream, "rdr2netflow_collector_dgrams_total", "counter",
+	 "Datagrams exported to the collector");
+   for (i=0; i < ctx->cnt; ++i)
+      fprintf(stream, "rdr2netflow_collector_dgrams_total{collector=\"%s\"} %llu\n",
+	    ctx->collectors[i].name, ctx->collectors[i].stats.dgrams - dropped_dgrams[i]);
+   stats_print_header(stream, "rdr2netflow_collector_records_total", "counter",
+	 "Records exported to the collector");
+   for (i=0; i < ctx->cnt; ++i)
+      fprintf(stream, "rdr2netflow_collector_records_total{collector=\"%s\"} %llu\n",
+	    ctx->collectors[i].name, ctx->collectors[i].stats.records - dropped_records[i]);
+   PRINT_COLLECTOR_METRIC("send_errors_total", "counter", "send() failures", stats.send_errors);
+   PRINT_COLLECTOR_METRIC("downs_total", "counter", "Times the collector was taken out", stats.downs);
+
+   for (i=0; i < ctx->cnt; ++i)
+      pacers[i] = ctx->collectors[i].pacer;
+   rdr_pacer_print_stats(pacers, ctx->cnt, stream);
+}
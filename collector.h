@@ -0,0 +1,95 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _COLLECTOR_H
+#define _COLLECTOR_H
+
+#define RDR_COLLECTOR_MAX 16
+#define RDR_COLLECTOR_DEFAULT_FAILURES 3
+#define RDR_COLLECTOR_DEFAULT_DOWN_S 10
+
+enum rdr_collector_policy_t {
+   RDR_COLLECTOR_HASH = 0,
+   RDR_COLLECTOR_ROUND_ROBIN
+};
+
+/*
+ * NetFlow collectors: a connected UDP socket, an export queue (pacer.h)
+ * and a flow_seq per collector. Records are spread by a consistent hash
+ * of the client address, so a client stays on one collector, or whole
+ * datagrams round-robin. A collector with failures or more send() errors
+ * in a second is taken out for down_s seconds and its share goes to the
+ * next collectors on the ring, then it gets traffic again.
+ */
+struct rdr_collector_ctx_t *rdr_collector_init();
+void rdr_collector_destroy(struct rdr_collector_ctx_t *ctx);
+/* address[/port][,address[/port]...], port 0 - default of rdr_collector_start()  */
+int rdr_collector_add(struct rdr_collector_ctx_t *ctx, const char *addrports, FILE *err_stream);
+/* hash|rr[/failures[/down_s]]  */
+int rdr_collector_set_policy(struct rdr_collector_ctx_t *ctx, const char *policy, FILE *err_stream);
+/* Export queue options of every collector, see rdr_pacer_set_rate() and rdr_pacer_set_retry()  */
+int rdr_collector_set_pacing(struct rdr_collector_ctx_t *ctx, const char *rate, FILE *err_stream);
+int rdr_collector_set_retry(struct rdr_collector_ctx_t *ctx, const char *retry, FILE *err_stream);
+/* Before rdr_collector_start(), see rdr_pacer_set_blocking()  */
+void rdr_collector_set_blocking(struct rdr_collector_ctx_t *ctx, int blocking);
+unsigned rdr_collector_count(struct rdr_collector_ctx_t *ctx);
+/* Datagrams go through the export queues  */
+int rdr_collector_is_queued(struct rdr_collector_ctx_t *ctx);
+enum rdr_collector_policy_t rdr_collector_policy(struct rdr_collector_ctx_t *ctx);
+
+int rdr_collector_start(struct rdr_collector_ctx_t *ctx, unsigned default_port, int verbose);
+int rdr_collector_socket(struct rdr_collector_ctx_t *ctx, unsigned idx);
+/* Sequence number of the next record sent to the collector  */
+uint32_t rdr_collector_flow_seq(struct rdr_collector_ctx_t *ctx, unsigned idx);
+void rdr_collector_set_flow_seq(struct rdr_collector_ctx_t *ctx, unsigned idx, uint32_t flow_seq);
+
+/* Collector of the client address (hash policy)  */
+unsigned rdr_collector_by_addr(struct rdr_collector_ctx_t *ctx, uint32_t addr);
+/* Next collector for a datagram (round-robin policy)  */
+unsigned rdr_collector_next(struct rdr_collector_ctx_t *ctx);
+
+/*
+ * Sends the datagram of records NetFlow records to the collector, sets
+ * its flow_seq first. Returns failed send() calls, errno is of the last one
+ */
+unsigned rdr_collector_send(struct rdr_collector_ctx_t *ctx, unsigned idx,
+      struct netflow_v5_export_dgram *dgram, size_t size, unsigned records);
+/* Datagrams and records the export queues dropped after rdr_collector_send() took them  */
+void rdr_collector_dropped(struct rdr_collector_ctx_t *ctx, unsigned long long *dgrams,
+      unsigned long long *records);
+/* Export queues: see rdr_pacer_step(), rdr_pacer_next_us(), rdr_pacer_drain()  */
+unsigned rdr_collector_step(struct rdr_collector_ctx_t *ctx);
+long rdr_collector_next_us(struct rdr_collector_ctx_t *ctx);
+unsigned rdr_collector_drain(struct rdr_collector_ctx_t *ctx);
+/* Once a second: takes out failing collectors and returns the recovered. Number of changes  */
+unsigned rdr_collector_check(struct rdr_collector_ctx_t *ctx, unsigned long long now_us);
+unsigned rdr_collector_up_count(struct rdr_collector_ctx_t *ctx);
+/* Fill of the fullest export queue or socket send buffer, 0..1  */
+double rdr_collector_backlog(struct rdr_collector_ctx_t *ctx);
+void rdr_collector_print_stats(struct rdr_collector_ctx_t *ctx, FILE *stream);
+
+#endif /* _COLLECTOR_H  */
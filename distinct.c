@@ -0,0 +1,519 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "distinct.h"
+#include "hash.h"
+#include "stats.h"
+
+#define TAG "Distinct:"
+
+#define DISTINCT_OUT_BUF_SIZE (64*1024)
+
+#define DISTINCT_DIM_SERVICE 0
+#define DISTINCT_DIM_PACKAGE 1
+
+#define DISTINCT_SUBSCRIBERS 0
+#define DISTINCT_SERVERS     1
+#define DISTINCT_PAIRS       2
+#define DISTINCT_SKETCHES    3
+
+/*
+ * XORed into the address keys: 0 is a fixed point of hash_mix64(), and
+ * 0.0.0.0 would then put the maximum rank into register 0
+ */
+#define DISTINCT_HASH_SEED 0xcbf29ce484222325ull
+
+struct distinct_group_t {
+   int32_t dim;
+   int32_t id;
+   uint32_t hash;
+   uint64_t turs;
+   /* Registers are allocated on the first use and kept  */
+   struct hll_t sk[DISTINCT_SKETCHES];
+};
+
+struct rdr_distinct_ctx_t {
+   unsigned window_s;
+   unsigned precision;
+   char *out_fname;
+   int verbose;
+   int started;
+
+   FILE *out;
+   char *out_buf;
+
+   /* Group index + 1, 0 - free slot. Linear probing, at most 50% load  */
+   uint32_t slots[2 * RDR_DISTINCT_MAX_GROUPS];
+   struct distinct_group_t groups[RDR_DISTINCT_MAX_GROUPS];
+   unsigned groups_cnt;
+   struct hll_t total[DISTINCT_SKETCHES];
+
+   /* Open window: start, local arrival of its last TUR  */
+   int open;
+   time_t window;
+   unsigned long long last_us;
+
+   struct {
+      unsigned long long turs;
+      unsigned long long late_turs;
+      unsigned long long overflow_turs;
+      unsigned long long windows;
+      unsigned long long write_errors;
+   } stats;
+};
+
+int hll_init(struct hll_t *h, unsigned precision)
+{
+   assert(precision >= 4 && (precision <= 18));
+
+   h->precision = precision;
+   h->registers = calloc((size_t)1 << precision, 1);
+
+   return h->registers == NULL ? -1 : 0;
+}
+
+void hll_free(struct hll_t *h)
+{
+   free(h->registers);
+   h->registers = NULL;
+}
+
+void hll_reset(struct hll_t *h)
+{
+   memset(h->registers, 0, (size_t)1 << h->precision);
+}
+
+void hll_add(struct hll_t *h, uint64_t hash)
+{
+   unsigned idx;
+   uint8_t rank;
+
+   idx = (unsigned)(hash >> (64 - h->precision));
+   /* Position of the first 1 bit of the rest, the sentinel bounds it  */
+   rank = (uint8_t)__builtin_clzll((hash << h->precision) | (1ull << (h->precision - 1))) + 1;
+   if (rank > h->registers[idx])
+      h->registers[idx] = rank;
+}
+
+void hll_merge(struct hll_t *dst, const struct hll_t *src)
+{
+   size_t i, m;
+
+   assert(dst->precision == src->precision);
+
+   m = (size_t)1 << dst->precision;
+   for (i=0; i < m; ++i) {
+      if (src->registers[i] > dst->registers[i])
+	 dst->registers[i] = src->registers[i];
+   }
+}
+
+static double hll_sigma(double x)
+{
+   double y, z, z_old;
+
+   if (x == 1.0)
+      return INFINITY;
+
+   y = 1.0;
+   z = x;
+   do {
+      x *= x;
+      z_old = z;
+      z += x * y;
+      y += y;
+   } while (z != z_old);
+
+   return z;
+}
+
+static double hll_tau(double x)
+{
+   double y, z, z_old;
+
+   if (x == 0.0 || (x == 1.0))
+      return 0.0;
+
+   y = 1.0;
+   z = 1.0 - x;
+   do {
+      x = sqrt(x);
+      z_old = z;
+      y *= 0.5;
+      z -= (1.0 - x) * (1.0 - x) * y;
+   } while (z != z_old);
+
+   return z / 3.0;
+}
+
+/*
+ * O. Ertl, "New cardinality estimation algorithms for HyperLogLog
+ * sketches": the register histogram gives an estimate without the bias
+ * of the raw estimator in the small and middle ranges, no empirical
+ * correction tables or linear counting threshold.
+ */
+double hll_estimate(const struct hll_t *h)
+{
+   unsigned hist[64 + 2];
+   unsigned q, k;
+   size_t i, m;
+   double z;
+
+   m = (size_t)1 << h->precision;
+   q = 64 - h->precision;
+   memset(hist, 0, sizeof(hist));
+   for (i=0; i < m; ++i)
+      hist[h->registers[i]] += 1;
+
+   z = m * hll_tau(1.0 - (double)hist[q + 1] / m);
+   for (k = q; k >= 1; --k)
+      z = 0.5 * (z + hist[k]);
+   z += m * hll_sigma((double)hist[0] / m);
+
+   return m * (m / (2.0 * M_LN2)) / z;
+}
+
+uint64_t hll_hash(const void *data, size_t size)
+{
+   const uint8_t *p;
+   uint64_t h;
+   size_t i;
+
+   p = (const uint8_t *)data;
+   h = DISTINCT_HASH_SEED;
+   for (i=0; i < size; ++i)
+      h = (h ^ p[i]) * 0x100000001b3ull;
+
+   return hash_mix64(h);
+}
+
+struct rdr_distinct_ctx_t *rdr_distinct_init()
+{
+   struct rdr_distinct_ctx_t *ctx;
+
+   ctx = (struct rdr_distinct_ctx_t *)calloc(1, sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->precision = RDR_DISTINCT_DEFAULT_PRECISION;
+
+   return ctx;
+}
+
+int rdr_distinct_set_params(struct rdr_distinct_ctx_t *ctx, const char *params, FILE *err_stream)
+{
+   unsigned long val;
+   char *endptr;
+
+   assert(ctx);
+   assert(params);
+
+   val = strtoul(params, &endptr, 10);
+   if (endptr == params || (val == 0) || (val > 86400)
+	 || (*endptr != '\0' && (*endptr != '/'))) {
+      if (err_stream != NULL) fprintf(err_stream, "%s wrong window `%s`\n", TAG, params);
+      return -1;
+   }
+   ctx->window_s = (unsigned)val;
+
+   if (*endptr == '/') {
+      params = endptr + 1;
+      val = strtoul(params, &endptr, 10);
+      if (endptr == params || (*endptr != '\0') || (val < 4) || (val > 16)) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong precision `%s`, expected 4-16\n",
+	       TAG, params);
+	 return -1;
+      }
+      ctx->precision = (unsigned)val;
+   }
+
+   return 0;
+}
+
+int rdr_distinct_set_output(struct rdr_distinct_ctx_t *ctx, const char *fname, FILE *err_stream)
+{
+   assert(ctx);
+   assert(fname);
+
+   free(ctx->out_fname);
+   ctx->out_fname = strdup(fname);
+   if (ctx->out_fname == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+      return -1;
+   }
+
+   return 0;
+}
+
+int rdr_distinct_is_enabled(struct rdr_distinct_ctx_t *ctx)
+{
+   return ctx->window_s != 0;
+}
+
+int rdr_distinct_start(struct rdr_distinct_ctx_t *ctx, int verbose)
+{
+   unsigned i;
+
+   assert(ctx);
+
+   ctx->verbose = verbose;
+   if (!rdr_distinct_is_enabled(ctx))
+      return 0;
+
+   for (i=0; i < DISTINCT_SKETCHES; ++i) {
+      if (hll_init(&ctx->total[i], ctx->precision) < 0) {
+	 fprintf(stderr, "%s calloc() error\n", TAG);
+	 return -1;
+      }
+   }
+
+   if (ctx->out_fname == NULL || (strcmp(ctx->out_fname, "-") == 0))
+      ctx->out = stdout;
+   else {
+      ctx->out = fopen(ctx->out_fname, "a");
+      if (ctx->out == NULL) {
+	 fprintf(stderr, "%s fopen(%s) error: %s\n", TAG, ctx->out_fname, strerror(errno));
+	 return -1;
+      }
+      ctx->out_buf = malloc(DISTINCT_OUT_BUF_SIZE);
+      if (ctx->out_buf != NULL)
+	 setvbuf(ctx->out, ctx->out_buf, _IOFBF, DISTINCT_OUT_BUF_SIZE);
+   }
+
+   ctx->started = 1;
+
+   if (verbose)
+      fprintf(stderr, "%s %u s windows, %u registers per sketch (%.1f%% error), writing to %s\n",
+	    TAG, ctx->window_s, 1u << ctx->precision, 104.0 / sqrt(1u << ctx->precision),
+	    ctx->out == stdout ? "stdout" : ctx->out_fname);
+
+   return 0;
+}
+
+static void write_line(struct rdr_distinct_ctx_t *ctx, const char *key,
+      uint64_t turs, const struct hll_t *sk)
+{
+   fprintf(ctx->out, "ts=%lu window=%u %s turs=%llu subscribers=%.0f servers=%.0f pairs=%.0f\n",
+	 (unsigned long)ctx->window, ctx->window_s, key, (unsigned long long)turs,
+	 hll_estimate(&sk[DISTINCT_SUBSCRIBERS]),
+	 hll_estimate(&sk[DISTINCT_SERVERS]),
+	 hll_estimate(&sk[DISTINCT_PAIRS]));
+}
+
+/* Writes out and empties the groups  */
+static void flush_window(struct rdr_distinct_ctx_t *ctx)
+{
+   unsigned i, j;
+   uint64_t turs;
+   struct distinct_group_t *g;
+   char key[32];
+
+   if (ctx->groups_cnt == 0)
+      return;
+
+   turs = 0;
+   for (i=0; i < ctx->groups_cnt; ++i) {
+      g = &ctx->groups[i];
+      snprintf(key, sizeof(key), "%s=%i",
+	    g->dim == DISTINCT_DIM_SERVICE ? "service_id" : "package_id", g->id);
+      write_line(ctx, key, g->turs, g->sk);
+      /* Every TUR is in exactly one service: their union is the total  */
+      if (g->dim == DISTINCT_DIM_SERVICE) {
+	 turs += g->turs;
+	 for (j=0; j < DISTINCT_SKETCHES; ++j)
+	    hll_merge(&ctx->total[j], &g->sk[j]);
+      }
+   }
+   write_line(ctx, "scope=total", turs, ctx->total);
+   if (fflush(ctx->out) != 0)
+      ctx->stats.write_errors += 1;
+
+   for (i=0; i < ctx->groups_cnt; ++i) {
+      for (j=0; j < DISTINCT_SKETCHES; ++j)
+	 hll_reset(&ctx->groups[i].sk[j]);
+   }
+   for (j=0; j < DISTINCT_SKETCHES; ++j)
+      hll_reset(&ctx->total[j]);
+   memset(ctx->slots, 0, sizeof(ctx->slots));
+   ctx->groups_cnt = 0;
+}
+
+static struct distinct_group_t *get_group(struct rdr_distinct_ctx_t *ctx, int dim, int id)
+{
+   struct distinct_group_t *g;
+   uint32_t hash;
+   unsigned i, j;
+   const unsigned mask = sizeof(ctx->slots) / sizeof(ctx->slots[0]) - 1;
+
+   hash = (uint32_t)hash_mix64(((uint64_t)(uint32_t)dim << 32) | (uint32_t)id);
+   for (i = hash & mask; ctx->slots[i] != 0; i = (i + 1) & mask) {
+      g = &ctx->groups[ctx->slots[i] - 1];
+      if (g->hash == hash && (g->dim == dim) && (g->id == id))
+	 return g;
+   }
+
+   if (ctx->groups_cnt == RDR_DISTINCT_MAX_GROUPS)
+      return NULL;
+
+   g = &ctx->groups[ctx->groups_cnt];
+   if (g->sk[0].registers == NULL) {
+      for (j=0; j < DISTINCT_SKETCHES; ++j) {
+	 if (hll_init(&g->sk[j], ctx->precision) < 0)
+	    return NULL;
+      }
+   }
+   g->dim = dim;
+   g->id = id;
+   g->hash = hash;
+   g->turs = 0;
+   ctx->slots[i] = ++ctx->groups_cnt;
+
+   return g;
+}
+
+void rdr_distinct_add(struct rdr_distinct_ctx_t *ctx, const struct rdr_distinct_tur_t *tur)
+{
+   struct distinct_group_t *groups[2];
+   uint64_t hashes[DISTINCT_SKETCHES];
+   time_t window;
+   unsigned i, j;
+
+   if (!ctx->started)
+      return;
+
+   ctx->stats.turs += 1;
+
+   /* REPORT_TIME below window_s is window 0, a window like the others  */
+   window = tur->report_time - tur->report_time % ctx->window_s;
+   if (!ctx->open || (window > ctx->window)) {
+      flush_window(ctx);
+      if (ctx->open)
+	 ctx->stats.windows += 1;
+      ctx->window = window;
+      ctx->open = 1;
+   }else if (window < ctx->window)
+      ctx->stats.late_turs += 1;
+   ctx->last_us = tur->arrival_us;
+
+   groups[0] = get_group(ctx, DISTINCT_DIM_SERVICE, tur->service_id);
+   groups[1] = get_group(ctx, DISTINCT_DIM_PACKAGE, tur->package_id);
+   if (groups[0] == NULL || (groups[1] == NULL)) {
+      ctx->stats.overflow_turs += 1;
+      return;
+   }
+
+   hashes[DISTINCT_SUBSCRIBERS] = hll_hash(tur->subscriber_id != NULL ? tur->subscriber_id : "",
+	 tur->subscriber_id != NULL ? strlen(tur->subscriber_id) : 0);
+   hashes[DISTINCT_SERVERS] = hash_mix64(tur->server_ip ^ DISTINCT_HASH_SEED);
+   hashes[DISTINCT_PAIRS] = hash_mix64((((uint64_t)tur->client_ip << 32) | tur->server_ip)
+	 ^ DISTINCT_HASH_SEED);
+
+   for (i=0; i < 2; ++i) {
+      groups[i]->turs += 1;
+      for (j=0; j < DISTINCT_SKETCHES; ++j)
+	 hll_add(&groups[i]->sk[j], hashes[j]);
+   }
+}
+
+void rdr_distinct_flush_idle(struct rdr_distinct_ctx_t *ctx, unsigned long long now_us)
+{
+   if (!ctx->started || !ctx->open)
+      return;
+
+   if (now_us >= ctx->last_us + 1000000ull * ctx->window_s) {
+      flush_window(ctx);
+      ctx->stats.windows += 1;
+      ctx->open = 0;
+   }
+}
+
+void rdr_distinct_destroy(struct rdr_distinct_ctx_t *ctx)
+{
+   unsigned i, j;
+
+   if (ctx == NULL)
+      return;
+
+   if (ctx->started)
+      flush_window(ctx);
+
+   if (ctx->out != NULL && (ctx->out != stdout)) {
+      if (fclose(ctx->out) != 0)
+	 perror("fclose() error");
+   }else if (ctx->out != NULL)
+      fflush(ctx->out);
+
+   for (i=0; i < RDR_DISTINCT_MAX_GROUPS; ++i) {
+      for (j=0; j < DISTINCT_SKETCHES; ++j)
+	 hll_free(&ctx->groups[i].sk[j]);
+   }
+   for (j=0; j < DISTINCT_SKETCHES; ++j)
+      hll_free(&ctx->total[j]);
+   free(ctx->out_buf);
+   free(ctx->out_fname);
+   free(ctx);
+}
+
+void rdr_distinct_print_stats(struct rdr_distinct_ctx_t *ctx, FILE *stream)
+{
+   assert(ctx);
+   assert(stream);
+
+   if (!ctx->started)
+      return;
+
+#define PRINT_DISTINCT_METRIC(_name, _type, _help, _val) \
+   stats_print_header(stream, "rdr2netflow_distinct_" _name, _type, _help); \
+   fprintf(stream, "rdr2netflow_distinct_" _name " %llu\n", (unsigned long long)(_val));
+
+   PRINT_DISTINCT_METRIC("turs_total", "counter",
+	 "TURs added to the distinct count sketches", ctx->stats.turs)
+   PRINT_DISTINCT_METRIC("late_turs_total", "counter",
+	 "TURs of an already written window, added to the open one", ctx->stats.late_turs)
+   PRINT_DISTINCT_METRIC("overflow_turs_total", "counter",
+	 "TURs not counted: too many services and packages in the window", ctx->stats.overflow_turs)
+   PRINT_DISTINCT_METRIC("windows_total", "counter",
+	 "Closed windows", ctx->stats.windows)
+   PRINT_DISTINCT_METRIC("write_errors_total", "counter",
+	 "Distinct count output write errors", ctx->stats.write_errors)
+   PRINT_DISTINCT_METRIC("groups", "gauge",
+	 "Services and packages in the open window", ctx->groups_cnt)
+
+#undef PRINT_DISTINCT_METRIC
+}
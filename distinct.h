@@ -0,0 +1,89 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _DISTINCT_H
+#define _DISTINCT_H
+
+#define RDR_DISTINCT_DEFAULT_PRECISION 12
+#define RDR_DISTINCT_MAX_GROUPS 4096
+
+/*
+ * HyperLogLog sketch: 2^precision one byte registers, relative standard
+ * error 1.04/sqrt(2^precision). Sketches of the same precision merge
+ * into the sketch of the union, so per-thread sketches can be combined.
+ */
+struct hll_t {
+   unsigned precision;
+   uint8_t *registers;
+};
+
+int hll_init(struct hll_t *h, unsigned precision);
+void hll_free(struct hll_t *h);
+void hll_reset(struct hll_t *h);
+/* 64-bit hash of the element, see hll_hash()  */
+void hll_add(struct hll_t *h, uint64_t hash);
+/* dst |= src, precisions must match  */
+void hll_merge(struct hll_t *dst, const struct hll_t *src);
+double hll_estimate(const struct hll_t *h);
+uint64_t hll_hash(const void *data, size_t size);
+
+struct rdr_distinct_tur_t {
+   const char *subscriber_id;
+   int service_id;
+   int package_id;
+   /* Network byte order  */
+   in_addr_t client_ip;
+   in_addr_t server_ip;
+   time_t report_time;
+   /* Local arrival, stats_monotonic_us()  */
+   unsigned long long arrival_us;
+};
+
+/*
+ * Distinct subscribers, server IPs and client/server pairs per SERVICE_ID
+ * and per PACKAGE_ID over fixed windows of REPORT_TIME. A window is
+ * written out like the -A rollups, one line per group and a total merged
+ * from the service sketches:
+ *
+ * ts=<window start> window=<sec> service_id=N|package_id=N|scope=total turs=N subscribers=N servers=N pairs=N
+ */
+struct rdr_distinct_ctx_t *rdr_distinct_init();
+/* Writes out the open window  */
+void rdr_distinct_destroy(struct rdr_distinct_ctx_t *ctx);
+/* sec[/precision]  */
+int rdr_distinct_set_params(struct rdr_distinct_ctx_t *ctx, const char *params, FILE *err_stream);
+/* "-" - stdout (default)  */
+int rdr_distinct_set_output(struct rdr_distinct_ctx_t *ctx, const char *fname, FILE *err_stream);
+int rdr_distinct_is_enabled(struct rdr_distinct_ctx_t *ctx);
+
+int rdr_distinct_start(struct rdr_distinct_ctx_t *ctx, int verbose);
+void rdr_distinct_add(struct rdr_distinct_ctx_t *ctx, const struct rdr_distinct_tur_t *tur);
+/* Writes out the open window if no TURs arrived for a window by the local clock  */
+void rdr_distinct_flush_idle(struct rdr_distinct_ctx_t *ctx, unsigned long long now_us);
+void rdr_distinct_print_stats(struct rdr_distinct_ctx_t *ctx, FILE *stream);
+
+#endif /* _DISTINCT_H  */
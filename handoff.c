@@ -0,0 +1,180 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "handoff.h"
+
+#define TAG "Handoff:"
+
+int handoff_exec(char *const argv[], pid_t *pid)
+{
+   int sp[2];
+   int fd, max_fd;
+   char fd_str[16];
+
+   assert(argv);
+   assert(pid);
+
+   if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sp) < 0) {
+      perror("socketpair() error");
+      return -1;
+   }
+
+   *pid = fork();
+   if (*pid < 0) {
+      perror("fork() error");
+      close(sp[0]);
+      close(sp[1]);
+      return -1;
+   }
+
+   if (*pid == 0) {
+      /* Child: sockets are passed over sp[1], do not leak the rest  */
+      max_fd = (int)sysconf(_SC_OPEN_MAX);
+      if (max_fd < 0 || (max_fd > 65536))
+	 max_fd = 65536;
+      for (fd = STDERR_FILENO + 1; fd < max_fd; ++fd) {
+	 if (fd != sp[1])
+	    close(fd);
+      }
+      snprintf(fd_str, sizeof(fd_str), "%i", sp[1]);
+      setenv(HANDOFF_ENV, fd_str, 1);
+      execvp(argv[0], argv);
+      fprintf(stderr, "%s execvp(%s) error: %s\n", TAG, argv[0], strerror(errno));
+      _exit(127);
+   }
+
+   close(sp[1]);
+
+   return sp[0];
+}
+
+int handoff_send(int s, const void *data, size_t size, int fd)
+{
+   struct msghdr msg;
+   struct iovec iov;
+   union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int))];
+   } cmsg;
+   ssize_t sent;
+
+   memset(&msg, 0, sizeof(msg));
+   iov.iov_base = (void *)data;
+   iov.iov_len = size;
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+
+   if (fd >= 0) {
+      memset(&cmsg, 0, sizeof(cmsg));
+      msg.msg_control = cmsg.buf;
+      msg.msg_controllen = sizeof(cmsg.buf);
+      cmsg.hdr.cmsg_level = SOL_SOCKET;
+      cmsg.hdr.cmsg_type = SCM_RIGHTS;
+      cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+      memcpy(CMSG_DATA(&cmsg.hdr), &fd, sizeof(int));
+   }
+
+   do {
+      sent = sendmsg(s, &msg, 0);
+   } while (sent < 0 && (errno == EINTR));
+
+   if (sent != (ssize_t)size) {
+      fprintf(stderr, "%s sendmsg() error: %s\n", TAG, sent < 0 ? strerror(errno) : "short write");
+      return -1;
+   }
+
+   return 0;
+}
+
+ssize_t handoff_recv(int s, void *data, size_t size, int *fd, int timeout_ms)
+{
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *c;
+   struct pollfd pfd;
+   union {
+      struct cmsghdr hdr;
+      char buf[CMSG_SPACE(sizeof(int))];
+   } cmsg;
+   ssize_t rcvd;
+   int res;
+
+   *fd = -1;
+
+   pfd.fd = s;
+   pfd.events = POLLIN;
+   do {
+      res = poll(&pfd, 1, timeout_ms);
+   } while (res < 0 && (errno == EINTR));
+   if (res <= 0) {
+      fprintf(stderr, "%s %s\n", TAG, res == 0 ? "timeout" : strerror(errno));
+      return -1;
+   }
+
+   memset(&msg, 0, sizeof(msg));
+   iov.iov_base = data;
+   iov.iov_len = size;
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = cmsg.buf;
+   msg.msg_controllen = sizeof(cmsg.buf);
+
+   do {
+      rcvd = recvmsg(s, &msg, 0);
+   } while (rcvd < 0 && (errno == EINTR));
+   if (rcvd < 0) {
+      fprintf(stderr, "%s recvmsg() error: %s\n", TAG, strerror(errno));
+      return -1;
+   }
+
+   for (c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && (c->cmsg_type == SCM_RIGHTS))
+	 memcpy(fd, CMSG_DATA(c), sizeof(int));
+   }
+
+   if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+      fprintf(stderr, "%s truncated message\n", TAG);
+      if (*fd >= 0)
+	 close(*fd);
+      *fd = -1;
+      return -1;
+   }
+
+   return rcvd;
+}
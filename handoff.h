@@ -0,0 +1,86 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _HANDOFF_H
+#define _HANDOFF_H
+
+/*
+ * Binary upgrade without dropping SCE sessions. The old process execs the
+ * new binary with a SOCK_SEQPACKET UNIX socket in HANDOFF_ENV and sends
+ * over it, one message each:
+ *
+ *   handoff_hdr_t      + listening socket
+ *   handoff_hdr_t      + netflow socket, export_socket times: a socket
+ *                        per collector, flow_seq is of the collector
+ *   handoff_session_t  + session socket, sessions_cnt times
+ *
+ * The new process answers with HANDOFF_ACK_MAGIC when it is ready to
+ * serve, the old one closes its copies of the sockets and exits. Both
+ * sides are the same host, integers are in host byte order
+ */
+#define HANDOFF_ENV "RDR2NETFLOW_HANDOFF_FD"
+#define HANDOFF_MAGIC 0x52444848 /* "RDHH"  */
+#define HANDOFF_ACK_MAGIC 0x5244484b /* "RDHK"  */
+#define HANDOFF_VERSION 1
+#define HANDOFF_TIMEOUT_MS 10000
+
+struct handoff_hdr_t {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t sessions_cnt;
+   /* Sequence number of the next exported record  */
+   uint32_t flow_seq;
+   /* Keep the exporter source ports for the collectors: sockets count  */
+   uint32_t export_socket;
+   uint32_t pad;
+   uint64_t export_dgrams;
+   uint64_t export_records;
+   uint64_t export_send_errors;
+};
+
+struct handoff_session_t {
+   uint32_t magic;
+   uint32_t remote_addr;
+   uint16_t remote_port;
+   uint16_t pad;
+   /* Bytes of the not yet parsed RDR in data  */
+   uint32_t pos;
+   uint64_t bytes_rcvd;
+   uint64_t frames;
+   uint64_t garbage_bytes;
+   uint64_t turs;
+   uint64_t turs_filtered;
+   uint8_t data[];
+};
+
+/* fork() and exec argv with the other end of the returned socket in HANDOFF_ENV  */
+int handoff_exec(char *const argv[], pid_t *pid);
+/* fd < 0 - message without a descriptor  */
+int handoff_send(int s, const void *data, size_t size, int fd);
+/* Returns message size, 0 on EOF, -1 on error or timeout. *fd is -1 if none  */
+ssize_t handoff_recv(int s, void *data, size_t size, int *fd, int timeout_ms);
+
+#endif /* _HANDOFF_H  */
@@ -0,0 +1,66 @@
+#!/bin/sh
+#
+# Parallel offline conversion check: rdr2netflow -r with -j1 and -jN must
+# produce the same netflow file and the same counters.
+#
+# rdrgen writes a fixed-seed capture with corrupted RDRs (broken bytes and
+# lengths, truncated frames, garbage between frames), it is converted once
+# single-threaded and then with each thread count.
+#
+# Usage: ./jcheck.sh [threads ...]
+#
+# Environment: FRAMES (default 200000), CORRUPT (default 0.05),
+# OTHER (default 0.1), SEED (default 9)
+
+FRAMES=${FRAMES:-200000}
+CORRUPT=${CORRUPT:-0.05}
+OTHER=${OTHER:-0.1}
+SEED=${SEED:-9}
+THREADS=${*:-"2 4 8"}
+
+BINDIR=$(dirname "$0")
+TMPDIR=$(mktemp -d /tmp/rdrjcheck.XXXXXX) || exit 1
+
+for b in rdr2netflow rdrgen; do
+   if [ ! -x "$BINDIR/$b" ]; then
+      echo "$BINDIR/$b not found, run make first" >&2
+      exit 1
+   fi
+done
+
+cleanup() {
+   rm -rf "$TMPDIR"
+}
+trap cleanup EXIT INT TERM
+
+convert() {
+   # convert <threads>: netflow file and counters of the summary line
+   "$BINDIR/rdr2netflow" -r "$TMPDIR/capture.rdr" -o "$TMPDIR/j$1.nf" -j $1 -V 1 \
+      2> "$TMPDIR/j$1.log" || return 1
+   grep ' bytes, ' "$TMPDIR/j$1.log" | sed 's/ in .*//' > "$TMPDIR/j$1.stats"
+}
+
+"$BINDIR/rdrgen" -f "$TMPDIR/capture.rdr" -n $FRAMES -x $CORRUPT -o $OTHER -S $SEED -V 0 || exit 1
+
+if ! convert 1; then
+   cat "$TMPDIR/j1.log" >&2
+   exit 1
+fi
+echo "j1: $(cat "$TMPDIR/j1.stats")"
+
+RES=0
+for j in $THREADS; do
+   if ! convert $j; then
+      cat "$TMPDIR/j$j.log" >&2
+      exit 1
+   fi
+   if cmp -s "$TMPDIR/j1.nf" "$TMPDIR/j$j.nf" && cmp -s "$TMPDIR/j1.stats" "$TMPDIR/j$j.stats"; then
+      result=ok
+   else
+      result=DIFF
+      RES=1
+   fi
+   echo "j$j: $(cat "$TMPDIR/j$j.stats") $result"
+done
+
+exit $RES
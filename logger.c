@@ -0,0 +1,568 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/* fopencookie()  */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "stats.h"
+
+#define TAG "Log:"
+
+/* Power of two  */
+#define LOG_RING_SIZE (1024*1024)
+/* stdio buffer of the ring stream: the largest message handed over whole  */
+#define LOG_STREAM_BUF_SIZE (64*1024)
+/* Drain thread poll interval when the ring is empty  */
+#define LOG_DRAIN_INTERVAL_US 10000
+#define LOG_RATE_WINDOW_US 1000000
+
+#define LOG_MAX_SELECTORS 16
+
+static const char *class_names[RDR_LOG_CLASSES] = {"error", "conn", "debug"};
+
+struct rdr_log_ctx_t {
+   int verbose;
+   FILE *stream;
+
+   pthread_t drain;
+   int drain_started;
+   int stop;
+
+   /*
+    * Single producer (the thread writing to stream), single consumer (the
+    * drain thread). head and tail only grow, position is (x & mask)
+    */
+   char *ring;
+   unsigned long head;
+   unsigned long tail;
+   char *stream_buf;
+
+   /* Dropped since the last marker written to the ring  */
+   unsigned long long dropped_pending;
+
+   struct {
+      unsigned rate;
+      unsigned long long window_start_us;
+      unsigned cnt;
+      unsigned long long suppressed;
+   } limit[RDR_LOG_CLASSES];
+
+   unsigned tags_cnt;
+   unsigned tags[LOG_MAX_SELECTORS];
+   unsigned sessions_cnt;
+   struct sockaddr_in sessions[LOG_MAX_SELECTORS];
+
+   struct {
+      unsigned long long messages[RDR_LOG_CLASSES];
+      unsigned long long suppressed[RDR_LOG_CLASSES];
+      unsigned long long dropped_bytes;
+      unsigned long long write_errors;
+   } stats;
+};
+
+struct rdr_log_ctx_t *rdr_log_init()
+{
+   unsigned i;
+   struct rdr_log_ctx_t *ctx;
+
+   ctx = (struct rdr_log_ctx_t *)calloc(1, sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->stream = stderr;
+   for (i=0; i < RDR_LOG_CLASSES; ++i)
+      ctx->limit[i].rate = (i == RDR_LOG_DEBUG) ? 0 : RDR_LOG_DEFAULT_RATE;
+
+   return ctx;
+}
+
+int rdr_log_set_rate(struct rdr_log_ctx_t *ctx, const char *rate, FILE *err_stream)
+{
+   unsigned i, first, last;
+   const char *p;
+   char *endptr;
+   unsigned long val;
+
+   assert(ctx);
+   assert(rate);
+
+   /* [class=]num, without class - error and conn  */
+   first = RDR_LOG_ERROR;
+   last = RDR_LOG_CONN;
+   p = strchr(rate, '=');
+   if (p != NULL) {
+      for (i=0; i < RDR_LOG_CLASSES; ++i) {
+	 if (strlen(class_names[i]) == (size_t)(p - rate)
+	       && (strncmp(class_names[i], rate, p - rate) == 0))
+	    break;
+      }
+      if (i == RDR_LOG_CLASSES) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s unknown message class in `%s`\n", TAG, rate);
+	 return -1;
+      }
+      first = last = i;
+      p += 1;
+   }else
+      p = rate;
+
+   val = strtoul(p, &endptr, 10);
+   if (*p == '\0' || (*endptr != '\0')) {
+      if (err_stream != NULL) fprintf(err_stream, "%s wrong rate `%s`, expected [class=]num\n", TAG, rate);
+      return -1;
+   }
+
+   for (i=first; i <= last; ++i)
+      ctx->limit[i].rate = (unsigned)val;
+
+   return 0;
+}
+
+static int add_selector(struct rdr_log_ctx_t *ctx, char *sel, FILE *err_stream)
+{
+   char *val, *port, *endptr;
+   unsigned long num;
+   struct sockaddr_in *addr;
+
+   val = strchr(sel, '=');
+   if (val == NULL)
+      goto wrong;
+   *val++ = '\0';
+
+   if (strcmp(sel, "tag") == 0) {
+      if (ctx->tags_cnt == LOG_MAX_SELECTORS)
+	 goto too_many;
+      num = strtoul(val, &endptr, 0);
+      if (*val == '\0' || (*endptr != '\0') || (num == RDR_LOG_ANY_TAG))
+	 goto wrong;
+      ctx->tags[ctx->tags_cnt++] = (unsigned)num;
+   }else if (strcmp(sel, "session") == 0) {
+      if (ctx->sessions_cnt == LOG_MAX_SELECTORS)
+	 goto too_many;
+      addr = &ctx->sessions[ctx->sessions_cnt];
+      memset(addr, 0, sizeof(*addr));
+      port = strchr(val, ':');
+      if (port != NULL) {
+	 *port++ = '\0';
+	 num = strtoul(port, &endptr, 10);
+	 if (*port == '\0' || (*endptr != '\0') || (num > 0xffff))
+	    goto wrong;
+	 addr->sin_port = htons((uint16_t)num);
+      }
+      if (inet_aton(val, &addr->sin_addr) <= 0)
+	 goto wrong;
+      ctx->sessions_cnt += 1;
+   }else
+      goto wrong;
+
+   return 0;
+
+wrong:
+   if (err_stream != NULL) fprintf(err_stream, "%s wrong selector, expected tag=num or session=ip[:port]\n", TAG);
+   return -1;
+too_many:
+   if (err_stream != NULL) fprintf(err_stream, "%s too many selectors\n", TAG);
+   return -1;
+}
+
+int rdr_log_add_selector(struct rdr_log_ctx_t *ctx, const char *selectors, FILE *err_stream)
+{
+   int res;
+   char *str, *token, *saveptr;
+
+   assert(ctx);
+   assert(selectors);
+
+   str = strdup(selectors);
+   if (str == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+      return -1;
+   }
+
+   res = 0;
+   for (token = strtok_r(str, ",", &saveptr); token != NULL && (res == 0);
+	 token = strtok_r(NULL, ",", &saveptr))
+      res = add_selector(ctx, token, err_stream);
+
+   free(str);
+   return res;
+}
+
+static ssize_t ring_put(struct rdr_log_ctx_t *ctx, const char *buf, size_t size)
+{
+   unsigned long head, tail;
+   size_t pos, chunk;
+
+   head = ctx->head;
+   tail = __atomic_load_n(&ctx->tail, __ATOMIC_ACQUIRE);
+   if (size > LOG_RING_SIZE - (head - tail))
+      return -1;
+
+   pos = head & (LOG_RING_SIZE - 1);
+   chunk = LOG_RING_SIZE - pos;
+   if (chunk > size)
+      chunk = size;
+   memcpy(&ctx->ring[pos], buf, chunk);
+   memcpy(&ctx->ring[0], buf + chunk, size - chunk);
+
+   __atomic_store_n(&ctx->head, head + size, __ATOMIC_RELEASE);
+
+   return size;
+}
+
+/* stdio write callback of the ring stream. Never blocks  */
+static ssize_t ring_stream_write(void *cookie, const char *buf, size_t size)
+{
+   struct rdr_log_ctx_t *ctx;
+
+   ctx = (struct rdr_log_ctx_t *)cookie;
+
+   if (ctx->dropped_pending != 0) {
+      char marker[64], *p;
+      p = marker;
+      memcpy(p, "[", 1);
+      p = rdr_log_fmt_uint(p + 1, ctx->dropped_pending);
+      memcpy(p, " log bytes dropped]\n", 20);
+      p += 20;
+      if (ring_put(ctx, marker, p - marker) > 0)
+	 ctx->dropped_pending = 0;
+   }
+
+   if (ctx->dropped_pending != 0 || (ring_put(ctx, buf, size) < 0)) {
+      ctx->stats.dropped_bytes += size;
+      ctx->dropped_pending += size;
+   }
+
+   /* Dropped data is reported as written: stdio would retry it otherwise  */
+   return size;
+}
+
+#ifndef __linux__
+static int ring_stream_write_bsd(void *cookie, const char *buf, int size)
+{
+   return (int)ring_stream_write(cookie, buf, size);
+}
+#endif
+
+static void *drain_thread(void *arg)
+{
+   struct rdr_log_ctx_t *ctx;
+   unsigned long head, tail;
+   size_t pos, chunk;
+   ssize_t written;
+   struct timespec ts;
+
+   ctx = (struct rdr_log_ctx_t *)arg;
+   ts.tv_sec = 0;
+   ts.tv_nsec = LOG_DRAIN_INTERVAL_US * 1000;
+
+   for (;;) {
+      tail = ctx->tail;
+      head = __atomic_load_n(&ctx->head, __ATOMIC_ACQUIRE);
+      if (head == tail) {
+	 if (__atomic_load_n(&ctx->stop, __ATOMIC_ACQUIRE))
+	    break;
+	 nanosleep(&ts, NULL);
+	 continue;
+      }
+
+      pos = tail & (LOG_RING_SIZE - 1);
+      chunk = LOG_RING_SIZE - pos;
+      if (chunk > head - tail)
+	 chunk = head - tail;
+
+      written = write(STDERR_FILENO, &ctx->ring[pos], chunk);
+      if (written < 0) {
+	 if (errno == EINTR)
+	    continue;
+	 /* Nowhere to report: skip  */
+	 __atomic_add_fetch(&ctx->stats.write_errors, 1, __ATOMIC_RELAXED);
+	 written = chunk;
+      }
+
+      __atomic_store_n(&ctx->tail, tail + written, __ATOMIC_RELEASE);
+   }
+
+   return NULL;
+}
+
+int rdr_log_start(struct rdr_log_ctx_t *ctx, int verbose)
+{
+   FILE *stream;
+
+   assert(ctx);
+
+   ctx->verbose = verbose;
+
+   ctx->ring = (char *)malloc(LOG_RING_SIZE);
+   ctx->stream_buf = (char *)malloc(LOG_STREAM_BUF_SIZE);
+   if (ctx->ring == NULL || (ctx->stream_buf == NULL)) {
+      perror("malloc() error");
+      return -1;
+   }
+
+#ifdef __linux__
+   {
+      cookie_io_functions_t io_funcs;
+      memset(&io_funcs, 0, sizeof(io_funcs));
+      io_funcs.write = ring_stream_write;
+      stream = fopencookie(ctx, "w", io_funcs);
+   }
+#else
+   stream = funopen(ctx, NULL, ring_stream_write_bsd, NULL, NULL);
+#endif
+   if (stream == NULL) {
+      perror("fopencookie() error");
+      return -1;
+   }
+   setvbuf(stream, ctx->stream_buf, _IOFBF, LOG_STREAM_BUF_SIZE);
+
+   fflush(stderr);
+   if (pthread_create(&ctx->drain, NULL, drain_thread, ctx) != 0) {
+      perror("pthread_create() error");
+      fclose(stream);
+      return -1;
+   }
+   ctx->drain_started = 1;
+   ctx->stream = stream;
+
+   return 0;
+}
+
+FILE *rdr_log_stream(struct rdr_log_ctx_t *ctx)
+{
+   return ctx->stream;
+}
+
+static void report_suppressed(struct rdr_log_ctx_t *ctx, unsigned msg_class)
+{
+   char buf[128], *p;
+   size_t len;
+
+   p = buf;
+   memcpy(p, TAG " ", sizeof(TAG " ") - 1);
+   p += sizeof(TAG " ") - 1;
+   p = rdr_log_fmt_uint(p, ctx->limit[msg_class].suppressed);
+   *p++ = ' ';
+   len = strlen(class_names[msg_class]);
+   memcpy(p, class_names[msg_class], len);
+   p += len;
+   memcpy(p, " messages suppressed\n", 21);
+   p += 21;
+
+   fwrite(buf, p - buf, 1, ctx->stream);
+   rdr_log_commit(ctx);
+   ctx->limit[msg_class].suppressed = 0;
+}
+
+int rdr_log_allow(struct rdr_log_ctx_t *ctx, unsigned msg_class)
+{
+   unsigned long long now_us;
+
+   assert(msg_class < RDR_LOG_CLASSES);
+
+   if (ctx->limit[msg_class].rate == 0) {
+      ctx->stats.messages[msg_class] += 1;
+      return 1;
+   }
+
+   now_us = stats_monotonic_us();
+   if (now_us - ctx->limit[msg_class].window_start_us >= LOG_RATE_WINDOW_US) {
+      if (ctx->limit[msg_class].suppressed != 0)
+	 report_suppressed(ctx, msg_class);
+      ctx->limit[msg_class].window_start_us = now_us;
+      ctx->limit[msg_class].cnt = 0;
+   }
+
+   if (ctx->limit[msg_class].cnt >= ctx->limit[msg_class].rate) {
+      ctx->limit[msg_class].suppressed += 1;
+      ctx->stats.suppressed[msg_class] += 1;
+      return 0;
+   }
+
+   ctx->limit[msg_class].cnt += 1;
+   ctx->stats.messages[msg_class] += 1;
+   return 1;
+}
+
+void rdr_log_commit(struct rdr_log_ctx_t *ctx)
+{
+   if (ctx->drain_started)
+      fflush(ctx->stream);
+}
+
+int rdr_log_selected(struct rdr_log_ctx_t *ctx, unsigned tag, const struct sockaddr_in *src)
+{
+   unsigned i;
+
+   if (tag != RDR_LOG_ANY_TAG && (ctx->tags_cnt != 0)) {
+      for (i=0; i < ctx->tags_cnt; ++i) {
+	 if (ctx->tags[i] == tag)
+	    break;
+      }
+      if (i == ctx->tags_cnt)
+	 return 0;
+   }
+
+   if (ctx->sessions_cnt != 0) {
+      for (i=0; i < ctx->sessions_cnt; ++i) {
+	 if (ctx->sessions[i].sin_addr.s_addr == src->sin_addr.s_addr
+	       && (ctx->sessions[i].sin_port == 0
+		  || (ctx->sessions[i].sin_port == src->sin_port)))
+	    break;
+      }
+      if (i == ctx->sessions_cnt)
+	 return 0;
+   }
+
+   return 1;
+}
+
+void rdr_log_flush(struct rdr_log_ctx_t *ctx)
+{
+   unsigned i;
+   unsigned long long now_us;
+
+   now_us = stats_monotonic_us();
+   for (i=0; i < RDR_LOG_CLASSES; ++i) {
+      if (ctx->limit[i].suppressed != 0
+	    && (now_us - ctx->limit[i].window_start_us >= LOG_RATE_WINDOW_US))
+	 report_suppressed(ctx, i);
+   }
+}
+
+void rdr_log_destroy(struct rdr_log_ctx_t *ctx)
+{
+   unsigned i;
+
+   if (ctx == NULL)
+      return;
+
+   for (i=0; i < RDR_LOG_CLASSES; ++i) {
+      if (ctx->limit[i].suppressed != 0)
+	 report_suppressed(ctx, i);
+   }
+
+   if (ctx->drain_started) {
+      /* Drain the rest and switch back to stderr  */
+      fflush(ctx->stream);
+      __atomic_store_n(&ctx->stop, 1, __ATOMIC_RELEASE);
+      pthread_join(ctx->drain, NULL);
+      fclose(ctx->stream);
+      ctx->stream = stderr;
+   }
+
+   free(ctx->stream_buf);
+   free(ctx->ring);
+   free(ctx);
+}
+
+void rdr_log_print_stats(struct rdr_log_ctx_t *ctx, FILE *stream)
+{
+   unsigned i;
+
+   assert(ctx);
+   assert(stream);
+
+   stats_print_header(stream, "rdr2netflow_log_messages_total", "counter",
+	 "Log messages written by class");
+   for (i=0; i < RDR_LOG_CLASSES; ++i)
+      fprintf(stream, "rdr2netflow_log_messages_total{class=\"%s\"} %llu\n",
+	    class_names[i], ctx->stats.messages[i]);
+   stats_print_header(stream, "rdr2netflow_log_suppressed_total", "counter",
+	 "Log messages suppressed by rate limit");
+   for (i=0; i < RDR_LOG_CLASSES; ++i)
+      fprintf(stream, "rdr2netflow_log_suppressed_total{class=\"%s\"} %llu\n",
+	    class_names[i], ctx->stats.suppressed[i]);
+   stats_print_header(stream, "rdr2netflow_log_dropped_bytes_total", "counter",
+	 "Log bytes dropped on ring overflow");
+   fprintf(stream, "rdr2netflow_log_dropped_bytes_total %llu\n", ctx->stats.dropped_bytes);
+   stats_print_header(stream, "rdr2netflow_log_write_errors_total", "counter",
+	 "Log write() errors");
+   fprintf(stream, "rdr2netflow_log_write_errors_total %llu\n",
+	 __atomic_load_n(&ctx->stats.write_errors, __ATOMIC_RELAXED));
+   stats_print_header(stream, "rdr2netflow_log_queued_bytes", "gauge",
+	 "Log bytes waiting for the drain thread");
+   fprintf(stream, "rdr2netflow_log_queued_bytes %lu\n",
+	 __atomic_load_n(&ctx->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ctx->tail, __ATOMIC_ACQUIRE));
+}
+
+char *rdr_log_fmt_uint(char *buf, unsigned long long val)
+{
+   char tmp[20];
+   unsigned len;
+
+   len = 0;
+   do {
+      tmp[len++] = '0' + (char)(val % 10);
+      val /= 10;
+   } while (val != 0);
+
+   while (len > 0)
+      *buf++ = tmp[--len];
+   *buf = '\0';
+
+   return buf;
+}
+
+char *rdr_log_fmt_ip(char *buf, struct in_addr addr)
+{
+   unsigned i;
+   const uint8_t *b;
+
+   b = (const uint8_t *)&addr.s_addr;
+   for (i=0; i < 4; ++i) {
+      if (b[i] >= 100)
+	 *buf++ = '0' + b[i] / 100;
+      if (b[i] >= 10)
+	 *buf++ = '0' + (b[i] / 10) % 10;
+      *buf++ = '0' + b[i] % 10;
+      *buf++ = (i == 3) ? '\0' : '.';
+   }
+
+   return buf - 1;
+}
+
+char *rdr_log_fmt_addr(char *buf, const struct sockaddr_in *addr)
+{
+   buf = rdr_log_fmt_ip(buf, addr->sin_addr);
+   *buf++ = ':';
+   return rdr_log_fmt_uint(buf, ntohs(addr->sin_port));
+}
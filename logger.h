@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOGGER_H
+#define _LOGGER_H
+
+/* Messages per second per class, 0 - unlimited  */
+#define RDR_LOG_DEFAULT_RATE 10
+
+/* Message classes with separate rate limits  */
+#define RDR_LOG_ERROR 0  /* Decode and send errors  */
+#define RDR_LOG_CONN  1  /* SCE connects and disconnects  */
+#define RDR_LOG_DEBUG 2  /* -V >= 10 dumps, not limited by default  */
+#define RDR_LOG_CLASSES 3
+
+/* rdr_log_selected(): tag is not known yet  */
+#define RDR_LOG_ANY_TAG 0
+
+/* "255.255.255.255:65535"  */
+#define RDR_LOG_ADDR_STRLEN 22
+
+struct rdr_log_ctx_t *rdr_log_init();
+void rdr_log_destroy(struct rdr_log_ctx_t *ctx);
+int rdr_log_set_rate(struct rdr_log_ctx_t *ctx, const char *rate, FILE *err_stream);
+int rdr_log_add_selector(struct rdr_log_ctx_t *ctx, const char *selectors, FILE *err_stream);
+
+/*
+ * Until rdr_log_start() messages go straight to stderr. After it they are
+ * queued to a ring drained to stderr by a background thread: the ingest
+ * thread never blocks on the terminal, messages that do not fit are
+ * dropped and counted. Only one thread may write to rdr_log_stream()
+ */
+int rdr_log_start(struct rdr_log_ctx_t *ctx, int verbose);
+FILE *rdr_log_stream(struct rdr_log_ctx_t *ctx);
+
+/* 1 if a message of this class may be written now  */
+int rdr_log_allow(struct rdr_log_ctx_t *ctx, unsigned msg_class);
+/* End of message: hand it over to the drain thread  */
+void rdr_log_commit(struct rdr_log_ctx_t *ctx);
+/* Debug output is enabled for this tag and SCE  */
+int rdr_log_selected(struct rdr_log_ctx_t *ctx, unsigned tag, const struct sockaddr_in *src);
+/* Report suppressed messages of the passed rate limit windows  */
+void rdr_log_flush(struct rdr_log_ctx_t *ctx);
+void rdr_log_print_stats(struct rdr_log_ctx_t *ctx, FILE *stream);
+
+/* Formatters without printf(). Return the end of the written string  */
+char *rdr_log_fmt_uint(char *buf, unsigned long long val);
+char *rdr_log_fmt_ip(char *buf, struct in_addr addr);
+char *rdr_log_fmt_addr(char *buf, const struct sockaddr_in *addr);
+
+#endif /* _LOGGER_H  */
@@ -0,0 +1,358 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Loopback Netflow v5 collector for soak tests: decodes datagrams and
+ * verifies record counts, octet totals and flow_seq continuity.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "netflow.h"
+
+const char *progname = "nfsink";
+const char *revision = "$Revision: 0.2 $";
+
+#define DEFAULT_LISTEN_IP   "127.0.0.1"
+#define DEFAULT_LISTEN_PORT 9995
+#define MAX_STREAMS 64
+
+struct opts_t {
+   struct in_addr addr;
+   unsigned port;
+   unsigned rcvbuf;
+   unsigned idle_tmout;
+   int verbose;
+};
+
+/* Exporter: source address and engine  */
+struct stream_t {
+   struct sockaddr_in addr;
+   unsigned engine_type;
+   unsigned engine_id;
+   uint32_t next_seq;
+};
+
+struct sink_stats_t {
+   unsigned long long dgrams;
+   unsigned long long records;
+   unsigned long long octets;
+   unsigned long long bad_dgrams;
+   unsigned long long lost_records;
+   unsigned long long reordered_dgrams;
+};
+
+static struct stream_t streams[MAX_STREAMS];
+static unsigned streams_cnt = 0;
+
+static volatile sig_atomic_t quit = 0;
+static volatile sig_atomic_t dump_stats = 0;
+
+static void help(void)
+{
+ printf("%s - Netflow v5 sink collector\t\t%s\n", progname, revision);
+ printf(
+   "\nUsage:\n    %s [-h] [options]\n"
+   "\nOptions:\n"
+   "    -s <address>    Address to bind (default %s)\n"
+   "    -p <port>       Port (default %u)\n"
+   "    -b <size>       Receive buffer size in bytes\n"
+   "    -t <seconds>    Exit after this idle time once datagrams arrived, 0 - never (default 0)\n"
+   "    -V <level>      Verbose output\n"
+   "    -h, --help      Help\n"
+   "\n",
+   progname, DEFAULT_LISTEN_IP, DEFAULT_LISTEN_PORT);
+}
+
+static void sig_quit(int signal) {
+   quit = signal;
+}
+
+static void sig_dump_stats(int signal) {
+   dump_stats = signal;
+}
+
+static double elapsed_s(const struct timespec *start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static struct stream_t *find_stream(const struct sockaddr_in *addr,
+      unsigned engine_type, unsigned engine_id, int *is_new)
+{
+   unsigned i;
+   struct stream_t *st;
+
+   for (i=0; i < streams_cnt; ++i) {
+      st = &streams[i];
+      if (st->addr.sin_addr.s_addr == addr->sin_addr.s_addr
+	    && (st->addr.sin_port == addr->sin_port)
+	    && (st->engine_type == engine_type)
+	    && (st->engine_id == engine_id)) {
+	 *is_new = 0;
+	 return st;
+      }
+   }
+
+   if (streams_cnt == MAX_STREAMS)
+      return NULL;
+
+   st = &streams[streams_cnt++];
+   st->addr = *addr;
+   st->engine_type = engine_type;
+   st->engine_id = engine_id;
+   *is_new = 1;
+
+   return st;
+}
+
+static void handle_dgram(const struct opts_t *opts, struct sink_stats_t *stats,
+      const uint8_t *buf, size_t size, const struct sockaddr_in *from)
+{
+   unsigned i, count;
+   uint32_t seq;
+   int is_new;
+   const struct netflow_v5_header *hdr;
+   const struct netflow_v5_record *rc;
+   struct stream_t *st;
+
+   hdr = (const struct netflow_v5_header *)buf;
+   if (size < sizeof(*hdr) || (ntohs(hdr->version) != NETFLOW_V5)) {
+      stats->bad_dgrams += 1;
+      return;
+   }
+
+   count = ntohs(hdr->count);
+   if (count > NETFLOW_V5_MAX_RECORDS
+	 || (size != sizeof(*hdr) + count * sizeof(struct netflow_v5_record))) {
+      stats->bad_dgrams += 1;
+      return;
+   }
+
+   stats->dgrams += 1;
+   stats->records += count;
+
+   rc = (const struct netflow_v5_record *)(buf + sizeof(*hdr));
+   for (i=0; i < count; ++i) {
+      stats->octets += ntohl(rc[i].octets);
+      if (opts->verbose >= 10) {
+	 char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+	 inet_ntop(AF_INET, &rc[i].src_addr, src, sizeof(src));
+	 inet_ntop(AF_INET, &rc[i].dst_addr, dst, sizeof(dst));
+	 fprintf(stderr, "\t%s:%u -> %s:%u proto %u octets %u first %u last %u\n",
+	       src, ntohs(rc[i].s_port), dst, ntohs(rc[i].d_port),
+	       rc[i].prot, ntohl(rc[i].octets), ntohl(rc[i].first), ntohl(rc[i].last));
+      }
+   }
+
+   seq = ntohl(hdr->flow_seq);
+   st = find_stream(from, hdr->engine_type, hdr->engine_id, &is_new);
+   if (st == NULL)
+      return;
+
+   if (!is_new && (seq != st->next_seq)) {
+      if ((int32_t)(seq - st->next_seq) > 0)
+	 stats->lost_records += seq - st->next_seq;
+      else
+	 stats->reordered_dgrams += 1;
+      if (opts->verbose > 1)
+	 fprintf(stderr, "flow_seq %u, expected %u\n", seq, st->next_seq);
+   }
+   if (is_new || ((int32_t)(seq + count - st->next_seq) > 0))
+      st->next_seq = seq + count;
+}
+
+static void print_stats(FILE *stream, const struct sink_stats_t *stats, double elapsed)
+{
+   fprintf(stream, "dgrams=%llu records=%llu octets=%llu bad=%llu lost=%llu reordered=%llu "
+	 "streams=%u seconds=%.3f records_per_s=%.0f\n",
+	 stats->dgrams, stats->records, stats->octets,
+	 stats->bad_dgrams, stats->lost_records, stats->reordered_dgrams,
+	 streams_cnt, elapsed,
+	 elapsed > 0 ? stats->records / elapsed : 0.0);
+   fflush(stream);
+}
+
+int main(int argc, char *argv[])
+{
+   signed char c;
+   int s;
+   struct opts_t opts;
+   struct sockaddr_in addr;
+   struct sink_stats_t stats;
+   struct timespec start_ts, last_ts;
+   int started;
+   static uint8_t buf[65536];
+
+   static struct option longopts[] = {
+      {"help",        no_argument,       0, 'h'},
+      {"verbose",        optional_argument,       0, 'V'},
+      {0, 0, 0, 0}
+   };
+
+   opts.addr.s_addr = inet_addr(DEFAULT_LISTEN_IP);
+   opts.port = DEFAULT_LISTEN_PORT;
+   opts.rcvbuf = 0;
+   opts.idle_tmout = 0;
+   opts.verbose = 1;
+
+   while ((c = getopt_long(argc, argv, "hV:s:p:b:t:",longopts,NULL)) != -1) {
+      switch (c) {
+	 case 's':
+	    if (inet_aton(optarg, &opts.addr) <= 0) {
+	       fprintf(stderr, "Incorrect address\n");
+	       return 1;
+	    }
+	    break;
+	 case 'p':
+	    opts.port = (unsigned)strtoul(optarg, NULL, 10);
+	    if (opts.port == 0 || (opts.port > 0xffff)) {
+	       fprintf(stderr, "Incorrect port\n");
+	       return 1;
+	    }
+	    break;
+	 case 'b':
+	    opts.rcvbuf = (unsigned)strtoul(optarg, NULL, 0);
+	    break;
+	 case 't':
+	    opts.idle_tmout = (unsigned)strtoul(optarg, NULL, 10);
+	    break;
+	 case 'V':
+	    if (optarg != NULL)
+	       opts.verbose=(unsigned)strtoul(optarg, NULL, 0);
+	    else
+	       opts.verbose=1;
+	    break;
+	 default:
+	    help();
+	    exit(0);
+	    break;
+      }
+   }
+
+   s = socket(PF_INET, SOCK_DGRAM, 0);
+   if (s < 0) {
+      perror("socket() error");
+      return 1;
+   }
+   if (opts.rcvbuf > 0) {
+      if (setsockopt(s, SOL_SOCKET, SO_RCVBUF, &opts.rcvbuf, sizeof(opts.rcvbuf)) < 0)
+	 perror("setsockopt(SO_RCVBUF) error");
+   }
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr = opts.addr;
+   addr.sin_port = htons(opts.port);
+   if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      perror("bind() error");
+      return 1;
+   }
+
+   signal(SIGHUP, sig_quit);
+   signal(SIGINT, sig_quit);
+   signal(SIGTERM, sig_quit);
+   signal(SIGUSR1, sig_dump_stats);
+
+   memset(&stats, 0, sizeof(stats));
+   started = 0;
+   clock_gettime(CLOCK_MONOTONIC, &start_ts);
+   last_ts = start_ts;
+
+   while (!quit) {
+      fd_set readfds;
+      struct timeval tv;
+      int ready_cnt;
+
+      FD_ZERO(&readfds);
+      FD_SET(s, &readfds);
+      tv.tv_sec = 0;
+      tv.tv_usec = 200000;
+      ready_cnt = select(s+1, &readfds, NULL, NULL, &tv);
+
+      if (dump_stats) {
+	 dump_stats = 0;
+	 print_stats(stderr, &stats, started ? elapsed_s(&start_ts) : 0);
+      }
+
+      if (ready_cnt < 0) {
+	 if (errno == EINTR)
+	    continue;
+	 perror("select() error");
+	 break;
+      }
+
+      if (ready_cnt == 0) {
+	 if (started && opts.idle_tmout != 0 && (elapsed_s(&last_ts) >= opts.idle_tmout))
+	    break;
+	 continue;
+      }
+
+      /* Drain the socket  */
+      for (;;) {
+	 ssize_t rcvd;
+	 struct sockaddr_in from;
+	 socklen_t fromlen;
+
+	 fromlen = sizeof(from);
+	 rcvd = recvfrom(s, buf, sizeof(buf), MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+	 if (rcvd < 0) {
+	    if (errno != EAGAIN && (errno != EINTR))
+	       perror("recvfrom() error");
+	    break;
+	 }
+	 if (!started) {
+	    started = 1;
+	    clock_gettime(CLOCK_MONOTONIC, &start_ts);
+	 }
+	 handle_dgram(&opts, &stats, buf, rcvd, &from);
+      }
+      clock_gettime(CLOCK_MONOTONIC, &last_ts);
+   }
+
+   print_stats(stdout, &stats,
+	 started ? (last_ts.tv_sec - start_ts.tv_sec) + (last_ts.tv_nsec - start_ts.tv_nsec) / 1e9 : 0);
+   close(s);
+
+   return 0;
+}
@@ -0,0 +1,558 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pacer.h"
+#include "stats.h"
+
+#define TAG "Export queue:"
+
+#define PACER_MIN_BACKOFF_US 10000
+
+struct pacer_dgram_t {
+   size_t size;
+   unsigned records;
+   uint8_t data[RDR_PACER_MAX_DGRAM_SIZE];
+};
+
+struct rdr_pacer_ctx_t {
+   /* Datagrams per second, 0 - not paced  */
+   unsigned long rate;
+   unsigned burst;
+   /* Retry transient send() failures  */
+   int retry;
+   unsigned queue_size;
+   unsigned long long max_backoff_us;
+   /* Wait for a token on a full queue instead of dropping  */
+   int blocking;
+
+   double tokens;
+   unsigned long long last_us;
+
+   /* Head is being retried: next attempt, current backoff  */
+   unsigned long long retry_at_us;
+   unsigned long long backoff_us;
+
+   /* Ring of the datagrams waiting for tokens or a retry  */
+   struct pacer_dgram_t *queue;
+   unsigned head;
+   unsigned queued;
+
+   struct {
+      unsigned long long sent;
+      unsigned long long deferred;
+      unsigned long long waits;
+      unsigned long long send_errors;
+      unsigned long long retries;
+      unsigned long long dropped_full;
+      unsigned long long dropped_full_records;
+      unsigned long long dropped_error;
+      unsigned long long dropped_error_records;
+      unsigned queued_max;
+   } stats;
+};
+
+struct rdr_pacer_ctx_t *rdr_pacer_init()
+{
+   struct rdr_pacer_ctx_t *ctx;
+
+   ctx = (struct rdr_pacer_ctx_t *)calloc(1, sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->burst = RDR_PACER_DEFAULT_BURST;
+   ctx->retry = 1;
+   ctx->queue_size = RDR_PACER_DEFAULT_QUEUE;
+   ctx->max_backoff_us = 1000ull * RDR_PACER_DEFAULT_MAX_BACKOFF_MS;
+
+   return ctx;
+}
+
+void rdr_pacer_destroy(struct rdr_pacer_ctx_t *ctx)
+{
+   if (ctx == NULL)
+      return;
+   free(ctx->queue);
+   free(ctx);
+}
+
+int rdr_pacer_set_rate(struct rdr_pacer_ctx_t *ctx, const char *rate, FILE *err_stream)
+{
+   char *endptr;
+   const char *p;
+   unsigned long val;
+
+   assert(ctx);
+   assert(rate);
+
+   val = strtoul(rate, &endptr, 10);
+   if (endptr == rate || (val == 0) || (*endptr != '\0' && (*endptr != '/'))) {
+      if (err_stream != NULL) fprintf(err_stream, "%s wrong rate `%s`\n", TAG, rate);
+      return -1;
+   }
+   ctx->rate = val;
+
+   if (*endptr == '/') {
+      p = endptr + 1;
+      val = strtoul(p, &endptr, 10);
+      if (endptr == p || (val == 0) || (val > 65535) || (*endptr != '\0' && (*endptr != '/'))) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong burst `%s`\n", TAG, p);
+	 return -1;
+      }
+      ctx->burst = (unsigned)val;
+   }
+
+   if (*endptr == '/') {
+      p = endptr + 1;
+      val = strtoul(p, &endptr, 10);
+      if (endptr == p || (val == 0) || (val > 1000000) || (*endptr != '\0')) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong queue size `%s`\n", TAG, p);
+	 return -1;
+      }
+      ctx->queue_size = (unsigned)val;
+   }
+
+   return 0;
+}
+
+int rdr_pacer_set_retry(struct rdr_pacer_ctx_t *ctx, const char *retry, FILE *err_stream)
+{
+   char *endptr;
+   const char *p;
+   unsigned long val;
+
+   assert(ctx);
+   assert(retry);
+
+   val = strtoul(retry, &endptr, 10);
+   if (endptr == retry || (val > 1000000) || (*endptr != '\0' && (*endptr != '/'))) {
+      if (err_stream != NULL) fprintf(err_stream, "%s wrong queue size `%s`\n", TAG, retry);
+      return -1;
+   }
+   /* 0 - no retries, pacing keeps its queue  */
+   ctx->retry = val != 0;
+   if (val != 0)
+      ctx->queue_size = (unsigned)val;
+
+   if (*endptr == '/') {
+      p = endptr + 1;
+      val = strtoul(p, &endptr, 10);
+      if (endptr == p || (val < PACER_MIN_BACKOFF_US / 1000) || (val > 3600000) || (*endptr != '\0')) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong maximum backoff `%s`\n", TAG, p);
+	 return -1;
+      }
+      ctx->max_backoff_us = 1000ull * val;
+   }
+
+   return 0;
+}
+
+void rdr_pacer_set_blocking(struct rdr_pacer_ctx_t *ctx, int blocking)
+{
+   assert(ctx);
+   ctx->blocking = blocking;
+}
+
+int rdr_pacer_is_enabled(struct rdr_pacer_ctx_t *ctx)
+{
+   return ctx->rate != 0 || ctx->retry;
+}
+
+int rdr_pacer_start(struct rdr_pacer_ctx_t *ctx, int verbose)
+{
+   assert(ctx);
+
+   if (!rdr_pacer_is_enabled(ctx))
+      return 0;
+
+   ctx->queue = (struct pacer_dgram_t *)malloc(ctx->queue_size * sizeof(ctx->queue[0]));
+   if (ctx->queue == NULL) {
+      fprintf(stderr, "%s malloc() error\n", TAG);
+      return -1;
+   }
+   ctx->tokens = ctx->burst;
+   ctx->last_us = stats_monotonic_us();
+
+   if (verbose) {
+      fprintf(stderr, "%s %u datagrams", TAG, ctx->queue_size);
+      if (ctx->rate != 0)
+	 fprintf(stderr, ", pacing %lu datagrams/s, burst %u", ctx->rate, ctx->burst);
+      if (ctx->retry)
+	 fprintf(stderr, ", retries with backoff up to %llu ms", ctx->max_backoff_us / 1000);
+      fprintf(stderr, "\n");
+   }
+
+   return 0;
+}
+
+static void refill(struct rdr_pacer_ctx_t *ctx)
+{
+   unsigned long long now_us;
+
+   now_us = stats_monotonic_us();
+   if (ctx->rate == 0)
+      ctx->tokens = ctx->queue_size + 1;
+   else {
+      ctx->tokens += (double)(now_us - ctx->last_us) * ctx->rate / 1000000.0;
+      if (ctx->tokens > ctx->burst)
+	 ctx->tokens = ctx->burst;
+   }
+   ctx->last_us = now_us;
+}
+
+static int is_transient(int err)
+{
+   switch (err) {
+      case ENOBUFS:
+      case ENOMEM:
+      case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+      case EWOULDBLOCK:
+#endif
+      case EINTR:
+      case ECONNREFUSED:
+      case EHOSTUNREACH:
+      case ENETUNREACH:
+      case EHOSTDOWN:
+      case ENETDOWN:
+	 return 1;
+      default:
+	 break;
+   }
+
+   return 0;
+}
+
+static void backoff(struct rdr_pacer_ctx_t *ctx)
+{
+   ctx->backoff_us = ctx->backoff_us == 0 ? PACER_MIN_BACKOFF_US : 2 * ctx->backoff_us;
+   if (ctx->backoff_us > ctx->max_backoff_us)
+      ctx->backoff_us = ctx->max_backoff_us;
+   ctx->retry_at_us = ctx->last_us + ctx->backoff_us;
+   ctx->stats.retries += 1;
+}
+
+/* 0 - sent, 1 - failed, keep for a retry, -1 - failed, drop  */
+static int send_dgram(struct rdr_pacer_ctx_t *ctx, int s, const void *dgram, size_t size)
+{
+   ctx->tokens -= 1.0;
+   if (send(s, dgram, size, 0) < 0) {
+      ctx->stats.send_errors += 1;
+      if (ctx->retry && is_transient(errno)) {
+	 backoff(ctx);
+	 return 1;
+      }
+      return -1;
+   }
+
+   ctx->stats.sent += 1;
+   ctx->backoff_us = 0;
+   ctx->retry_at_us = 0;
+
+   return 0;
+}
+
+static void pop(struct rdr_pacer_ctx_t *ctx)
+{
+   ctx->head = (ctx->head + 1) % ctx->queue_size;
+   ctx->queued -= 1;
+}
+
+static void drop_head(struct rdr_pacer_ctx_t *ctx)
+{
+   ctx->stats.dropped_error += 1;
+   ctx->stats.dropped_error_records += ctx->queue[ctx->head].records;
+   pop(ctx);
+}
+
+/* Sends the queued datagrams while there are tokens. Returns send() errors  */
+static unsigned send_queued(struct rdr_pacer_ctx_t *ctx, int s)
+{
+   int res, err;
+   unsigned errors;
+   struct pacer_dgram_t *d;
+
+   errors = 0;
+   err = 0;
+   refill(ctx);
+   if (ctx->retry_at_us != 0 && (ctx->last_us < ctx->retry_at_us))
+      return 0;
+
+   while (ctx->queued != 0 && (ctx->tokens >= 1.0)) {
+      d = &ctx->queue[ctx->head];
+      res = send_dgram(ctx, s, d->data, d->size);
+      if (res != 0) {
+	 errors += 1;
+	 err = errno;
+      }
+      if (res > 0)
+	 break;
+      if (res < 0)
+	 drop_head(ctx);
+      else
+	 pop(ctx);
+   }
+
+   if (errors != 0)
+      errno = err;
+
+   return errors;
+}
+
+static void wait_next(struct rdr_pacer_ctx_t *ctx)
+{
+   struct timespec ts;
+   long us;
+
+   us = rdr_pacer_next_us(ctx);
+   if (us <= 0)
+      return;
+   ts.tv_sec = us / 1000000;
+   ts.tv_nsec = (us % 1000000) * 1000;
+   ctx->stats.waits += 1;
+   while (nanosleep(&ts, &ts) < 0 && (errno == EINTR))
+      ;
+}
+
+static void enqueue(struct rdr_pacer_ctx_t *ctx, const void *dgram, size_t size, unsigned records)
+{
+   struct pacer_dgram_t *d;
+
+   d = &ctx->queue[(ctx->head + ctx->queued) % ctx->queue_size];
+   memcpy(d->data, dgram, size);
+   d->size = size;
+   d->records = records;
+   ctx->queued += 1;
+   if (ctx->queued > ctx->stats.queued_max)
+      ctx->stats.queued_max = ctx->queued;
+}
+
+unsigned rdr_pacer_send(struct rdr_pacer_ctx_t *ctx, int s, const void *dgram, size_t size,
+      unsigned records)
+{
+   int res, err;
+   unsigned errors;
+
+   assert(ctx);
+   assert(ctx->queue);
+   assert(size <= RDR_PACER_MAX_DGRAM_SIZE);
+
+   errors = send_queued(ctx, s);
+   err = errno;
+
+   if (ctx->queued == 0 && (ctx->retry_at_us == 0) && (ctx->tokens >= 1.0)) {
+      res = send_dgram(ctx, s, dgram, size);
+      if (res == 0)
+	 return errors;
+      errors += 1;
+      err = errno;
+      if (res > 0)
+	 enqueue(ctx, dgram, size, records);
+      else {
+	 ctx->stats.dropped_error += 1;
+	 ctx->stats.dropped_error_records += records;
+      }
+      errno = err;
+      return errors;
+   }
+
+   /*
+    * Full: drop, the caller runs the main loop and must not sleep in it.
+    * Blocking: wait for a token, but do not stall the reads for a backoff
+    */
+   while (ctx->queued == ctx->queue_size) {
+      if (!ctx->blocking || (ctx->retry_at_us != 0)) {
+	 ctx->stats.dropped_full += 1;
+	 ctx->stats.dropped_full_records += records;
+	 errno = err;
+	 return errors;
+      }
+      wait_next(ctx);
+      res = send_queued(ctx, s);
+      if (res != 0) {
+	 errors += res;
+	 err = errno;
+      }
+   }
+
+   enqueue(ctx, dgram, size, records);
+   ctx->stats.deferred += 1;
+   errno = err;
+
+   return errors;
+}
+
+unsigned rdr_pacer_step(struct rdr_pacer_ctx_t *ctx, int s)
+{
+   assert(ctx);
+
+   if (ctx->queued == 0)
+      return 0;
+
+   return send_queued(ctx, s);
+}
+
+long rdr_pacer_next_us(struct rdr_pacer_ctx_t *ctx)
+{
+   unsigned long long now_us;
+   long res;
+
+   assert(ctx);
+
+   if (ctx->queued == 0)
+      return -1;
+
+   /* Not paced: only the backoff delays the queue  */
+   res = 0;
+   if (ctx->rate != 0 && (ctx->tokens < 1.0))
+      res = (long)((1.0 - ctx->tokens) * 1000000.0 / ctx->rate) + 1;
+   if (ctx->retry_at_us != 0) {
+      now_us = stats_monotonic_us();
+      if (ctx->retry_at_us > now_us && ((long)(ctx->retry_at_us - now_us) > res))
+	 res = (long)(ctx->retry_at_us - now_us);
+   }
+
+   return res;
+}
+
+unsigned rdr_pacer_drain(struct rdr_pacer_ctx_t *ctx, int s)
+{
+   unsigned errors;
+
+   assert(ctx);
+
+   errors = 0;
+   while (ctx->queued != 0) {
+      errors += send_queued(ctx, s);
+      if (ctx->queued == 0)
+	 break;
+      /* Collector is still unreachable at the longest backoff  */
+      if (ctx->backoff_us >= ctx->max_backoff_us) {
+	 while (ctx->queued != 0)
+	    drop_head(ctx);
+	 break;
+      }
+      wait_next(ctx);
+   }
+
+   return errors;
+}
+
+void rdr_pacer_dropped(struct rdr_pacer_ctx_t *ctx, unsigned long long *dgrams,
+      unsigned long long *records)
+{
+   assert(ctx);
+   assert(dgrams);
+   assert(records);
+
+   *dgrams += ctx->stats.dropped_full + ctx->stats.dropped_error;
+   *records += ctx->stats.dropped_full_records + ctx->stats.dropped_error_records;
+}
+
+double rdr_pacer_backlog(struct rdr_pacer_ctx_t *ctx)
+{
+   if (ctx == NULL || (ctx->queue == NULL))
+      return 0;
+
+   return (double)ctx->queued / ctx->queue_size;
+}
+
+#define PRINT_PACER_METRIC(_name, _type, _help, _val) \
+   stats_print_header(stream, "rdr2netflow_" _name, _type, _help); \
+   fprintf(stream, "rdr2netflow_" _name " %llu\n", (unsigned long long)(_val))
+
+void rdr_pacer_print_stats(struct rdr_pacer_ctx_t *const *pacers, unsigned cnt, FILE *stream)
+{
+   unsigned i;
+   unsigned long long queued;
+   struct rdr_pacer_ctx_t *ctx;
+   struct rdr_pacer_ctx_t sum;
+
+   assert(pacers);
+   assert(stream);
+
+   if (cnt == 0 || (pacers[0]->queue == NULL))
+      return;
+
+   memset(&sum, 0, sizeof(sum));
+   queued = 0;
+   for (i=0; i < cnt; ++i) {
+      ctx = pacers[i];
+      sum.stats.sent += ctx->stats.sent;
+      sum.stats.deferred += ctx->stats.deferred;
+      sum.stats.waits += ctx->stats.waits;
+      sum.stats.retries += ctx->stats.retries;
+      sum.stats.dropped_full += ctx->stats.dropped_full;
+      sum.stats.dropped_full_records += ctx->stats.dropped_full_records;
+      sum.stats.dropped_error += ctx->stats.dropped_error;
+      sum.stats.dropped_error_records += ctx->stats.dropped_error_records;
+      if (ctx->stats.queued_max > sum.stats.queued_max)
+	 sum.stats.queued_max = ctx->stats.queued_max;
+      queued += ctx->queued;
+   }
+   ctx = pacers[0];
+
+   if (ctx->rate != 0) {
+      PRINT_PACER_METRIC("pacing_rate", "gauge", "Export rate limit per collector, datagrams per second",
+	    ctx->rate);
+   }
+   if (ctx->rate != 0 && ctx->blocking) {
+      PRINT_PACER_METRIC("pacing_waits_total", "counter", "Waits for a token on a full queue",
+	    sum.stats.waits);
+   }
+   PRINT_PACER_METRIC("export_queue_sent_total", "counter", "Datagrams sent through the export queues",
+	 sum.stats.sent);
+   PRINT_PACER_METRIC("export_queue_deferred_total", "counter", "Datagrams queued for a token or a retry",
+	 sum.stats.deferred);
+   PRINT_PACER_METRIC("export_queue_retries_total", "counter", "send() failures kept for a retry",
+	 sum.stats.retries);
+   PRINT_PACER_METRIC("export_queue_queued", "gauge", "Datagrams in the export queues", queued);
+   PRINT_PACER_METRIC("export_queue_queued_max", "gauge", "Fullest export queue high water mark",
+	 sum.stats.queued_max);
+
+   stats_print_header(stream, "rdr2netflow_export_dropped_datagrams_total", "counter",
+	 "Datagrams dropped by the export queues");
+   fprintf(stream, "rdr2netflow_export_dropped_datagrams_total{reason=\"queue_full\"} %llu\n",
+	 sum.stats.dropped_full);
+   fprintf(stream, "rdr2netflow_export_dropped_datagrams_total{reason=\"send_error\"} %llu\n",
+	 sum.stats.dropped_error);
+   stats_print_header(stream, "rdr2netflow_export_dropped_records_total", "counter",
+	 "NetFlow records in the dropped datagrams");
+   fprintf(stream, "rdr2netflow_export_dropped_records_total{reason=\"queue_full\"} %llu\n",
+	 sum.stats.dropped_full_records);
+   fprintf(stream, "rdr2netflow_export_dropped_records_total{reason=\"send_error\"} %llu\n",
+	 sum.stats.dropped_error_records);
+}
@@ -0,0 +1,83 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _PACER_H
+#define _PACER_H
+
+#define RDR_PACER_DEFAULT_BURST 8
+#define RDR_PACER_DEFAULT_QUEUE 1024
+#define RDR_PACER_DEFAULT_MAX_BACKOFF_MS 1000
+#define RDR_PACER_MAX_DGRAM_SIZE 1500
+
+/*
+ * Queue of the datagrams sent to a connected UDP socket.
+ *
+ * Pacing: token bucket of rate datagrams per second on average, up to
+ * burst back to back. The datagrams over the rate wait in the queue in
+ * order and are sent by rdr_pacer_step() from the main loop. When the
+ * queue is full the datagram is dropped and counted, or, blocking, the
+ * caller waits for a token.
+ *
+ * Retries: a datagram that send() failed with a transient error
+ * (ENOBUFS, ECONNREFUSED after an ICMP unreachable, ...) stays at the
+ * head of the queue and is sent again after a backoff doubling from
+ * 10 ms up to the maximum. Datagrams that do not fit the queue during
+ * the backoff are dropped and counted.
+ */
+struct rdr_pacer_ctx_t *rdr_pacer_init();
+void rdr_pacer_destroy(struct rdr_pacer_ctx_t *ctx);
+/* rate[/burst[/queue]]  */
+int rdr_pacer_set_rate(struct rdr_pacer_ctx_t *ctx, const char *rate, FILE *err_stream);
+/* queue[/max_backoff_ms], queue 0 - no retries, the queue of rdr_pacer_set_rate() stays  */
+int rdr_pacer_set_retry(struct rdr_pacer_ctx_t *ctx, const char *retry, FILE *err_stream);
+/* Wait for a token on a full queue instead of dropping (offline conversion)  */
+void rdr_pacer_set_blocking(struct rdr_pacer_ctx_t *ctx, int blocking);
+/* Pacing or retries are on  */
+int rdr_pacer_is_enabled(struct rdr_pacer_ctx_t *ctx);
+
+int rdr_pacer_start(struct rdr_pacer_ctx_t *ctx, int verbose);
+/*
+ * Sends the datagram of records NetFlow records to s now or queues it.
+ * Returns failed send() calls, errno is of the last one
+ */
+unsigned rdr_pacer_send(struct rdr_pacer_ctx_t *ctx, int s, const void *dgram, size_t size,
+      unsigned records);
+/* Sends the queued datagrams the tokens and the backoff allow  */
+unsigned rdr_pacer_step(struct rdr_pacer_ctx_t *ctx, int s);
+/* Microseconds to the next send if datagrams are queued, -1 - none queued  */
+long rdr_pacer_next_us(struct rdr_pacer_ctx_t *ctx);
+/* Sends everything queued, drops the rest once the backoff reaches the maximum  */
+unsigned rdr_pacer_drain(struct rdr_pacer_ctx_t *ctx, int s);
+/* Adds the datagrams and the records dropped after rdr_pacer_send() took them  */
+void rdr_pacer_dropped(struct rdr_pacer_ctx_t *ctx, unsigned long long *dgrams,
+      unsigned long long *records);
+/* Queue fill, 0..1  */
+double rdr_pacer_backlog(struct rdr_pacer_ctx_t *ctx);
+/* Sums of the queues of all collectors  */
+void rdr_pacer_print_stats(struct rdr_pacer_ctx_t *const *pacers, unsigned cnt, FILE *stream);
+
+#endif /* _PACER_H  */
@@ -0,0 +1,71 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _PROBES_H
+#define _PROBES_H
+
+/*
+ * USDT (SystemTap/DTrace) static probes of the rdr2netflow provider. An
+ * unattached probe is a single nop. List the probes:
+ *
+ *   readelf -n rdr2netflow | grep -A1 stapsdt
+ *
+ * and attach, for example:
+ *
+ *   bpftrace -e 'usdt:./rdr2netflow:rdr2netflow:decode_error { @[arg1] = count(); }'
+ *
+ * Probes and arguments:
+ *   frame(src_addr, src_port, size)            RDR frame found in the stream
+ *   decode_ok(tag, size)                       decode_rdr_packet() success
+ *   decode_error(tag, err)                     decode_rdr_packet() failure
+ *   filter(client_ip, server_ip, filtered)     IP filter decision on a TUR
+ *   export(client_ip, server_ip, up, down)     TUR added to the netflow datagram
+ *   flush(records, flow_seq, sent)             netflow datagram sent
+ *   repeater_overflow(host, bytes)             repeater buffer overflow
+ *   repeater_reconnect(host, reconnects)       repeater connection attempt
+ *
+ * Addresses are in network byte order. Compiled out without sys/sdt.h or
+ * with -DRDR_NO_PROBES
+ */
+
+#if !defined(RDR_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RDR_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef RDR_HAVE_PROBES
+#define RDR_PROBE2(_name, _a1, _a2) DTRACE_PROBE2(rdr2netflow, _name, _a1, _a2)
+#define RDR_PROBE3(_name, _a1, _a2, _a3) DTRACE_PROBE3(rdr2netflow, _name, _a1, _a2, _a3)
+#define RDR_PROBE4(_name, _a1, _a2, _a3, _a4) DTRACE_PROBE4(rdr2netflow, _name, _a1, _a2, _a3, _a4)
+#else
+#define RDR_PROBE2(_name, _a1, _a2) do {} while (0)
+#define RDR_PROBE3(_name, _a1, _a2, _a3) do {} while (0)
+#define RDR_PROBE4(_name, _a1, _a2, _a3, _a4) do {} while (0)
+#endif
+
+#endif /* _PROBES_H  */
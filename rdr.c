@@ -31,12 +31,14 @@
 #include <sys/types.h>
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "rdr.h"
+#include "probes.h"
 
 static int get_string_field(uint8_t *pkt, size_t pkt_size,
       size_t *field_pos, char *dst, size_t dst_buf_size);
@@ -49,6 +51,18 @@ static int get_uint32_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, un
 static int get_ip_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, struct in_addr *ip);
 static int get_time_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, time_t *time);
 
+static int put_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos,
+      unsigned type, const void *data, size_t data_size);
+static int put_string_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, const char *str);
+static int put_int8_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, int val);
+static int put_uint8_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, unsigned val);
+static int put_int16_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, int val);
+static int put_uint16_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, unsigned val);
+static int put_int32_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, int val);
+static int put_uint32_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, unsigned val);
+static int put_ip_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, struct in_addr ip);
+static int put_time_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, time_t time);
+
 /*
  * >0 - RDR packet (size)
  * =0 - not RDR
@@ -123,6 +137,18 @@ static int decode_rdr_packet_header(void *data, size_t data_size, struct rdr_pac
    return packet_size;
 }
 
+unsigned rdr_packet_tag(const void *data, size_t data_size)
+{
+   uint32_t tag;
+
+   if (data_size < sizeof(struct rdrv1_header_t))
+      return 0;
+
+   memcpy(&tag, (const uint8_t *)data + offsetof(struct rdrv1_header_t, tag), sizeof(tag));
+
+   return ntohl(tag);
+}
+
 int decode_rdr_packet(void *data, size_t data_size, struct rdr_packet_t *res)
 {
    size_t field_pos;
@@ -138,8 +164,10 @@ int decode_rdr_packet(void *data, size_t data_size, struct rdr_packet_t *res)
    rdr_header = (struct rdrv1_header_t *)data;
    field_pos = sizeof(*rdr_header);
    packet_size = decode_rdr_packet_header(data, data_size, res);
-   if (packet_size < 0)
+   if (packet_size < 0) {
+      RDR_PROBE2(decode_error, 0, packet_size);
       return packet_size;
+   }
 
    err = 0;
    switch (res->header.tag) {
@@ -197,7 +225,8 @@ int decode_rdr_packet(void *data, size_t data_size, struct rdr_packet_t *res)
 
       case TRANSACTION_USAGE_RDR:
 	 if (rdr_header->field_cnt < 25) {
-	    return -1;
+	    err = -1;
+	    break;
 	 }
 	 /* 1. STRING subscriber_id  */
 	 err = get_string_field((uint8_t *)data, data_size,
@@ -245,7 +274,143 @@ int decode_rdr_packet(void *data, size_t data_size, struct rdr_packet_t *res)
    }
 #undef GET_FIELD
 
-   return err >= 0 ? packet_size : err;
+   if (err < 0) {
+      RDR_PROBE2(decode_error, res->header.tag, err);
+      return err;
+   }
+
+   RDR_PROBE2(decode_ok, res->header.tag, packet_size);
+   return packet_size;
+}
+
+size_t rdr_frame_stream(uint8_t *buf, size_t size, rdr_frame_f frame_f, void *arg,
+      unsigned long long *garbage)
+{
+   size_t p;
+   size_t handled_bytes;
+   ssize_t truncated;
+
+   assert(frame_f);
+   assert(garbage);
+
+   p=0;
+   handled_bytes = 0;
+   truncated = -1;
+
+   /* Version?  */
+   while(p < size) {
+      int msg_size;
+
+      msg_size = is_rdr_packet(&buf[p], size - p);
+      if (msg_size > 0) {
+	 /*
+	  * Inside of the truncated packet: accept only packets followed by
+	  * the next complete packet, not a random digits in the payload
+	  */
+	 if ((truncated >= 0)
+	       && ((p + msg_size >= size)
+		  || (is_rdr_packet(&buf[p + msg_size], size - p - msg_size) <= 0))) {
+	    p += 1;
+	    continue;
+	 }
+	 /* RDR packet  */
+	 if (frame_f(arg, &buf[p], msg_size) < 0) {
+	    /* Invalid RDR packet  */
+	    p += 1;
+	 }else {
+	    p += msg_size;
+	    handled_bytes += msg_size;
+	    truncated = -1;
+	 }
+      }else if (msg_size < 0) {
+	 /* Trucated RDR packet  */
+	 if (truncated < 0)
+	    truncated = p;
+	 p += 1;
+      }else {
+	 /* Not RDR  */
+	 p += 1;
+      }
+   } /* while  */
+
+   *garbage += (truncated < 0 ? size : (size_t)truncated) - handled_bytes;
+
+   return truncated < 0 ? size : (size_t)truncated;
+}
+
+static int parser_frame(void *arg, uint8_t *pkt, size_t pkt_size)
+{
+   struct rdr_parser_t *p;
+
+   p = (struct rdr_parser_t *)arg;
+
+   if (decode_rdr_packet(pkt, pkt_size, &p->pkt) < 0) {
+      p->stats.decode_errors += 1;
+      return -1;
+   }
+
+   p->stats.frames += 1;
+   p->packet_f(p->arg, &p->pkt, pkt, pkt_size);
+
+   return 0;
+}
+
+void rdr_parser_init(struct rdr_parser_t *p, rdr_packet_f packet_f, void *arg)
+{
+   assert(p);
+   assert(packet_f);
+
+   p->packet_f = packet_f;
+   p->arg = arg;
+   memset(&p->stats, 0, sizeof(p->stats));
+   p->pos = 0;
+}
+
+void rdr_parser_reset(struct rdr_parser_t *p)
+{
+   p->stats.garbage_bytes += p->pos;
+   p->pos = 0;
+}
+
+void rdr_parser_feed(struct rdr_parser_t *p, const void *data, size_t size)
+{
+   const uint8_t *d;
+   size_t consumed;
+   size_t n;
+
+   assert(p);
+
+   d = (const uint8_t *)data;
+   p->stats.bytes += size;
+
+   while (size > 0) {
+      if (p->pos == 0) {
+	 /* Frame in place (the data is not modified), keep only the truncated tail  */
+	 consumed = rdr_frame_stream((uint8_t *)d, size, parser_frame, p, &p->stats.garbage_bytes);
+	 assert(size - consumed < sizeof(p->buf));
+	 memcpy(p->buf, d + consumed, size - consumed);
+	 p->pos = size - consumed;
+	 return;
+      }
+
+      /* Complete the buffered packet  */
+      n = sizeof(p->buf) - p->pos;
+      if (n > size)
+	 n = size;
+      memcpy(&p->buf[p->pos], d, n);
+      p->pos += n;
+      d += n;
+      size -= n;
+
+      consumed = rdr_frame_stream(p->buf, p->pos, parser_frame, p, &p->stats.garbage_bytes);
+      if (consumed == 0 && (p->pos == sizeof(p->buf))) {
+	 /* Can not be a truncated packet, skip a byte  */
+	 consumed = 1;
+	 p->stats.garbage_bytes += 1;
+      }
+      memmove(p->buf, &p->buf[consumed], p->pos - consumed);
+      p->pos -= consumed;
+   }
 }
 
 static int get_string_field(uint8_t *pkt, size_t pkt_size,
@@ -519,6 +684,191 @@ static int get_time_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, time
    return res;
 }
 
+int encode_rdr_packet(const struct rdr_packet_t *pkt, void *buf, size_t buf_size)
+{
+   size_t field_pos;
+   size_t payload_size;
+   unsigned field_cnt;
+   int err;
+   uint8_t *data;
+   struct rdrv1_header_t *rdr_header;
+
+   assert(pkt);
+   assert(buf);
+   assert(sizeof(*rdr_header) == 20);
+
+   if (buf_size < sizeof(*rdr_header))
+      return -1;
+
+   data = (uint8_t *)buf;
+   if (buf_size > MAX_RDR_PACKET_SIZE - 1)
+      buf_size = MAX_RDR_PACKET_SIZE - 1;
+   field_pos = sizeof(*rdr_header);
+   field_cnt = 0;
+
+   err = 0;
+   switch (pkt->header.tag) {
+#define PUT_FIELD(_Func, _Field) \
+	 err = put_ ## _Func ## _field(data, buf_size, &field_pos, pkt->rdr._Field); \
+	 if (err < 0) break; \
+	 field_cnt += 1;
+
+      case TRANSACTION_RDR:
+	 PUT_FIELD(string, transaction.subscriber_id)
+	 PUT_FIELD(int16, transaction.package_id)
+	 PUT_FIELD(int32, transaction.service_id)
+	 PUT_FIELD(int16, transaction.protocol_id)
+	 PUT_FIELD(int32, transaction.skipped_sessions)
+	 PUT_FIELD(ip, transaction.server_ip)
+	 PUT_FIELD(uint16, transaction.server_port)
+	 PUT_FIELD(string, transaction.access_string)
+	 PUT_FIELD(string, transaction.info_string)
+	 PUT_FIELD(ip, transaction.client_ip)
+	 PUT_FIELD(uint16, transaction.client_port)
+	 PUT_FIELD(int8, transaction.initiating_side)
+	 PUT_FIELD(time, transaction.report_time)
+	 PUT_FIELD(uint32, transaction.millisec_duration)
+	 PUT_FIELD(int8, transaction.time_frame)
+	 PUT_FIELD(uint32, transaction.session_upstream_volume)
+	 PUT_FIELD(uint32, transaction.session_downstream_volume)
+	 PUT_FIELD(uint16, transaction.subscriber_counter_id)
+	 PUT_FIELD(uint16, transaction.global_counter_id)
+	 PUT_FIELD(uint16, transaction.package_counter_id)
+	 PUT_FIELD(uint8, transaction.ip_protocol)
+	 PUT_FIELD(int32, transaction.protocol_signature)
+	 PUT_FIELD(int32, transaction.zone_id)
+	 PUT_FIELD(int32, transaction.flavor_id)
+	 PUT_FIELD(uint8, transaction.flow_close_mode)
+	 break;
+      case TRANSACTION_USAGE_RDR:
+	 PUT_FIELD(string, transaction_usage.subscriber_id)
+	 PUT_FIELD(int16, transaction_usage.package_id)
+	 PUT_FIELD(int32, transaction_usage.service_id)
+	 PUT_FIELD(int16, transaction_usage.protocol_id)
+	 PUT_FIELD(uint32, transaction_usage.generation_reason)
+	 PUT_FIELD(ip, transaction_usage.server_ip)
+	 PUT_FIELD(uint16, transaction_usage.server_port)
+	 PUT_FIELD(string, transaction_usage.access_string)
+	 PUT_FIELD(string, transaction_usage.info_string)
+	 PUT_FIELD(ip, transaction_usage.client_ip)
+	 PUT_FIELD(uint16, transaction_usage.client_port)
+	 PUT_FIELD(int8, transaction_usage.initiating_side)
+	 PUT_FIELD(time, transaction_usage.report_time)
+	 PUT_FIELD(uint32, transaction_usage.millisec_duration)
+	 PUT_FIELD(int8, transaction_usage.time_frame)
+	 PUT_FIELD(uint32, transaction_usage.session_upstream_volume)
+	 PUT_FIELD(uint32, transaction_usage.session_downstream_volume)
+	 PUT_FIELD(uint16, transaction_usage.subscriber_counter_id)
+	 PUT_FIELD(uint16, transaction_usage.global_counter_id)
+	 PUT_FIELD(uint16, transaction_usage.package_counter_id)
+	 PUT_FIELD(uint8, transaction_usage.ip_protocol)
+	 PUT_FIELD(int32, transaction_usage.protocol_signature)
+	 PUT_FIELD(int32, transaction_usage.zone_id)
+	 PUT_FIELD(int32, transaction_usage.flavor_id)
+	 PUT_FIELD(uint8, transaction_usage.flow_close_mode)
+	 break;
+      default:
+	 /* Not implemented: header only  */
+	 break;
+#undef PUT_FIELD
+   }
+
+   if (err < 0)
+      return err;
+
+   payload_size = field_pos - 5;
+   assert(payload_size <= 9999);
+
+   rdr_header = (struct rdrv1_header_t *)data;
+   rdr_header->ppc_num = (uint8_t)pkt->header.ppc_num;
+   rdr_header->payload_size[0] = '0' + (payload_size / 1000) % 10;
+   rdr_header->payload_size[1] = '0' + (payload_size / 100) % 10;
+   rdr_header->payload_size[2] = '0' + (payload_size / 10) % 10;
+   rdr_header->payload_size[3] = '0' + payload_size % 10;
+   rdr_header->src = (uint8_t)pkt->header.src;
+   rdr_header->dst = (uint8_t)pkt->header.dst;
+   rdr_header->src_port = htons((uint16_t)pkt->header.src_port);
+   rdr_header->dst_port = htons((uint16_t)pkt->header.dst_port);
+   rdr_header->fc_id = htonl(pkt->header.fc_id);
+   rdr_header->tag = htonl(pkt->header.tag);
+   rdr_header->field_cnt = (uint8_t)field_cnt;
+
+   return (int)field_pos;
+}
+
+static int put_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos,
+      unsigned type, const void *data, size_t data_size)
+{
+   struct rdrv1_field_t *field;
+
+   assert(pkt);
+   assert(field_pos);
+   assert(sizeof(*field)==5);
+
+   if (*field_pos+sizeof(*field)+data_size > pkt_size)
+      return -1;
+
+   field = (struct rdrv1_field_t *)&pkt[*field_pos];
+   field->type = (uint8_t)type;
+   field->size = htonl((uint32_t)data_size);
+   memcpy(field->data, data, data_size);
+
+   *field_pos += sizeof(*field) + data_size;
+
+   return data_size+sizeof(*field);
+}
+
+static int put_string_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, const char *str)
+{
+   return put_field(pkt, pkt_size, field_pos, RDR_TYPE_STRING, str, strlen(str));
+}
+
+static int put_int8_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, int val)
+{
+   int8_t tmp = (int8_t)val;
+   return put_field(pkt, pkt_size, field_pos, RDR_TYPE_INT8, &tmp, sizeof(tmp));
+}
+
+static int put_uint8_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, unsigned val)
+{
+   uint8_t tmp = (uint8_t)val;
+   return put_field(pkt, pkt_size, field_pos, RDR_TYPE_UINT8, &tmp, sizeof(tmp));
+}
+
+static int put_int16_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, int val)
+{
+   uint16_t tmp = htons((uint16_t)(int16_t)val);
+   return put_field(pkt, pkt_size, field_pos, RDR_TYPE_INT16, &tmp, sizeof(tmp));
+}
+
+static int put_uint16_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, unsigned val)
+{
+   uint16_t tmp = htons((uint16_t)val);
+   return put_field(pkt, pkt_size, field_pos, RDR_TYPE_UINT16, &tmp, sizeof(tmp));
+}
+
+static int put_int32_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, int val)
+{
+   uint32_t tmp = htonl((uint32_t)(int32_t)val);
+   return put_field(pkt, pkt_size, field_pos, RDR_TYPE_INT32, &tmp, sizeof(tmp));
+}
+
+static int put_uint32_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, unsigned val)
+{
+   uint32_t tmp = htonl((uint32_t)val);
+   return put_field(pkt, pkt_size, field_pos, RDR_TYPE_UINT32, &tmp, sizeof(tmp));
+}
+
+static int put_ip_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, struct in_addr ip)
+{
+   return put_uint32_field(pkt, pkt_size, field_pos, ntohl(ip.s_addr));
+}
+
+static int put_time_field(uint8_t *pkt, size_t pkt_size, size_t *field_pos, time_t time)
+{
+   return put_uint32_field(pkt, pkt_size, field_pos, (unsigned)time);
+}
+
 static void dump_rdr_packet_header(FILE *stream, const struct rdr_packet_t *pkt)
 {
    assert(pkt);
@@ -557,9 +907,9 @@ void dump_rdr_packet(FILE *stream, const struct rdr_packet_t *pkt)
 	       pkt->rdr.transaction.skipped_sessions-1
 	       );
 
-	 strncpy(server_ip, inet_ntoa(pkt->rdr.transaction.server_ip), sizeof(server_ip));
-	 strncpy(client_ip, inet_ntoa(pkt->rdr.transaction.client_ip), sizeof(client_ip));
-	 strncpy(report_time, ctime(&pkt->rdr.transaction.report_time), sizeof(report_time));
+	 snprintf(server_ip, sizeof(server_ip), "%s", inet_ntoa(pkt->rdr.transaction.server_ip));
+	 snprintf(client_ip, sizeof(client_ip), "%s", inet_ntoa(pkt->rdr.transaction.client_ip));
+	 snprintf(report_time, sizeof(report_time), "%s", ctime(&pkt->rdr.transaction.report_time));
 	 report_time[strlen(report_time)-1]='\0';
 	 fprintf(stream, "\t%s %s:%u%s -> %s:%u%s %s %s\n",
 	       report_time,
@@ -593,9 +943,9 @@ void dump_rdr_packet(FILE *stream, const struct rdr_packet_t *pkt)
 	       pkt->rdr.transaction_usage.generation_reason
 	       );
 
-	 strncpy(server_ip, inet_ntoa(pkt->rdr.transaction_usage.server_ip), sizeof(server_ip));
-	 strncpy(client_ip, inet_ntoa(pkt->rdr.transaction_usage.client_ip), sizeof(client_ip));
-	 strncpy(report_time, ctime(&pkt->rdr.transaction_usage.report_time), sizeof(report_time));
+	 snprintf(server_ip, sizeof(server_ip), "%s", inet_ntoa(pkt->rdr.transaction_usage.server_ip));
+	 snprintf(client_ip, sizeof(client_ip), "%s", inet_ntoa(pkt->rdr.transaction_usage.client_ip));
+	 snprintf(report_time, sizeof(report_time), "%s", ctime(&pkt->rdr.transaction_usage.report_time));
 	 report_time[strlen(report_time)-1]='\0';
 	 fprintf(stream, "\t%s %s:%u%s -> %s:%u%s %s %s\n",
 	       report_time,
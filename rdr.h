@@ -181,6 +181,63 @@ int is_rdr_packet(void *data, size_t data_size);
  */
 int decode_rdr_packet(void *data, size_t data_size, struct rdr_packet_t *res);
 
+/* Tag of a framed RDR packet without decoding it, 0 - too short  */
+unsigned rdr_packet_tag(const void *data, size_t data_size);
+
+/*
+ * Stream framing: frame_f is called for every RDR packet found in buf and
+ * returns <0 if the packet is invalid, the search then resumes from the
+ * next byte. Garbage between the packets is skipped, inside of a
+ * truncated packet only packets followed by the next complete packet are
+ * accepted.
+ * Returns the number of bytes consumed, the rest is the beginning of a
+ * truncated packet to be completed by the next data. Skipped bytes are
+ * added to *garbage
+ */
+typedef int (*rdr_frame_f)(void *arg, uint8_t *pkt, size_t pkt_size);
+size_t rdr_frame_stream(uint8_t *buf, size_t size, rdr_frame_f frame_f, void *arg,
+      unsigned long long *garbage);
+
+/*
+ * Incremental parser of an RDR TCP stream: feed it the data as it is
+ * received, packet_f is called for every decoded packet. The partial
+ * packet is kept in the context, the parser never allocates.
+ * pkt and raw are valid only during the call
+ */
+typedef void (*rdr_packet_f)(void *arg, const struct rdr_packet_t *pkt,
+      const uint8_t *raw, size_t raw_size);
+
+struct rdr_parser_stats_t {
+   unsigned long long bytes;
+   unsigned long long frames;
+   unsigned long long garbage_bytes;
+   unsigned long long decode_errors;
+};
+
+struct rdr_parser_t {
+   rdr_packet_f packet_f;
+   void *arg;
+   struct rdr_parser_stats_t stats;
+
+   struct rdr_packet_t pkt;
+   size_t pos;
+   uint8_t buf[MAX_RDR_PACKET_SIZE];
+};
+
+void rdr_parser_init(struct rdr_parser_t *p, rdr_packet_f packet_f, void *arg);
+void rdr_parser_feed(struct rdr_parser_t *p, const void *data, size_t size);
+/* Drops the partial packet, e.g. on reconnect  */
+void rdr_parser_reset(struct rdr_parser_t *p);
+
+/*
+ * Encodes TRANSACTION_RDR and TRANSACTION_USAGE_RDR with all the fields,
+ * other RDRs with header only.
+ * Return values:
+ *    >0 - RDR packet (size)
+ *    <0 - buffer too small
+ */
+int encode_rdr_packet(const struct rdr_packet_t *pkt, void *buf, size_t buf_size);
+
 const char *rdr_name(unsigned tag);
 const char *rdr_field_type(unsigned type);
 
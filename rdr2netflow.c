@@ -25,8 +25,11 @@
  */
 
 #include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -34,15 +37,31 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "rdr.h"
 #include "repeater.h"
 #include "netflow.h"
+#include "stats.h"
+#include "capfile.h"
+#include "recorder.h"
+#include "logger.h"
+#include "probes.h"
+#include "handoff.h"
+#include "shmring.h"
+#include "aggr.h"
+#include "topk.h"
+#include "distinct.h"
+#include "sampling.h"
+#include "pacer.h"
+#include "collector.h"
+#include "shed.h"
 
 const char *progname = "rdr2netflow";
 const char *revision = "$Revision: 0.2 $";
@@ -52,17 +71,77 @@ const char *revision = "$Revision: 0.2 $";
 #define DEFAULT_DST_PORT   9995
 
 #define DEFAULT_NETFLOW_FLUSH_TMOUT 3
+/* Backlog check interval while the session reads are paused  */
+#define BACKPRESSURE_POLL_US 10000
+
+#define NETFLOW_FILE_BUF_SIZE (1024*1024)
+
+/* Profiling stages  */
+#define PROF_OTHER    0
+#define PROF_POLL     1
+#define PROF_READ     2
+#define PROF_FRAMING  3
+#define PROF_DECODE   4
+#define PROF_FILTER   5
+#define PROF_ENCODE   6
+#define PROF_SEND     7
+#define PROF_REPEATER 8
+#define PROF_RECORDER 9
+#define PROF_AGGR     10
+#define PROF_TOPK     11
+#define PROF_DISTINCT 12
+#define PROF_STAGES   13
+
+/* Preallocated SCE sessions  */
+#define DEFAULT_SESSION_POOL_SIZE 64
+#define SESSION_POOL_MAX_SIZE FD_SETSIZE
+#define HUGEPAGE_SIZE (2*1024*1024)
+
+/* Parallel offline conversion  */
+#define OFFLINE_CHUNK_SIZE (4*1024*1024)
+#define OFFLINE_MAX_THREADS 64
+
+/* decode_rdr_packet() errors: -1 or -RDR_TYPE_XXX  */
+#define DECODE_ERRORS_MAX (RDR_TYPE_STRING+1)
 
 
 struct opts_t {
    struct in_addr src_addr;
    unsigned src_port;
 
-   struct in_addr dst_addr;
    unsigned dst_port;
 
    unsigned s_bufsize;
 
+   /* Offline mode: recorded RDR stream or pcap  */
+   const char *read_fname;
+   /* Write netflow datagrams to this file instead of the collector  */
+   const char *out_fname;
+   /* Offline mode decoder threads  */
+   unsigned threads;
+   /* Preallocated sessions  */
+   unsigned session_pool_size;
+   /* Write TURs to the shared memory ring  */
+   int shmring;
+   /* Sum TURs into rollups instead of the netflow export  */
+   int aggr;
+   /* Heavy hitter sketches  */
+   int topk;
+   /* Distinct count sketches  */
+   int distinct;
+   /* Export sampling  */
+   int sampling;
+   /* Overload shedding  */
+   int shed;
+   /* Pause session reads on downstream backlog, %  */
+   unsigned backpressure_high;
+   unsigned backpressure_low;
+   /* Copy SUBSCRIBER_ID to the decoded frame  */
+   int frame_subscriber;
+   /* Per-stage cycle accounting, print period in seconds (0 - on exit only)  */
+   int profile;
+   unsigned profile_period;
+
    int verbose;
 
    struct ipfilter_item_t {
@@ -73,47 +152,271 @@ struct opts_t {
 
 };
 
+struct rdr_session_stats_t {
+   unsigned long long bytes_rcvd;
+   unsigned long long frames;
+   unsigned long long garbage_bytes;
+   unsigned long long turs;
+   unsigned long long turs_filtered;
+   unsigned long long decode_errors[DECODE_ERRORS_MAX];
+} __attribute__((aligned(STATS_CACHE_LINE_SIZE)));
+
+/* Decoded RDR: tag and the TUR fields used in the netflow export  */
+struct rdr_frame_t {
+   unsigned tag;
+   unsigned filtered;
+   struct in_addr client_ip;
+   struct in_addr server_ip;
+   unsigned client_port;
+   unsigned server_port;
+   int initiating_side;
+   time_t report_time;
+   unsigned millisec_duration;
+   unsigned upstream_volume;
+   unsigned downstream_volume;
+   unsigned ip_protocol;
+   int service_id;
+   int protocol_id;
+   int package_id;
+   unsigned generation_reason;
+   /* Only with opts.frame_subscriber  */
+   char subscriber_id[64+1];
+};
+
+/* RDR header decoded by an offline conversion thread  */
+struct offline_frame_t {
+   size_t offset;
+   /* decode_rdr_packet() error or 0  */
+   int err;
+   struct rdr_frame_t frame;
+};
+
+struct offline_chunk_t {
+   /* Chunk holds the RDR headers found in [start, stop)  */
+   size_t start;
+   size_t stop;
+   int done;
+
+   unsigned frames_cnt;
+   unsigned frames_size;
+   struct offline_frame_t *frames;
+};
+
+struct offline_job_t {
+   struct ctx_t *ctx;
+   const uint8_t *data;
+   size_t size;
+
+   unsigned chunks_cnt;
+   /* Chunk i is parsed into slots[i % window]  */
+   unsigned window;
+   struct offline_chunk_t *slots;
+
+   unsigned next_chunk;
+   unsigned merged;
+   int error;
+
+   pthread_mutex_t mtx;
+   pthread_cond_t chunk_done;
+   pthread_cond_t slot_free;
+};
+
+struct session_dgram_t {
+   unsigned records_count;
+   struct netflow_v5_export_dgram dgram;
+
+   /* Latency accounting of the records in dgram  */
+   unsigned long long arrival_us[NETFLOW_V5_MAX_RECORDS];
+   time_t report_time[NETFLOW_V5_MAX_RECORDS];
+};
+
 struct rdr_session_ctx_t {
    int s;
    struct sockaddr_in remote_addr;
+   /* Established sessions list, free list in the pool  */
    struct rdr_session_ctx_t *next;
+   struct rdr_session_ctx_t **pprev;
+   /* Allocated from the pool  */
+   unsigned pooled;
+
+   /* Updated on every frame, kept on its own cache line  */
+   struct rdr_session_stats_t stats;
+
+   /* Arrival time of the data in buf  */
+   unsigned long long rcvd_us;
+
+   /* Overload shedding level and the receive buffer it is measured against  */
+   unsigned shed_level;
+   int rcvbuf;
+
    size_t pos;
    uint8_t buf[MAX_RDR_PACKET_SIZE];
 
    struct {
       time_t first_packet_ts;
       time_t last_packet_ts;
-
-      unsigned records_count;
-      unsigned flow_seq;
-      struct netflow_v5_export_dgram dgram;
    } netflow;
 
+   /* Datagram being filled per collector, ctx->session_dgrams of them  */
+   struct session_dgram_t dgrams[];
 };
 
 struct ctx_t {
    struct opts_t opts;
 
    struct rdr_repeater_ctx_t *rdr_repeater;
+   struct rdr_recorder_ctx_t *rdr_recorder;
+   struct rdr_shmring_ctx_t *shmring;
+   struct rdr_aggr_ctx_t *aggr;
+   struct rdr_topk_ctx_t *topk;
+   struct rdr_distinct_ctx_t *distinct;
+   struct rdr_sampling_ctx_t *sampling;
+   struct rdr_collector_ctx_t *collectors;
+   struct rdr_shed_ctx_t *shed;
+   /* Last adaptive sampling check  */
+   unsigned long long sampling_check_us;
+   /* Last collector health check  */
+   unsigned long long collector_check_us;
+
+   /* Session reads are paused until the downstream queues drain  */
+   struct {
+      int paused;
+      unsigned long long paused_since_us;
+      unsigned long long pauses;
+      unsigned long long paused_us;
+   } backpressure;
+   struct stats_srv_ctx_t *stats_srv;
+   struct rdr_log_ctx_t *log;
 
    struct sockaddr_in src_addr;
-   struct sockaddr_in dst_addr;
 
    int rcv_s;
-   int snd_s;
+   FILE *out_file;
+
+   /* Command line for the binary upgrade  */
+   char **argv;
+   /* Sessions are passed to the new binary, do not close them on exit  */
+   unsigned handed_over;
+
+   /* Sequence number of the next record written to out_file  */
+   unsigned flow_seq;
+   /* Datagram buffers of a session: 1 or a collector each for the hash policy  */
+   unsigned session_dgrams;
 
    struct rdr_session_ctx_t *rdr_sessions;
    fd_set rdr_fdset;
    int rdr_maxfd;
 
+   /* Established sessions by socket  */
+   struct rdr_session_ctx_t *sessions_by_fd[FD_SETSIZE];
+
+   struct {
+      struct rdr_session_ctx_t *mem;
+      size_t mem_size;
+      unsigned size;
+      unsigned used;
+      unsigned hugepages;
+      struct rdr_session_ctx_t *free;
+      /* Sessions allocated on the heap when the pool is empty  */
+      unsigned long long overflows;
+   } session_pool;
+
+   time_t start_ts;
+
+   /* Totals of the closed sessions  */
+   struct rdr_session_stats_t closed_sessions_stats;
+
+   struct {
+      unsigned long long dgrams;
+      unsigned long long records;
+      unsigned long long send_errors;
+   } export_stats __attribute__((aligned(STATS_CACHE_LINE_SIZE)));
+
+   struct {
+      /* Frame arrival to datagram send, us  */
+      struct stats_hist_t arrival_to_send;
+      /* RDR REPORT_TIME to datagram send, ms  */
+      struct stats_hist_t report_to_send;
+      /* Records with REPORT_TIME ahead of our clock  */
+      unsigned long long report_in_future;
+   } latency;
+
+   /* Exclusive cycles of the ingest thread by stage  */
+   struct {
+      int enabled;
+      unsigned cur;
+      unsigned long long ts;
+      unsigned long long start_us;
+      unsigned long long cycles[PROF_STAGES];
+      unsigned long long calls[PROF_STAGES];
+
+      /* Totals at the last periodic print  */
+      unsigned long long last_us;
+      unsigned long long last_cycles[PROF_STAGES];
+      unsigned long long last_calls[PROF_STAGES];
+   } prof;
+
 } Ctx;
 
 
 static struct rdr_session_ctx_t *remove_session(struct ctx_t *ctx, struct rdr_session_ctx_t *session);
+static void destroy_session_pool(struct ctx_t *ctx);
 static int ip_filter_add_networks(struct ctx_t *ctx, char *optarg);
 static inline unsigned is_ip_filtered(struct ctx_t *ctx, in_addr_t src_ip, in_addr_t dst_ip);
+static void print_stats(FILE *stream, void *arg);
+static void print_profile(struct ctx_t *ctx, FILE *stream, int interval);
 
 static volatile sig_atomic_t quit = 0;
+static volatile sig_atomic_t dump_stats = 0;
+static volatile sig_atomic_t upgrade = 0;
+
+static const char *prof_stage_names[PROF_STAGES] = {
+   "other", "poll", "read", "framing", "decode", "filter", "encode", "send",
+   "repeater", "recorder", "aggregate", "topk", "distinct"
+};
+
+/* Charge the cycles since the last switch to the current stage  */
+static inline void prof_sync(struct ctx_t *ctx)
+{
+   unsigned long long now;
+
+   now = stats_cycles();
+   ctx->prof.cycles[ctx->prof.cur] += now - ctx->prof.ts;
+   ctx->prof.ts = now;
+}
+
+static inline unsigned prof_enter(struct ctx_t *ctx, unsigned stage)
+{
+   unsigned prev;
+
+   if (!ctx->prof.enabled)
+      return PROF_OTHER;
+
+   prof_sync(ctx);
+   prev = ctx->prof.cur;
+   ctx->prof.calls[stage] += 1;
+   ctx->prof.cur = stage;
+
+   return prev;
+}
+
+static void prof_start(struct ctx_t *ctx)
+{
+   memset(&ctx->prof, 0, sizeof(ctx->prof));
+   ctx->prof.cur = PROF_OTHER;
+   ctx->prof.start_us = ctx->prof.last_us = stats_monotonic_us();
+   ctx->prof.ts = stats_cycles();
+   ctx->prof.enabled = 1;
+}
+
+static inline void prof_leave(struct ctx_t *ctx, unsigned prev)
+{
+   if (!ctx->prof.enabled)
+      return;
+
+   prof_sync(ctx);
+   ctx->prof.cur = prev;
+}
 
 
 static void usage(void)
@@ -138,20 +441,83 @@ static void help(void)
    "\nOptions:\n"
    "    -s <address>    Address to bind for listening (default %s)\n"
    "    -p <port>       Specifies the port number to listen (default %u)\n"
-   "    -d <address>    Send netflow to this remote host (default %s)\n"
+   "    -d <address>[/<port>][,...] Send netflow to these collectors (default %s)\n"
    "    -P <port>       Remote port (default %u)\n"
+   "    -H hash|rr[/<failures>[/<sec>]] Spread records over the collectors by\n"
+   "                    consistent hash of the client address or datagrams round-robin,\n"
+   "                    take a collector out for sec seconds after failures send()\n"
+   "                    errors in a second (default hash/%u/%u)\n"
+   "    -E <rate>[/<burst>[/<queue>]] Pace export to rate datagrams per second,\n"
+   "                    up to burst back to back, queue the rest, drop when full\n"
+   "                    (default %u/%u)\n"
+   "    -Q <queue>[/<ms>] Export queue size in datagrams, retry failed sends with\n"
+   "                    backoff up to ms (default %u/%u), 0 - no retries\n"
    "    -R <host/port>  RDR Repeater: send all incoming packets to this host\n"
    "    -F ip[/net][,...] Comma-separated list of networks to be excluded from the dump\n"
+   "    -m <host/port>  Serve Prometheus metrics over HTTP on this address\n"
+   "    -M <name>[/<records>] Write TURs to the shared memory ring /dev/shm/name\n"
+   "                    (default %u records)\n"
+   "    -S count/<N>|hash/<N>|adaptive[/<N>[/<max>]] Export 1 in N TURs or flows,\n"
+   "                    adaptive: raise N up to max (default %u) on export backlog\n"
+   "    -O <policy>[,<policy>...][/<high>[/<low>]] Shed load when the receive buffer\n"
+   "                    of an SCE fills up over high%% (default %u%%, off below %u%%):\n"
+   "                    nontur, interim, bytes:<N> in the order of priority\n"
+   "    -B <high>[/<low>] Stop reading SCEs when export, repeater or recorder\n"
+   "                    queues fill over high%%, resume below low%% (default high/2)\n"
+   "    -A <key>[,<key>...][/<sec>[/<entries>]] Export rollups instead of TURs: sum\n"
+   "                    TURs by subscriber, service, protocol, package, client[:len]\n"
+   "                    over REPORT_TIME windows (default %u s, %u entries)\n"
+   "    -a <file>       Append rollups to file (default stdout)\n"
+   "    -K <k>[/<sec>[/<counters>]] Log top k subscribers, servers and services\n"
+   "                    by octets every sec seconds (default %u s, %u counters)\n"
+   "    -U <sec>[/<precision>] Count distinct subscribers, servers and client/server\n"
+   "                    pairs per service and package over REPORT_TIME windows\n"
+   "                    (HyperLogLog, 2^precision registers, default %u)\n"
+   "    -u <file>       Append distinct counts to file (default stdout)\n"
+   "    -w <dir>        Record raw RDR stream to segment files in this directory\n"
+   "    -W <MB>[/<sec>] Segment rotation size and interval (default %u/%u)\n"
+   "    -r <file>       Convert recorded RDR stream or pcap file and exit\n"
+   "    -o <file>       Write netflow datagrams to file instead of sending\n"
+   "    -j <threads>    Decoder threads for -r (default 1)\n"
+   "    -c <num>        Preallocated SCE sessions (default %u)\n"
+   "    -L [<class>=]<num> Log messages per second of the class (error, conn,\n"
+   "                    debug; default error and conn), 0 - unlimited (default %u)\n"
+   "    -D tag=<num>|session=<ip>[:<port>][,...] Limit -V >= 10 dumps to these\n"
+   "                    RDR tags and SCE sessions\n"
+   "    -T <sec>        Per-stage cycle accounting, print every sec seconds\n"
+   "                    (0 - on exit and SIGUSR1 only)\n"
    "    -b <size>       Set send buffer size in bytes.\n"
    "    -V <level>      Verbose output\n"
    "    -h, --help                  Help\n"
    "    -v, --version               Show version\n"
+   "\nSignals:\n"
+   "    SIGUSR1         Print statistics to stderr\n"
+   "    SIGUSR2         Upgrade: exec the binary again and hand it the SCE sessions\n"
    "\n",
 
    "any",
    DEFAULT_SRC_PORT,
    DEFAULT_DST_IP,
-   DEFAULT_DST_PORT
+   DEFAULT_DST_PORT,
+   RDR_COLLECTOR_DEFAULT_FAILURES,
+   RDR_COLLECTOR_DEFAULT_DOWN_S,
+   RDR_PACER_DEFAULT_BURST,
+   RDR_PACER_DEFAULT_QUEUE,
+   RDR_PACER_DEFAULT_QUEUE,
+   RDR_PACER_DEFAULT_MAX_BACKOFF_MS,
+   RDR_SHMRING_DEFAULT_RECORDS,
+   RDR_SAMPLING_DEFAULT_MAX_INTERVAL,
+   RDR_SHED_DEFAULT_HIGH,
+   RDR_SHED_DEFAULT_LOW,
+   RDR_AGGR_DEFAULT_WINDOW_S,
+   RDR_AGGR_DEFAULT_ENTRIES,
+   RDR_TOPK_DEFAULT_PERIOD,
+   RDR_TOPK_DEFAULT_COUNTERS,
+   RDR_DISTINCT_DEFAULT_PRECISION,
+   RDR_RECORDER_DEFAULT_SEGMENT_MB,
+   RDR_RECORDER_DEFAULT_SEGMENT_S,
+   DEFAULT_SESSION_POOL_SIZE,
+   RDR_LOG_DEFAULT_RATE
  );
  return;
 }
@@ -160,21 +526,76 @@ static void sig_quit(int signal) {
    quit = signal;
 }
 
+static void sig_dump_stats(int signal) {
+   dump_stats = signal;
+}
+
+static void sig_upgrade(int signal) {
+   upgrade = signal;
+}
+
 static struct ctx_t *init_ctx()
 {
    Ctx.opts.src_addr.s_addr = INADDR_ANY;
-   Ctx.opts.dst_addr.s_addr = inet_addr(DEFAULT_DST_IP);
    Ctx.opts.src_port = 0;
    Ctx.opts.dst_port = 0;
    Ctx.opts.s_bufsize = 0;
    Ctx.opts.verbose = 1;
    Ctx.opts.ip_filter = NULL;
+   Ctx.opts.read_fname = NULL;
+   Ctx.opts.out_fname = NULL;
+   Ctx.opts.threads = 1;
+   Ctx.opts.session_pool_size = DEFAULT_SESSION_POOL_SIZE;
+   Ctx.out_file = NULL;
+   Ctx.argv = NULL;
+   Ctx.handed_over = 0;
    Ctx.rdr_sessions = NULL;
+   Ctx.flow_seq = 0;
+   Ctx.session_dgrams = 1;
    Ctx.rdr_maxfd = 0;
    FD_ZERO(&Ctx.rdr_fdset);
+   memset(Ctx.sessions_by_fd, 0, sizeof(Ctx.sessions_by_fd));
+   memset(&Ctx.session_pool, 0, sizeof(Ctx.session_pool));
+   Ctx.start_ts = time(NULL);
+   memset(&Ctx.closed_sessions_stats, 0, sizeof(Ctx.closed_sessions_stats));
+   memset(&Ctx.export_stats, 0, sizeof(Ctx.export_stats));
+   stats_hist_init(&Ctx.latency.arrival_to_send);
+   stats_hist_init(&Ctx.latency.report_to_send);
+   Ctx.latency.report_in_future = 0;
+   memset(&Ctx.prof, 0, sizeof(Ctx.prof));
    Ctx.rdr_repeater = rdr_repeater_init();
    if (Ctx.rdr_repeater == NULL)
       return NULL;
+   Ctx.rdr_recorder = rdr_recorder_init();
+   if (Ctx.rdr_recorder == NULL)
+      return NULL;
+   Ctx.shmring = rdr_shmring_init();
+   if (Ctx.shmring == NULL)
+      return NULL;
+   Ctx.aggr = rdr_aggr_init();
+   if (Ctx.aggr == NULL)
+      return NULL;
+   Ctx.topk = rdr_topk_init();
+   if (Ctx.topk == NULL)
+      return NULL;
+   Ctx.distinct = rdr_distinct_init();
+   if (Ctx.distinct == NULL)
+      return NULL;
+   Ctx.sampling = rdr_sampling_init();
+   if (Ctx.sampling == NULL)
+      return NULL;
+   Ctx.collectors = rdr_collector_init();
+   if (Ctx.collectors == NULL)
+      return NULL;
+   Ctx.shed = rdr_shed_init();
+   if (Ctx.shed == NULL)
+      return NULL;
+   Ctx.stats_srv = stats_srv_init(print_stats, &Ctx);
+   if (Ctx.stats_srv == NULL)
+      return NULL;
+   Ctx.log = rdr_log_init();
+   if (Ctx.log == NULL)
+      return NULL;
 
    return &Ctx;
 }
@@ -189,13 +610,20 @@ static void free_ctx(struct ctx_t *ctx)
       close(ctx->rcv_s);
    }
 
-   if (ctx->snd_s > 0) {
-      close(ctx->rcv_s);
+   if (ctx->out_file == NULL)
+      rdr_collector_drain(ctx->collectors);
+
+   if (ctx->out_file != NULL) {
+      if (fclose(ctx->out_file) != 0)
+	 perror("fclose() error");
+      ctx->out_file = NULL;
    }
 
    while (ctx->rdr_sessions != NULL)
       remove_session(ctx, ctx->rdr_sessions);
 
+   destroy_session_pool(ctx);
+
    while (ctx->opts.ip_filter != NULL) {
       struct ipfilter_item_t *i;
       i = ctx->opts.ip_filter;
@@ -209,6 +637,35 @@ static void free_ctx(struct ctx_t *ctx)
    rdr_repeater_destroy(ctx->rdr_repeater);
    ctx->rdr_repeater = NULL;
 
+   rdr_recorder_destroy(ctx->rdr_recorder);
+   ctx->rdr_recorder = NULL;
+
+   rdr_shmring_destroy(ctx->shmring);
+   ctx->shmring = NULL;
+
+   rdr_aggr_destroy(ctx->aggr);
+   ctx->aggr = NULL;
+
+   rdr_topk_destroy(ctx->topk);
+   ctx->topk = NULL;
+
+   rdr_distinct_destroy(ctx->distinct);
+   ctx->distinct = NULL;
+
+   rdr_sampling_destroy(ctx->sampling);
+   ctx->sampling = NULL;
+
+   rdr_collector_destroy(ctx->collectors);
+   ctx->collectors = NULL;
+
+   rdr_shed_destroy(ctx->shed);
+   ctx->shed = NULL;
+
+   stats_srv_destroy(ctx->stats_srv);
+   ctx->stats_srv = NULL;
+
+   rdr_log_destroy(ctx->log);
+   ctx->log = NULL;
 }
 
 static int init_listening_socket(struct ctx_t *ctx)
@@ -278,28 +735,195 @@ static int init_listening_socket(struct ctx_t *ctx)
 static int init_sending_socket(struct ctx_t *ctx)
 {
    assert(ctx);
+
+   if (rdr_collector_count(ctx->collectors) == 0
+	 && (rdr_collector_add(ctx->collectors, DEFAULT_DST_IP, stderr) < 0))
+      return -1;
+
+   /* Offline: no reads to keep up with, a full export queue waits  */
+   rdr_collector_set_blocking(ctx->collectors, ctx->opts.read_fname != NULL);
+
+   return rdr_collector_start(ctx->collectors,
+	 ctx->opts.dst_port != 0 ? ctx->opts.dst_port : DEFAULT_DST_PORT, ctx->opts.verbose);
+}
+
+static int init_output_file(struct ctx_t *ctx)
+{
+   assert(ctx);
+   assert(ctx->opts.out_fname);
+
    if (ctx->opts.verbose)
-      fprintf(stderr, "Sending to %s:%u\n",
-	    inet_ntoa(ctx->opts.dst_addr),
-	    ctx->opts.dst_port != 0 ? ctx->opts.dst_port : DEFAULT_DST_PORT
-	    );
+      fprintf(stderr, "Writing to %s\n", ctx->opts.out_fname);
 
-   ctx->snd_s = socket(PF_INET, SOCK_DGRAM, 0);
-   if (ctx->rcv_s < 0) {
-      perror("socket() on sending socket error");
+   ctx->out_file = fopen(ctx->opts.out_fname, "w");
+   if (ctx->out_file == NULL) {
+      perror("fopen() error");
       return -1;
    }
-   memset(&ctx->dst_addr, 0, sizeof(ctx->dst_addr));
-   ctx->dst_addr.sin_family = AF_INET;
-   ctx->dst_addr.sin_addr.s_addr = ctx->opts.dst_addr.s_addr;
-   ctx->dst_addr.sin_port = htons(ctx->opts.dst_port != 0 ? ctx->opts.dst_port : DEFAULT_DST_PORT);
-   if (connect(ctx->snd_s, (struct sockaddr *)&ctx->dst_addr, sizeof(ctx->dst_addr) ) < 0) {
-      perror("connect() error");
-      return -1;
+   setvbuf(ctx->out_file, NULL, _IOFBF, NETFLOW_FILE_BUF_SIZE);
+
+   return 0;
+}
+
+/*
+ * Sessions are preallocated in one pre-faulted block (on hugepages if
+ * the system has them reserved), SCE reconnects do not touch malloc
+ */
+/* Session with its datagram buffers, a multiple of the cache line  */
+static size_t session_size(const struct ctx_t *ctx)
+{
+   size_t size;
+
+   size = sizeof(struct rdr_session_ctx_t) + ctx->session_dgrams * sizeof(struct session_dgram_t);
+   return (size + STATS_CACHE_LINE_SIZE - 1) & ~((size_t)STATS_CACHE_LINE_SIZE - 1);
+}
+
+static int init_session_pool(struct ctx_t *ctx)
+{
+   unsigned i;
+   size_t size;
+   void *mem;
+   struct rdr_session_ctx_t *session;
+
+   size = (size_t)ctx->opts.session_pool_size * session_size(ctx);
+   if (size == 0)
+      return 0;
+
+   mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+   ctx->session_pool.mem_size = (size + HUGEPAGE_SIZE - 1) & ~((size_t)HUGEPAGE_SIZE - 1);
+   mem = mmap(NULL, ctx->session_pool.mem_size, PROT_READ | PROT_WRITE,
+	 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   ctx->session_pool.hugepages = (mem != MAP_FAILED);
+#endif
+   if (mem == MAP_FAILED) {
+      ctx->session_pool.mem_size = size;
+      mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+      if (mem == MAP_FAILED) {
+	 perror("mmap() error");
+	 return -1;
+      }
+   }
+
+   /* Pre-fault  */
+   memset(mem, 0, ctx->session_pool.mem_size);
+
+   ctx->session_pool.mem = (struct rdr_session_ctx_t *)mem;
+   ctx->session_pool.size = ctx->opts.session_pool_size;
+   ctx->session_pool.used = 0;
+   ctx->session_pool.free = NULL;
+   for (i = ctx->session_pool.size; i > 0; --i) {
+      session = (struct rdr_session_ctx_t *)((uint8_t *)mem + (size_t)(i-1) * session_size(ctx));
+      session->next = ctx->session_pool.free;
+      ctx->session_pool.free = session;
    }
+
+   if (ctx->opts.verbose > 1)
+      fprintf(stderr, "Session pool: %u sessions, %lu bytes%s\n",
+	    ctx->session_pool.size, (unsigned long)ctx->session_pool.mem_size,
+	    ctx->session_pool.hugepages ? " on hugepages" : "");
+
    return 0;
 }
 
+static void destroy_session_pool(struct ctx_t *ctx)
+{
+   if (ctx->session_pool.mem == NULL)
+      return;
+   munmap(ctx->session_pool.mem, ctx->session_pool.mem_size);
+   memset(&ctx->session_pool, 0, sizeof(ctx->session_pool));
+}
+
+static struct rdr_session_ctx_t *alloc_session(struct ctx_t *ctx)
+{
+   struct rdr_session_ctx_t *session;
+
+   session = ctx->session_pool.free;
+   if (session != NULL) {
+      ctx->session_pool.free = session->next;
+      ctx->session_pool.used += 1;
+      session->pooled = 1;
+      return session;
+   }
+
+   ctx->session_pool.overflows += 1;
+   if (posix_memalign((void **)&session, STATS_CACHE_LINE_SIZE, session_size(ctx)) != 0) {
+      perror("posix_memalign() error");
+      return NULL;
+   }
+   session->pooled = 0;
+
+   return session;
+}
+
+static void free_session(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
+{
+   if (session->pooled) {
+      session->next = ctx->session_pool.free;
+      ctx->session_pool.free = session;
+      ctx->session_pool.used -= 1;
+   }else
+      free(session);
+}
+
+static void link_session(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
+{
+   session->next = ctx->rdr_sessions;
+   session->pprev = &ctx->rdr_sessions;
+   if (ctx->rdr_sessions != NULL)
+      ctx->rdr_sessions->pprev = &session->next;
+   ctx->rdr_sessions = session;
+}
+
+static void init_session(struct ctx_t *ctx, struct rdr_session_ctx_t *session, int s,
+      const struct sockaddr_in *remote_addr)
+{
+   unsigned i;
+
+   session->s = s;
+   session->remote_addr = *remote_addr;
+   session->next = NULL;
+   session->pprev = NULL;
+   session->pos = 0;
+   session->rcvd_us = 0;
+   session->shed_level = 0;
+   session->rcvbuf = 0;
+   memset(&session->stats, 0, sizeof(session->stats));
+
+   /* Netflow ctx  */
+   session->netflow.first_packet_ts = 0;
+   for (i=0; i < ctx->session_dgrams; ++i) {
+      session->dgrams[i].records_count = 0;
+      session->dgrams[i].dgram.header.version = htons(NETFLOW_V5);
+      session->dgrams[i].dgram.header.count = 0;
+      session->dgrams[i].dgram.header.sys_uptime = 0;
+      session->dgrams[i].dgram.header.engine_type = 0;
+      session->dgrams[i].dgram.header.engine_id = 0;
+      session->dgrams[i].dgram.header.sampling_int = 0;
+   }
+}
+
+/* "<msg> <ip>:<port>" under the rate limit of the class  */
+static void log_session_msg(struct ctx_t *ctx, unsigned msg_class, const char *msg,
+      const struct sockaddr_in *addr)
+{
+   char buf[128 + RDR_LOG_ADDR_STRLEN];
+   char *p;
+   size_t len;
+
+   if (!rdr_log_allow(ctx->log, msg_class))
+      return;
+
+   len = strlen(msg);
+   if (len > 128)
+      len = 128;
+   memcpy(buf, msg, len);
+   p = rdr_log_fmt_addr(buf + len, addr);
+   *p++ = '\n';
+   fwrite(buf, p - buf, 1, rdr_log_stream(ctx->log));
+   rdr_log_commit(ctx->log);
+}
+
 static int accept_connection(struct ctx_t *ctx)
 {
    int s;
@@ -314,13 +938,21 @@ static int accept_connection(struct ctx_t *ctx)
    slen = sizeof(remote_addr);
    s = accept(ctx->rcv_s, (struct sockaddr *)&remote_addr, &slen);
    if (s < 0) {
-      perror("accept() error");
+      if (rdr_log_allow(ctx->log, RDR_LOG_ERROR)) {
+	 fprintf(rdr_log_stream(ctx->log), "accept() error: %s\n", strerror(errno));
+	 rdr_log_commit(ctx->log);
+      }
+      return -1;
+   }
+
+   if (s >= FD_SETSIZE) {
+      log_session_msg(ctx, RDR_LOG_ERROR, "Too many connections, rejecting ", &remote_addr);
+      close(s);
       return -1;
    }
 
-   session = (struct rdr_session_ctx_t *)malloc(sizeof(*session));
+   session = alloc_session(ctx);
    if (session == NULL) {
-      perror("malloc() error");
       close(s);
       return -1;
    }
@@ -328,61 +960,143 @@ static int accept_connection(struct ctx_t *ctx)
    flags = fcntl(s, F_GETFL, 0);
    fcntl(s, F_SETFL, flags | O_NONBLOCK);
 
-   session->s = s;
-   session->remote_addr = remote_addr;
-   session->pos = 0;
-
-   /* Netflow ctx  */
-   session->netflow.first_packet_ts = 0;
-   session->netflow.flow_seq = 0;
-   session->netflow.records_count = 0;
-   session->netflow.dgram.header.version = htons(NETFLOW_V5);
-   session->netflow.dgram.header.count = 0;
-   session->netflow.dgram.header.sys_uptime = 0;
-   session->netflow.dgram.header.engine_type = 0;
-   session->netflow.dgram.header.engine_id = 0;
-   session->netflow.dgram.header.sampling_int = 0;
-
-   session->next = ctx->rdr_sessions;
-   ctx->rdr_sessions = session;
+   init_session(ctx, session, s, &remote_addr);
+   link_session(ctx, session);
 
+   ctx->sessions_by_fd[s] = session;
    FD_SET(s, &ctx->rdr_fdset);
    if (s > ctx->rdr_maxfd)
       ctx->rdr_maxfd = s;
 
+   rdr_recorder_append(ctx->rdr_recorder, RDR_SEGMENT_REC_OPEN, &remote_addr, NULL, 0);
+
    if (ctx->opts.verbose)
-      fprintf(stderr, "Accepted connection from %s:%u\n",
-	    inet_ntoa(remote_addr.sin_addr),
-	    (unsigned)remote_addr.sin_port
-	    );
+      log_session_msg(ctx, RDR_LOG_CONN, "Accepted connection from ", &remote_addr);
 
    return 0;
 }
 
-static int flush_netflow_dgram(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
+/* send() failures of the export queue, errno is of the last one  */
+static void count_send_errors(struct ctx_t *ctx, unsigned errors)
+{
+   int err;
+
+   if (errors == 0)
+      return;
+
+   err = errno;
+   ctx->export_stats.send_errors += errors;
+   if (ctx->opts.verbose && rdr_log_allow(ctx->log, RDR_LOG_ERROR)) {
+      fprintf(rdr_log_stream(ctx->log), "send() error: %s\n", strerror(err));
+      rdr_log_commit(ctx->log);
+   }
+}
+
+/* Exported datagrams and records less the ones the export queues dropped after taking them  */
+static void export_sent(struct ctx_t *ctx, unsigned long long *dgrams, unsigned long long *records)
+{
+   unsigned long long dropped_dgrams, dropped_records;
+
+   *dgrams = ctx->export_stats.dgrams;
+   *records = ctx->export_stats.records;
+   if (ctx->out_file != NULL)
+      return;
+
+   rdr_collector_dropped(ctx->collectors, &dropped_dgrams, &dropped_records);
+   *dgrams -= dropped_dgrams;
+   *records -= dropped_records;
+}
+
+static int flush_session_dgram(struct ctx_t *ctx, struct rdr_session_ctx_t *session, unsigned idx)
 {
    int res;
+   unsigned prof, errors;
+   ssize_t sent;
+   size_t dgram_size;
+   struct session_dgram_t *d;
    assert(ctx);
    assert(session);
+   assert(idx < ctx->session_dgrams);
 
-   if (session->netflow.records_count == 0)
+   d = &session->dgrams[idx];
+   if (d->records_count == 0)
       return 0;
 
-   assert(session->netflow.records_count == ntohs(session->netflow.dgram.header.count));
+   assert(d->records_count == ntohs(d->dgram.header.count));
+
+   d->dgram.header.sampling_int = htons(rdr_sampling_v5_header(ctx->sampling));
+
+   dgram_size = sizeof(struct netflow_v5_header) +
+      sizeof(struct netflow_v5_record) * d->records_count;
 
    res = 0;
-   if (send(ctx->snd_s,
-	    &session->netflow.dgram,
-	    sizeof(struct netflow_v5_header) +
-	       sizeof(struct netflow_v5_record) * session->netflow.records_count,
-	       0) < 0) {
+   prof = prof_enter(ctx, PROF_SEND);
+   if (ctx->out_file != NULL) {
+      /* All sessions share one exporter: sequence is global  */
+      d->dgram.header.flow_seq = htonl(ctx->flow_seq);
+      ctx->flow_seq += d->records_count;
+      sent = fwrite(&d->dgram, dgram_size, 1, ctx->out_file) == 1 ? (ssize_t)dgram_size : -1;
+   }else {
+      /* Hash policy fills a datagram per collector, the others pick one per datagram  */
+      if (ctx->session_dgrams == 1)
+	 idx = rdr_collector_next(ctx->collectors);
+      /* Sent now or later in order, drops are counted by the export queue  */
+      errors = rdr_collector_send(ctx->collectors, idx, &d->dgram, dgram_size, d->records_count);
+      count_send_errors(ctx, errors);
+      if (errors != 0 && !rdr_collector_is_queued(ctx->collectors))
+	 sent = -1;
+      else
+	 sent = (ssize_t)dgram_size;
+   }
+   prof_leave(ctx, prof);
+   RDR_PROBE3(flush, d->records_count, ntohl(d->dgram.header.flow_seq), sent);
+
+   if (sent < 0) {
+      /* send() failures are counted and logged by count_send_errors()  */
+      if (ctx->out_file != NULL)
+	 ctx->export_stats.send_errors += 1;
       if (ctx->opts.verbose) {
-	 perror("send() error");
+	 if (ctx->out_file != NULL && rdr_log_allow(ctx->log, RDR_LOG_ERROR)) {
+	    fprintf(rdr_log_stream(ctx->log), "fwrite() error: %s\n", strerror(errno));
+	    rdr_log_commit(ctx->log);
+	 }
 	 res = -1;
       }
+   }else {
+      unsigned i;
+      unsigned long long now_us;
+      time_t now;
+
+      ctx->export_stats.dgrams += 1;
+      ctx->export_stats.records += d->records_count;
+
+      now_us = stats_monotonic_us();
+      now = time(NULL);
+      for (i=0; i < d->records_count; ++i) {
+	 stats_hist_add(&ctx->latency.arrival_to_send, now_us - d->arrival_us[i]);
+	 if (now < d->report_time[i])
+	    ctx->latency.report_in_future += 1;
+	 else
+	    stats_hist_add(&ctx->latency.report_to_send,
+		  1000 * (unsigned long long)(now - d->report_time[i]));
+      }
    }
 
-   session->netflow.records_count = 0;
+   d->records_count = 0;
+
+   return res;
+}
+
+static int flush_netflow_dgram(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
+{
+   unsigned i;
+   int res;
+
+   res = 0;
+   for (i=0; i < ctx->session_dgrams; ++i) {
+      if (flush_session_dgram(ctx, session, i) < 0)
+	 res = -1;
+   }
 
    return res;
 }
@@ -397,110 +1111,239 @@ static void flush_all_netflow_sessions(struct ctx_t *ctx)
    }
 }
 
-static int handle_rdr_packet(struct ctx_t *ctx, struct rdr_session_ctx_t *session,
-      uint8_t *raw_pkt, size_t raw_pkt_size)
+/* Fill of the fullest export queue or collector socket send buffer, 0..1  */
+static double export_backlog(struct ctx_t *ctx)
 {
-   int err;
-   unsigned long long uptime;
-   int duration;
-   struct rdr_packet_t pkt;
-   struct netflow_v5_export_dgram *dg;
-   struct netflow_v5_record *rc;
-
-   if ((err = decode_rdr_packet(raw_pkt, raw_pkt_size, &pkt)) < 0) {
-      if (ctx->opts.verbose)
-	 fprintf(stderr, "decode_rdr_packet() error %i\n", err);
-      if (ctx->opts.verbose >= 50)
-	 dump_raw_rdr_packet(stderr, 1, raw_pkt, raw_pkt_size);
-      return err;
-   }
+   if (ctx->out_file != NULL)
+      return 0;
 
-   if (ctx->opts.verbose >= 10) {
-      dump_rdr_packet(stderr, &pkt);
-      if (ctx->opts.verbose >= 50)
-	 dump_raw_rdr_packet(stderr, 0, raw_pkt, raw_pkt_size);
-      if (pkt.header.tag == TRANSACTION_USAGE_RDR) {
-	 unsigned filtered = is_ip_filtered(ctx, pkt.rdr.transaction_usage.client_ip.s_addr, pkt.rdr.transaction_usage.server_ip.s_addr);
-	 if (filtered & 0x01) {
-	    fprintf(stderr, "Client IP Filtered ");
-	 }
-	 if (filtered & 0x02) {
-	    fprintf(stderr, "Server IP Filtered ");
-	 }
-      }
-      fprintf(stderr, "\n");
-   }
+   return rdr_collector_backlog(ctx->collectors);
+}
 
-   /* Not intersted in  */
-   if (pkt.header.tag != TRANSACTION_USAGE_RDR)
-      return 0;
+/* Fill of the fullest queue after the decoder: export socket, repeater, recorder, 0..1  */
+static double downstream_backlog(struct ctx_t *ctx)
+{
+   double res, backlog;
 
-   if (is_ip_filtered(ctx, pkt.rdr.transaction_usage.client_ip.s_addr, pkt.rdr.transaction_usage.server_ip.s_addr))
-      return 0;
+   res = export_backlog(ctx);
+   backlog = rdr_repeater_backlog(ctx->rdr_repeater);
+   if (backlog > res)
+      res = backlog;
+   backlog = rdr_recorder_backlog(ctx->rdr_recorder);
+   if (backlog > res)
+      res = backlog;
 
-   duration = (pkt.rdr.transaction_usage.millisec_duration / 1000)
-      + ((pkt.rdr.transaction_usage.millisec_duration % 1000 == 0) ? 0 : 1);
+   return res;
+}
 
-   if (pkt.rdr.transaction_usage.report_time < duration) {
-      duration = 0;
+/*
+ * Backpressure: stop reading the SCE sessions above the high watermark
+ * of the downstream backlog, resume below the low one. The data stays in
+ * the socket buffers and TCP flow control makes the SCEs buffer it.
+ * Returns 1 while paused
+ */
+static int update_backpressure(struct ctx_t *ctx)
+{
+   double backlog;
+   unsigned long long now_us;
+   char buf[128];
+
+   backlog = 100.0 * downstream_backlog(ctx);
+
+   if (!ctx->backpressure.paused && (backlog >= ctx->opts.backpressure_high)) {
+      ctx->backpressure.paused = 1;
+      ctx->backpressure.paused_since_us = stats_monotonic_us();
+      ctx->backpressure.pauses += 1;
+   }else if (ctx->backpressure.paused && (backlog < ctx->opts.backpressure_low)) {
+      now_us = stats_monotonic_us();
+      ctx->backpressure.paused = 0;
+      ctx->backpressure.paused_us += now_us - ctx->backpressure.paused_since_us;
+   }else
+      return ctx->backpressure.paused;
+
+   if (ctx->opts.verbose && rdr_log_allow(ctx->log, RDR_LOG_CONN)) {
+      snprintf(buf, sizeof(buf), "Backpressure: %s reads, downstream backlog %.0f%%\n",
+	    ctx->backpressure.paused ? "pausing" : "resuming", backlog);
+      fputs(buf, rdr_log_stream(ctx->log));
+      rdr_log_commit(ctx->log);
    }
 
-   if ( (session->netflow.first_packet_ts == 0)
-	 || (pkt.rdr.transaction_usage.report_time - duration < session->netflow.first_packet_ts)
-	 ) {
-      session->netflow.first_packet_ts = pkt.rdr.transaction_usage.report_time - duration;
-   }
+   return ctx->backpressure.paused;
+}
 
-   if (pkt.rdr.transaction_usage.report_time < session->netflow.first_packet_ts) {
-      if (ctx->opts.verbose)
-	 fprintf(stderr, "Time went backwards. %u => %u\n", (unsigned)session->netflow.first_packet_ts,
-	       (unsigned)pkt.rdr.transaction_usage.report_time);
-      session->netflow.first_packet_ts = pkt.rdr.transaction_usage.report_time - duration;
-   }
+/* Once a second take out the failing collectors and return the recovered ones  */
+static void check_collectors(struct ctx_t *ctx)
+{
+   unsigned long long now_us;
 
-   session->netflow.last_packet_ts = pkt.rdr.transaction_usage.report_time;
+   now_us = stats_monotonic_us();
+   if (now_us - ctx->collector_check_us < 1000000ull)
+      return;
+   ctx->collector_check_us = now_us;
 
-   assert(session->netflow.last_packet_ts >= session->netflow.first_packet_ts);
+   if (rdr_collector_check(ctx->collectors, now_us) == 0)
+      return;
 
-   uptime = 1000*(session->netflow.last_packet_ts - session->netflow.first_packet_ts) + 1;
+   if (ctx->opts.verbose && rdr_log_allow(ctx->log, RDR_LOG_CONN)) {
+      fprintf(rdr_log_stream(ctx->log), "Collectors: %u of %u up\n",
+	    rdr_collector_up_count(ctx->collectors), rdr_collector_count(ctx->collectors));
+      rdr_log_commit(ctx->log);
+   }
+}
 
-   assert(uptime >= pkt.rdr.transaction_usage.millisec_duration);
+/* Adaptive sampling: once a second adjust the interval to the export backlog  */
+static void adapt_sampling(struct ctx_t *ctx)
+{
+   unsigned long long now_us;
+   unsigned interval;
+   double backlog;
 
-   dg = &session->netflow.dgram;
+   now_us = stats_monotonic_us();
+   if (now_us - ctx->sampling_check_us < 1000000ull)
+      return;
+   ctx->sampling_check_us = now_us;
 
-   assert (session->netflow.records_count+1 < NETFLOW_V5_MAX_RECORDS);
+   backlog = export_backlog(ctx);
+   interval = rdr_sampling_adapt(ctx->sampling, backlog, ctx->export_stats.send_errors, now_us);
+   if (interval == 0)
+      return;
 
-   /* Export upstream flow  */
-   dg->header.sys_uptime = htonl((uint32_t)uptime);
-   dg->header.unix_secs = htonl(pkt.rdr.transaction_usage.report_time);
-   dg->header.unix_nsecs = 0; /* XXX  */
-   dg->header.flow_seq = htonl(++session->netflow.flow_seq);
+   /* Datagrams advertise the interval their records were sampled with  */
+   flush_all_netflow_sessions(ctx);
+   rdr_sampling_set_interval(ctx->sampling, interval);
 
-   rc = &dg->r[session->netflow.records_count++];
-   dg->header.count = htons((uint16_t)session->netflow.records_count);
-   /* If initiating_side 0 - Subscriber side; 1 - Network side. Change direction */
-   if (pkt.rdr.transaction_usage.initiating_side == 0) {
-      rc->src_addr = pkt.rdr.transaction_usage.client_ip.s_addr;
-      rc->dst_addr = pkt.rdr.transaction_usage.server_ip.s_addr;
-      rc->s_port = htons(pkt.rdr.transaction_usage.client_port);
-      rc->d_port = htons(pkt.rdr.transaction_usage.server_port);
+   if (ctx->opts.verbose && rdr_log_allow(ctx->log, RDR_LOG_ERROR)) {
+      fprintf(rdr_log_stream(ctx->log), "Sampling: 1 in %u flows, export backlog %.0f%%, "
+	    "%llu send errors\n", interval, 100.0 * backlog, ctx->export_stats.send_errors);
+      rdr_log_commit(ctx->log);
    }
-   else {
-      rc->dst_addr = pkt.rdr.transaction_usage.client_ip.s_addr;
-      rc->src_addr = pkt.rdr.transaction_usage.server_ip.s_addr;
-      rc->d_port = htons(pkt.rdr.transaction_usage.client_port);
-      rc->s_port = htons(pkt.rdr.transaction_usage.server_port);
-   }   
+}
+
+static int sample_tur(struct ctx_t *ctx, const struct rdr_frame_t *tur)
+{
+   struct rdr_sampling_flow_t flow;
+
+   flow.client_ip = tur->client_ip.s_addr;
+   flow.server_ip = tur->server_ip.s_addr;
+   flow.client_port = tur->client_port;
+   flow.server_port = tur->server_port;
+   flow.ip_protocol = tur->ip_protocol;
+
+   return rdr_sampling_select(ctx->sampling, &flow);
+}
+
+static void describe_rdr_frame(struct ctx_t *ctx, const struct rdr_packet_t *pkt,
+      struct rdr_frame_t *frame)
+{
+   unsigned prof;
+   const typeof(pkt->rdr.transaction_usage) *tu;
+
+   frame->tag = pkt->header.tag;
+   if (pkt->header.tag != TRANSACTION_USAGE_RDR)
+      return;
+
+   tu = &pkt->rdr.transaction_usage;
+   prof = prof_enter(ctx, PROF_FILTER);
+   frame->filtered = is_ip_filtered(ctx, tu->client_ip.s_addr, tu->server_ip.s_addr);
+   prof_leave(ctx, prof);
+   RDR_PROBE3(filter, tu->client_ip.s_addr, tu->server_ip.s_addr, frame->filtered);
+   frame->client_ip = tu->client_ip;
+   frame->server_ip = tu->server_ip;
+   frame->client_port = tu->client_port;
+   frame->server_port = tu->server_port;
+   frame->initiating_side = tu->initiating_side;
+   frame->report_time = tu->report_time;
+   frame->millisec_duration = tu->millisec_duration;
+   frame->upstream_volume = tu->session_upstream_volume;
+   frame->downstream_volume = tu->session_downstream_volume;
+   frame->ip_protocol = tu->ip_protocol;
+   frame->service_id = tu->service_id;
+   frame->protocol_id = tu->protocol_id;
+   frame->package_id = tu->package_id;
+   frame->generation_reason = tu->generation_reason;
+   if (ctx->opts.frame_subscriber)
+      memcpy(frame->subscriber_id, tu->subscriber_id, sizeof(frame->subscriber_id));
+}
+
+static int export_tur(struct ctx_t *ctx, struct rdr_session_ctx_t *session,
+      const struct rdr_frame_t *tur)
+{
+   unsigned long long uptime;
+   int duration;
+   unsigned idx;
+   struct session_dgram_t *d;
+   struct netflow_v5_export_dgram *dg;
+   struct netflow_v5_record *rc;
+
+   duration = (tur->millisec_duration / 1000)
+      + ((tur->millisec_duration % 1000 == 0) ? 0 : 1);
+
+   if (tur->report_time < duration) {
+      duration = 0;
+   }
+
+   if ( (session->netflow.first_packet_ts == 0)
+	 || (tur->report_time - duration < session->netflow.first_packet_ts)
+	 ) {
+      session->netflow.first_packet_ts = tur->report_time - duration;
+   }
+
+   if (tur->report_time < session->netflow.first_packet_ts) {
+      if (ctx->opts.verbose && rdr_log_allow(ctx->log, RDR_LOG_ERROR)) {
+	 fprintf(rdr_log_stream(ctx->log), "Time went backwards. %u => %u\n",
+	       (unsigned)session->netflow.first_packet_ts, (unsigned)tur->report_time);
+	 rdr_log_commit(ctx->log);
+      }
+      session->netflow.first_packet_ts = tur->report_time - duration;
+   }
+
+   session->netflow.last_packet_ts = tur->report_time;
+
+   assert(session->netflow.last_packet_ts >= session->netflow.first_packet_ts);
+
+   uptime = 1000*(session->netflow.last_packet_ts - session->netflow.first_packet_ts) + 1;
+
+   assert(uptime >= tur->millisec_duration);
+
+   /* Both flows of the client go to its collector  */
+   idx = ctx->session_dgrams == 1 ? 0 : rdr_collector_by_addr(ctx->collectors, tur->client_ip.s_addr);
+   d = &session->dgrams[idx];
+   dg = &d->dgram;
+
+   assert (d->records_count+1 < NETFLOW_V5_MAX_RECORDS);
+
+   /* Export upstream flow  */
+   dg->header.sys_uptime = htonl((uint32_t)uptime);
+   dg->header.unix_secs = htonl(tur->report_time);
+   dg->header.unix_nsecs = 0; /* XXX  */
+
+   d->arrival_us[d->records_count] = session->rcvd_us;
+   d->report_time[d->records_count] = tur->report_time;
+   rc = &dg->r[d->records_count++];
+   dg->header.count = htons((uint16_t)d->records_count);
+   /* If initiating_side 0 - Subscriber side; 1 - Network side. Change direction */
+   if (tur->initiating_side == 0) {
+      rc->src_addr = tur->client_ip.s_addr;
+      rc->dst_addr = tur->server_ip.s_addr;
+      rc->s_port = htons(tur->client_port);
+      rc->d_port = htons(tur->server_port);
+   }
+   else {
+      rc->dst_addr = tur->client_ip.s_addr;
+      rc->src_addr = tur->server_ip.s_addr;
+      rc->d_port = htons(tur->client_port);
+      rc->s_port = htons(tur->server_port);
+   }   
    rc->next_hop = 0;
    rc->i_ifx = 0;
    rc->o_ifx = 0;
    rc->packets = 0; /* XXX: ???  */
-   rc->octets = htonl(pkt.rdr.transaction_usage.session_upstream_volume);
-   rc->first =  htonl((uint32_t)(uptime - pkt.rdr.transaction_usage.millisec_duration));
+   rc->octets = htonl(tur->upstream_volume);
+   rc->first =  htonl((uint32_t)(uptime - tur->millisec_duration));
    rc->last = htonl((uint32_t)uptime);
    rc->pad1 = 0;
    rc->flags = 0; //* XXX  */
-   rc->prot = pkt.rdr.transaction_usage.ip_protocol;
+   rc->prot = tur->ip_protocol;
    rc->tos = 0; /* XXX  */
    rc->src_as = 0;
    rc->dst_as = 0;
@@ -509,32 +1352,33 @@ static int handle_rdr_packet(struct ctx_t *ctx, struct rdr_session_ctx_t *sessio
    rc->pad2 = 0;
 
    /* Export downstream flow  */
-   dg->header.flow_seq = htonl(++session->netflow.flow_seq);
-   rc = &dg->r[session->netflow.records_count++];
-   dg->header.count = htons((uint16_t)session->netflow.records_count);
+   d->arrival_us[d->records_count] = session->rcvd_us;
+   d->report_time[d->records_count] = tur->report_time;
+   rc = &dg->r[d->records_count++];
+   dg->header.count = htons((uint16_t)d->records_count);
    /* If initiating_side 0 - Subscriber side; 1 - Network side. Change direction */
-   if (pkt.rdr.transaction_usage.initiating_side == 0) {
-      rc->src_addr = pkt.rdr.transaction_usage.server_ip.s_addr;
-      rc->dst_addr = pkt.rdr.transaction_usage.client_ip.s_addr;
-      rc->s_port = htons(pkt.rdr.transaction_usage.server_port);
-      rc->d_port = htons(pkt.rdr.transaction_usage.client_port);
+   if (tur->initiating_side == 0) {
+      rc->src_addr = tur->server_ip.s_addr;
+      rc->dst_addr = tur->client_ip.s_addr;
+      rc->s_port = htons(tur->server_port);
+      rc->d_port = htons(tur->client_port);
    }
    else {
-      rc->dst_addr = pkt.rdr.transaction_usage.server_ip.s_addr;
-      rc->src_addr = pkt.rdr.transaction_usage.client_ip.s_addr;
-      rc->d_port = htons(pkt.rdr.transaction_usage.server_port);
-      rc->s_port = htons(pkt.rdr.transaction_usage.client_port);
+      rc->dst_addr = tur->server_ip.s_addr;
+      rc->src_addr = tur->client_ip.s_addr;
+      rc->d_port = htons(tur->server_port);
+      rc->s_port = htons(tur->client_port);
    }
    rc->next_hop = 0;
    rc->i_ifx = 0;
    rc->o_ifx = 0;
    rc->packets = 0;
-   rc->octets = htonl(pkt.rdr.transaction_usage.session_downstream_volume);
-   rc->first =  htonl((uint32_t)(uptime - pkt.rdr.transaction_usage.millisec_duration));
+   rc->octets = htonl(tur->downstream_volume);
+   rc->first =  htonl((uint32_t)(uptime - tur->millisec_duration));
    rc->last = htonl((uint32_t)uptime);
    rc->pad1 = 0;
    rc->flags = 0;
-   rc->prot = pkt.rdr.transaction_usage.ip_protocol;
+   rc->prot = tur->ip_protocol;
    rc->tos = 0;
    rc->src_as = 0;
    rc->dst_as = 0;
@@ -542,164 +1386,1032 @@ static int handle_rdr_packet(struct ctx_t *ctx, struct rdr_session_ctx_t *sessio
    rc->dst_mask = 32;
    rc->pad2 = 0;
 
-   if (session->netflow.records_count == NETFLOW_V5_MAX_RECORDS)
-      flush_netflow_dgram(ctx, session);
+   RDR_PROBE4(export, tur->client_ip.s_addr, tur->server_ip.s_addr,
+	 tur->upstream_volume, tur->downstream_volume);
+
+   if (d->records_count == NETFLOW_V5_MAX_RECORDS)
+      flush_session_dgram(ctx, session, idx);
 
    return 0;
 }
 
-static int convert_rcvd_data(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
-{
-   size_t p;
-   ssize_t truncated1, truncated2;
+static void shmring_tur(struct ctx_t *ctx, const struct rdr_session_ctx_t *session,
+      const struct rdr_frame_t *tur)
+{
+   struct shmring_tur_t rec;
+
+   rec.sce_addr = session->remote_addr.sin_addr.s_addr;
+   rec.sce_port = ntohs(session->remote_addr.sin_port);
+   rec.ip_protocol = tur->ip_protocol;
+   rec.initiating_side = tur->initiating_side;
+   rec.client_ip = tur->client_ip.s_addr;
+   rec.server_ip = tur->server_ip.s_addr;
+   rec.client_port = tur->client_port;
+   rec.server_port = tur->server_port;
+   rec.millisec_duration = tur->millisec_duration;
+   rec.report_time = tur->report_time;
+   rec.upstream_volume = tur->upstream_volume;
+   rec.downstream_volume = tur->downstream_volume;
+   rec.rcvd_us = session->rcvd_us;
+   memset(rec.pad, 0, sizeof(rec.pad));
+
+   rdr_shmring_append(ctx->shmring, &rec);
+}
+
+static void aggr_tur(struct ctx_t *ctx, const struct rdr_session_ctx_t *session,
+      const struct rdr_frame_t *tur)
+{
+   struct rdr_aggr_tur_t t;
+
+   t.subscriber_id = ctx->opts.frame_subscriber ? tur->subscriber_id : NULL;
+   t.service_id = tur->service_id;
+   t.protocol_id = tur->protocol_id;
+   t.package_id = tur->package_id;
+   t.client_ip = tur->client_ip.s_addr;
+   t.report_time = tur->report_time;
+   t.millisec_duration = tur->millisec_duration;
+   t.upstream_volume = tur->upstream_volume;
+   t.downstream_volume = tur->downstream_volume;
+   t.arrival_us = session->rcvd_us;
+
+   rdr_aggr_add(ctx->aggr, &t);
+}
+
+static void topk_tur(struct ctx_t *ctx, const struct rdr_frame_t *tur)
+{
+   struct rdr_topk_tur_t t;
+
+   t.subscriber_id = tur->subscriber_id;
+   t.server_ip = tur->server_ip.s_addr;
+   t.service_id = tur->service_id;
+   t.octets = (unsigned long long)tur->upstream_volume + tur->downstream_volume;
+
+   rdr_topk_add(ctx->topk, &t);
+}
+
+static void distinct_tur(struct ctx_t *ctx, const struct rdr_session_ctx_t *session,
+      const struct rdr_frame_t *tur)
+{
+   struct rdr_distinct_tur_t t;
+
+   t.subscriber_id = tur->subscriber_id;
+   t.service_id = tur->service_id;
+   t.package_id = tur->package_id;
+   t.client_ip = tur->client_ip.s_addr;
+   t.server_ip = tur->server_ip.s_addr;
+   t.report_time = tur->report_time;
+   t.arrival_us = session->rcvd_us;
+
+   rdr_distinct_add(ctx->distinct, &t);
+}
+
+/* Decoded frame: session counters and export  */
+static int account_rdr_frame(struct ctx_t *ctx, struct rdr_session_ctx_t *session,
+      const struct rdr_frame_t *frame)
+{
+   int res;
+   unsigned prof;
+
+   session->stats.frames += 1;
+
+   /* Not intersted in  */
+   if (frame->tag != TRANSACTION_USAGE_RDR)
+      return 0;
+
+   session->stats.turs += 1;
+
+   if (frame->filtered) {
+      session->stats.turs_filtered += 1;
+      return 0;
+   }
+
+   if (session->shed_level != 0
+	 && rdr_shed_tur(ctx->shed, session->shed_level, frame->generation_reason,
+	    (unsigned long long)frame->upstream_volume + frame->downstream_volume))
+      return 0;
+
+   if (ctx->opts.topk) {
+      prof = prof_enter(ctx, PROF_TOPK);
+      topk_tur(ctx, frame);
+      prof_leave(ctx, prof);
+   }
+
+   res = 0;
+
+   if (ctx->opts.distinct) {
+      prof = prof_enter(ctx, PROF_DISTINCT);
+      distinct_tur(ctx, session, frame);
+      prof_leave(ctx, prof);
+   }
+
+   if (ctx->opts.aggr) {
+      /* Rollups replace the per-TUR export  */
+      prof = prof_enter(ctx, PROF_AGGR);
+      aggr_tur(ctx, session, frame);
+      prof_leave(ctx, prof);
+   }
+
+   prof = prof_enter(ctx, PROF_ENCODE);
+   if (ctx->opts.shmring)
+      shmring_tur(ctx, session, frame);
+   if (!ctx->opts.aggr && (!ctx->opts.sampling || sample_tur(ctx, frame)))
+      res = export_tur(ctx, session, frame);
+   prof_leave(ctx, prof);
+
+   return res;
+}
+
+static int handle_rdr_packet(struct ctx_t *ctx, struct rdr_session_ctx_t *session,
+      uint8_t *raw_pkt, size_t raw_pkt_size)
+{
+   int err;
+   unsigned prof;
+   FILE *log;
+   struct rdr_packet_t pkt;
+   struct rdr_frame_t frame;
+
+   if (session->shed_level != 0
+	 && rdr_shed_frame(ctx->shed, session->shed_level, rdr_packet_tag(raw_pkt, raw_pkt_size))) {
+      session->stats.frames += 1;
+      return 0;
+   }
+
+   prof = prof_enter(ctx, PROF_DECODE);
+   err = decode_rdr_packet(raw_pkt, raw_pkt_size, &pkt);
+   prof_leave(ctx, prof);
+   if (err < 0) {
+      session->stats.decode_errors[-err < DECODE_ERRORS_MAX ? -err : 0] += 1;
+      if (ctx->opts.verbose && rdr_log_allow(ctx->log, RDR_LOG_ERROR)) {
+	 log = rdr_log_stream(ctx->log);
+	 fprintf(log, "decode_rdr_packet() error %i\n", err);
+	 if (ctx->opts.verbose >= 50)
+	    dump_raw_rdr_packet(log, 1, raw_pkt, raw_pkt_size);
+	 rdr_log_commit(ctx->log);
+      }
+      return err;
+   }
+
+   describe_rdr_frame(ctx, &pkt, &frame);
+
+   if (ctx->opts.verbose >= 10
+	 && rdr_log_selected(ctx->log, pkt.header.tag, &session->remote_addr)
+	 && rdr_log_allow(ctx->log, RDR_LOG_DEBUG)) {
+      log = rdr_log_stream(ctx->log);
+      dump_rdr_packet(log, &pkt);
+      if (ctx->opts.verbose >= 50)
+	 dump_raw_rdr_packet(log, 0, raw_pkt, raw_pkt_size);
+      if (pkt.header.tag == TRANSACTION_USAGE_RDR) {
+	 if (frame.filtered & 0x01) {
+	    fputs("Client IP Filtered ", log);
+	 }
+	 if (frame.filtered & 0x02) {
+	    fputs("Server IP Filtered ", log);
+	 }
+      }
+      fputc('\n', log);
+      rdr_log_commit(ctx->log);
+   }
+
+   return account_rdr_frame(ctx, session, &frame);
+}
+
+struct convert_frame_arg_t {
+   struct ctx_t *ctx;
+   struct rdr_session_ctx_t *session;
+};
+
+static int convert_rdr_frame(void *arg, uint8_t *pkt, size_t pkt_size)
+{
+   struct convert_frame_arg_t *a;
+
+   a = (struct convert_frame_arg_t *)arg;
+   RDR_PROBE3(frame, a->session->remote_addr.sin_addr.s_addr,
+	 ntohs(a->session->remote_addr.sin_port), pkt_size);
+
+   return handle_rdr_packet(a->ctx, a->session, pkt, pkt_size);
+}
+
+static int convert_rcvd_data(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
+{
+   size_t consumed;
+   unsigned prof;
+   struct convert_frame_arg_t frame_arg;
+
+   if (session->pos == 0)
+      return 0;
+
+   prof = prof_enter(ctx, PROF_FRAMING);
+
+   if (ctx->opts.verbose >= 20
+	 && rdr_log_selected(ctx->log, RDR_LOG_ANY_TAG, &session->remote_addr)
+	 && rdr_log_allow(ctx->log, RDR_LOG_DEBUG)) {
+      char msg[64 + RDR_LOG_ADDR_STRLEN], *m;
+      memcpy(msg, "rcvd ", 5);
+      m = rdr_log_fmt_uint(msg + 5, session->pos);
+      memcpy(m, " bytes from ", 12);
+      m = rdr_log_fmt_addr(m + 12, &session->remote_addr);
+      *m++ = '\n';
+      fwrite(msg, m - msg, 1, rdr_log_stream(ctx->log));
+      rdr_log_commit(ctx->log);
+   }
+
+   frame_arg.ctx = ctx;
+   frame_arg.session = session;
+   consumed = rdr_frame_stream(session->buf, session->pos, convert_rdr_frame, &frame_arg,
+	 &session->stats.garbage_bytes);
+
+   /* Buffer holds the largest packet  */
+   assert(consumed != 0 || (session->pos < sizeof(session->buf)));
+
+   if (consumed == session->pos) {
+      session->pos = 0;
+   }else if (consumed != 0) {
+      if (ctx->opts.verbose >= 20
+	    && rdr_log_selected(ctx->log, RDR_LOG_ANY_TAG, &session->remote_addr)
+	    && rdr_log_allow(ctx->log, RDR_LOG_DEBUG)) {
+	 fputs("Received truncated message\n", rdr_log_stream(ctx->log));
+	 rdr_log_commit(ctx->log);
+      }
+      memmove(session->buf, &session->buf[consumed], session->pos - consumed);
+      session->pos -= consumed;
+   }
+
+   prof_leave(ctx, prof);
+
+   return 0;
+}
+
+/* Overload: shedding level of the session by the data waiting in its receive buffer  */
+static void update_shed_level(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
+{
+   int queued;
+   unsigned level;
+   socklen_t optlen;
+   char buf[64 + RDR_LOG_ADDR_STRLEN];
+
+   if (session->rcvbuf <= 0) {
+      optlen = sizeof(session->rcvbuf);
+      if (getsockopt(session->s, SOL_SOCKET, SO_RCVBUF, &session->rcvbuf, &optlen) < 0
+	    || (session->rcvbuf <= 0))
+	 return;
+#ifdef __linux__
+      /* Linux reports the doubled size, half of it is bookkeeping overhead  */
+      session->rcvbuf /= 2;
+#endif
+   }
+
+   if (ioctl(session->s, FIONREAD, &queued) < 0)
+      return;
+
+   level = rdr_shed_level(ctx->shed, session->shed_level, (double)queued / session->rcvbuf);
+   if (level == session->shed_level)
+      return;
+
+   snprintf(buf, sizeof(buf), "Overload: shedding %s, backlog %i bytes, ",
+	 rdr_shed_level_name(ctx->shed, level), queued);
+   log_session_msg(ctx, RDR_LOG_CONN, buf, &session->remote_addr);
+   session->shed_level = level;
+}
+
+static int read_data(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
+{
+   int rcvd_total;
+   unsigned prof;
+   ssize_t rcvd;
+
+   assert(ctx);
+   assert(session);
+   assert(session->pos < sizeof(session->buf));
+
+   if (ctx->opts.shed)
+      update_shed_level(ctx, session);
+
+   rcvd_total = 0;
+   for (;;) {
+      prof = prof_enter(ctx, PROF_READ);
+      rcvd = read(session->s,
+	    &session->buf[session->pos],
+	    sizeof(session->buf) - session->pos
+	    );
+      prof_leave(ctx, prof);
+      if (rcvd == 0) {
+	 /* EOF  */
+	 return -1;
+      }
+
+      if (rcvd < 0) {
+	 switch (errno) {
+	    case EAGAIN:
+	    case EINTR:
+	       break;
+	    default:
+	       if (ctx->opts.verbose && rdr_log_allow(ctx->log, RDR_LOG_ERROR)) {
+		  fprintf(rdr_log_stream(ctx->log), "read() error: %s\n", strerror(errno));
+		  rdr_log_commit(ctx->log);
+	       }
+	       return -1;
+	       break;
+	 }
+	 break;
+      }
+
+      prof = prof_enter(ctx, PROF_REPEATER);
+      rdr_repeater_append(ctx->rdr_repeater, &session->buf[session->pos], rcvd);
+      prof_leave(ctx, prof);
+      prof = prof_enter(ctx, PROF_RECORDER);
+      rdr_recorder_append(ctx->rdr_recorder, RDR_SEGMENT_REC_DATA, &session->remote_addr,
+	    &session->buf[session->pos], rcvd);
+      prof_leave(ctx, prof);
+
+      session->stats.bytes_rcvd += rcvd;
+      session->rcvd_us = stats_monotonic_us();
+      session->pos += rcvd;
+      rcvd_total += rcvd;
+
+      convert_rcvd_data(ctx, session);
+
+      if (ctx->opts.backpressure_high != 0 && update_backpressure(ctx))
+	 break;
+   }
+
+   return rcvd_total;
+}
+
+static void *offline_open_stream(void *arg, const struct sockaddr_in *src,
+      const struct sockaddr_in *dst)
+{
+   struct ctx_t *ctx;
+   struct rdr_session_ctx_t *session;
+
+   ctx = (struct ctx_t *)arg;
+
+   session = alloc_session(ctx);
+   if (session == NULL)
+      return NULL;
+
+   init_session(ctx, session, -1, src);
+   link_session(ctx, session);
+
+   if (ctx->opts.verbose > 1)
+      fprintf(stderr, "Stream %s:%u -> %s:%u\n",
+	    inet_ntoa(src->sin_addr), (unsigned)ntohs(src->sin_port),
+	    inet_ntoa(dst->sin_addr), (unsigned)ntohs(dst->sin_port));
+
+   return session;
+}
+
+static void offline_stream_data(void *arg, void *stream, const uint8_t *data, size_t size)
+{
+   size_t chunk;
+   struct ctx_t *ctx;
+   struct rdr_session_ctx_t *session;
+
+   ctx = (struct ctx_t *)arg;
+   session = (struct rdr_session_ctx_t *)stream;
+
+   if (session == NULL)
+      return;
+
+   while (size > 0 && !quit) {
+      chunk = sizeof(session->buf) - session->pos;
+      if (chunk > size)
+	 chunk = size;
+      memcpy(&session->buf[session->pos], data, chunk);
+      session->stats.bytes_rcvd += chunk;
+      session->rcvd_us = stats_monotonic_us();
+      session->pos += chunk;
+      data += chunk;
+      size -= chunk;
+
+      convert_rcvd_data(ctx, session);
+   }
+}
+
+static void offline_close_stream(void *arg, void *stream)
+{
+   struct ctx_t *ctx;
+   struct rdr_session_ctx_t *session;
+
+   ctx = (struct ctx_t *)arg;
+   session = (struct rdr_session_ctx_t *)stream;
+
+   if (session == NULL)
+      return;
+
+   flush_netflow_dgram(ctx, session);
+   remove_session(ctx, session);
+}
+
+static int offline_chunk_add(struct offline_chunk_t *chunk, size_t offset, int err)
+{
+   struct offline_frame_t *f;
+
+   if (chunk->frames_cnt == chunk->frames_size) {
+      unsigned new_size;
+      new_size = chunk->frames_size ? 2 * chunk->frames_size : 4096;
+      f = realloc(chunk->frames, new_size * sizeof(*f));
+      if (f == NULL)
+	 return -1;
+      chunk->frames = f;
+      chunk->frames_size = new_size;
+   }
+
+   f = &chunk->frames[chunk->frames_cnt++];
+   f->offset = offset;
+   f->err = err;
+
+   return 0;
+}
+
+/*
+ * Decode the RDR frames starting in the chunk, from a header to the end of
+ * the decoded frame. The chunk starts at an arbitrary offset, so the frames
+ * are only a hint: which headers are frames is decided by the main thread
+ */
+static int parse_frames(struct ctx_t *ctx, const uint8_t *data, size_t size,
+      struct offline_chunk_t *chunk)
+{
+   int err;
+   int msg_size;
+   size_t p;
+   struct rdr_packet_t pkt;
+
+   chunk->frames_cnt = 0;
+   for (p=chunk->start; p < chunk->stop; ++p) {
+      msg_size = is_rdr_packet((void *)&data[p], size - p);
+      if (msg_size <= 0)
+	 continue;
+
+      err = decode_rdr_packet((void *)&data[p], msg_size, &pkt);
+      if (offline_chunk_add(chunk, p, err < 0 ? err : 0) < 0)
+	 return -1;
+      if (err >= 0) {
+	 describe_rdr_frame(ctx, &pkt, &chunk->frames[chunk->frames_cnt-1].frame);
+	 p += msg_size - 1;
+      }
+   }
+
+   return 0;
+}
+
+static void *offline_worker(void *arg)
+{
+   unsigned i;
+   int res;
+   struct offline_job_t *job;
+   struct offline_chunk_t *chunk;
+
+   job = (struct offline_job_t *)arg;
+
+   pthread_mutex_lock(&job->mtx);
+   for (;;) {
+      while (job->next_chunk < job->chunks_cnt
+	    && (job->next_chunk >= job->merged + job->window)
+	    && !job->error)
+	 pthread_cond_wait(&job->slot_free, &job->mtx);
+
+      if (job->next_chunk >= job->chunks_cnt || job->error)
+	 break;
+
+      i = job->next_chunk++;
+      chunk = &job->slots[i % job->window];
+      pthread_mutex_unlock(&job->mtx);
+
+      chunk->start = (size_t)i * OFFLINE_CHUNK_SIZE;
+      chunk->stop = chunk->start + OFFLINE_CHUNK_SIZE < job->size
+	 ? chunk->start + OFFLINE_CHUNK_SIZE : job->size;
+      res = parse_frames(job->ctx, job->data, job->size, chunk);
+
+      pthread_mutex_lock(&job->mtx);
+      if (res < 0)
+	 job->error = 1;
+      chunk->done = 1;
+      pthread_cond_broadcast(&job->chunk_done);
+   }
+   pthread_mutex_unlock(&job->mtx);
+
+   return NULL;
+}
+
+static struct offline_chunk_t *offline_wait_chunk(struct offline_job_t *job, unsigned i)
+{
+   struct offline_chunk_t *chunk;
+
+   chunk = &job->slots[i % job->window];
+   pthread_mutex_lock(&job->mtx);
+   while (!chunk->done && !job->error)
+      pthread_cond_wait(&job->chunk_done, &job->mtx);
+   pthread_mutex_unlock(&job->mtx);
+
+   return job->error ? NULL : chunk;
+}
+
+struct offline_frame_arg_t {
+   struct ctx_t *ctx;
+   struct rdr_session_ctx_t *session;
+   const uint8_t *data;
+   /* Current chunk and the next one, a frame may start in both  */
+   const struct offline_chunk_t *chunks[2];
+};
+
+static const struct offline_frame_t *offline_find_frame(const struct offline_chunk_t *chunk,
+      size_t offset)
+{
+   unsigned lo, hi, mid;
+
+   lo = 0;
+   hi = chunk->frames_cnt;
+   while (lo < hi) {
+      mid = lo + (hi - lo) / 2;
+      if (chunk->frames[mid].offset < offset)
+	 lo = mid + 1;
+      else
+	 hi = mid;
+   }
+
+   return lo < chunk->frames_cnt && (chunk->frames[lo].offset == offset) ? &chunk->frames[lo] : NULL;
+}
+
+/* rdr_frame_stream() callback: the frame is decoded by a thread or here if skipped by it  */
+static int offline_frame(void *arg, uint8_t *pkt, size_t pkt_size)
+{
+   size_t offset;
+   const struct offline_frame_t *f;
+   struct offline_frame_arg_t *a;
+
+   a = (struct offline_frame_arg_t *)arg;
+   offset = pkt - a->data;
+
+   f = offline_find_frame(a->chunks[a->chunks[1] != NULL && (offset >= a->chunks[1]->start)], offset);
+   if (f == NULL)
+      return handle_rdr_packet(a->ctx, a->session, pkt, pkt_size);
+
+   if (f->err < 0) {
+      a->session->stats.decode_errors[-f->err < DECODE_ERRORS_MAX ? -f->err : 0] += 1;
+      if (a->ctx->opts.verbose && rdr_log_allow(a->ctx->log, RDR_LOG_ERROR)) {
+	 fprintf(rdr_log_stream(a->ctx->log), "decode_rdr_packet() error %i\n", f->err);
+	 rdr_log_commit(a->ctx->log);
+      }
+      return f->err;
+   }
+
+   return account_rdr_frame(a->ctx, a->session, &f->frame);
+}
+
+/*
+ * The file is split into OFFLINE_CHUNK_SIZE chunks decoded by the threads.
+ * Main thread frames the file in chunk order
+ * with the same rdr_frame_stream() calls over the same session buffer
+ * sized windows as offline_stream_data(), so the frames, netflow output
+ * and flow_seq are the same as in single-threaded mode
+ */
+static int convert_parallel(struct ctx_t *ctx, struct capfile_ctx_t *capfile)
+{
+   unsigned i, threads_cnt;
+   int res;
+   size_t pos, end, consumed;
+   struct sockaddr_in none;
+   struct offline_job_t job;
+   struct offline_frame_arg_t frame_arg;
+   struct rdr_session_ctx_t *session;
+   pthread_t threads[OFFLINE_MAX_THREADS];
+
+   memset(&none, 0, sizeof(none));
+   none.sin_family = AF_INET;
+   session = offline_open_stream(ctx, &none, &none);
+   if (session == NULL)
+      return -1;
+
+   memset(&job, 0, sizeof(job));
+   job.ctx = ctx;
+   job.data = capfile_data(capfile);
+   job.size = capfile_size(capfile);
+   job.chunks_cnt = (job.size + OFFLINE_CHUNK_SIZE - 1) / OFFLINE_CHUNK_SIZE;
+   /* Main thread holds two chunks  */
+   job.window = 2 * ctx->opts.threads;
+   job.slots = calloc(job.window, sizeof(job.slots[0]));
+   if (job.slots == NULL) {
+      perror("calloc() error");
+      offline_close_stream(ctx, session);
+      return -1;
+   }
+   pthread_mutex_init(&job.mtx, NULL);
+   pthread_cond_init(&job.chunk_done, NULL);
+   pthread_cond_init(&job.slot_free, NULL);
+
+   for (threads_cnt=0; threads_cnt < ctx->opts.threads; ++threads_cnt) {
+      if (pthread_create(&threads[threads_cnt], NULL, offline_worker, &job) != 0) {
+	 perror("pthread_create() error");
+	 break;
+      }
+   }
+
+   frame_arg.ctx = ctx;
+   frame_arg.session = session;
+   frame_arg.data = job.data;
+
+   res = threads_cnt == 0 ? -1 : 0;
+   /* Start of the session buffer window  */
+   pos = 0;
+   for (i=0; i < job.chunks_cnt && (threads_cnt > 0); ++i) {
+      frame_arg.chunks[0] = offline_wait_chunk(&job, i);
+      frame_arg.chunks[1] = i + 1 < job.chunks_cnt ? offline_wait_chunk(&job, i + 1) : NULL;
+      if (frame_arg.chunks[0] == NULL || (i + 1 < job.chunks_cnt && frame_arg.chunks[1] == NULL)
+	    || quit) {
+	 res = -1;
+	 break;
+      }
+
+      session->rcvd_us = stats_monotonic_us();
+      while (pos < frame_arg.chunks[0]->stop) {
+	 end = pos + sizeof(session->buf) < job.size ? pos + sizeof(session->buf) : job.size;
+	 consumed = rdr_frame_stream((uint8_t *)&job.data[pos], end - pos, offline_frame, &frame_arg,
+	       &session->stats.garbage_bytes);
+	 /* Truncated tail at the end of file is left in the buffer  */
+	 pos = end == job.size ? job.size : pos + consumed;
+      }
+
+      pthread_mutex_lock(&job.mtx);
+      job.slots[i % job.window].done = 0;
+      job.merged = i + 1;
+      pthread_cond_broadcast(&job.slot_free);
+      pthread_mutex_unlock(&job.mtx);
+   }
+
+   pthread_mutex_lock(&job.mtx);
+   if (res < 0)
+      job.error = 1;
+   pthread_cond_broadcast(&job.slot_free);
+   pthread_mutex_unlock(&job.mtx);
+   for (i=0; i < threads_cnt; ++i)
+      pthread_join(threads[i], NULL);
+
+   if (res < 0 && ctx->opts.verbose)
+      fprintf(stderr, "Parallel conversion aborted\n");
+
+   session->stats.bytes_rcvd += job.size;
+   offline_close_stream(ctx, session);
+
+   for (i=0; i < job.window; ++i)
+      free(job.slots[i].frames);
+   free(job.slots);
+   pthread_cond_destroy(&job.slot_free);
+   pthread_cond_destroy(&job.chunk_done);
+   pthread_mutex_destroy(&job.mtx);
+
+   return res;
+}
+
+static int convert_capture_file(struct ctx_t *ctx)
+{
+   int res;
+   double elapsed;
+   unsigned long long start_us;
+   unsigned long long dgrams, records;
+   struct capfile_ctx_t *capfile;
+   const struct capfile_stats_t *cst;
+
+   capfile = capfile_open(ctx->opts.read_fname, stderr);
+   if (capfile == NULL)
+      return -1;
+
+   if (ctx->opts.verbose)
+      fprintf(stderr, "Reading %s %s, %lu bytes\n",
+	    capfile_is_pcap(capfile) ? "pcap" : capfile_is_segment(capfile) ? "segment" : "RDR stream",
+	    ctx->opts.read_fname, (unsigned long)capfile_size(capfile));
+
+   start_us = stats_monotonic_us();
+   if (ctx->opts.threads > 1 && !capfile_is_pcap(capfile) && !capfile_is_segment(capfile)
+	 && (ctx->opts.verbose < 10)) {
+      if (ctx->opts.profile)
+	 fprintf(stderr, "Cycle accounting is not supported with -j, ignored\n");
+      res = convert_parallel(ctx, capfile);
+   }else {
+      if (ctx->opts.profile)
+	 prof_start(ctx);
+      if (ctx->opts.threads > 1 && ctx->opts.verbose)
+	 fprintf(stderr, "Multithreaded conversion is supported only for raw RDR stream and -V < 10\n");
+      res = capfile_read(capfile, offline_open_stream, offline_stream_data,
+	    offline_close_stream, ctx);
+   }
+   while (ctx->rdr_sessions != NULL) {
+      flush_netflow_dgram(ctx, ctx->rdr_sessions);
+      remove_session(ctx, ctx->rdr_sessions);
+   }
+   if (ctx->out_file != NULL && (fflush(ctx->out_file) != 0)) {
+      perror("fflush() error");
+      res = -1;
+   }
+   /* The summary counts what the export queues actually sent  */
+   if (ctx->out_file == NULL)
+      count_send_errors(ctx, rdr_collector_drain(ctx->collectors));
+   elapsed = (stats_monotonic_us() - start_us) / 1e6;
+
+   if (ctx->opts.verbose) {
+      export_sent(ctx, &dgrams, &records);
+      cst = capfile_stats(capfile);
+      if (capfile_is_pcap(capfile))
+	 fprintf(stderr, "pcap: %llu packets, %llu skipped, %llu TCP streams, "
+	       "%llu retransmitted bytes, %llu out of order segments, %llu bytes lost in gaps\n",
+	       cst->packets, cst->skipped_packets, cst->streams,
+	       cst->retransmitted_bytes, cst->ooo_segments, cst->gap_bytes);
+      fprintf(stderr, "%llu bytes, %llu RDRs, %llu TURs, %llu garbage bytes => "
+	    "%llu datagrams, %llu records in %.3f s (%.1f MB/s, %.0f RDR/s)\n",
+	    ctx->closed_sessions_stats.bytes_rcvd,
+	    ctx->closed_sessions_stats.frames,
+	    ctx->closed_sessions_stats.turs,
+	    ctx->closed_sessions_stats.garbage_bytes,
+	    dgrams,
+	    records,
+	    elapsed,
+	    elapsed > 0 ? ctx->closed_sessions_stats.bytes_rcvd / elapsed / 1e6 : 0.0,
+	    elapsed > 0 ? ctx->closed_sessions_stats.frames / elapsed : 0.0);
+   }
+
+   if (ctx->prof.enabled)
+      print_profile(ctx, stderr, 0);
+   if (ctx->opts.topk)
+      rdr_topk_report(ctx->topk, stderr, stats_monotonic_us());
+
+   capfile_close(capfile);
+
+   return res;
+}
+
+static void add_session_stats(struct rdr_session_stats_t *dst, const struct rdr_session_stats_t *src)
+{
+   unsigned i;
+
+   dst->bytes_rcvd += src->bytes_rcvd;
+   dst->frames += src->frames;
+   dst->garbage_bytes += src->garbage_bytes;
+   dst->turs += src->turs;
+   dst->turs_filtered += src->turs_filtered;
+   for (i=0; i < DECODE_ERRORS_MAX; ++i)
+      dst->decode_errors[i] += src->decode_errors[i];
+}
+
+static struct rdr_session_ctx_t *remove_session(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
+{
+   struct rdr_session_ctx_t *res;
+
+   assert(session);
+   assert(session->pprev);
+
+   res = session->next;
+   *session->pprev = res;
+   if (res != NULL)
+      res->pprev = session->pprev;
+
+   /* Offline streams have no socket  */
+   if (session->s >= 0) {
+      ctx->sessions_by_fd[session->s] = NULL;
+      FD_CLR(session->s, &ctx->rdr_fdset);
+      if (ctx->rdr_maxfd == session->s) {
+	 int fd;
+	 /* Sessions may be below the listening socket after the upgrade  */
+	 for (fd = session->s - 1; fd >= 0 && (ctx->sessions_by_fd[fd] == NULL); --fd)
+	    ;
+	 ctx->rdr_maxfd = fd > ctx->rcv_s ? fd : ctx->rcv_s;
+      }
+      close(session->s);
+      if (!ctx->handed_over)
+	 rdr_recorder_append(ctx->rdr_recorder, RDR_SEGMENT_REC_CLOSE, &session->remote_addr, NULL, 0);
+   }
+
+   add_session_stats(&ctx->closed_sessions_stats, &session->stats);
+
+   if (ctx->opts.verbose && !ctx->handed_over)
+      log_session_msg(ctx, RDR_LOG_CONN, "Closed connection ", &session->remote_addr);
+
+   free_session(ctx, session);
+
+   return res;
+}
+
+/* Old process side of the binary upgrade  */
+static int handoff_sessions(struct ctx_t *ctx)
+{
+   int hs;
+   int fd;
+   unsigned i;
+   pid_t pid;
+   unsigned sent;
+   ssize_t rcvd;
+   unsigned long long dgrams, records;
+   struct handoff_hdr_t hdr;
+   struct handoff_session_t *msg;
+   struct rdr_session_ctx_t *session;
+
+   assert(ctx->argv);
 
-   if (session->pos == 0)
-      return 0;
+   /* Export everything decoded so far, the new process continues flow_seq  */
+   flush_all_netflow_sessions(ctx);
+   if (ctx->out_file == NULL)
+      count_send_errors(ctx, rdr_collector_drain(ctx->collectors));
 
-   if (ctx->opts.verbose >= 20)
-      fprintf(stderr, "rcvd %i bytes from %s:%i\n",
-	    (int)session->pos,
-	    inet_ntoa(session->remote_addr.sin_addr),
-	    (int)session->remote_addr.sin_port
-	    );
+   msg = malloc(sizeof(*msg) + MAX_RDR_PACKET_SIZE);
+   if (msg == NULL) {
+      perror("malloc() error");
+      return -1;
+   }
 
-   p=0;
-   truncated1 = truncated2 = -1;
-
-   /* Version?  */
-   while(p < session->pos) {
-      int msg_size;
-
-      msg_size = is_rdr_packet(&session->buf[p], session->pos - p);
-      if (msg_size > 0) {
-	 /* RDR packet  */
-	 if (handle_rdr_packet(ctx, session, &session->buf[p], msg_size) < 0) {
-	    /* Invalid RDR packet  */
-	    p += 1;
-	 }else {
-	    p += msg_size;
-	    truncated1 = truncated2 = -1;
-	 }
-      }else if (msg_size < 0) {
-	 /* Trucated RDR packet  */
-	 if (truncated1 < 0)
-	    truncated1 = p;
-	 else if (truncated2 < 0)
-	    truncated2 = p;
-	 p += 1;
-      }else {
-	 /* Not RDR  */
-	 p += 1;
-      }
-   } /* while  */
+   hs = handoff_exec(ctx->argv, &pid);
+   if (hs < 0) {
+      free(msg);
+      return -1;
+   }
 
-   assert(p <= sizeof(session->buf));
+   /* Metrics port is bound by the new process  */
+   stats_srv_close_connection(ctx->stats_srv);
+
+   memset(&hdr, 0, sizeof(hdr));
+   hdr.magic = HANDOFF_MAGIC;
+   hdr.version = HANDOFF_VERSION;
+   for (session = ctx->rdr_sessions; session != NULL; session = session->next)
+      hdr.sessions_cnt += 1;
+   hdr.flow_seq = ctx->flow_seq;
+   hdr.export_socket = ctx->opts.out_fname == NULL ? rdr_collector_count(ctx->collectors) : 0;
+   /* The new process starts with empty export queues  */
+   export_sent(ctx, &dgrams, &records);
+   hdr.export_dgrams = dgrams;
+   hdr.export_records = records;
+   hdr.export_send_errors = ctx->export_stats.send_errors;
+
+   if (handoff_send(hs, &hdr, sizeof(hdr), ctx->rcv_s) < 0)
+      goto failed;
+   for (i=0; i < hdr.export_socket; ++i) {
+      hdr.flow_seq = rdr_collector_flow_seq(ctx->collectors, i);
+      if (handoff_send(hs, &hdr, sizeof(hdr), rdr_collector_socket(ctx->collectors, i)) < 0)
+	 goto failed;
+   }
 
-   if ( (truncated1 == 0) && (p == sizeof(session->buf)))  {
-      /* Buffer full  */
-      truncated1 = truncated2;
-      if (truncated1 < 0)
-	 fprintf(stderr, "Skipped %u garbage bytes\n", (unsigned)sizeof(session->buf));
+   sent = 0;
+   for (session = ctx->rdr_sessions; session != NULL; session = session->next) {
+      memset(msg, 0, sizeof(*msg));
+      msg->magic = HANDOFF_MAGIC;
+      msg->remote_addr = session->remote_addr.sin_addr.s_addr;
+      msg->remote_port = session->remote_addr.sin_port;
+      msg->pos = session->pos;
+      msg->bytes_rcvd = session->stats.bytes_rcvd;
+      msg->frames = session->stats.frames;
+      msg->garbage_bytes = session->stats.garbage_bytes;
+      msg->turs = session->stats.turs;
+      msg->turs_filtered = session->stats.turs_filtered;
+      memcpy(msg->data, session->buf, session->pos);
+      if (handoff_send(hs, msg, sizeof(*msg) + session->pos, session->s) < 0)
+	 goto failed;
+      sent += 1;
    }
 
-   if (truncated1 < 0) {
-      session->pos = 0;
-   }else if (truncated1 != 0) {
-      if (ctx->opts.verbose >= 20)
-	 fprintf(stderr, "Received truncated message\n");
-      assert(truncated1 < (ssize_t)session->pos);
-      memmove(session->buf, &session->buf[truncated1], session->pos - truncated1);
-      session->pos -= truncated1;
+   /* The new process is serving once it acks, we must not read any more  */
+   rcvd = handoff_recv(hs, &hdr, sizeof(hdr), &fd, HANDOFF_TIMEOUT_MS);
+   if (fd >= 0)
+      close(fd);
+   if (rcvd != sizeof(hdr) || (hdr.magic != HANDOFF_ACK_MAGIC)) {
+      fprintf(stderr, "Upgrade: no ack from the new process\n");
+      goto failed;
    }
 
+   if (ctx->opts.verbose)
+      fprintf(stderr, "Upgrade: %u sessions passed to pid %i\n", sent, (int)pid);
+
+   close(hs);
+   free(msg);
+   ctx->handed_over = 1;
    return 0;
+
+failed:
+   close(hs);
+   free(msg);
+   kill(pid, SIGKILL);
+   waitpid(pid, NULL, 0);
+   stats_srv_init_connection(ctx->stats_srv, ctx->opts.verbose);
+   fprintf(stderr, "Upgrade failed, continue serving\n");
+   return -1;
 }
 
-static int read_data(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
+/* New process side: listening socket and sessions instead of init_listening_socket()  */
+static int receive_handoff(struct ctx_t *ctx, int hs)
 {
-   int rcvd_total;
+   int fd;
+   unsigned i, export_sockets;
    ssize_t rcvd;
+   struct handoff_hdr_t hdr;
+   struct handoff_session_t *msg;
+   struct rdr_session_ctx_t *session;
+   struct sockaddr_in remote_addr;
 
-   assert(ctx);
-   assert(session);
-   assert(session->pos < sizeof(session->buf));
+   rcvd = handoff_recv(hs, &hdr, sizeof(hdr), &fd, HANDOFF_TIMEOUT_MS);
+   if (rcvd != sizeof(hdr) || (fd < 0)
+	 || (hdr.magic != HANDOFF_MAGIC)
+	 || (hdr.version != HANDOFF_VERSION)) {
+      fprintf(stderr, "Upgrade: incorrect handoff header\n");
+      if (fd >= 0)
+	 close(fd);
+      return -1;
+   }
 
-   rcvd_total = 0;
-   for (;;) {
-      rcvd = read(session->s,
-	    &session->buf[session->pos],
-	    sizeof(session->buf) - session->pos
-	    );
-      if (rcvd == 0) {
-	 /* EOF  */
+   ctx->rcv_s = fd;
+   ctx->rdr_maxfd = ctx->rcv_s;
+   FD_SET(ctx->rcv_s, &ctx->rdr_fdset);
+   ctx->flow_seq = hdr.flow_seq;
+
+   /* A socket per collector, each with the flow_seq of the collector  */
+   export_sockets = hdr.export_socket;
+   for (i=0; i < export_sockets; ++i) {
+      rcvd = handoff_recv(hs, &hdr, sizeof(hdr), &fd, HANDOFF_TIMEOUT_MS);
+      if (rcvd != sizeof(hdr) || (fd < 0)) {
+	 fprintf(stderr, "Upgrade: no netflow socket\n");
+	 if (fd >= 0)
+	    close(fd);
 	 return -1;
       }
-
-      if (rcvd < 0) {
-	 switch (errno) {
-	    case EAGAIN:
-	    case EINTR:
-	       break;
-	    default:
-	       if (ctx->opts.verbose) {
-		  perror("read() error");
-	       }
-	       return -1;
-	       break;
-	 }
-	 break;
+      /* Replaces the socket of init_sending_socket() of the collector at the same position  */
+      if (ctx->opts.out_fname == NULL && (i < rdr_collector_count(ctx->collectors))) {
+	 dup2(fd, rdr_collector_socket(ctx->collectors, i));
+	 rdr_collector_set_flow_seq(ctx->collectors, i, hdr.flow_seq);
       }
-
-      rdr_repeater_append(ctx->rdr_repeater, &session->buf[session->pos], rcvd);
-
-      session->pos += rcvd;
-      rcvd_total += rcvd;
-
-      convert_rcvd_data(ctx, session);
+      close(fd);
    }
 
-   return rcvd_total;
-}
-
-static struct rdr_session_ctx_t *remove_session(struct ctx_t *ctx, struct rdr_session_ctx_t *session)
-{
-   struct rdr_session_ctx_t *res, **pred;
+   ctx->export_stats.dgrams = hdr.export_dgrams;
+   ctx->export_stats.records = hdr.export_records;
+   ctx->export_stats.send_errors = hdr.export_send_errors;
 
-   assert(session);
+   msg = malloc(sizeof(*msg) + MAX_RDR_PACKET_SIZE);
+   if (msg == NULL) {
+      perror("malloc() error");
+      return -1;
+   }
 
-   res = session->next;
+   for (i=0; i < hdr.sessions_cnt; ++i) {
+      rcvd = handoff_recv(hs, msg, sizeof(*msg) + MAX_RDR_PACKET_SIZE, &fd, HANDOFF_TIMEOUT_MS);
+      if (rcvd < (ssize_t)sizeof(*msg) || (fd < 0)
+	    || (msg->magic != HANDOFF_MAGIC)
+	    || (msg->pos >= MAX_RDR_PACKET_SIZE)
+	    || (rcvd != (ssize_t)(sizeof(*msg) + msg->pos))) {
+	 fprintf(stderr, "Upgrade: incorrect session %u\n", i);
+	 if (fd >= 0)
+	    close(fd);
+	 free(msg);
+	 return -1;
+      }
 
-   if (ctx->rdr_sessions == session) {
-      pred = &ctx->rdr_sessions;
-   }else {
-      struct rdr_session_ctx_t *s;
-      s = ctx->rdr_sessions;
-      while (s->next != session) s = s->next;
-      pred = &s->next;
-   }
+      if (fd < 0 || (fd >= FD_SETSIZE)) {
+	 fprintf(stderr, "Upgrade: no descriptor for session %u\n", i);
+	 if (fd >= 0)
+	    close(fd);
+	 free(msg);
+	 return -1;
+      }
 
-   *pred = res;
-   FD_CLR(session->s, &ctx->rdr_fdset);
-   if (ctx->rdr_maxfd == session->s) {
-      struct rdr_session_ctx_t *s;
-      ctx->rdr_maxfd = ctx->rcv_s;
-      for (s=ctx->rdr_sessions; s != NULL; s=s->next) {
-	 if (s->s > ctx->rdr_maxfd)
-	    ctx->rdr_maxfd = s->s;
+      session = alloc_session(ctx);
+      if (session == NULL) {
+	 close(fd);
+	 free(msg);
+	 return -1;
       }
+
+      memset(&remote_addr, 0, sizeof(remote_addr));
+      remote_addr.sin_family = AF_INET;
+      remote_addr.sin_addr.s_addr = msg->remote_addr;
+      remote_addr.sin_port = msg->remote_port;
+      init_session(ctx, session, fd, &remote_addr);
+      session->pos = msg->pos;
+      memcpy(session->buf, msg->data, msg->pos);
+      session->stats.bytes_rcvd = msg->bytes_rcvd;
+      session->stats.frames = msg->frames;
+      session->stats.garbage_bytes = msg->garbage_bytes;
+      session->stats.turs = msg->turs;
+      session->stats.turs_filtered = msg->turs_filtered;
+      link_session(ctx, session);
+
+      ctx->sessions_by_fd[fd] = session;
+      FD_SET(fd, &ctx->rdr_fdset);
+      if (fd > ctx->rdr_maxfd)
+	 ctx->rdr_maxfd = fd;
    }
 
-   close(session->s);
+   free(msg);
 
    if (ctx->opts.verbose)
-      fprintf(stderr, "Closed connection %s:%u\n",
-	    inet_ntoa(session->remote_addr.sin_addr),
-	    (unsigned)session->remote_addr.sin_port
-	    );
+      fprintf(stderr, "Upgrade: received %u sessions\n", hdr.sessions_cnt);
 
-   free(session);
+   return 0;
+}
 
-   return res;
+/* Recorded streams of the new segment start with the handed over sessions  */
+static void record_handed_over_sessions(struct ctx_t *ctx)
+{
+   struct rdr_session_ctx_t *session;
+
+   for (session = ctx->rdr_sessions; session != NULL; session = session->next) {
+      rdr_recorder_append(ctx->rdr_recorder, RDR_SEGMENT_REC_OPEN, &session->remote_addr, NULL, 0);
+      if (session->pos != 0)
+	 rdr_recorder_append(ctx->rdr_recorder, RDR_SEGMENT_REC_DATA, &session->remote_addr,
+	       session->buf, session->pos);
+   }
 }
 
 static inline unsigned is_ip_filtered(struct ctx_t *ctx, in_addr_t src_ip, in_addr_t dst_ip)
@@ -807,11 +2519,182 @@ static void ip_filter_print(struct ctx_t *ctx)
 
 }
 
+/* Table of the stages: since the last interval print or since start  */
+static void print_profile(struct ctx_t *ctx, FILE *stream, int interval)
+{
+   unsigned i;
+   unsigned long long now_us, cycles[PROF_STAGES], calls[PROF_STAGES];
+   unsigned long long total, frames;
+
+   prof_sync(ctx);
+
+   now_us = stats_monotonic_us();
+   total = 0;
+   for (i=0; i < PROF_STAGES; ++i) {
+      cycles[i] = ctx->prof.cycles[i] - (interval ? ctx->prof.last_cycles[i] : 0);
+      calls[i] = ctx->prof.calls[i] - (interval ? ctx->prof.last_calls[i] : 0);
+      total += cycles[i];
+   }
+   frames = calls[PROF_DECODE];
+
+   fprintf(stream, "Profile: %.1f s, %llu frames, %s cycles\n"
+	 "%-10s %12s %16s %12s %12s %7s\n",
+	 (now_us - (interval ? ctx->prof.last_us : ctx->prof.start_us)) / 1e6,
+	 frames, STATS_CYCLES_UNIT,
+	 "stage", "calls", "cycles", "per_call", "per_frame", "share");
+   for (i=0; i < PROF_STAGES; ++i) {
+      fprintf(stream, "%-10s %12llu %16llu %12.1f %12.1f %6.2f%%\n",
+	    prof_stage_names[i], calls[i], cycles[i],
+	    calls[i] ? (double)cycles[i] / calls[i] : 0.0,
+	    frames ? (double)cycles[i] / frames : 0.0,
+	    total ? 100.0 * cycles[i] / total : 0.0);
+   }
+
+   if (interval) {
+      memcpy(ctx->prof.last_cycles, ctx->prof.cycles, sizeof(ctx->prof.last_cycles));
+      memcpy(ctx->prof.last_calls, ctx->prof.calls, sizeof(ctx->prof.last_calls));
+      ctx->prof.last_us = now_us;
+   }
+}
+
+static void print_stats(FILE *stream, void *arg)
+{
+   unsigned i;
+   unsigned sessions_cnt;
+   unsigned long long dgrams, records;
+   struct ctx_t *ctx;
+   struct rdr_session_ctx_t *session;
+   struct rdr_session_stats_t total;
+
+   ctx = (struct ctx_t *)arg;
+   assert(ctx);
+
+   total = ctx->closed_sessions_stats;
+   sessions_cnt = 0;
+   for (session=ctx->rdr_sessions; session != NULL; session=session->next) {
+      add_session_stats(&total, &session->stats);
+      sessions_cnt += 1;
+   }
+
+   stats_print_header(stream, "rdr2netflow_uptime_seconds", "gauge", "Seconds since start");
+   fprintf(stream, "rdr2netflow_uptime_seconds %lu\n", (unsigned long)(time(NULL) - ctx->start_ts));
+   stats_print_header(stream, "rdr2netflow_sessions", "gauge", "Established SCE sessions");
+   fprintf(stream, "rdr2netflow_sessions %u\n", sessions_cnt);
+   stats_print_header(stream, "rdr2netflow_session_pool_size", "gauge", "Preallocated sessions");
+   fprintf(stream, "rdr2netflow_session_pool_size %u\n", ctx->session_pool.size);
+   stats_print_header(stream, "rdr2netflow_session_pool_used", "gauge", "Sessions allocated from the pool");
+   fprintf(stream, "rdr2netflow_session_pool_used %u\n", ctx->session_pool.used);
+   stats_print_header(stream, "rdr2netflow_session_pool_overflows_total", "counter",
+	 "Sessions allocated on the heap because the pool was empty");
+   fprintf(stream, "rdr2netflow_session_pool_overflows_total %llu\n", ctx->session_pool.overflows);
+
+   /* Total RDR counters (closed sessions included) and per session
+    * counters of established sessions in a separate family  */
+#define PRINT_SESSION_METRIC(_name, _help, _field) \
+   stats_print_header(stream, "rdr2netflow_" _name, "counter", _help); \
+   fprintf(stream, "rdr2netflow_" _name " %llu\n", total._field); \
+   stats_print_header(stream, "rdr2netflow_session_" _name, "counter", _help " by SCE session"); \
+   for (session=ctx->rdr_sessions; session != NULL; session=session->next) { \
+      fprintf(stream, "rdr2netflow_session_" _name "{session=\"%s:%u\"} %llu\n", \
+	    inet_ntoa(session->remote_addr.sin_addr), \
+	    (unsigned)ntohs(session->remote_addr.sin_port), \
+	    session->stats._field); \
+   }
+
+   PRINT_SESSION_METRIC("rcvd_bytes_total", "Bytes read from SCE", bytes_rcvd)
+   PRINT_SESSION_METRIC("frames_total", "Decoded RDR frames", frames)
+   PRINT_SESSION_METRIC("garbage_bytes_total", "Skipped non-RDR bytes", garbage_bytes)
+   PRINT_SESSION_METRIC("turs_total", "Received TRANSACTION_USAGE_RDRs", turs)
+   PRINT_SESSION_METRIC("turs_filtered_total", "TRANSACTION_USAGE_RDRs excluded by IP filter", turs_filtered)
+#undef PRINT_SESSION_METRIC
+
+   stats_print_header(stream, "rdr2netflow_decode_errors_total", "counter",
+	 "decode_rdr_packet() errors by code");
+   for (i=0; i < DECODE_ERRORS_MAX; ++i) {
+      if (total.decode_errors[i] == 0)
+	 continue;
+      fprintf(stream, "rdr2netflow_decode_errors_total{code=\"-%u\"} %llu\n",
+	    i, total.decode_errors[i]);
+   }
+   stats_print_header(stream, "rdr2netflow_session_decode_errors_total", "counter",
+	 "decode_rdr_packet() errors by code and SCE session");
+   for (i=0; i < DECODE_ERRORS_MAX; ++i) {
+      for (session=ctx->rdr_sessions; session != NULL; session=session->next) {
+	 if (session->stats.decode_errors[i] == 0)
+	    continue;
+	 fprintf(stream, "rdr2netflow_session_decode_errors_total{code=\"-%u\",session=\"%s:%u\"} %llu\n",
+	       i,
+	       inet_ntoa(session->remote_addr.sin_addr),
+	       (unsigned)ntohs(session->remote_addr.sin_port),
+	       session->stats.decode_errors[i]);
+      }
+   }
+
+   /* Netflow export  */
+   export_sent(ctx, &dgrams, &records);
+   stats_print_header(stream, "rdr2netflow_export_dgrams_total", "counter", "Sent netflow datagrams");
+   fprintf(stream, "rdr2netflow_export_dgrams_total %llu\n", dgrams);
+   stats_print_header(stream, "rdr2netflow_export_records_total", "counter", "Sent netflow records");
+   fprintf(stream, "rdr2netflow_export_records_total %llu\n", records);
+   stats_print_header(stream, "rdr2netflow_export_send_errors_total", "counter", "send() failures");
+   fprintf(stream, "rdr2netflow_export_send_errors_total %llu\n", ctx->export_stats.send_errors);
+
+   stats_hist_print(stream, "rdr2netflow_export_arrival_to_send_seconds",
+	 "Time from RDR frame arrival to netflow datagram send",
+	 &ctx->latency.arrival_to_send, 1e-6);
+   stats_hist_print(stream, "rdr2netflow_export_report_to_send_seconds",
+	 "Time from RDR REPORT_TIME to netflow datagram send",
+	 &ctx->latency.report_to_send, 1e-3);
+   stats_print_header(stream, "rdr2netflow_export_report_in_future_total", "counter",
+	 "Records with REPORT_TIME ahead of local clock (SCE clock skew)");
+   fprintf(stream, "rdr2netflow_export_report_in_future_total %llu\n", ctx->latency.report_in_future);
+
+   if (ctx->opts.backpressure_high != 0) {
+      stats_print_header(stream, "rdr2netflow_backpressure_paused", "gauge",
+	    "1 while the session reads are paused on downstream backlog");
+      fprintf(stream, "rdr2netflow_backpressure_paused %i\n", ctx->backpressure.paused);
+      stats_print_header(stream, "rdr2netflow_backpressure_pauses_total", "counter",
+	    "Session reads paused on downstream backlog");
+      fprintf(stream, "rdr2netflow_backpressure_pauses_total %llu\n", ctx->backpressure.pauses);
+      stats_print_header(stream, "rdr2netflow_backpressure_paused_seconds_total", "counter",
+	    "Time the session reads were paused");
+      fprintf(stream, "rdr2netflow_backpressure_paused_seconds_total %.6f\n",
+	    (ctx->backpressure.paused_us + (ctx->backpressure.paused
+		  ? stats_monotonic_us() - ctx->backpressure.paused_since_us : 0)) / 1e6);
+   }
+
+   rdr_repeater_print_stats(ctx->rdr_repeater, stream);
+   rdr_recorder_print_stats(ctx->rdr_recorder, stream);
+   rdr_shmring_print_stats(ctx->shmring, stream);
+   rdr_aggr_print_stats(ctx->aggr, stream);
+   rdr_topk_print_stats(ctx->topk, stream);
+   rdr_distinct_print_stats(ctx->distinct, stream);
+   rdr_sampling_print_stats(ctx->sampling, stream);
+   rdr_collector_print_stats(ctx->collectors, stream);
+   rdr_shed_print_stats(ctx->shed, stream);
+   rdr_log_print_stats(ctx->log, stream);
+
+   if (ctx->prof.enabled) {
+      stats_print_header(stream, "rdr2netflow_profile_cycles_total", "counter",
+	    "Ingest thread cycles by stage (" STATS_CYCLES_UNIT ")");
+      for (i=0; i < PROF_STAGES; ++i)
+	 fprintf(stream, "rdr2netflow_profile_cycles_total{stage=\"%s\"} %llu\n",
+	       prof_stage_names[i], ctx->prof.cycles[i]);
+      stats_print_header(stream, "rdr2netflow_profile_calls_total", "counter",
+	    "Stage entries");
+      for (i=0; i < PROF_STAGES; ++i)
+	 fprintf(stream, "rdr2netflow_profile_calls_total{stage=\"%s\"} %llu\n",
+	       prof_stage_names[i], ctx->prof.calls[i]);
+   }
+}
+
 int main(int argc, char *argv[])
 {
    signed char c;
    struct ctx_t *ctx;
    struct timeval netflow_flush_tmout;
+   const char *handoff_env;
+   int handoff_s;
 
    static struct option longopts[] = {
       {"version",     no_argument,       0, 'v'},
@@ -824,13 +2707,36 @@ int main(int argc, char *argv[])
       {NULL,      required_argument, 0, 'F'},
       {NULL,      required_argument, 0, 'R'},
       {NULL,      required_argument, 0, 'b'},
+      {NULL,      required_argument, 0, 'm'},
+      {NULL,      required_argument, 0, 'r'},
+      {NULL,      required_argument, 0, 'o'},
+      {NULL,      required_argument, 0, 'j'},
+      {NULL,      required_argument, 0, 'w'},
+      {NULL,      required_argument, 0, 'W'},
+      {NULL,      required_argument, 0, 'c'},
+      {NULL,      required_argument, 0, 'L'},
+      {NULL,      required_argument, 0, 'D'},
+      {NULL,      required_argument, 0, 'T'},
+      {NULL,      required_argument, 0, 'M'},
+      {NULL,      required_argument, 0, 'A'},
+      {NULL,      required_argument, 0, 'a'},
+      {NULL,      required_argument, 0, 'K'},
+      {NULL,      required_argument, 0, 'U'},
+      {NULL,      required_argument, 0, 'u'},
+      {NULL,      required_argument, 0, 'S'},
+      {NULL,      required_argument, 0, 'O'},
+      {NULL,      required_argument, 0, 'B'},
+      {NULL,      required_argument, 0, 'E'},
+      {NULL,      required_argument, 0, 'Q'},
+      {NULL,      required_argument, 0, 'H'},
       {0, 0, 0, 0}
    };
 
    ctx = init_ctx();
    assert(ctx);
+   ctx->argv = argv;
 
-   while ((c = getopt_long(argc, argv, "vhV:s:p:d:P:R:b:F:",longopts,NULL)) != -1) {
+   while ((c = getopt_long(argc, argv, "vhV:s:p:d:P:R:b:F:m:r:o:j:w:W:c:L:D:T:M:A:a:K:U:u:S:O:B:E:Q:H:",longopts,NULL)) != -1) {
       switch (c) {
 	 case 's':
 	    if (inet_aton(optarg, &ctx->opts.src_addr) <= 0) {
@@ -840,8 +2746,13 @@ int main(int argc, char *argv[])
 	    }
 	    break;
 	 case 'd':
-	    if (inet_aton(optarg, &ctx->opts.dst_addr) <= 0) {
-	       fprintf(stderr, "Incorrect destination address\n");
+	    if (rdr_collector_add(ctx->collectors, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'H':
+	    if (rdr_collector_set_policy(ctx->collectors, optarg, stderr) < 0) {
 	       free_ctx(ctx);
 	       return 1;
 	    }
@@ -876,6 +2787,148 @@ int main(int argc, char *argv[])
 	       return 1;
 	    }
 	    break;
+	 case 'm':
+	    if (stats_srv_set_addr(ctx->stats_srv, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'r':
+	    ctx->opts.read_fname = optarg;
+	    break;
+	 case 'o':
+	    ctx->opts.out_fname = optarg;
+	    break;
+	 case 'j':
+	    ctx->opts.threads = (unsigned)strtoul(optarg, NULL, 10);
+	    if (ctx->opts.threads == 0
+		  || (ctx->opts.threads > OFFLINE_MAX_THREADS)) {
+	       fprintf(stderr, "Incorrect number of threads\n");
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'c':
+	    ctx->opts.session_pool_size = (unsigned)strtoul(optarg, NULL, 10);
+	    if (ctx->opts.session_pool_size > SESSION_POOL_MAX_SIZE) {
+	       fprintf(stderr, "Incorrect number of sessions\n");
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'L':
+	    if (rdr_log_set_rate(ctx->log, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'D':
+	    if (rdr_log_add_selector(ctx->log, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'M':
+	    if (rdr_shmring_set_name(ctx->shmring, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    ctx->opts.shmring = 1;
+	    break;
+	 case 'A':
+	    if (rdr_aggr_set_keys(ctx->aggr, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    ctx->opts.aggr = 1;
+	    ctx->opts.frame_subscriber |= (rdr_aggr_keys(ctx->aggr) & RDR_AGGR_KEY_SUBSCRIBER) != 0;
+	    break;
+	 case 'K':
+	    if (rdr_topk_set_params(ctx->topk, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    ctx->opts.topk = 1;
+	    ctx->opts.frame_subscriber = 1;
+	    break;
+	 case 'U':
+	    if (rdr_distinct_set_params(ctx->distinct, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    ctx->opts.distinct = 1;
+	    ctx->opts.frame_subscriber = 1;
+	    break;
+	 case 'u':
+	    if (rdr_distinct_set_output(ctx->distinct, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'S':
+	    if (rdr_sampling_set_mode(ctx->sampling, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    ctx->opts.sampling = 1;
+	    break;
+	 case 'O':
+	    if (rdr_shed_set_policies(ctx->shed, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    ctx->opts.shed = 1;
+	    break;
+	 case 'E':
+	    if (rdr_collector_set_pacing(ctx->collectors, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'Q':
+	    if (rdr_collector_set_retry(ctx->collectors, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'B':
+	    {
+	       char *endptr;
+	       ctx->opts.backpressure_high = (unsigned)strtoul(optarg, &endptr, 10);
+	       ctx->opts.backpressure_low = ctx->opts.backpressure_high / 2;
+	       if (*endptr == '/')
+		  ctx->opts.backpressure_low = (unsigned)strtoul(endptr + 1, &endptr, 10);
+	       if (*endptr != '\0' || (ctx->opts.backpressure_high == 0)
+		     || (ctx->opts.backpressure_high > 100)
+		     || (ctx->opts.backpressure_low >= ctx->opts.backpressure_high)) {
+		  fprintf(stderr, "Incorrect backpressure watermarks\n");
+		  free_ctx(ctx);
+		  return 1;
+	       }
+	    }
+	    break;
+	 case 'a':
+	    if (rdr_aggr_set_output(ctx->aggr, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'T':
+	    ctx->opts.profile = 1;
+	    ctx->opts.profile_period = (unsigned)strtoul(optarg, NULL, 10);
+	    break;
+	 case 'w':
+	    if (rdr_recorder_set_dir(ctx->rdr_recorder, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
+	 case 'W':
+	    if (rdr_recorder_set_rotation(ctx->rdr_recorder, optarg, stderr) < 0) {
+	       free_ctx(ctx);
+	       return 1;
+	    }
+	    break;
 	 case 'b':
 	    ctx->opts.s_bufsize = (unsigned)strtoul(optarg, NULL, 0);
 	    if (ctx->opts.s_bufsize == 0) {
@@ -905,14 +2958,71 @@ int main(int argc, char *argv[])
    argc -= optind;
    argv += optind;
 
-   /* RDR socket  */
-   if (init_listening_socket(ctx) < 0) {
+   /* RDR sessions, with a datagram per collector for the hash policy  */
+   if (ctx->opts.out_fname == NULL && (rdr_collector_count(ctx->collectors) > 1)
+	 && (rdr_collector_policy(ctx->collectors) == RDR_COLLECTOR_HASH))
+      ctx->session_dgrams = rdr_collector_count(ctx->collectors);
+   if (init_session_pool(ctx) < 0) {
+      free_ctx(ctx);
+      return -1;
+   }
+
+   /* Netflow socket or file  */
+   if ((ctx->opts.out_fname != NULL ? init_output_file(ctx) : init_sending_socket(ctx)) < 0) {
+      free_ctx(ctx);
+      return -1;
+   }
+
+   /* Shared memory ring  */
+   if (rdr_shmring_start(ctx->shmring, ctx->opts.verbose) < 0) {
+      free_ctx(ctx);
+      return -1;
+   }
+
+   /* Rollups  */
+   if (rdr_aggr_start(ctx->aggr, ctx->opts.verbose) < 0) {
+      free_ctx(ctx);
+      return -1;
+   }
+
+   /* Heavy hitters  */
+   if (rdr_topk_start(ctx->topk, ctx->opts.verbose) < 0) {
+      free_ctx(ctx);
+      return -1;
+   }
+
+   /* Distinct counts  */
+   if (rdr_distinct_start(ctx->distinct, ctx->opts.verbose) < 0) {
       free_ctx(ctx);
       return -1;
    }
 
-   /* Netflow socket  */
-   if (init_sending_socket(ctx) < 0) {
+   if (ctx->opts.sampling && ctx->opts.verbose)
+      rdr_sampling_print_info(ctx->sampling, stderr);
+   if (ctx->opts.shed && ctx->opts.verbose)
+      rdr_shed_print_info(ctx->shed, stderr);
+
+   /* Offline conversion  */
+   if (ctx->opts.read_fname != NULL) {
+      int res;
+      signal(SIGINT, sig_quit);
+      signal(SIGTERM, sig_quit);
+      res = convert_capture_file(ctx);
+      free_ctx(ctx);
+      return res < 0 ? 1 : 0;
+   }
+
+   /* RDR socket: our own or passed by the previous binary  */
+   handoff_s = -1;
+   handoff_env = getenv(HANDOFF_ENV);
+   if (handoff_env != NULL) {
+      handoff_s = atoi(handoff_env);
+      unsetenv(HANDOFF_ENV);
+      if (receive_handoff(ctx, handoff_s) < 0) {
+	 free_ctx(ctx);
+	 return -1;
+      }
+   }else if (init_listening_socket(ctx) < 0) {
       free_ctx(ctx);
       return -1;
    }
@@ -923,6 +3033,41 @@ int main(int argc, char *argv[])
       return -1;
    }
 
+   /* Recorder  */
+   if (rdr_recorder_start(ctx->rdr_recorder, ctx->opts.verbose) < 0) {
+      free_ctx(ctx);
+      return -1;
+   }
+
+   /* Metrics  */
+   if (stats_srv_init_connection(ctx->stats_srv, ctx->opts.verbose) < 0) {
+      free_ctx(ctx);
+      return -1;
+   }
+
+   /* Asynchronous log  */
+   if (rdr_log_start(ctx->log, ctx->opts.verbose) < 0) {
+      free_ctx(ctx);
+      return -1;
+   }
+
+   if (ctx->opts.profile)
+      prof_start(ctx);
+
+   /* Ready to serve the handed over sessions, the previous binary exits  */
+   if (handoff_s >= 0) {
+      struct handoff_hdr_t ack;
+      record_handed_over_sessions(ctx);
+      memset(&ack, 0, sizeof(ack));
+      ack.magic = HANDOFF_ACK_MAGIC;
+      ack.version = HANDOFF_VERSION;
+      if (handoff_send(handoff_s, &ack, sizeof(ack), -1) < 0) {
+	 free_ctx(ctx);
+	 return -1;
+      }
+      close(handoff_s);
+   }
+
    /* IP filter */
    if (ctx->opts.verbose)
       ip_filter_print(ctx);
@@ -931,36 +3076,108 @@ int main(int argc, char *argv[])
    signal(SIGINT, sig_quit);
    signal(SIGTERM, sig_quit);
    signal(SIGPIPE, SIG_IGN);
+   signal(SIGUSR1, sig_dump_stats);
+   signal(SIGUSR2, sig_upgrade);
 
    for (;!quit;) {
       struct rdr_session_ctx_t *session;
       int ready_cnt;
       int maxfd;
+      int fd;
+      int paced;
+      long pacer_us;
+      unsigned prof;
 
       fd_set readfds;
       fd_set writefds;
 
       readfds = ctx->rdr_fdset;
+      if (ctx->opts.backpressure_high != 0 && update_backpressure(ctx)) {
+	 for (session = ctx->rdr_sessions; session != NULL; session = session->next)
+	    FD_CLR(session->s, &readfds);
+      }
       FD_ZERO(&writefds);
       rdr_repeater_on_select(ctx->rdr_repeater, &readfds, &writefds, &maxfd);
 
       if (ctx->rdr_maxfd > maxfd)
 	 maxfd = ctx->rdr_maxfd;
+      stats_srv_on_select(ctx->stats_srv, &readfds, &writefds, &maxfd);
 
-      netflow_flush_tmout.tv_sec = DEFAULT_NETFLOW_FLUSH_TMOUT;
-      netflow_flush_tmout.tv_usec = 0;
+      if (ctx->backpressure.paused) {
+	 netflow_flush_tmout.tv_sec = 0;
+	 netflow_flush_tmout.tv_usec = BACKPRESSURE_POLL_US;
+      }else {
+	 netflow_flush_tmout.tv_sec = DEFAULT_NETFLOW_FLUSH_TMOUT;
+	 netflow_flush_tmout.tv_usec = 0;
+      }
+
+      /* Wake up for the next token while datagrams are queued  */
+      paced = 0;
+      if (ctx->out_file == NULL && ((pacer_us = rdr_collector_next_us(ctx->collectors)) >= 0)
+	    && (pacer_us < netflow_flush_tmout.tv_sec * 1000000l + netflow_flush_tmout.tv_usec)) {
+	 netflow_flush_tmout.tv_sec = pacer_us / 1000000;
+	 netflow_flush_tmout.tv_usec = pacer_us % 1000000;
+	 paced = 1;
+      }
 
+      prof = prof_enter(ctx, PROF_POLL);
       ready_cnt = select(maxfd+1, &readfds, &writefds, NULL, &netflow_flush_tmout);
+      prof_leave(ctx, prof);
 
       if (quit)
 	 break;
 
-      if (ready_cnt < 0)
+      if (ctx->out_file == NULL)
+	 count_send_errors(ctx, rdr_collector_step(ctx->collectors));
+
+      if (dump_stats) {
+	 dump_stats = 0;
+	 print_stats(stderr, ctx);
+	 if (ctx->prof.enabled)
+	    print_profile(ctx, stderr, 0);
+      }
+
+      if (upgrade) {
+	 upgrade = 0;
+	 if (handoff_sessions(ctx) == 0)
+	    break;
+	 continue;
+      }
+
+      if (ctx->prof.enabled && (ctx->opts.profile_period != 0)
+	    && (stats_monotonic_us() - ctx->prof.last_us >= 1000000ull * ctx->opts.profile_period)) {
+	 print_profile(ctx, rdr_log_stream(ctx->log), 1);
+	 rdr_log_commit(ctx->log);
+      }
+
+      if (ctx->opts.sampling && rdr_sampling_is_adaptive(ctx->sampling))
+	 adapt_sampling(ctx);
+
+      if (ctx->out_file == NULL && (rdr_collector_count(ctx->collectors) > 1))
+	 check_collectors(ctx);
+
+      if (ctx->opts.topk && rdr_topk_report_due(ctx->topk, stats_monotonic_us())) {
+	 rdr_topk_report(ctx->topk, rdr_log_stream(ctx->log), stats_monotonic_us());
+	 rdr_log_commit(ctx->log);
+      }
+
+      if (ready_cnt < 0) {
+	 if (errno == EINTR)
+	    continue;
 	 break;
+      }
 
       if (ready_cnt == 0) {
-	 flush_all_netflow_sessions(ctx);
+	 if (!ctx->backpressure.paused && !paced)
+	    flush_all_netflow_sessions(ctx);
+	 rdr_aggr_flush_idle(ctx->aggr, stats_monotonic_us());
+	 rdr_distinct_flush_idle(ctx->distinct, stats_monotonic_us());
+	 rdr_recorder_flush(ctx->rdr_recorder);
+	 rdr_log_flush(ctx->log);
+	 prof = prof_enter(ctx, PROF_REPEATER);
 	 rdr_repeater_step(ctx->rdr_repeater, &readfds, &writefds);
+	 prof_leave(ctx, prof);
+	 stats_srv_step(ctx->stats_srv, &readfds, &writefds);
 	 continue;
       }
 
@@ -968,21 +3185,22 @@ int main(int argc, char *argv[])
 	 accept_connection(ctx);
       }
 
+      prof = prof_enter(ctx, PROF_REPEATER);
       rdr_repeater_step(ctx->rdr_repeater, &readfds, &writefds);
+      prof_leave(ctx, prof);
+      stats_srv_step(ctx->stats_srv, &readfds, &writefds);
 
-      session=ctx->rdr_sessions;
-      while (session != NULL) {
-
-	 if (!FD_ISSET(session->s, &readfds)) {
-	    session = session->next;
+      for (fd = 0; fd <= ctx->rdr_maxfd; ++fd) {
+	 session = ctx->sessions_by_fd[fd];
+	 if (session == NULL || !FD_ISSET(fd, &readfds))
 	    continue;
-	 }
+	 if (ctx->backpressure.paused)
+	    break;
 
 	 if ( read_data(ctx, session) < 0) {
 	    flush_netflow_dgram(ctx, session);
-	    session = remove_session(ctx, session);
-	 }else
-	    session = session->next;
+	    remove_session(ctx, session);
+	 }
       }
 
    } /* for(;!quit;) */
@@ -991,8 +3209,14 @@ int main(int argc, char *argv[])
    signal(SIGINT, SIG_DFL);
    signal(SIGTERM, SIG_DFL);
    signal(SIGPIPE, SIG_DFL);
+   signal(SIGUSR1, SIG_DFL);
+   signal(SIGUSR2, SIG_DFL);
 
    flush_all_netflow_sessions(ctx);
+   if (ctx->prof.enabled) {
+      print_profile(ctx, rdr_log_stream(ctx->log), 0);
+      rdr_log_commit(ctx->log);
+   }
    free_ctx(ctx);
    return 0;
 }
@@ -0,0 +1,382 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * librdr behavior check: a stream is framed once with rdr_frame_stream()
+ * and then fed to rdr_parser_feed() split at random byte boundaries. The
+ * parser must find the same frames in the same order, the same garbage and
+ * decode errors for any split.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rdr.h"
+
+const char *progname = "rdrcheck";
+const char *revision = "$Revision: 0.2 $";
+
+#define DEFAULT_FRAMES 20000
+#define DEFAULT_ROUNDS 20
+#define DEFAULT_SEED 1
+/* Ratio of frames followed by garbage bytes, percent  */
+#define GARBAGE_PCT 10
+
+struct opts_t {
+   const char *fname;
+   unsigned frames;
+   unsigned rounds;
+   unsigned long long seed;
+   int verbose;
+};
+
+/* What a framing pass found  */
+struct check_result_t {
+   unsigned long long frames;
+   unsigned long long garbage_bytes;
+   unsigned long long decode_errors;
+   /* FNV-1a over the raw frames in order  */
+   uint64_t digest;
+};
+
+static uint64_t rnd_state;
+
+static inline uint64_t rnd(void)
+{
+   rnd_state ^= rnd_state >> 12;
+   rnd_state ^= rnd_state << 25;
+   rnd_state ^= rnd_state >> 27;
+   return rnd_state * 2685821657736338717ULL;
+}
+
+static void help(void)
+{
+ printf("%s - librdr stream parser check\t\t%s\n", progname, revision);
+ printf(
+   "\nUsage:\n    %s [-h] [options] [file]\n"
+   "\nChecks rdr_parser_feed() against rdr_frame_stream() on a raw RDR stream\n"
+   "file or a generated stream with garbage between the frames. Frames with\n"
+   "broken length fields are found depending on where the stream is split,\n"
+   "so only files without them are expected to pass.\n"
+   "\nOptions:\n"
+   "    -n <num>        Frames of the generated stream (default %u)\n"
+   "    -i <num>        Random splits to check (default %u)\n"
+   "    -S <seed>       Random seed (default %u)\n"
+   "    -V <level>      Verbose output\n"
+   "    -h, --help      Help\n"
+   "\n",
+   progname, DEFAULT_FRAMES, DEFAULT_ROUNDS, DEFAULT_SEED);
+}
+
+static uint64_t digest_add(uint64_t digest, const uint8_t *raw, size_t raw_size)
+{
+   size_t i;
+
+   for (i=0; i < raw_size; ++i) {
+      digest ^= raw[i];
+      digest *= 0x100000001b3ULL;
+   }
+
+   return digest;
+}
+
+static void fill_rdr(struct rdr_packet_t *pkt, unsigned i)
+{
+   memset(pkt, 0, sizeof(*pkt));
+   pkt->header.ppc_num = 1;
+   if (i % 8 == 7) {
+      pkt->header.tag = TRANSACTION_RDR;
+      snprintf(pkt->rdr.transaction.subscriber_id,
+	    sizeof(pkt->rdr.transaction.subscriber_id), "sub%u", (unsigned)(rnd() % 100000));
+      pkt->rdr.transaction.server_ip.s_addr = htonl(0xc0000000 | (i & 0xffffff));
+      pkt->rdr.transaction.client_ip.s_addr = htonl(0x0a000000 | (i & 0xffffff));
+      pkt->rdr.transaction.report_time = 1350000000 + i;
+      return;
+   }
+
+   pkt->header.tag = TRANSACTION_USAGE_RDR;
+   snprintf(pkt->rdr.transaction_usage.subscriber_id,
+	 sizeof(pkt->rdr.transaction_usage.subscriber_id), "sub%u", (unsigned)(rnd() % 100000));
+   snprintf(pkt->rdr.transaction_usage.access_string,
+	 sizeof(pkt->rdr.transaction_usage.access_string), "host%u.example.com", (unsigned)(rnd() % 1000));
+   snprintf(pkt->rdr.transaction_usage.info_string,
+	 sizeof(pkt->rdr.transaction_usage.info_string), "/%u.html", (unsigned)(rnd() % 10000));
+   pkt->rdr.transaction_usage.server_ip.s_addr = htonl(0xc0000000 | (i & 0xffffff));
+   pkt->rdr.transaction_usage.server_port = 80;
+   pkt->rdr.transaction_usage.client_ip.s_addr = htonl(0x0a000000 | (i & 0xffffff));
+   pkt->rdr.transaction_usage.client_port = 1024 + i % 60000;
+   pkt->rdr.transaction_usage.report_time = 1350000000 + i;
+   pkt->rdr.transaction_usage.session_upstream_volume = (uint32_t)rnd();
+   pkt->rdr.transaction_usage.session_downstream_volume = (uint32_t)rnd();
+   pkt->rdr.transaction_usage.ip_protocol = 6;
+}
+
+/* Frames with random garbage between some of them and a truncated tail  */
+static uint8_t *generate_stream(unsigned frames, size_t *size)
+{
+   unsigned i, garbage;
+   size_t pos;
+   int frame_size;
+   uint8_t *data;
+   struct rdr_packet_t pkt;
+
+   data = malloc((size_t)frames * (MAX_RDR_PACKET_SIZE + 32));
+   if (data == NULL) {
+      perror("malloc() error");
+      return NULL;
+   }
+
+   pos = 0;
+   for (i=0; i < frames; ++i) {
+      fill_rdr(&pkt, i);
+      frame_size = encode_rdr_packet(&pkt, &data[pos], MAX_RDR_PACKET_SIZE);
+      if (frame_size <= 0) {
+	 fprintf(stderr, "encode_rdr_packet() error %i on frame %u\n", frame_size, i);
+	 free(data);
+	 return NULL;
+      }
+      /* Truncated last frame  */
+      if (i == frames - 1)
+	 frame_size /= 2;
+      pos += frame_size;
+      if (rnd() % 100 < GARBAGE_PCT) {
+	 for (garbage = 1 + rnd() % 32; garbage > 0; --garbage)
+	    data[pos++] = (uint8_t)rnd();
+      }
+   }
+   *size = pos;
+
+   return data;
+}
+
+static uint8_t *read_stream(const char *fname, size_t *size)
+{
+   FILE *f;
+   long fsize;
+   uint8_t *data;
+
+   f = fopen(fname, "rb");
+   if (f == NULL) {
+      fprintf(stderr, "fopen(%s) error: %s\n", fname, strerror(errno));
+      return NULL;
+   }
+
+   data = NULL;
+   if (fseek(f, 0, SEEK_END) < 0 || ((fsize = ftell(f)) <= 0)
+	 || (fseek(f, 0, SEEK_SET) < 0)) {
+      fprintf(stderr, "%s: empty or not seekable\n", fname);
+   }else if ((data = malloc(fsize)) == NULL) {
+      perror("malloc() error");
+   }else if (fread(data, 1, fsize, f) != (size_t)fsize) {
+      fprintf(stderr, "%s: read error\n", fname);
+      free(data);
+      data = NULL;
+   }else
+      *size = fsize;
+   fclose(f);
+
+   return data;
+}
+
+static int stream_frame(void *arg, uint8_t *pkt, size_t pkt_size)
+{
+   struct check_result_t *r;
+   struct rdr_packet_t decoded;
+
+   r = (struct check_result_t *)arg;
+
+   if (decode_rdr_packet(pkt, pkt_size, &decoded) < 0) {
+      r->decode_errors += 1;
+      return -1;
+   }
+   r->frames += 1;
+   r->digest = digest_add(r->digest, pkt, pkt_size);
+
+   return 0;
+}
+
+static void parser_packet(void *arg, const struct rdr_packet_t *pkt,
+      const uint8_t *raw, size_t raw_size)
+{
+   struct check_result_t *r;
+
+   (void)pkt;
+   r = (struct check_result_t *)arg;
+   r->digest = digest_add(r->digest, raw, raw_size);
+}
+
+/* Chunk sizes of a round: single bytes, TCP segments or large reads  */
+static size_t split_size(unsigned round)
+{
+   switch (round % 4) {
+      case 0:
+	 return 1 + rnd() % 16;
+      case 1:
+	 return 1 + rnd() % 1460;
+      case 2:
+	 return 1 + rnd() % (3 * MAX_RDR_PACKET_SIZE);
+      default:
+	 return 1 + rnd() % 262144;
+   }
+}
+
+static int check_round(const uint8_t *data, size_t size, unsigned round,
+      const struct check_result_t *expected, int verbose)
+{
+   size_t pos, chunk;
+   unsigned long long chunks;
+   struct check_result_t r;
+   struct rdr_parser_t *p;
+
+   p = malloc(sizeof(*p));
+   if (p == NULL) {
+      perror("malloc() error");
+      return -1;
+   }
+
+   memset(&r, 0, sizeof(r));
+   r.digest = 0xcbf29ce484222325ULL;
+   rdr_parser_init(p, parser_packet, &r);
+   chunks = 0;
+   for (pos=0; pos < size; pos += chunk) {
+      chunk = split_size(round);
+      if (chunk > size - pos)
+	 chunk = size - pos;
+      rdr_parser_feed(p, &data[pos], chunk);
+      chunks += 1;
+   }
+   r.frames = p->stats.frames;
+   r.garbage_bytes = p->stats.garbage_bytes;
+   r.decode_errors = p->stats.decode_errors;
+
+   if (p->stats.bytes != size
+	 || (r.frames != expected->frames)
+	 || (r.garbage_bytes != expected->garbage_bytes)
+	 || (r.decode_errors != expected->decode_errors)
+	 || (r.digest != expected->digest)) {
+      fprintf(stderr, "round %u: %llu chunks: frames=%llu garbage=%llu decode_errors=%llu digest=%016llx, "
+	    "expected frames=%llu garbage=%llu decode_errors=%llu digest=%016llx\n",
+	    round, chunks, r.frames, r.garbage_bytes, r.decode_errors, (unsigned long long)r.digest,
+	    expected->frames, expected->garbage_bytes, expected->decode_errors,
+	    (unsigned long long)expected->digest);
+      free(p);
+      return -1;
+   }
+
+   if (verbose > 1)
+      fprintf(stderr, "round %u: %llu chunks ok\n", round, chunks);
+   free(p);
+
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   signed char c;
+   unsigned i, failed;
+   size_t size;
+   uint8_t *data;
+   struct opts_t opts;
+   struct check_result_t expected;
+
+   static struct option longopts[] = {
+      {"help",        no_argument,       0, 'h'},
+      {"verbose",        optional_argument,       0, 'V'},
+      {0, 0, 0, 0}
+   };
+
+   opts.fname = NULL;
+   opts.frames = DEFAULT_FRAMES;
+   opts.rounds = DEFAULT_ROUNDS;
+   opts.seed = DEFAULT_SEED;
+   opts.verbose = 1;
+
+   while ((c = getopt_long(argc, argv, "hV:n:i:S:",longopts,NULL)) != -1) {
+      switch (c) {
+	 case 'n':
+	    opts.frames = (unsigned)strtoul(optarg, NULL, 10);
+	    if (opts.frames == 0) {
+	       fprintf(stderr, "Incorrect number of frames\n");
+	       return 1;
+	    }
+	    break;
+	 case 'i':
+	    opts.rounds = (unsigned)strtoul(optarg, NULL, 10);
+	    break;
+	 case 'S':
+	    opts.seed = strtoull(optarg, NULL, 0);
+	    break;
+	 case 'V':
+	    if (optarg != NULL) {
+	       opts.verbose=(unsigned)strtoul(optarg, NULL, 0);
+	    }else
+	       opts.verbose=1;
+	    break;
+	 default:
+	    help();
+	    exit(0);
+	    break;
+      }
+   }
+   if (optind < argc)
+      opts.fname = argv[optind];
+
+   rnd_state = opts.seed ? opts.seed : 1;
+
+   size = 0;
+   data = opts.fname ? read_stream(opts.fname, &size) : generate_stream(opts.frames, &size);
+   if (data == NULL)
+      return 1;
+
+   /* One-shot framing of the whole stream  */
+   memset(&expected, 0, sizeof(expected));
+   expected.digest = 0xcbf29ce484222325ULL;
+   rdr_frame_stream(data, size, stream_frame, &expected, &expected.garbage_bytes);
+
+   failed = 0;
+   for (i=0; i < opts.rounds; ++i) {
+      if (check_round(data, size, i, &expected, opts.verbose) < 0)
+	 failed += 1;
+   }
+
+   if (opts.verbose)
+      printf("%s: %lu bytes, %llu frames, %llu garbage bytes, %llu decode errors: %u of %u splits %s\n",
+	    opts.fname ? opts.fname : "generated", (unsigned long)size,
+	    expected.frames, expected.garbage_bytes, expected.decode_errors,
+	    opts.rounds - failed, opts.rounds, failed ? "FAILED" : "ok");
+   free(data);
+
+   return failed ? 1 : 0;
+}
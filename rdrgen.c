@@ -0,0 +1,619 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rdr.h"
+
+const char *progname = "rdrgen";
+const char *revision = "$Revision: 0.2 $";
+
+#define DEFAULT_DST_HOST "127.0.0.1"
+#define DEFAULT_DST_PORT "10000"
+#define DEFAULT_STR_LEN 16
+
+#define BATCH_SIZE (64*1024)
+
+struct opts_t {
+   const char *hostname;
+   const char *servname;
+   /* Write the stream to this file instead  */
+   const char *fname;
+
+   unsigned conns;
+   unsigned rate;
+   unsigned long long count;
+   unsigned duration;
+
+   double other_ratio;
+   double interim_ratio;
+   double corrupt_ratio;
+
+   unsigned str_len;
+   unsigned long long seed;
+
+   int verbose;
+};
+
+struct gen_stats_t {
+   unsigned long long frames;
+   unsigned long long turs;
+   unsigned long long corrupted;
+   /* Upstream + downstream volume of the valid TURs  */
+   unsigned long long tur_octets;
+   unsigned long long bytes;
+};
+
+static const unsigned other_tags[] = {
+   SUBSCRIBER_USAGE_RDR,
+   REALTIME_SUBSCRIBER_USAGE_RDR,
+   PACKAGE_USAGE_RDR,
+   LINK_USAGE_RDR,
+   VIRTUAL_LINKS_USAGE_RDR,
+   TRANSACTION_RDR,
+   HTTP_TRANSACTION_USAGE_RDR,
+   RTSP_TRANSACTION_USAGE_RDR,
+   VOIP_TRANSACTION_USAGE_RDR,
+   ANONYMIZED_HTTP_TRANSACTION_USAGE_RDR,
+   SERVICE_BLOCK_RDR,
+   QUOTA_BREACH_RDR,
+   REMAINING_QUOTA_RDR,
+   QUOTA_THRESHOLD_BREACH_RDR,
+   QUOTA_STATE_RESTORE_RDR,
+   RADIUS_RDR,
+   DHCP_RDR,
+   FLOW_START_RDR,
+   FLOW_END_RDR,
+   MEDIA_FLOW_RDR,
+   FLOW_ONGOING_RDR,
+   ATTACK_START_RDR,
+   ATTACK_END_RDR,
+   MALICIOUS_TRAFFIC_PERIODIC_RDR,
+   SPAM_RDR,
+   GENERIC_USAGE_RDR
+};
+
+static volatile sig_atomic_t quit = 0;
+
+/* xorshift64*  */
+static uint64_t rnd_state;
+
+static inline uint64_t rnd(void)
+{
+   rnd_state ^= rnd_state >> 12;
+   rnd_state ^= rnd_state << 25;
+   rnd_state ^= rnd_state >> 27;
+   return rnd_state * 2685821657736338717ULL;
+}
+
+static inline double rnd_double(void)
+{
+   return (rnd() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void usage(void)
+{
+   fprintf(stdout, "\nUsage:\n    %s [-h] [options]\n"
+	 ,progname);
+   return;
+}
+
+static void version(void)
+{
+   fprintf(stdout,"%s %s\n",progname,revision);
+}
+
+static void help(void)
+{
+ printf("%s - synthetic Cisco SCE RDRv1 stream generator\t\t%s\n",
+       progname, revision);
+ usage();
+ printf(
+   "\nOptions:\n"
+   "    -d <host/port>  Send RDR to this host (default %s/%s)\n"
+   "    -f <file>       Write RDR stream to this file instead, - for stdout\n"
+   "    -c <num>        Number of concurrent connections (default 1)\n"
+   "    -r <rate>       RDRs per second per connection, 0 - unlimited (default 0)\n"
+   "    -n <num>        RDRs per connection, 0 - unlimited (default 0)\n"
+   "    -t <seconds>    Stop after this time, 0 - never (default 0)\n"
+   "    -o <ratio>      Ratio of non-TUR RDRs, 0..1 (default 0)\n"
+   "    -i <ratio>      Ratio of interim TURs, 0..1 (default 0)\n"
+   "    -l <len>        Length of the string fields (default %u)\n"
+   "    -x <ratio>      Ratio of corrupted RDRs, 0..1 (default 0)\n"
+   "    -S <seed>       Random seed\n"
+   "    -V <level>      Verbose output\n"
+   "    -h, --help                  Help\n"
+   "    -v, --version               Show version\n"
+   "\n",
+   DEFAULT_DST_HOST, DEFAULT_DST_PORT, DEFAULT_STR_LEN
+ );
+ return;
+}
+
+static void sig_quit(int signal) {
+   quit = signal;
+}
+
+static void fill_string(char *dst, size_t dst_size, unsigned len, const char *prefix)
+{
+   unsigned i;
+   int prefix_len;
+
+   assert(dst_size > 0);
+
+   if (len > dst_size - 1)
+      len = dst_size - 1;
+
+   prefix_len = snprintf(dst, len+1, "%s", prefix);
+   if (prefix_len < 0)
+      prefix_len = 0;
+   for (i=prefix_len; i < len; ++i)
+      dst[i] = 'a' + rnd() % 26;
+   dst[len] = '\0';
+}
+
+static void fill_transaction_usage(const struct opts_t *opts, struct rdr_packet_t *pkt, time_t now)
+{
+   char sub[32];
+
+   snprintf(sub, sizeof(sub), "sub%u.", (unsigned)(rnd() % 100000));
+   fill_string(pkt->rdr.transaction_usage.subscriber_id,
+	 sizeof(pkt->rdr.transaction_usage.subscriber_id), opts->str_len, sub);
+   pkt->rdr.transaction_usage.package_id = rnd() % 16;
+   pkt->rdr.transaction_usage.service_id = rnd() % 64;
+   pkt->rdr.transaction_usage.protocol_id = rnd() % 128;
+   pkt->rdr.transaction_usage.generation_reason = rnd_double() < opts->interim_ratio ? 1 : 0;
+   pkt->rdr.transaction_usage.server_ip.s_addr = htonl(0xc0000000 | (rnd() & 0x00ffffff));
+   pkt->rdr.transaction_usage.server_port = rnd() % 2 ? 80 : 443;
+   fill_string(pkt->rdr.transaction_usage.access_string,
+	 sizeof(pkt->rdr.transaction_usage.access_string), opts->str_len, "host.");
+   fill_string(pkt->rdr.transaction_usage.info_string,
+	 sizeof(pkt->rdr.transaction_usage.info_string), opts->str_len, "/");
+   pkt->rdr.transaction_usage.client_ip.s_addr = htonl(0x0a000000 | (rnd() & 0x00ffffff));
+   pkt->rdr.transaction_usage.client_port = 1024 + rnd() % 64000;
+   pkt->rdr.transaction_usage.initiating_side = rnd() % 4 == 0 ? 1 : 0;
+   pkt->rdr.transaction_usage.report_time = now;
+   pkt->rdr.transaction_usage.millisec_duration = rnd() % 600000;
+   pkt->rdr.transaction_usage.time_frame = rnd() % 4;
+   pkt->rdr.transaction_usage.session_upstream_volume = rnd() % 100000;
+   pkt->rdr.transaction_usage.session_downstream_volume = rnd() % 10000000;
+   pkt->rdr.transaction_usage.subscriber_counter_id = rnd() % 32;
+   pkt->rdr.transaction_usage.global_counter_id = rnd() % 32;
+   pkt->rdr.transaction_usage.package_counter_id = rnd() % 32;
+   pkt->rdr.transaction_usage.ip_protocol = rnd() % 3 ? 6 : 17;
+   pkt->rdr.transaction_usage.protocol_signature = (int)(rnd() % 0x7fffffff);
+   pkt->rdr.transaction_usage.zone_id = 0;
+   pkt->rdr.transaction_usage.flavor_id = 0;
+   pkt->rdr.transaction_usage.flow_close_mode = rnd() % 4;
+}
+
+/*
+ * TRANSACTION_RDR differs from TRANSACTION_USAGE_RDR only in the 5th field
+ */
+static void fill_transaction(const struct opts_t *opts, struct rdr_packet_t *pkt, time_t now)
+{
+   fill_transaction_usage(opts, pkt, now);
+   pkt->rdr.transaction.skipped_sessions = rnd() % 4;
+}
+
+static size_t corrupt_frame(uint8_t *frame, size_t frame_size, size_t buf_size)
+{
+   unsigned i, garbage;
+
+   switch (rnd() % 4) {
+      case 0:
+	 /* Flip a byte  */
+	 frame[rnd() % frame_size] ^= 1 << (rnd() % 8);
+	 break;
+      case 1:
+	 /* Broken payload size  */
+	 frame[1 + rnd() % 4] = 'x';
+	 break;
+      case 2:
+	 /* Truncated frame  */
+	 frame_size = 1 + rnd() % (frame_size - 1);
+	 break;
+      default:
+	 /* Garbage after the frame  */
+	 garbage = 1 + rnd() % 32;
+	 if (frame_size + garbage > buf_size)
+	    garbage = buf_size - frame_size;
+	 for (i=0; i < garbage; ++i)
+	    frame[frame_size+i] = (uint8_t)rnd();
+	 frame_size += garbage;
+	 break;
+   }
+
+   return frame_size;
+}
+
+static size_t gen_frame(const struct opts_t *opts, struct gen_stats_t *stats,
+      uint8_t *buf, size_t buf_size, time_t now)
+{
+   int frame_size;
+   struct rdr_packet_t pkt;
+
+   memset(&pkt.header, 0, sizeof(pkt.header));
+   pkt.header.ppc_num = 1;
+   pkt.header.src = 1;
+   pkt.header.dst = 2;
+   pkt.header.fc_id = (unsigned)(rnd() % 1000);
+
+   if ((opts->other_ratio > 0) && (rnd_double() < opts->other_ratio)) {
+      pkt.header.tag = other_tags[rnd() % (sizeof(other_tags)/sizeof(other_tags[0]))];
+      if (pkt.header.tag == TRANSACTION_RDR)
+	 fill_transaction(opts, &pkt, now);
+   }else {
+      pkt.header.tag = TRANSACTION_USAGE_RDR;
+      fill_transaction_usage(opts, &pkt, now);
+      stats->turs += 1;
+   }
+
+   frame_size = encode_rdr_packet(&pkt, buf, buf_size);
+   if (frame_size <= 0)
+      return 0;
+
+   if ((opts->corrupt_ratio > 0) && (rnd_double() < opts->corrupt_ratio)) {
+      stats->corrupted += 1;
+      frame_size = corrupt_frame(buf, frame_size, buf_size);
+   }else if (pkt.header.tag == TRANSACTION_USAGE_RDR) {
+      stats->tur_octets += (unsigned long long)pkt.rdr.transaction_usage.session_upstream_volume
+	 + pkt.rdr.transaction_usage.session_downstream_volume;
+   }
+
+   stats->frames += 1;
+
+   return frame_size;
+}
+
+static double elapsed_s(const struct timespec *start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int open_connection(const struct opts_t *opts)
+{
+   int s;
+   int error;
+   struct addrinfo hints, *res, *ai;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = PF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   error = getaddrinfo(opts->hostname, opts->servname, &hints, &res);
+   if (error) {
+      fprintf(stderr, "getaddrinfo(%s/%s) error: %s\n",
+	    opts->hostname, opts->servname, gai_strerror(error));
+      return -1;
+   }
+
+   s = -1;
+   for (ai = res; ai != NULL; ai = ai->ai_next) {
+      s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (s < 0)
+	 continue;
+      if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+	 break;
+      close(s);
+      s = -1;
+   }
+   freeaddrinfo(res);
+
+   if (s < 0)
+      perror("connect() error");
+
+   return s;
+}
+
+static int open_file(const struct opts_t *opts)
+{
+   int s;
+
+   if (strcmp(opts->fname, "-") == 0)
+      return STDOUT_FILENO;
+
+   s = open(opts->fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (s < 0)
+      fprintf(stderr, "open(%s) error: %s\n", opts->fname, strerror(errno));
+
+   return s;
+}
+
+static int write_all(int s, const uint8_t *data, size_t data_size)
+{
+   ssize_t written;
+
+   while (data_size > 0) {
+      written = write(s, data, data_size);
+      if (written < 0) {
+	 if (errno == EINTR) {
+	    if (quit)
+	       return -1;
+	    continue;
+	 }
+	 perror("write() error");
+	 return -1;
+      }
+      data += written;
+      data_size -= written;
+   }
+
+   return 0;
+}
+
+static int run_connection(const struct opts_t *opts, unsigned conn_id)
+{
+   int s;
+   size_t batch_pos;
+   unsigned long long limit;
+   double elapsed, last_report;
+   struct gen_stats_t stats;
+   struct timespec start_ts;
+   static uint8_t batch[BATCH_SIZE];
+
+   rnd_state = opts->seed + 0x9e3779b97f4a7c15ULL * (conn_id + 1);
+   if (rnd_state == 0)
+      rnd_state = 1;
+
+   s = opts->fname != NULL ? open_file(opts) : open_connection(opts);
+   if (s < 0)
+      return -1;
+
+   memset(&stats, 0, sizeof(stats));
+   clock_gettime(CLOCK_MONOTONIC, &start_ts);
+   last_report = 0;
+
+   while (!quit) {
+      time_t now;
+
+      elapsed = elapsed_s(&start_ts);
+
+      if (opts->duration != 0 && (elapsed >= opts->duration))
+	 break;
+      if (opts->count != 0 && (stats.frames >= opts->count))
+	 break;
+
+      /* Frames allowed to be sent up to now  */
+      limit = opts->count != 0 ? opts->count : ~0ULL;
+      if (opts->rate != 0) {
+	 unsigned long long allowed;
+	 allowed = (unsigned long long)(elapsed * opts->rate) + 1;
+	 if (allowed < limit)
+	    limit = allowed;
+	 if (stats.frames >= limit) {
+	    struct timespec ts;
+	    ts.tv_sec = 0;
+	    ts.tv_nsec = 1000000;
+	    nanosleep(&ts, NULL);
+	    continue;
+	 }
+      }
+
+      now = time(NULL);
+      batch_pos = 0;
+      while ((stats.frames < limit)
+	    && (batch_pos + MAX_RDR_PACKET_SIZE + 32 <= sizeof(batch))) {
+	 batch_pos += gen_frame(opts, &stats, &batch[batch_pos],
+	       sizeof(batch) - batch_pos, now);
+      }
+
+      if (write_all(s, batch, batch_pos) < 0)
+	 break;
+      stats.bytes += batch_pos;
+
+      if (opts->verbose > 1 && (elapsed - last_report >= 1.0)) {
+	 fprintf(stderr, "conn %u: %llu RDRs, %.0f RDR/s\n",
+	       conn_id, stats.frames, stats.frames / (elapsed > 0 ? elapsed : 1));
+	 last_report = elapsed;
+      }
+   }
+
+   close(s);
+
+   elapsed = elapsed_s(&start_ts);
+   if (opts->verbose)
+      fprintf(stderr, "conn=%u rdrs=%llu turs=%llu corrupted=%llu tur_octets=%llu bytes=%llu "
+	    "seconds=%.3f rdr_per_s=%.0f mbit_per_s=%.1f\n",
+	    conn_id, stats.frames, stats.turs, stats.corrupted, stats.tur_octets, stats.bytes,
+	    elapsed,
+	    stats.frames / (elapsed > 0 ? elapsed : 1),
+	    stats.bytes * 8 / 1e6 / (elapsed > 0 ? elapsed : 1));
+
+   return 0;
+}
+
+static int parse_ratio(const char *str, double *res)
+{
+   char *endptr;
+
+   *res = strtod(str, &endptr);
+   if (*endptr != '\0' || (*res < 0) || (*res > 1)) {
+      fprintf(stderr, "Incorrect ratio %s\n", str);
+      return -1;
+   }
+
+   return 0;
+}
+
+int main(int argc, char *argv[])
+{
+   signed char c;
+   unsigned i;
+   int res;
+   char *servname;
+   struct opts_t opts;
+
+   static struct option longopts[] = {
+      {"version",     no_argument,       0, 'v'},
+      {"help",        no_argument,       0, 'h'},
+      {"verbose",        optional_argument,       0, 'V'},
+      {0, 0, 0, 0}
+   };
+
+   opts.hostname = DEFAULT_DST_HOST;
+   opts.servname = DEFAULT_DST_PORT;
+   opts.fname = NULL;
+   opts.conns = 1;
+   opts.rate = 0;
+   opts.count = 0;
+   opts.duration = 0;
+   opts.other_ratio = 0;
+   opts.interim_ratio = 0;
+   opts.corrupt_ratio = 0;
+   opts.str_len = DEFAULT_STR_LEN;
+   opts.seed = (unsigned long long)time(NULL) ^ ((unsigned long long)getpid() << 32);
+   opts.verbose = 1;
+
+   while ((c = getopt_long(argc, argv, "vhV:d:f:c:r:n:t:o:i:l:x:S:",longopts,NULL)) != -1) {
+      switch (c) {
+	 case 'd':
+	    opts.hostname = optarg;
+	    servname = strrchr(optarg, '/');
+	    if (servname != NULL) {
+	       *servname++ = '\0';
+	       if (*servname != '\0')
+		  opts.servname = servname;
+	       if (optarg[0] == '\0')
+		  opts.hostname = DEFAULT_DST_HOST;
+	    }
+	    break;
+	 case 'f':
+	    opts.fname = optarg;
+	    break;
+	 case 'c':
+	    opts.conns = (unsigned)strtoul(optarg, NULL, 10);
+	    if (opts.conns == 0) {
+	       fprintf(stderr, "Incorrect number of connections\n");
+	       return 1;
+	    }
+	    break;
+	 case 'r':
+	    opts.rate = (unsigned)strtoul(optarg, NULL, 10);
+	    break;
+	 case 'n':
+	    opts.count = strtoull(optarg, NULL, 10);
+	    break;
+	 case 't':
+	    opts.duration = (unsigned)strtoul(optarg, NULL, 10);
+	    break;
+	 case 'o':
+	    if (parse_ratio(optarg, &opts.other_ratio) < 0)
+	       return 1;
+	    break;
+	 case 'i':
+	    if (parse_ratio(optarg, &opts.interim_ratio) < 0)
+	       return 1;
+	    break;
+	 case 'x':
+	    if (parse_ratio(optarg, &opts.corrupt_ratio) < 0)
+	       return 1;
+	    break;
+	 case 'l':
+	    opts.str_len = (unsigned)strtoul(optarg, NULL, 10);
+	    break;
+	 case 'S':
+	    opts.seed = strtoull(optarg, NULL, 0);
+	    break;
+	 case 'V':
+	    if (optarg != NULL) {
+	       opts.verbose=(unsigned)strtoul(optarg, NULL, 0);
+	    }else
+	       opts.verbose=1;
+	    break;
+	 case 'v':
+	    version();
+	    exit(0);
+	    break;
+	 default:
+	    help();
+	    exit(0);
+	    break;
+      }
+   }
+
+   if (opts.fname != NULL && (opts.conns != 1)) {
+      fprintf(stderr, "-f works with a single connection\n");
+      return 1;
+   }
+
+   signal(SIGHUP, sig_quit);
+   signal(SIGINT, sig_quit);
+   signal(SIGTERM, sig_quit);
+   signal(SIGPIPE, SIG_IGN);
+
+   if (opts.conns == 1)
+      return run_connection(&opts, 0) < 0 ? 1 : 0;
+
+   /* One process per connection  */
+   for (i=0; i < opts.conns; ++i) {
+      pid_t pid;
+      pid = fork();
+      if (pid < 0) {
+	 perror("fork() error");
+	 break;
+      }else if (pid == 0) {
+	 exit(run_connection(&opts, i) < 0 ? 1 : 0);
+      }
+   }
+
+   res = 0;
+   for (;;) {
+      int status;
+      pid_t pid;
+      pid = wait(&status);
+      if (pid < 0) {
+	 if (errno == EINTR) {
+	    /* Children receive the signal from the terminal themselves  */
+	    continue;
+	 }
+	 break;
+      }
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+	 res = 1;
+   }
+
+   return res;
+}
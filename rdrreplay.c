@@ -0,0 +1,592 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Replays rdr2netflow -w segments to a TCP endpoint: one connection per
+ * recorded SCE stream, original inter-arrival timing scaled by a factor.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+const char *progname = "rdrreplay";
+const char *revision = "$Revision: 0.2 $";
+
+#define DEFAULT_DST_HOST "127.0.0.1"
+#define DEFAULT_DST_PORT "10000"
+
+/* Stop reading records while this much is not yet sent  */
+#define MAX_PENDING_BYTES (16*1024*1024)
+/* Records later than this are counted as late  */
+#define LATE_THRESHOLD_US 10000
+
+struct opts_t {
+   const char *hostname;
+   const char *servname;
+
+   /* 0 - as fast as possible  */
+   double speed;
+   unsigned loops;
+
+   int verbose;
+};
+
+struct stream_t {
+   struct sockaddr_in src;
+   int s;
+   int closing;
+
+   uint8_t *buf;
+   size_t buf_size;
+   size_t head;
+   size_t tail;
+
+   struct stream_t *next;
+};
+
+struct replay_stats_t {
+   unsigned long long records;
+   unsigned long long bytes;
+   unsigned long long connections;
+   unsigned long long write_errors;
+   unsigned long long late_records;
+   unsigned long long max_lag_us;
+};
+
+struct replay_ctx_t {
+   struct opts_t opts;
+   struct addrinfo *addrinfo;
+   struct stream_t *streams;
+   size_t pending;
+   struct replay_stats_t stats;
+};
+
+static volatile sig_atomic_t quit = 0;
+
+static void usage(void)
+{
+   fprintf(stdout, "\nUsage:\n    %s [-h] [options] segment ...\n"
+	 ,progname);
+   return;
+}
+
+static void version(void)
+{
+   fprintf(stdout,"%s %s\n",progname,revision);
+}
+
+static void help(void)
+{
+ printf("%s - replay recorded Cisco SCE RDR streams\t\t%s\n",
+       progname, revision);
+ usage();
+ printf(
+   "\nOptions:\n"
+   "    -d <host/port>  Send RDR to this host (default %s/%s)\n"
+   "    -s <factor>     Speed factor: 1 - original timing, 10 - 10x faster,\n"
+   "                    0 or max - as fast as possible (default 1)\n"
+   "    -n <num>        Replay segments num times, 0 - forever (default 1)\n"
+   "    -V <level>      Verbose output\n"
+   "    -h, --help                  Help\n"
+   "    -v, --version               Show version\n"
+   "\n",
+   DEFAULT_DST_HOST, DEFAULT_DST_PORT
+ );
+ return;
+}
+
+static void sig_quit(int signal) {
+   quit = signal;
+}
+
+static unsigned long long monotonic_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return 1000000ull * ts.tv_sec + ts.tv_nsec / 1000;
+}
+
+static int open_connection(struct replay_ctx_t *ctx)
+{
+   int s;
+   int flags;
+   const struct addrinfo *ai;
+
+   s = -1;
+   for (ai = ctx->addrinfo; ai != NULL; ai = ai->ai_next) {
+      s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (s < 0)
+	 continue;
+      if (connect(s, ai->ai_addr, ai->ai_addrlen) == 0)
+	 break;
+      close(s);
+      s = -1;
+   }
+
+   if (s < 0) {
+      perror("connect() error");
+      return -1;
+   }
+
+   flags = fcntl(s, F_GETFL, 0);
+   fcntl(s, F_SETFL, flags | O_NONBLOCK);
+
+   return s;
+}
+
+static struct stream_t *find_stream(struct replay_ctx_t *ctx, const struct sockaddr_in *src)
+{
+   struct stream_t *st;
+
+   for (st = ctx->streams; st != NULL; st = st->next) {
+      if (st->src.sin_addr.s_addr == src->sin_addr.s_addr
+	    && (st->src.sin_port == src->sin_port)
+	    && !st->closing)
+	 return st;
+   }
+
+   return NULL;
+}
+
+static struct stream_t *new_stream(struct replay_ctx_t *ctx, const struct sockaddr_in *src)
+{
+   struct stream_t *st;
+
+   st = (struct stream_t *)calloc(1, sizeof(*st));
+   if (st == NULL)
+      return NULL;
+
+   st->src = *src;
+   st->s = open_connection(ctx);
+   if (st->s < 0) {
+      free(st);
+      return NULL;
+   }
+
+   st->next = ctx->streams;
+   ctx->streams = st;
+   ctx->stats.connections += 1;
+
+   if (ctx->opts.verbose > 1)
+      fprintf(stderr, "Stream %s:%u connected\n",
+	    inet_ntoa(src->sin_addr), (unsigned)ntohs(src->sin_port));
+
+   return st;
+}
+
+static void free_stream(struct replay_ctx_t *ctx, struct stream_t *st)
+{
+   struct stream_t **pred;
+
+   for (pred = &ctx->streams; *pred != st; pred = &(*pred)->next)
+      ;
+   *pred = st->next;
+
+   ctx->pending -= st->tail - st->head;
+   if (st->s >= 0)
+      close(st->s);
+   free(st->buf);
+   free(st);
+}
+
+static int stream_append(struct replay_ctx_t *ctx, struct stream_t *st,
+      const uint8_t *data, size_t size)
+{
+   if (st->head == st->tail)
+      st->head = st->tail = 0;
+
+   if (st->tail + size > st->buf_size) {
+      size_t new_size;
+      uint8_t *new_buf;
+
+      if (st->head > 0) {
+	 memmove(st->buf, st->buf + st->head, st->tail - st->head);
+	 st->tail -= st->head;
+	 st->head = 0;
+      }
+      if (st->tail + size > st->buf_size) {
+	 new_size = st->buf_size ? st->buf_size : 64*1024;
+	 while (new_size < st->tail + size)
+	    new_size *= 2;
+	 new_buf = realloc(st->buf, new_size);
+	 if (new_buf == NULL)
+	    return -1;
+	 st->buf = new_buf;
+	 st->buf_size = new_size;
+      }
+   }
+
+   memcpy(st->buf + st->tail, data, size);
+   st->tail += size;
+   ctx->pending += size;
+
+   return 0;
+}
+
+/* Write what the sockets accept, wait at most timeout_us  */
+static void flush_streams(struct replay_ctx_t *ctx, unsigned long long timeout_us)
+{
+   int maxfd;
+   fd_set writefds;
+   struct timeval tv;
+   struct stream_t *st, *next;
+
+   FD_ZERO(&writefds);
+   maxfd = -1;
+   for (st = ctx->streams; st != NULL; st = st->next) {
+      if (st->head == st->tail)
+	 continue;
+      FD_SET(st->s, &writefds);
+      if (st->s > maxfd)
+	 maxfd = st->s;
+   }
+
+   tv.tv_sec = timeout_us / 1000000;
+   tv.tv_usec = timeout_us % 1000000;
+   if (select(maxfd + 1, NULL, maxfd >= 0 ? &writefds : NULL, NULL, &tv) <= 0)
+      return;
+
+   for (st = ctx->streams; st != NULL; st = next) {
+      ssize_t written;
+
+      next = st->next;
+      if (st->head == st->tail || !FD_ISSET(st->s, &writefds))
+	 continue;
+
+      written = write(st->s, st->buf + st->head, st->tail - st->head);
+      if (written < 0) {
+	 if (errno == EAGAIN || (errno == EINTR))
+	    continue;
+	 if (ctx->opts.verbose)
+	    fprintf(stderr, "Stream %s:%u write() error: %s\n",
+		  inet_ntoa(st->src.sin_addr), (unsigned)ntohs(st->src.sin_port),
+		  strerror(errno));
+	 ctx->stats.write_errors += 1;
+	 free_stream(ctx, st);
+	 continue;
+      }
+      st->head += written;
+      ctx->pending -= written;
+      ctx->stats.bytes += written;
+
+      if (st->head == st->tail && st->closing)
+	 free_stream(ctx, st);
+   }
+}
+
+static void close_stream(struct replay_ctx_t *ctx, struct stream_t *st)
+{
+   if (st->head == st->tail)
+      free_stream(ctx, st);
+   else
+      st->closing = 1;
+}
+
+/* Send the rest and close all connections  */
+static void drain_streams(struct replay_ctx_t *ctx)
+{
+   struct stream_t *st, *next;
+
+   for (st = ctx->streams; st != NULL; st = next) {
+      next = st->next;
+      close_stream(ctx, st);
+   }
+
+   while (!quit && (ctx->streams != NULL))
+      flush_streams(ctx, 100000);
+
+   while (ctx->streams != NULL)
+      free_stream(ctx, ctx->streams);
+}
+
+static int handle_record(struct replay_ctx_t *ctx, const struct rdr_segment_rec_info_t *rec)
+{
+   struct stream_t *st;
+
+   st = find_stream(ctx, &rec->src);
+
+   switch (rec->type) {
+      case RDR_SEGMENT_REC_OPEN:
+	 /* SCE reconnected  */
+	 if (st != NULL)
+	    close_stream(ctx, st);
+	 if (new_stream(ctx, &rec->src) == NULL)
+	    return -1;
+	 break;
+      case RDR_SEGMENT_REC_CLOSE:
+	 if (st != NULL)
+	    close_stream(ctx, st);
+	 break;
+      case RDR_SEGMENT_REC_DATA:
+	 if (st == NULL)
+	    st = new_stream(ctx, &rec->src);
+	 if (st == NULL)
+	    return -1;
+	 if (stream_append(ctx, st, rec->data, rec->size) < 0) {
+	    ctx->stats.write_errors += 1;
+	    close_stream(ctx, st);
+	 }
+	 break;
+      default:
+	 break;
+   }
+
+   return 0;
+}
+
+static int replay_file(struct replay_ctx_t *ctx, const char *fname,
+      unsigned long long *start_us, unsigned long long *first_ts_us)
+{
+   int fd;
+   size_t p;
+   ssize_t rec_size;
+   struct stat st;
+   const uint8_t *data;
+   struct rdr_segment_rec_info_t rec;
+
+   fd = open(fname, O_RDONLY);
+   if (fd < 0 || (fstat(fd, &st) < 0)) {
+      fprintf(stderr, "%s: %s\n", fname, strerror(errno));
+      if (fd >= 0)
+	 close(fd);
+      return -1;
+   }
+   if (st.st_size == 0) {
+      close(fd);
+      return 0;
+   }
+
+   data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED) {
+      fprintf(stderr, "mmap() %s: %s\n", fname, strerror(errno));
+      return -1;
+   }
+   madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+   if (!rdr_segment_is_segment(data, st.st_size)) {
+      fprintf(stderr, "%s: not a rdr2netflow segment\n", fname);
+      munmap((void *)data, st.st_size);
+      return -1;
+   }
+
+   for (p = 0; p < (size_t)st.st_size && !quit; p += rec_size) {
+      unsigned long long now_us, target_us;
+
+      rec_size = rdr_segment_parse(data + p, st.st_size - p, &rec);
+      if (rec_size < 0) {
+	 fprintf(stderr, "%s: broken record at offset %lu\n", fname, (unsigned long)p);
+	 break;
+      }
+
+      if (*first_ts_us == 0) {
+	 *first_ts_us = rec.ts_us;
+	 *start_us = monotonic_us();
+      }
+
+      /* Keep the sockets busy while waiting for the record time  */
+      if (ctx->opts.speed > 0 && (rec.ts_us > *first_ts_us)) {
+	 target_us = *start_us + (unsigned long long)((rec.ts_us - *first_ts_us) / ctx->opts.speed);
+	 now_us = monotonic_us();
+	 while (!quit && (now_us < target_us)) {
+	    flush_streams(ctx, target_us - now_us);
+	    now_us = monotonic_us();
+	 }
+	 if (now_us > target_us) {
+	    if (now_us - target_us > ctx->stats.max_lag_us)
+	       ctx->stats.max_lag_us = now_us - target_us;
+	    if (now_us - target_us > LATE_THRESHOLD_US)
+	       ctx->stats.late_records += 1;
+	 }
+      }
+
+      while (!quit && (ctx->pending > MAX_PENDING_BYTES))
+	 flush_streams(ctx, 100000);
+
+      if (handle_record(ctx, &rec) < 0) {
+	 munmap((void *)data, st.st_size);
+	 return -1;
+      }
+      ctx->stats.records += 1;
+      if (ctx->opts.speed == 0)
+	 flush_streams(ctx, 0);
+   }
+
+   munmap((void *)data, st.st_size);
+
+   return quit ? -1 : 0;
+}
+
+static double parse_speed(const char *str)
+{
+   char *endptr;
+   double res;
+
+   if (strcmp(str, "max") == 0)
+      return 0;
+   res = strtod(str, &endptr);
+   if (*endptr != '\0' || (res < 0))
+      return -1;
+
+   return res;
+}
+
+int main(int argc, char *argv[])
+{
+   signed char c;
+   int i, error, res;
+   unsigned loop;
+   char *servname;
+   double elapsed;
+   unsigned long long start_us, first_ts_us, run_start_us;
+   struct addrinfo hints;
+   struct replay_ctx_t ctx;
+
+   static struct option longopts[] = {
+      {"version",     no_argument,       0, 'v'},
+      {"help",        no_argument,       0, 'h'},
+      {"verbose",        optional_argument,       0, 'V'},
+      {0, 0, 0, 0}
+   };
+
+   memset(&ctx, 0, sizeof(ctx));
+   ctx.opts.hostname = DEFAULT_DST_HOST;
+   ctx.opts.servname = DEFAULT_DST_PORT;
+   ctx.opts.speed = 1;
+   ctx.opts.loops = 1;
+   ctx.opts.verbose = 1;
+
+   while ((c = getopt_long(argc, argv, "vhV:d:s:n:",longopts,NULL)) != -1) {
+      switch (c) {
+	 case 'd':
+	    ctx.opts.hostname = optarg;
+	    servname = strrchr(optarg, '/');
+	    if (servname != NULL) {
+	       *servname++ = '\0';
+	       if (*servname != '\0')
+		  ctx.opts.servname = servname;
+	       if (optarg[0] == '\0')
+		  ctx.opts.hostname = DEFAULT_DST_HOST;
+	    }
+	    break;
+	 case 's':
+	    ctx.opts.speed = parse_speed(optarg);
+	    if (ctx.opts.speed < 0) {
+	       fprintf(stderr, "Incorrect speed factor\n");
+	       return 1;
+	    }
+	    break;
+	 case 'n':
+	    ctx.opts.loops = (unsigned)strtoul(optarg, NULL, 10);
+	    break;
+	 case 'V':
+	    if (optarg != NULL) {
+	       ctx.opts.verbose=(unsigned)strtoul(optarg, NULL, 0);
+	    }else
+	       ctx.opts.verbose=1;
+	    break;
+	 case 'v':
+	    version();
+	    exit(0);
+	    break;
+	 default:
+	    help();
+	    exit(0);
+	    break;
+      }
+   }
+   argc -= optind;
+   argv += optind;
+
+   if (argc == 0) {
+      help();
+      return 1;
+   }
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = PF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   error = getaddrinfo(ctx.opts.hostname, ctx.opts.servname, &hints, &ctx.addrinfo);
+   if (error) {
+      fprintf(stderr, "getaddrinfo(%s/%s) error: %s\n",
+	    ctx.opts.hostname, ctx.opts.servname, gai_strerror(error));
+      return 1;
+   }
+
+   signal(SIGHUP, sig_quit);
+   signal(SIGINT, sig_quit);
+   signal(SIGTERM, sig_quit);
+   signal(SIGPIPE, SIG_IGN);
+
+   res = 0;
+   run_start_us = monotonic_us();
+   for (loop = 0; !quit && (ctx.opts.loops == 0 || (loop < ctx.opts.loops)); ++loop) {
+      /* Every pass starts a new set of connections with the original timing  */
+      first_ts_us = start_us = 0;
+      for (i = 0; i < argc && !quit; ++i) {
+	 if (replay_file(&ctx, argv[i], &start_us, &first_ts_us) < 0) {
+	    res = 1;
+	    break;
+	 }
+      }
+      drain_streams(&ctx);
+      if (res != 0)
+	 break;
+   }
+
+   elapsed = (monotonic_us() - run_start_us) / 1e6;
+   if (ctx.opts.verbose)
+      fprintf(stderr, "records=%llu bytes=%llu connections=%llu write_errors=%llu "
+	    "late_records=%llu max_lag_ms=%.1f seconds=%.3f mbit_per_s=%.1f\n",
+	    ctx.stats.records, ctx.stats.bytes, ctx.stats.connections,
+	    ctx.stats.write_errors, ctx.stats.late_records, ctx.stats.max_lag_us / 1000.0,
+	    elapsed, ctx.stats.bytes * 8 / 1e6 / (elapsed > 0 ? elapsed : 1));
+
+   freeaddrinfo(ctx.addrinfo);
+
+   return res;
+}
@@ -0,0 +1,588 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "recorder.h"
+#include "stats.h"
+
+#define TAG "RDR Recorder:"
+
+/* Each of the two buffers  */
+#define RECORDER_BUF_SIZE (4*1024*1024)
+#define RECORDER_BUF_ALIGN 4096
+/* Hand over partially filled buffer after this time  */
+#define RECORDER_FLUSH_INTERVAL_US 1000000
+
+struct rdr_recorder_ctx_t {
+   char *dir;
+   unsigned long long segment_size;
+   unsigned long long segment_us;
+   int verbose;
+
+   pthread_t writer;
+   int writer_started;
+   pthread_mutex_t mtx;
+   pthread_cond_t cond;
+
+   uint8_t *buf[2];
+
+   /* Ingest side: buffer being filled, owned by the main thread  */
+   unsigned active;
+   size_t fill;
+   unsigned long long fill_start_us;
+   unsigned long long seg_bytes;
+   unsigned long long seg_start_us;
+   unsigned seg_no;
+   int rotate_pending;
+
+   /* Handed to the writer, protected by mtx  */
+   struct {
+      int busy;
+      unsigned idx;
+      size_t len;
+      int rotate;
+      unsigned long long seg_start_us;
+      unsigned seg_no;
+   } pending;
+   int stop;
+
+   /* Writer side  */
+   int fd;
+   char *cur_fname;
+   char *tmp_fname;
+
+   struct {
+      unsigned long long records;
+      unsigned long long bytes;
+      unsigned long long dropped_bytes;
+      unsigned long long segments;
+      unsigned long long write_errors;
+   } stats;
+};
+
+static inline void put_uint32(uint8_t *p, uint32_t v)
+{
+   v = htonl(v);
+   memcpy(p, &v, sizeof(v));
+}
+
+static inline uint32_t get_uint32(const uint8_t *p)
+{
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return ntohl(v);
+}
+
+int rdr_segment_is_segment(const void *data, size_t size)
+{
+   return size >= sizeof(struct rdr_segment_rec_t)
+      && (get_uint32((const uint8_t *)data) == RDR_SEGMENT_MAGIC);
+}
+
+ssize_t rdr_segment_parse(const void *data, size_t size, struct rdr_segment_rec_info_t *res)
+{
+   const uint8_t *p;
+   uint16_t v16;
+
+   p = (const uint8_t *)data;
+   if (size < sizeof(struct rdr_segment_rec_t))
+      return -1;
+   if (get_uint32(p + offsetof(struct rdr_segment_rec_t, magic)) != RDR_SEGMENT_MAGIC)
+      return -1;
+
+   res->size = get_uint32(p + offsetof(struct rdr_segment_rec_t, size));
+   if (res->size > size - sizeof(struct rdr_segment_rec_t))
+      return -1;
+
+   res->ts_us = 1000000ull * get_uint32(p + offsetof(struct rdr_segment_rec_t, ts_sec))
+      + get_uint32(p + offsetof(struct rdr_segment_rec_t, ts_usec));
+   memset(&res->src, 0, sizeof(res->src));
+   res->src.sin_family = AF_INET;
+   memcpy(&res->src.sin_addr.s_addr, p + offsetof(struct rdr_segment_rec_t, src_addr), 4);
+   memcpy(&res->src.sin_port, p + offsetof(struct rdr_segment_rec_t, src_port), 2);
+   memcpy(&v16, p + offsetof(struct rdr_segment_rec_t, type), 2);
+   res->type = ntohs(v16);
+   res->data = p + sizeof(struct rdr_segment_rec_t);
+
+   return sizeof(struct rdr_segment_rec_t) + res->size;
+}
+
+struct rdr_recorder_ctx_t *rdr_recorder_init()
+{
+   struct rdr_recorder_ctx_t *ctx;
+
+   ctx = (struct rdr_recorder_ctx_t *)calloc(1, sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->segment_size = RDR_RECORDER_DEFAULT_SEGMENT_MB * 1024ull * 1024ull;
+   ctx->segment_us = RDR_RECORDER_DEFAULT_SEGMENT_S * 1000000ull;
+   ctx->fd = -1;
+   pthread_mutex_init(&ctx->mtx, NULL);
+   pthread_cond_init(&ctx->cond, NULL);
+
+   return ctx;
+}
+
+int rdr_recorder_set_dir(struct rdr_recorder_ctx_t *ctx, const char *dir, FILE *err_stream)
+{
+   struct stat st;
+
+   assert(ctx);
+   assert(dir);
+
+   if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+      if (err_stream != NULL) fprintf(err_stream, "%s %s is not a directory\n", TAG, dir);
+      return -1;
+   }
+
+   free(ctx->dir);
+   ctx->dir = strdup(dir);
+   if (ctx->dir == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+      return -1;
+   }
+
+   return 0;
+}
+
+int rdr_recorder_set_rotation(struct rdr_recorder_ctx_t *ctx, const char *size_secs, FILE *err_stream)
+{
+   char *endptr;
+   unsigned long mb, secs;
+
+   assert(ctx);
+   assert(size_secs);
+
+   mb = strtoul(size_secs, &endptr, 10);
+   secs = ctx->segment_us / 1000000;
+   if (*endptr == '/')
+      secs = strtoul(endptr + 1, &endptr, 10);
+
+   if (mb == 0 || secs == 0 || (*endptr != '\0')) {
+      if (err_stream != NULL) fprintf(err_stream, "%s wrong rotation `%s`, expected size_mb[/seconds]\n",
+	    TAG, size_secs);
+      return -1;
+   }
+
+   ctx->segment_size = mb * 1024ull * 1024ull;
+   ctx->segment_us = secs * 1000000ull;
+
+   return 0;
+}
+
+int rdr_recorder_is_enabled(struct rdr_recorder_ctx_t *ctx)
+{
+   return ctx->dir != NULL;
+}
+
+static unsigned long long realtime_us(void)
+{
+   struct timeval tv;
+
+   gettimeofday(&tv, NULL);
+   return 1000000ull * tv.tv_sec + tv.tv_usec;
+}
+
+/* -1 - close() failed, the caller counts it under mtx  */
+static int close_segment(struct rdr_recorder_ctx_t *ctx)
+{
+   int res;
+
+   if (ctx->fd < 0)
+      return 0;
+
+   res = 0;
+   if (close(ctx->fd) < 0) {
+      res = -1;
+      if (ctx->verbose)
+	 fprintf(stderr, "%s close() %s: %s\n", TAG, ctx->tmp_fname, strerror(errno));
+   }
+   ctx->fd = -1;
+
+   /* Complete segments only under the final name  */
+   if (rename(ctx->tmp_fname, ctx->cur_fname) < 0) {
+      if (ctx->verbose)
+	 fprintf(stderr, "%s rename() %s: %s\n", TAG, ctx->tmp_fname, strerror(errno));
+   }else if (ctx->verbose)
+      fprintf(stderr, "%s segment %s closed\n", TAG, ctx->cur_fname);
+
+   free(ctx->cur_fname);
+   free(ctx->tmp_fname);
+   ctx->cur_fname = ctx->tmp_fname = NULL;
+
+   return res;
+}
+
+static int open_segment(struct rdr_recorder_ctx_t *ctx, unsigned long long start_us, unsigned seg_no)
+{
+   time_t start;
+   struct tm tm;
+   size_t len;
+   char ts[32];
+
+   assert(ctx->fd < 0);
+
+   start = (time_t)(start_us / 1000000);
+   gmtime_r(&start, &tm);
+   strftime(ts, sizeof(ts), "%Y%m%d-%H%M%S", &tm);
+
+   len = strlen(ctx->dir) + 64;
+   ctx->cur_fname = malloc(len);
+   ctx->tmp_fname = malloc(len);
+   if (ctx->cur_fname == NULL || (ctx->tmp_fname == NULL)) {
+      free(ctx->cur_fname);
+      free(ctx->tmp_fname);
+      ctx->cur_fname = ctx->tmp_fname = NULL;
+      return -1;
+   }
+   snprintf(ctx->cur_fname, len, "%s/rdr-%s-%04u.seg", ctx->dir, ts, seg_no);
+   snprintf(ctx->tmp_fname, len, "%s.part", ctx->cur_fname);
+
+   ctx->fd = open(ctx->tmp_fname, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+   if (ctx->fd < 0) {
+      if (ctx->verbose)
+	 fprintf(stderr, "%s open() %s: %s\n", TAG, ctx->tmp_fname, strerror(errno));
+      free(ctx->cur_fname);
+      free(ctx->tmp_fname);
+      ctx->cur_fname = ctx->tmp_fname = NULL;
+      return -1;
+   }
+
+   return 0;
+}
+
+static int write_all(int fd, const uint8_t *data, size_t size)
+{
+   ssize_t written;
+
+   while (size > 0) {
+      written = write(fd, data, size);
+      if (written < 0) {
+	 if (errno == EINTR)
+	    continue;
+	 return -1;
+      }
+      data += written;
+      size -= written;
+   }
+
+   return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+   unsigned idx;
+   size_t len;
+   int rotate, res, closed;
+   unsigned long long seg_start_us;
+   unsigned seg_no;
+   struct rdr_recorder_ctx_t *ctx;
+
+   ctx = (struct rdr_recorder_ctx_t *)arg;
+
+   pthread_mutex_lock(&ctx->mtx);
+   for (;;) {
+      while (!ctx->pending.busy && !ctx->stop)
+	 pthread_cond_wait(&ctx->cond, &ctx->mtx);
+      if (!ctx->pending.busy)
+	 break;
+
+      idx = ctx->pending.idx;
+      len = ctx->pending.len;
+      rotate = ctx->pending.rotate;
+      seg_start_us = ctx->pending.seg_start_us;
+      seg_no = ctx->pending.seg_no;
+      pthread_mutex_unlock(&ctx->mtx);
+
+      res = 0;
+      if (len > 0) {
+	 if (ctx->fd < 0)
+	    res = open_segment(ctx, seg_start_us, seg_no);
+	 if (res == 0)
+	    res = write_all(ctx->fd, ctx->buf[idx], len);
+	 if (res < 0 && ctx->verbose)
+	    fprintf(stderr, "%s write error: %s\n", TAG, strerror(errno));
+      }
+      closed = rotate ? close_segment(ctx) : 0;
+
+      pthread_mutex_lock(&ctx->mtx);
+      if (res < 0) {
+	 ctx->stats.write_errors += 1;
+	 ctx->stats.dropped_bytes += len;
+      }else
+	 ctx->stats.bytes += len;
+      if (closed < 0)
+	 ctx->stats.write_errors += 1;
+      if (rotate)
+	 ctx->stats.segments += 1;
+      ctx->pending.busy = 0;
+      pthread_cond_broadcast(&ctx->cond);
+   }
+   pthread_mutex_unlock(&ctx->mtx);
+
+   if (close_segment(ctx) < 0) {
+      pthread_mutex_lock(&ctx->mtx);
+      ctx->stats.write_errors += 1;
+      pthread_mutex_unlock(&ctx->mtx);
+   }
+
+   return NULL;
+}
+
+int rdr_recorder_start(struct rdr_recorder_ctx_t *ctx, int verbose)
+{
+   unsigned i;
+
+   assert(ctx);
+
+   ctx->verbose = verbose;
+   if (!rdr_recorder_is_enabled(ctx))
+      return 0;
+
+   for (i=0; i < 2; ++i) {
+      if (posix_memalign((void **)&ctx->buf[i], RECORDER_BUF_ALIGN, RECORDER_BUF_SIZE) != 0) {
+	 perror("posix_memalign() error");
+	 return -1;
+      }
+   }
+
+   if (pthread_create(&ctx->writer, NULL, writer_thread, ctx) != 0) {
+      perror("pthread_create() error");
+      return -1;
+   }
+   ctx->writer_started = 1;
+
+   if (verbose)
+      fprintf(stderr, "%s writing to %s, segments %llu MB / %llu s\n", TAG, ctx->dir,
+	    ctx->segment_size / 1024 / 1024, ctx->segment_us / 1000000);
+
+   return 0;
+}
+
+/* Hand the active buffer to the writer. Never waits: -1 if writer is busy  */
+static int submit_buffer(struct rdr_recorder_ctx_t *ctx, int rotate)
+{
+   int res;
+
+   rotate |= ctx->rotate_pending;
+   if (ctx->fill == 0 && !rotate)
+      return 0;
+
+   pthread_mutex_lock(&ctx->mtx);
+   if (ctx->pending.busy) {
+      res = -1;
+      ctx->rotate_pending = rotate;
+   }else {
+      ctx->pending.busy = 1;
+      ctx->pending.idx = ctx->active;
+      ctx->pending.len = ctx->fill;
+      ctx->pending.rotate = rotate;
+      ctx->pending.seg_start_us = ctx->seg_start_us;
+      ctx->pending.seg_no = ctx->seg_no;
+      pthread_cond_signal(&ctx->cond);
+      res = 0;
+   }
+   pthread_mutex_unlock(&ctx->mtx);
+
+   if (res == 0) {
+      ctx->active ^= 1;
+      ctx->fill = 0;
+      ctx->rotate_pending = 0;
+      if (rotate) {
+	 ctx->seg_bytes = 0;
+	 ctx->seg_start_us = 0;
+	 ctx->seg_no += 1;
+      }
+   }
+
+   return res;
+}
+
+void rdr_recorder_append(struct rdr_recorder_ctx_t *ctx, unsigned type,
+      const struct sockaddr_in *src, const void *data, size_t data_size)
+{
+   size_t rec_size;
+   unsigned long long now_us;
+   uint8_t *p;
+   uint16_t v16;
+
+   assert(ctx);
+
+   if (!ctx->writer_started)
+      return;
+
+   rec_size = sizeof(struct rdr_segment_rec_t) + data_size;
+   assert(rec_size <= RECORDER_BUF_SIZE);
+   now_us = realtime_us();
+
+   if (ctx->seg_start_us != 0
+	 && ((ctx->seg_bytes + rec_size > ctx->segment_size)
+	    || (now_us - ctx->seg_start_us >= ctx->segment_us)))
+      submit_buffer(ctx, 1);
+
+   if (ctx->fill + rec_size > RECORDER_BUF_SIZE
+	 || (ctx->fill != 0 && (now_us - ctx->fill_start_us >= RECORDER_FLUSH_INTERVAL_US)))
+      submit_buffer(ctx, 0);
+
+   if (ctx->fill + rec_size > RECORDER_BUF_SIZE) {
+      /* Both buffers are full: disk is too slow  */
+      pthread_mutex_lock(&ctx->mtx);
+      ctx->stats.dropped_bytes += rec_size;
+      pthread_mutex_unlock(&ctx->mtx);
+      return;
+   }
+
+   if (ctx->fill == 0)
+      ctx->fill_start_us = now_us;
+   if (ctx->seg_start_us == 0)
+      ctx->seg_start_us = now_us;
+
+   p = ctx->buf[ctx->active] + ctx->fill;
+   put_uint32(p + offsetof(struct rdr_segment_rec_t, magic), RDR_SEGMENT_MAGIC);
+   put_uint32(p + offsetof(struct rdr_segment_rec_t, size), data_size);
+   put_uint32(p + offsetof(struct rdr_segment_rec_t, ts_sec), now_us / 1000000);
+   put_uint32(p + offsetof(struct rdr_segment_rec_t, ts_usec), now_us % 1000000);
+   memcpy(p + offsetof(struct rdr_segment_rec_t, src_addr), &src->sin_addr.s_addr, 4);
+   memcpy(p + offsetof(struct rdr_segment_rec_t, src_port), &src->sin_port, 2);
+   v16 = htons((uint16_t)type);
+   memcpy(p + offsetof(struct rdr_segment_rec_t, type), &v16, 2);
+   if (data_size > 0)
+      memcpy(p + sizeof(struct rdr_segment_rec_t), data, data_size);
+
+   ctx->fill += rec_size;
+   ctx->seg_bytes += rec_size;
+   ctx->stats.records += 1;
+}
+
+double rdr_recorder_backlog(struct rdr_recorder_ctx_t *ctx)
+{
+   int busy;
+
+   assert(ctx);
+
+   if (!ctx->writer_started)
+      return 0;
+
+   pthread_mutex_lock(&ctx->mtx);
+   busy = ctx->pending.busy;
+   pthread_mutex_unlock(&ctx->mtx);
+
+   return busy ? (double)ctx->fill / RECORDER_BUF_SIZE : 0;
+}
+
+void rdr_recorder_flush(struct rdr_recorder_ctx_t *ctx)
+{
+   unsigned long long now_us;
+
+   assert(ctx);
+
+   if (!ctx->writer_started)
+      return;
+
+   now_us = realtime_us();
+   if (ctx->seg_start_us != 0 && (now_us - ctx->seg_start_us >= ctx->segment_us))
+      submit_buffer(ctx, 1);
+   else
+      submit_buffer(ctx, 0);
+}
+
+void rdr_recorder_destroy(struct rdr_recorder_ctx_t *ctx)
+{
+   if (ctx == NULL)
+      return;
+
+   if (ctx->writer_started) {
+      /* Wait for the writer, then close the segment with the rest  */
+      pthread_mutex_lock(&ctx->mtx);
+      while (ctx->pending.busy)
+	 pthread_cond_wait(&ctx->cond, &ctx->mtx);
+      pthread_mutex_unlock(&ctx->mtx);
+      submit_buffer(ctx, 1);
+
+      pthread_mutex_lock(&ctx->mtx);
+      ctx->stop = 1;
+      pthread_cond_broadcast(&ctx->cond);
+      pthread_mutex_unlock(&ctx->mtx);
+      pthread_join(ctx->writer, NULL);
+   }
+
+   pthread_cond_destroy(&ctx->cond);
+   pthread_mutex_destroy(&ctx->mtx);
+   free(ctx->buf[0]);
+   free(ctx->buf[1]);
+   free(ctx->dir);
+   free(ctx);
+}
+
+void rdr_recorder_print_stats(struct rdr_recorder_ctx_t *ctx, FILE *stream)
+{
+   assert(ctx);
+   assert(stream);
+
+   if (!ctx->writer_started)
+      return;
+
+   pthread_mutex_lock(&ctx->mtx);
+
+#define PRINT_REC_METRIC(_name, _type, _help, _val) \
+   stats_print_header(stream, "rdr2netflow_recorder_" _name, _type, _help); \
+   fprintf(stream, "rdr2netflow_recorder_" _name " %llu\n", (unsigned long long)(_val));
+
+   PRINT_REC_METRIC("records_total", "counter",
+	 "Records appended to the recorder buffer", ctx->stats.records)
+   PRINT_REC_METRIC("written_bytes_total", "counter",
+	 "Bytes written to the segment files", ctx->stats.bytes)
+   PRINT_REC_METRIC("dropped_bytes_total", "counter",
+	 "Bytes dropped on buffer overflow or write error", ctx->stats.dropped_bytes)
+   PRINT_REC_METRIC("segments_total", "counter",
+	 "Closed segment files", ctx->stats.segments)
+   PRINT_REC_METRIC("write_errors_total", "counter",
+	 "Segment write errors", ctx->stats.write_errors)
+   PRINT_REC_METRIC("buffered_bytes", "gauge",
+	 "Bytes waiting in the active buffer", ctx->fill)
+
+#undef PRINT_REC_METRIC
+
+   pthread_mutex_unlock(&ctx->mtx);
+}
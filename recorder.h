@@ -0,0 +1,81 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _RECORDER_H
+#define _RECORDER_H
+
+#define RDR_RECORDER_DEFAULT_SEGMENT_MB 256
+#define RDR_RECORDER_DEFAULT_SEGMENT_S 3600
+
+/*
+ * Segment file: sequence of records, all fields in network byte order.
+ * OPEN and CLOSE records have no data and mark SCE connection lifetime
+ */
+#define RDR_SEGMENT_MAGIC 0x52445231 /* "RDR1"  */
+
+#define RDR_SEGMENT_REC_DATA  0
+#define RDR_SEGMENT_REC_OPEN  1
+#define RDR_SEGMENT_REC_CLOSE 2
+
+struct rdr_segment_rec_t {
+   uint32_t magic;
+   uint32_t size;        /* Data bytes  */
+   uint32_t ts_sec;      /* Arrival time, UTC  */
+   uint32_t ts_usec;
+   uint32_t src_addr;    /* SCE address and port  */
+   uint16_t src_port;
+   uint16_t type;
+   uint8_t data[];
+} __attribute__((__packed__));
+
+/* Decoded record header  */
+struct rdr_segment_rec_info_t {
+   unsigned type;
+   size_t size;
+   unsigned long long ts_us;
+   struct sockaddr_in src;
+   const uint8_t *data;
+};
+
+int rdr_segment_is_segment(const void *data, size_t size);
+/* Returns record size or -1 on a broken record  */
+ssize_t rdr_segment_parse(const void *data, size_t size, struct rdr_segment_rec_info_t *res);
+
+struct rdr_recorder_ctx_t *rdr_recorder_init();
+void rdr_recorder_destroy(struct rdr_recorder_ctx_t *ctx);
+int rdr_recorder_set_dir(struct rdr_recorder_ctx_t *ctx, const char *dir, FILE *err_stream);
+int rdr_recorder_set_rotation(struct rdr_recorder_ctx_t *ctx, const char *size_secs, FILE *err_stream);
+int rdr_recorder_is_enabled(struct rdr_recorder_ctx_t *ctx);
+
+int rdr_recorder_start(struct rdr_recorder_ctx_t *ctx, int verbose);
+void rdr_recorder_append(struct rdr_recorder_ctx_t *ctx, unsigned type,
+      const struct sockaddr_in *src, const void *data, size_t data_size);
+void rdr_recorder_flush(struct rdr_recorder_ctx_t *ctx);
+/* Fill of the buffer waiting for the writer, 0..1; 0 while the writer is idle  */
+double rdr_recorder_backlog(struct rdr_recorder_ctx_t *ctx);
+void rdr_recorder_print_stats(struct rdr_recorder_ctx_t *ctx, FILE *stream);
+
+#endif /* _RECORDER_H  */
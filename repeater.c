@@ -42,6 +42,8 @@
 
 #include "rdr.h"
 #include "repeater.h"
+#include "stats.h"
+#include "probes.h"
 
 #define RECONNECT_TIMEOUT_S 2
 #define TAG "RDR Repeater:"
@@ -75,6 +77,13 @@ struct endpoint_t {
 
    struct endpoint_t *next;
 
+   struct {
+      unsigned long long bytes_written;
+      unsigned long long bytes_dropped;
+      unsigned long long purges;
+      unsigned long long reconnects;
+   } stats;
+
    int iptr, optr;
    uint8_t buf[MAX_RDR_PACKET_SIZE*2];
 };
@@ -158,6 +167,7 @@ int rdr_repeater_add_endpoint(struct rdr_repeater_ctx_t *ctx, const char *addrpo
    ep->next = NULL;
    ep->s = -1;
    ep->status = S_NOT_INITIALIZED;
+   memset(&ep->stats, 0, sizeof(ep->stats));
    purge_buffer(ep);
 
    ep->hostname = strdup(addrport);
@@ -381,6 +391,8 @@ static int try_reopen_socket(struct rdr_repeater_ctx_t *ctx, struct endpoint_t *
    close_socket(ctx, ep);
 
    ep->status = S_NOT_INITIALIZED;
+   ep->stats.reconnects += 1;
+   RDR_PROBE2(repeater_reconnect, ep->hostname, ep->stats.reconnects);
 
    if (ep->cur_addr == NULL)
       ep->cur_addr = ep->addrinfo;
@@ -577,6 +589,26 @@ void rdr_repeater_append(struct rdr_repeater_ctx_t *ctx, void *data, size_t data
 
 }
 
+double rdr_repeater_backlog(struct rdr_repeater_ctx_t *ctx)
+{
+   struct endpoint_t *ep;
+   double fill, res;
+
+   assert(ctx);
+
+   res = 0;
+   for (ep = ctx->head; ep != NULL; ep = ep->next) {
+      /* Disconnected endpoints are purged anyway, do not wait for them  */
+      if (ep->status != S_WRITING)
+	 continue;
+      fill = (double)(ep->iptr - ep->optr) / sizeof(ep->buf);
+      if (fill > res)
+	 res = fill;
+   }
+
+   return res;
+}
+
 static int buffered_write(struct rdr_repeater_ctx_t *ctx, struct endpoint_t *ep,
       void *data, size_t data_size)
 {
@@ -592,6 +624,9 @@ static int buffered_write(struct rdr_repeater_ctx_t *ctx, struct endpoint_t *ep,
 	 if (ctx->verbose >= 10)
 	    fprintf(stderr, "%s %s Buffer overflow. %u bytes packet skipped\n",
 		  TAG, get_endpoint_name(ep), (unsigned)data_size);
+	 ep->stats.purges += 1;
+	 ep->stats.bytes_dropped += data_size;
+	 RDR_PROBE2(repeater_overflow, ep->hostname, data_size);
 	 return 0;
       }
 
@@ -604,6 +639,9 @@ static int buffered_write(struct rdr_repeater_ctx_t *ctx, struct endpoint_t *ep,
 	    if (ctx->verbose >= 10)
 	       fprintf(stderr, "%s %s Buffer overflow. %u bytes skipped\n",
 		     TAG, get_endpoint_name(ep), ep->iptr+1);
+	    ep->stats.purges += 1;
+	    ep->stats.bytes_dropped += ep->iptr - ep->optr;
+	    RDR_PROBE2(repeater_overflow, ep->hostname, ep->iptr - ep->optr);
 	    purge_buffer(ep);
 	 }
       }
@@ -648,6 +686,7 @@ static int buffered_write(struct rdr_repeater_ctx_t *ctx, struct endpoint_t *ep,
       try_reopen_socket(ctx, ep);
    }else {
       ep->optr += written;
+      ep->stats.bytes_written += written;
       if (ep->optr == ep->iptr)
 	 ep->iptr = ep->optr = 0;
    }
@@ -655,3 +694,36 @@ static int buffered_write(struct rdr_repeater_ctx_t *ctx, struct endpoint_t *ep,
    return written;
 }
 
+
+void rdr_repeater_print_stats(struct rdr_repeater_ctx_t *ctx, FILE *stream)
+{
+   struct endpoint_t *ep;
+
+   assert(ctx);
+   assert(stream);
+
+   if (ctx->head == NULL)
+      return;
+
+#define PRINT_EP_METRIC(_name, _type, _help, _val) \
+   stats_print_header(stream, "rdr2netflow_repeater_" _name, _type, _help); \
+   for (ep = ctx->head; ep != NULL; ep = ep->next) { \
+      fprintf(stream, "rdr2netflow_repeater_" _name "{endpoint=\"%s/%s\"} %llu\n", \
+	    ep->hostname, ep->servname, (unsigned long long)(_val)); \
+   }
+
+   PRINT_EP_METRIC("backlog_bytes", "gauge",
+	 "Bytes buffered and not yet written to the endpoint", ep->iptr - ep->optr)
+   PRINT_EP_METRIC("connected", "gauge",
+	 "1 if connection with the endpoint is established", ep->status == S_WRITING)
+   PRINT_EP_METRIC("written_bytes_total", "counter",
+	 "Bytes written to the endpoint", ep->stats.bytes_written)
+   PRINT_EP_METRIC("dropped_bytes_total", "counter",
+	 "Bytes dropped on buffer overflow", ep->stats.bytes_dropped)
+   PRINT_EP_METRIC("purges_total", "counter",
+	 "Buffer overflows", ep->stats.purges)
+   PRINT_EP_METRIC("reconnects_total", "counter",
+	 "Connection attempts", ep->stats.reconnects)
+
+#undef PRINT_EP_METRIC
+}
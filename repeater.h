@@ -38,6 +38,9 @@ int rdr_repeater_init_connection(struct rdr_repeater_ctx_t *ctx, unsigned socket
 void rdr_repeater_on_select(struct rdr_repeater_ctx_t *ctx, fd_set *readfds, fd_set *writefds, int *maxfd);
 int rdr_repeater_step(struct rdr_repeater_ctx_t *ctx, fd_set *readfds, fd_set *writefds);
 void rdr_repeater_append(struct rdr_repeater_ctx_t *ctx, void *data, size_t data_size);
+/* Fill of the fullest buffer of the connected endpoints, 0..1  */
+double rdr_repeater_backlog(struct rdr_repeater_ctx_t *ctx);
+void rdr_repeater_print_stats(struct rdr_repeater_ctx_t *ctx, FILE *stream);
 
 
 #endif /* _RDR_REPEATER_H  */
@@ -0,0 +1,299 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "sampling.h"
+#include "stats.h"
+
+#define TAG "Sampling:"
+
+#define SAMPLING_NONE  0
+#define SAMPLING_COUNT 1
+#define SAMPLING_HASH  2
+
+/* v5 sampling_int modes  */
+#define SAMPLING_V5_DETERMINISTIC 1
+#define SAMPLING_V5_RANDOM        2
+
+struct rdr_sampling_ctx_t {
+   unsigned mode;
+   int adaptive;
+   unsigned interval;
+   unsigned min_interval;
+   unsigned max_interval;
+
+   /* count/N: TURs since the last exported one  */
+   unsigned skipped;
+
+   /* Adaptive state  */
+   unsigned long long last_change_us;
+   unsigned long long last_send_errors;
+
+   struct {
+      unsigned long long selected;
+      unsigned long long skipped;
+      unsigned long long raises;
+      unsigned long long drops;
+   } stats;
+};
+
+struct rdr_sampling_ctx_t *rdr_sampling_init()
+{
+   struct rdr_sampling_ctx_t *ctx;
+
+   ctx = (struct rdr_sampling_ctx_t *)calloc(1, sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->interval = 1;
+
+   return ctx;
+}
+
+void rdr_sampling_destroy(struct rdr_sampling_ctx_t *ctx)
+{
+   free(ctx);
+}
+
+static int parse_interval(const char *str, char **endptr, unsigned *res)
+{
+   unsigned long val;
+
+   val = strtoul(str, endptr, 10);
+   if (*endptr == str || (val == 0) || (val > RDR_SAMPLING_MAX_INTERVAL))
+      return -1;
+   *res = (unsigned)val;
+
+   return 0;
+}
+
+int rdr_sampling_set_mode(struct rdr_sampling_ctx_t *ctx, const char *mode, FILE *err_stream)
+{
+   const char *p;
+   char *endptr;
+
+   assert(ctx);
+   assert(mode);
+
+   ctx->adaptive = 0;
+   if (strncmp(mode, "count/", 6) == 0) {
+      ctx->mode = SAMPLING_COUNT;
+      p = mode + 6;
+   }else if (strncmp(mode, "hash/", 5) == 0) {
+      ctx->mode = SAMPLING_HASH;
+      p = mode + 5;
+   }else if (strncmp(mode, "adaptive", 8) == 0 && (mode[8] == '\0' || (mode[8] == '/'))) {
+      ctx->mode = SAMPLING_HASH;
+      ctx->adaptive = 1;
+      ctx->interval = 1;
+      ctx->max_interval = RDR_SAMPLING_DEFAULT_MAX_INTERVAL;
+      if (mode[8] == '\0') {
+	 ctx->min_interval = ctx->interval;
+	 return 0;
+      }
+      p = mode + 9;
+   }else {
+      if (err_stream != NULL) fprintf(err_stream, "%s unknown mode `%s`, expected count/N, "
+	    "hash/N or adaptive[/N[/max]]\n", TAG, mode);
+      return -1;
+   }
+
+   if (parse_interval(p, &endptr, &ctx->interval) < 0
+	 || (*endptr != '\0' && !(ctx->adaptive && (*endptr == '/')))) {
+      if (err_stream != NULL) fprintf(err_stream, "%s wrong interval `%s`, expected 1-%u\n",
+	    TAG, p, RDR_SAMPLING_MAX_INTERVAL);
+      return -1;
+   }
+   ctx->min_interval = ctx->interval;
+   /* adaptive/N above the default maximum: sampling stays at 1 in N  */
+   if (ctx->max_interval < ctx->min_interval)
+      ctx->max_interval = ctx->min_interval;
+
+   if (*endptr == '/') {
+      p = endptr + 1;
+      if (parse_interval(p, &endptr, &ctx->max_interval) < 0 || (*endptr != '\0')
+	    || (ctx->max_interval < ctx->min_interval)) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong maximum interval `%s`\n", TAG, p);
+	 return -1;
+      }
+   }
+
+   /* Down to N*2^k: every step doubles, so the flows at 2N stay a subset of N  */
+   if (ctx->adaptive) {
+      unsigned max;
+      for (max = ctx->min_interval; max <= ctx->max_interval / 2; max *= 2)
+	 ;
+      ctx->max_interval = max;
+   }
+
+   return 0;
+}
+
+int rdr_sampling_is_enabled(struct rdr_sampling_ctx_t *ctx)
+{
+   return ctx->mode != SAMPLING_NONE;
+}
+
+int rdr_sampling_is_adaptive(struct rdr_sampling_ctx_t *ctx)
+{
+   return ctx->adaptive;
+}
+
+void rdr_sampling_print_info(struct rdr_sampling_ctx_t *ctx, FILE *stream)
+{
+   if (ctx->adaptive)
+      fprintf(stream, "%s adaptive 1 in %u to 1 in %u flows\n", TAG,
+	    ctx->min_interval, ctx->max_interval);
+   else
+      fprintf(stream, "%s 1 in %u %s\n", TAG, ctx->interval,
+	    ctx->mode == SAMPLING_COUNT ? "TURs" : "flows");
+}
+
+static inline uint64_t flow_hash(const struct rdr_sampling_flow_t *flow)
+{
+   uint64_t h;
+
+   h = ((uint64_t)flow->client_ip << 32) | flow->server_ip;
+   h ^= ((uint64_t)flow->client_port << 40) ^ ((uint64_t)flow->server_port << 16)
+      ^ flow->ip_protocol;
+
+   return hash_mix64(h);
+}
+
+int rdr_sampling_select(struct rdr_sampling_ctx_t *ctx, const struct rdr_sampling_flow_t *flow)
+{
+   int res;
+
+   switch (ctx->mode) {
+      case SAMPLING_COUNT:
+	 res = ctx->skipped == 0;
+	 if (++ctx->skipped == ctx->interval)
+	    ctx->skipped = 0;
+	 break;
+      case SAMPLING_HASH:
+	 res = flow_hash(flow) % ctx->interval == 0;
+	 break;
+      default:
+	 return 1;
+   }
+
+   if (res)
+      ctx->stats.selected += 1;
+   else
+      ctx->stats.skipped += 1;
+
+   return res;
+}
+
+uint16_t rdr_sampling_v5_header(struct rdr_sampling_ctx_t *ctx)
+{
+   if (ctx->mode == SAMPLING_NONE)
+      return 0;
+
+   return (uint16_t)(((ctx->mode == SAMPLING_COUNT ? SAMPLING_V5_DETERMINISTIC
+	       : SAMPLING_V5_RANDOM) << 14) | ctx->interval);
+}
+
+unsigned rdr_sampling_adapt(struct rdr_sampling_ctx_t *ctx, double backlog,
+      unsigned long long send_errors, unsigned long long now_us)
+{
+   unsigned next;
+   int errors;
+
+   if (!ctx->adaptive)
+      return 0;
+
+   errors = send_errors != ctx->last_send_errors;
+   ctx->last_send_errors = send_errors;
+
+   next = ctx->interval;
+   if (backlog >= RDR_SAMPLING_BACKLOG_HIGH || errors) {
+      next = 2 * ctx->interval;
+      if (next > ctx->max_interval)
+	 next = ctx->max_interval;
+   }else if (backlog < RDR_SAMPLING_BACKLOG_LOW
+	 && (now_us - ctx->last_change_us >= 1000000ull * RDR_SAMPLING_CALM_S)) {
+      next = ctx->interval / 2;
+      if (next < ctx->min_interval)
+	 next = ctx->min_interval;
+   }
+
+   if (next == ctx->interval) {
+      if (backlog >= RDR_SAMPLING_BACKLOG_LOW || errors)
+	 ctx->last_change_us = now_us;
+      return 0;
+   }
+   ctx->last_change_us = now_us;
+
+   return next;
+}
+
+void rdr_sampling_set_interval(struct rdr_sampling_ctx_t *ctx, unsigned interval)
+{
+   assert(interval >= 1 && (interval <= RDR_SAMPLING_MAX_INTERVAL));
+
+   if (interval > ctx->interval)
+      ctx->stats.raises += 1;
+   else if (interval < ctx->interval)
+      ctx->stats.drops += 1;
+   ctx->interval = interval;
+   ctx->skipped = 0;
+}
+
+void rdr_sampling_print_stats(struct rdr_sampling_ctx_t *ctx, FILE *stream)
+{
+   assert(ctx);
+   assert(stream);
+
+   if (ctx->mode == SAMPLING_NONE)
+      return;
+
+#define PRINT_SAMPLING_METRIC(_name, _type, _help, _val) \
+   stats_print_header(stream, "rdr2netflow_sampling_" _name, _type, _help); \
+   fprintf(stream, "rdr2netflow_sampling_" _name " %llu\n", (unsigned long long)(_val));
+
+   PRINT_SAMPLING_METRIC("interval", "gauge",
+	 "Current sampling interval: 1 in N", ctx->interval)
+   PRINT_SAMPLING_METRIC("selected_turs_total", "counter",
+	 "TURs selected for the export", ctx->stats.selected)
+   PRINT_SAMPLING_METRIC("skipped_turs_total", "counter",
+	 "TURs not exported by sampling", ctx->stats.skipped)
+   PRINT_SAMPLING_METRIC("raises_total", "counter",
+	 "Adaptive interval raises on export backlog", ctx->stats.raises)
+   PRINT_SAMPLING_METRIC("drops_total", "counter",
+	 "Adaptive interval drops after the backlog cleared", ctx->stats.drops)
+
+#undef PRINT_SAMPLING_METRIC
+}
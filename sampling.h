@@ -0,0 +1,85 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _SAMPLING_H
+#define _SAMPLING_H
+
+/* Netflow v5 sampling_int: 2 bits of mode, 14 bits of interval  */
+#define RDR_SAMPLING_MAX_INTERVAL 16383
+#define RDR_SAMPLING_DEFAULT_MAX_INTERVAL 1024
+
+/* Adaptive mode: send buffer fill to raise and to lower the interval  */
+#define RDR_SAMPLING_BACKLOG_HIGH 0.5
+#define RDR_SAMPLING_BACKLOG_LOW  0.125
+/* Seconds without backlog before the interval is lowered  */
+#define RDR_SAMPLING_CALM_S 10
+
+struct rdr_sampling_flow_t {
+   /* Network byte order  */
+   in_addr_t client_ip;
+   in_addr_t server_ip;
+   unsigned client_port;
+   unsigned server_port;
+   unsigned ip_protocol;
+};
+
+/*
+ * Export sampling, one of:
+ *   count/N - every Nth TUR (v5 mode 1, deterministic)
+ *   hash/N  - TURs of 1/N of the flows by a hash of the 5-tuple, every TUR
+ *             of a selected flow is exported (v5 mode 2, random)
+ *   adaptive[/N[/max]] - hash sampling with the interval doubled up to max
+ *             (default 1024, rounded down to N*2^k) while the export backs
+ *             up and halved back down to N (default 1) when it drains
+ * Hash sampling at 2N selects a subset of the flows selected at N.
+ */
+struct rdr_sampling_ctx_t *rdr_sampling_init();
+void rdr_sampling_destroy(struct rdr_sampling_ctx_t *ctx);
+int rdr_sampling_set_mode(struct rdr_sampling_ctx_t *ctx, const char *mode, FILE *err_stream);
+int rdr_sampling_is_enabled(struct rdr_sampling_ctx_t *ctx);
+int rdr_sampling_is_adaptive(struct rdr_sampling_ctx_t *ctx);
+void rdr_sampling_print_info(struct rdr_sampling_ctx_t *ctx, FILE *stream);
+
+/* 1 - export the TUR  */
+int rdr_sampling_select(struct rdr_sampling_ctx_t *ctx, const struct rdr_sampling_flow_t *flow);
+/* sampling_int of the v5 header in host byte order, 0 - not sampled  */
+uint16_t rdr_sampling_v5_header(struct rdr_sampling_ctx_t *ctx);
+
+/*
+ * Adaptive mode, about once a second: backlog is the used part of the
+ * export send buffer (0..1), send_errors the send() failures so far.
+ * Returns the new interval, 0 - keep the current one. The caller flushes
+ * the datagrams of the old interval and applies it with
+ * rdr_sampling_set_interval()
+ */
+unsigned rdr_sampling_adapt(struct rdr_sampling_ctx_t *ctx, double backlog,
+      unsigned long long send_errors, unsigned long long now_us);
+void rdr_sampling_set_interval(struct rdr_sampling_ctx_t *ctx, unsigned interval);
+
+void rdr_sampling_print_stats(struct rdr_sampling_ctx_t *ctx, FILE *stream);
+
+#endif /* _SAMPLING_H  */
@@ -0,0 +1,277 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rdr.h"
+#include "shed.h"
+#include "stats.h"
+
+#define TAG "Overload:"
+
+static const char *const shed_policy_names[RDR_SHED_MAX_POLICIES + 1] = {
+   "none", "nontur", "interim", "bytes"
+};
+
+struct rdr_shed_ctx_t {
+   unsigned policies[RDR_SHED_MAX_POLICIES];
+   unsigned policies_cnt;
+   unsigned long long min_bytes;
+   unsigned high;
+   unsigned low;
+
+   /* Fill to enable the policy, %  */
+   double watermarks[RDR_SHED_MAX_POLICIES];
+   /* Policies of the level as bits (1 << policy)  */
+   unsigned level_mask[RDR_SHED_MAX_POLICIES + 1];
+   char level_names[RDR_SHED_MAX_POLICIES + 1][64];
+
+   struct {
+      unsigned long long nontur_frames;
+      unsigned long long interim_turs;
+      unsigned long long small_turs;
+      unsigned long long level_raises[RDR_SHED_MAX_POLICIES + 1];
+   } stats;
+};
+
+struct rdr_shed_ctx_t *rdr_shed_init()
+{
+   struct rdr_shed_ctx_t *ctx;
+
+   ctx = (struct rdr_shed_ctx_t *)calloc(1, sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->high = RDR_SHED_DEFAULT_HIGH;
+   ctx->low = RDR_SHED_DEFAULT_LOW;
+
+   return ctx;
+}
+
+void rdr_shed_destroy(struct rdr_shed_ctx_t *ctx)
+{
+   free(ctx);
+}
+
+static int parse_percent(const char *str, char **endptr, unsigned *res)
+{
+   unsigned long val;
+
+   val = strtoul(str, endptr, 10);
+   if (*endptr == str || (val == 0) || (val > 100))
+      return -1;
+   if (**endptr == '%')
+      *endptr += 1;
+   *res = (unsigned)val;
+
+   return 0;
+}
+
+int rdr_shed_set_policies(struct rdr_shed_ctx_t *ctx, const char *policies, FILE *err_stream)
+{
+   char *str, *p, *last, *endptr, *watermarks;
+   unsigned i, policy;
+   unsigned long long val;
+   int res;
+
+   assert(ctx);
+   assert(policies);
+
+   str = strdup(policies);
+   if (str == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+      return -1;
+   }
+
+   res = -1;
+   ctx->policies_cnt = 0;
+   watermarks = strchr(str, '/');
+   if (watermarks != NULL)
+      *watermarks++ = '\0';
+
+   for (p = strtok_r(str, ",", &last); p != NULL; p = strtok_r(NULL, ",", &last)) {
+      if (strcmp(p, "nontur") == 0)
+	 policy = RDR_SHED_NONTUR;
+      else if (strcmp(p, "interim") == 0)
+	 policy = RDR_SHED_INTERIM;
+      else if (strncmp(p, "bytes:", 6) == 0) {
+	 val = strtoull(p + 6, &endptr, 10);
+	 if (*endptr != '\0' || (p[6] == '\0') || (val == 0)) {
+	    if (err_stream != NULL) fprintf(err_stream, "%s wrong byte threshold `%s`\n", TAG, p);
+	    goto done;
+	 }
+	 ctx->min_bytes = val;
+	 policy = RDR_SHED_BYTES;
+      }else {
+	 if (err_stream != NULL) fprintf(err_stream, "%s unknown policy `%s`, expected "
+	       "nontur, interim or bytes:N\n", TAG, p);
+	 goto done;
+      }
+      for (i=0; i < ctx->policies_cnt; ++i) {
+	 if (ctx->policies[i] == policy) {
+	    if (err_stream != NULL) fprintf(err_stream, "%s duplicate policy `%s`\n", TAG, p);
+	    goto done;
+	 }
+      }
+      ctx->policies[ctx->policies_cnt++] = policy;
+   }
+
+   if (ctx->policies_cnt == 0) {
+      if (err_stream != NULL) fprintf(err_stream, "%s no policies in `%s`\n", TAG, policies);
+      goto done;
+   }
+
+   if (watermarks != NULL) {
+      if (parse_percent(watermarks, &endptr, &ctx->high) < 0
+	    || (*endptr != '\0' && (*endptr != '/'))) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong high watermark `%s`\n", TAG, watermarks);
+	 goto done;
+      }
+      ctx->low = ctx->high / 2;
+      if (*endptr == '/') {
+	 p = endptr + 1;
+	 if (parse_percent(p, &endptr, &ctx->low) < 0 || (*endptr != '\0')
+	       || (ctx->low >= ctx->high)) {
+	    if (err_stream != NULL) fprintf(err_stream, "%s wrong low watermark `%s`\n", TAG, p);
+	    goto done;
+	 }
+      }
+   }
+
+   ctx->level_mask[0] = 0;
+   strcpy(ctx->level_names[0], shed_policy_names[0]);
+   for (i=0; i < ctx->policies_cnt; ++i) {
+      ctx->watermarks[i] = ctx->high + (double)i * (100 - ctx->high) / ctx->policies_cnt;
+      ctx->level_mask[i + 1] = ctx->level_mask[i] | (1u << ctx->policies[i]);
+      snprintf(ctx->level_names[i + 1], sizeof(ctx->level_names[i + 1]), "%s%s%s",
+	    i == 0 ? "" : ctx->level_names[i], i == 0 ? "" : ",",
+	    shed_policy_names[ctx->policies[i]]);
+   }
+
+   res = 0;
+
+done:
+   free(str);
+   return res;
+}
+
+int rdr_shed_is_enabled(struct rdr_shed_ctx_t *ctx)
+{
+   return ctx->policies_cnt != 0;
+}
+
+void rdr_shed_print_info(struct rdr_shed_ctx_t *ctx, FILE *stream)
+{
+   unsigned i;
+
+   fprintf(stream, "%s", TAG);
+   for (i=0; i < ctx->policies_cnt; ++i) {
+      fprintf(stream, " %s", shed_policy_names[ctx->policies[i]]);
+      if (ctx->policies[i] == RDR_SHED_BYTES)
+	 fprintf(stream, " < %llu", ctx->min_bytes);
+      fprintf(stream, " at %.0f%%%s", ctx->watermarks[i], i + 1 < ctx->policies_cnt ? "," : "");
+   }
+   fprintf(stream, " of the receive buffer, off %u%% lower\n", ctx->high - ctx->low);
+}
+
+unsigned rdr_shed_level(struct rdr_shed_ctx_t *ctx, unsigned level, double backlog)
+{
+   double fill, hysteresis;
+
+   fill = 100.0 * backlog;
+   hysteresis = ctx->high - ctx->low;
+
+   while (level < ctx->policies_cnt && (fill >= ctx->watermarks[level])) {
+      level += 1;
+      ctx->stats.level_raises[level] += 1;
+   }
+   while (level > 0 && (fill < ctx->watermarks[level - 1] - hysteresis))
+      level -= 1;
+
+   return level;
+}
+
+const char *rdr_shed_level_name(struct rdr_shed_ctx_t *ctx, unsigned level)
+{
+   assert(level <= ctx->policies_cnt);
+   return ctx->level_names[level];
+}
+
+int rdr_shed_frame(struct rdr_shed_ctx_t *ctx, unsigned level, unsigned tag)
+{
+   if ((ctx->level_mask[level] & (1u << RDR_SHED_NONTUR)) && (tag != TRANSACTION_USAGE_RDR)) {
+      ctx->stats.nontur_frames += 1;
+      return 1;
+   }
+
+   return 0;
+}
+
+int rdr_shed_tur(struct rdr_shed_ctx_t *ctx, unsigned level, unsigned generation_reason,
+      unsigned long long octets)
+{
+   if ((ctx->level_mask[level] & (1u << RDR_SHED_INTERIM)) && (generation_reason != 0)) {
+      ctx->stats.interim_turs += 1;
+      return 1;
+   }
+
+   if ((ctx->level_mask[level] & (1u << RDR_SHED_BYTES)) && (octets < ctx->min_bytes)) {
+      ctx->stats.small_turs += 1;
+      return 1;
+   }
+
+   return 0;
+}
+
+void rdr_shed_print_stats(struct rdr_shed_ctx_t *ctx, FILE *stream)
+{
+   unsigned i;
+
+   assert(ctx);
+   assert(stream);
+
+   if (ctx->policies_cnt == 0)
+      return;
+
+   stats_print_header(stream, "rdr2netflow_shed_total", "counter",
+	 "RDRs shed under overload by policy");
+   fprintf(stream, "rdr2netflow_shed_total{policy=\"nontur\"} %llu\n", ctx->stats.nontur_frames);
+   fprintf(stream, "rdr2netflow_shed_total{policy=\"interim\"} %llu\n", ctx->stats.interim_turs);
+   fprintf(stream, "rdr2netflow_shed_total{policy=\"bytes\"} %llu\n", ctx->stats.small_turs);
+
+   stats_print_header(stream, "rdr2netflow_shed_level_raises_total", "counter",
+	 "Sessions that entered the shedding level");
+   for (i=1; i <= ctx->policies_cnt; ++i)
+      fprintf(stream, "rdr2netflow_shed_level_raises_total{level=\"%u\",policies=\"%s\"} %llu\n",
+	    i, ctx->level_names[i], ctx->stats.level_raises[i]);
+}
@@ -0,0 +1,69 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _SHED_H
+#define _SHED_H
+
+/* Receive buffer fill of an SCE session to start and to stop shedding, %  */
+#define RDR_SHED_DEFAULT_HIGH 50
+#define RDR_SHED_DEFAULT_LOW  25
+
+/* Policies  */
+#define RDR_SHED_NONTUR  1  /* Skip decoding of RDRs other than TUR  */
+#define RDR_SHED_INTERIM 2  /* Drop interim TURs, GENERATION_REASON != 0  */
+#define RDR_SHED_BYTES   3  /* Drop TURs below the byte threshold  */
+
+#define RDR_SHED_MAX_POLICIES 3
+
+/*
+ * Priority load shedding. The policies are listed in the order of
+ * priority and are enabled one by one as the receive buffer of an SCE
+ * session fills up: the first at the high watermark, the rest evenly
+ * between it and 100%. Each one is disabled when the fill drops below
+ * its watermark less (high - low), so the levels do not flap.
+ */
+struct rdr_shed_ctx_t *rdr_shed_init();
+void rdr_shed_destroy(struct rdr_shed_ctx_t *ctx);
+/* policy[,policy...][/high[/low]], policies: nontur, interim, bytes:N  */
+int rdr_shed_set_policies(struct rdr_shed_ctx_t *ctx, const char *policies, FILE *err_stream);
+int rdr_shed_is_enabled(struct rdr_shed_ctx_t *ctx);
+void rdr_shed_print_info(struct rdr_shed_ctx_t *ctx, FILE *stream);
+
+/* Shedding level of a session (number of enabled policies) for its backlog 0..1  */
+unsigned rdr_shed_level(struct rdr_shed_ctx_t *ctx, unsigned level, double backlog);
+/* Comma separated names of the policies of the level  */
+const char *rdr_shed_level_name(struct rdr_shed_ctx_t *ctx, unsigned level);
+
+/* 1 - do not decode the RDR with this tag. Counted  */
+int rdr_shed_frame(struct rdr_shed_ctx_t *ctx, unsigned level, unsigned tag);
+/* 1 - drop the TUR. Counted  */
+int rdr_shed_tur(struct rdr_shed_ctx_t *ctx, unsigned level, unsigned generation_reason,
+      unsigned long long octets);
+
+void rdr_shed_print_stats(struct rdr_shed_ctx_t *ctx, FILE *stream);
+
+#endif /* _SHED_H  */
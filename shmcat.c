@@ -0,0 +1,255 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Shared memory ring reader (rdr2netflow -M): example consumer and
+ * verification tool for the soak tests. Counts TURs and octets, prints
+ * them with -V 10.
+ */
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+const char *progname = "shmcat";
+const char *revision = "$Revision: 0.2 $";
+
+#define DEFAULT_RING_NAME "rdr2netflow"
+#define DEFAULT_POLL_US 1000
+#define BATCH_SIZE 256
+
+struct opts_t {
+   const char *name;
+   unsigned poll_us;
+   unsigned idle_tmout;
+   int verbose;
+};
+
+struct cat_stats_t {
+   unsigned long long turs;
+   unsigned long long octets;
+   /* TURs of the batches overwritten while read  */
+   unsigned long long torn;
+   unsigned long long reopened;
+};
+
+static volatile sig_atomic_t quit = 0;
+static volatile sig_atomic_t dump_stats = 0;
+
+static void help(void)
+{
+ printf("%s - rdr2netflow shared memory ring reader\t\t%s\n", progname, revision);
+ printf(
+   "\nUsage:\n    %s [-h] [options]\n"
+   "\nOptions:\n"
+   "    -n <name>       Ring name, rdr2netflow -M (default %s)\n"
+   "    -i <us>         Poll interval when the ring is empty (default %u)\n"
+   "    -t <seconds>    Exit after this idle time once TURs arrived, 0 - never (default 0)\n"
+   "    -V <level>      Verbose output, 10 - print TURs\n"
+   "    -h, --help      Help\n"
+   "\n",
+   progname, DEFAULT_RING_NAME, DEFAULT_POLL_US);
+}
+
+static void sig_quit(int signal) {
+   quit = signal;
+}
+
+static void sig_dump_stats(int signal) {
+   dump_stats = signal;
+}
+
+static double elapsed_s(const struct timespec *start)
+{
+   struct timespec now;
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void print_tur(FILE *stream, const struct shmring_tur_t *t)
+{
+   char sce[INET_ADDRSTRLEN], client[INET_ADDRSTRLEN], server[INET_ADDRSTRLEN];
+
+   inet_ntop(AF_INET, &t->sce_addr, sce, sizeof(sce));
+   inet_ntop(AF_INET, &t->client_ip, client, sizeof(client));
+   inet_ntop(AF_INET, &t->server_ip, server, sizeof(server));
+   fprintf(stream, "%s:%u %s:%u %s %s:%u proto %u up %llu down %llu duration %u report_time %llu\n",
+	 sce, t->sce_port, client, t->client_port,
+	 t->initiating_side ? "<-" : "->",
+	 server, t->server_port, t->ip_protocol,
+	 (unsigned long long)t->upstream_volume, (unsigned long long)t->downstream_volume,
+	 t->millisec_duration, (unsigned long long)t->report_time);
+}
+
+static void print_stats(FILE *stream, const struct shmring_consumer_t *c,
+      const struct cat_stats_t *stats, double elapsed)
+{
+   fprintf(stream, "turs=%llu octets=%llu lost=%llu torn=%llu reopened=%llu "
+	 "seconds=%.3f turs_per_s=%.0f\n",
+	 stats->turs, stats->octets, c->lost, stats->torn, stats->reopened,
+	 elapsed, elapsed > 0 ? stats->turs / elapsed : 0.0);
+   fflush(stream);
+}
+
+int main(int argc, char *argv[])
+{
+   signed char c;
+   struct opts_t opts;
+   struct shmring_consumer_t ring;
+   struct cat_stats_t stats;
+   struct timespec start_ts, last_ts, poll_ts;
+   const struct shmring_tur_t *recs;
+   unsigned long long lost;
+   unsigned long long batch_octets;
+   ssize_t n, i;
+   size_t torn;
+   int started;
+
+   static struct option longopts[] = {
+      {"help",        no_argument,       0, 'h'},
+      {"verbose",        optional_argument,       0, 'V'},
+      {0, 0, 0, 0}
+   };
+
+   opts.name = DEFAULT_RING_NAME;
+   opts.poll_us = DEFAULT_POLL_US;
+   opts.idle_tmout = 0;
+   opts.verbose = 1;
+
+   while ((c = getopt_long(argc, argv, "hV:n:i:t:",longopts,NULL)) != -1) {
+      switch (c) {
+	 case 'n':
+	    opts.name = optarg;
+	    break;
+	 case 'i':
+	    opts.poll_us = (unsigned)strtoul(optarg, NULL, 10);
+	    if (opts.poll_us == 0 || (opts.poll_us >= 1000000)) {
+	       fprintf(stderr, "Incorrect poll interval\n");
+	       return 1;
+	    }
+	    break;
+	 case 't':
+	    opts.idle_tmout = (unsigned)strtoul(optarg, NULL, 10);
+	    break;
+	 case 'V':
+	    if (optarg != NULL)
+	       opts.verbose=(unsigned)strtoul(optarg, NULL, 0);
+	    else
+	       opts.verbose=1;
+	    break;
+	 default:
+	    help();
+	    exit(0);
+	    break;
+      }
+   }
+
+   if (shmring_open(&ring, opts.name) < 0) {
+      fprintf(stderr, "shmring_open(%s) error: %s\n", opts.name, strerror(errno));
+      return 1;
+   }
+
+   signal(SIGHUP, sig_quit);
+   signal(SIGINT, sig_quit);
+   signal(SIGTERM, sig_quit);
+   signal(SIGUSR1, sig_dump_stats);
+
+   memset(&stats, 0, sizeof(stats));
+   started = 0;
+   clock_gettime(CLOCK_MONOTONIC, &start_ts);
+   last_ts = start_ts;
+   poll_ts.tv_sec = 0;
+   poll_ts.tv_nsec = opts.poll_us * 1000l;
+
+   while (!quit) {
+      if (dump_stats) {
+	 dump_stats = 0;
+	 print_stats(stderr, &ring, &stats, started ? elapsed_s(&start_ts) : 0);
+      }
+
+      n = shmring_peek(&ring, &recs, BATCH_SIZE);
+      if (n < 0) {
+	 /* rdr2netflow created a new ring  */
+	 lost = ring.lost;
+	 shmring_close(&ring);
+	 if (shmring_open(&ring, opts.name) < 0) {
+	    fprintf(stderr, "shmring_open(%s) error: %s\n", opts.name, strerror(errno));
+	    break;
+	 }
+	 ring.lost = lost;
+	 stats.reopened += 1;
+	 continue;
+      }
+
+      if (n == 0) {
+	 if (started && opts.idle_tmout != 0 && (elapsed_s(&last_ts) >= opts.idle_tmout))
+	    break;
+	 nanosleep(&poll_ts, NULL);
+	 continue;
+      }
+
+      if (!started) {
+	 started = 1;
+	 clock_gettime(CLOCK_MONOTONIC, &start_ts);
+      }
+
+      batch_octets = 0;
+      for (i=0; i < n; ++i) {
+	 batch_octets += recs[i].upstream_volume + recs[i].downstream_volume;
+	 if (opts.verbose >= 10)
+	    print_tur(stdout, &recs[i]);
+      }
+
+      /* Some were overwritten while we were counting: drop the batch  */
+      torn = shmring_release(&ring);
+      if (torn == 0) {
+	 stats.turs += n;
+	 stats.octets += batch_octets;
+      }else
+	 stats.torn += n;
+
+      clock_gettime(CLOCK_MONOTONIC, &last_ts);
+   }
+
+   print_stats(stdout, &ring, &stats, started ? elapsed_s(&start_ts) : 0);
+   shmring_close(&ring);
+
+   return 0;
+}
@@ -0,0 +1,390 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shmring.h"
+#include "stats.h"
+
+#define TAG "Shmring:"
+
+struct rdr_shmring_ctx_t {
+   char *name;
+   unsigned capacity;
+   int verbose;
+
+   int fd;
+   struct shmring_hdr_t *hdr;
+   struct shmring_tur_t *records;
+   size_t map_size;
+
+   /* Writer copy of hdr->head  */
+   uint64_t head;
+   uint64_t mask;
+
+   unsigned long long appended;
+};
+
+static size_t ring_size(unsigned capacity)
+{
+   return SHMRING_HDR_SIZE + (size_t)capacity * sizeof(struct shmring_tur_t);
+}
+
+struct rdr_shmring_ctx_t *rdr_shmring_init()
+{
+   struct rdr_shmring_ctx_t *ctx;
+
+   ctx = (struct rdr_shmring_ctx_t *)calloc(1, sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->capacity = RDR_SHMRING_DEFAULT_RECORDS;
+   ctx->fd = -1;
+
+   return ctx;
+}
+
+int rdr_shmring_set_name(struct rdr_shmring_ctx_t *ctx, const char *name_records, FILE *err_stream)
+{
+   const char *p;
+   char *endptr;
+   unsigned long records;
+   size_t len;
+
+   assert(ctx);
+   assert(name_records);
+
+   /* shm_open() names are "/name"  */
+   if (name_records[0] == '/')
+      name_records += 1;
+
+   records = ctx->capacity;
+   p = strchr(name_records, '/');
+   len = p == NULL ? strlen(name_records) : (size_t)(p - name_records);
+   if (p != NULL) {
+      records = strtoul(p + 1, &endptr, 10);
+      if (*endptr != '\0')
+	 records = 0;
+   }
+
+   if (len == 0 || (len > 200)
+	 || (records < 1024) || (records > (1ul << 28)) || (records & (records - 1))) {
+      if (err_stream != NULL) fprintf(err_stream, "%s wrong ring `%s`, expected name[/records],"
+	    " records is a power of 2 from 1024\n", TAG, name_records);
+      return -1;
+   }
+
+   free(ctx->name);
+   ctx->name = malloc(len + 2);
+   if (ctx->name == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s malloc() error\n", TAG);
+      return -1;
+   }
+   ctx->name[0] = '/';
+   memcpy(ctx->name + 1, name_records, len);
+   ctx->name[len + 1] = '\0';
+   ctx->capacity = (unsigned)records;
+
+   return 0;
+}
+
+int rdr_shmring_is_enabled(struct rdr_shmring_ctx_t *ctx)
+{
+   return ctx->name != NULL;
+}
+
+/* Existing ring of the same layout is kept, readers continue with it  */
+static int reuse_ring(struct rdr_shmring_ctx_t *ctx)
+{
+   struct stat st;
+   struct shmring_hdr_t *hdr;
+
+   if (fstat(ctx->fd, &st) < 0 || (st.st_size < SHMRING_HDR_SIZE))
+      return 0;
+
+   hdr = mmap(NULL, SHMRING_HDR_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd, 0);
+   if (hdr == MAP_FAILED)
+      return 0;
+
+   if (hdr->magic == SHMRING_MAGIC
+	 && (hdr->version == SHMRING_VERSION)
+	 && (hdr->record_size == sizeof(struct shmring_tur_t))
+	 && (hdr->capacity == ctx->capacity)
+	 && ((size_t)st.st_size == ctx->map_size)
+	 && !hdr->closed) {
+      munmap(hdr, SHMRING_HDR_SIZE);
+      return 1;
+   }
+
+   /* Readers of the old object reopen by name  */
+   if (hdr->magic == SHMRING_MAGIC)
+      __atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+   munmap(hdr, SHMRING_HDR_SIZE);
+
+   return 0;
+}
+
+int rdr_shmring_start(struct rdr_shmring_ctx_t *ctx, int verbose)
+{
+   int reused;
+
+   assert(ctx);
+
+   ctx->verbose = verbose;
+   if (!rdr_shmring_is_enabled(ctx))
+      return 0;
+
+   ctx->map_size = ring_size(ctx->capacity);
+   ctx->mask = ctx->capacity - 1;
+
+   ctx->fd = shm_open(ctx->name, O_RDWR | O_CREAT, 0644);
+   if (ctx->fd < 0) {
+      fprintf(stderr, "%s shm_open(%s) error: %s\n", TAG, ctx->name, strerror(errno));
+      return -1;
+   }
+
+   reused = reuse_ring(ctx);
+   if (!reused) {
+      /* New object: readers holding the old mapping are never truncated under  */
+      close(ctx->fd);
+      shm_unlink(ctx->name);
+      ctx->fd = shm_open(ctx->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+      if (ctx->fd < 0) {
+	 fprintf(stderr, "%s shm_open(%s) error: %s\n", TAG, ctx->name, strerror(errno));
+	 return -1;
+      }
+      if (ftruncate(ctx->fd, ctx->map_size) < 0) {
+	 fprintf(stderr, "%s ftruncate(%s) error: %s\n", TAG, ctx->name, strerror(errno));
+	 return -1;
+      }
+   }
+
+   ctx->hdr = mmap(NULL, ctx->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd, 0);
+   if (ctx->hdr == MAP_FAILED) {
+      ctx->hdr = NULL;
+      fprintf(stderr, "%s mmap(%s) error: %s\n", TAG, ctx->name, strerror(errno));
+      return -1;
+   }
+   ctx->records = (struct shmring_tur_t *)((uint8_t *)ctx->hdr + SHMRING_HDR_SIZE);
+
+   if (!reused) {
+      /* Fault in the pages now, not on the first records  */
+      memset(ctx->hdr, 0, ctx->map_size);
+      ctx->hdr->magic = SHMRING_MAGIC;
+      ctx->hdr->version = SHMRING_VERSION;
+      ctx->hdr->record_size = sizeof(struct shmring_tur_t);
+      ctx->hdr->capacity = ctx->capacity;
+      ctx->hdr->epoch = ((uint64_t)time(NULL) << 32) ^ (stats_monotonic_us() << 8) ^ getpid();
+   }
+   ctx->head = __atomic_load_n(&ctx->hdr->head, __ATOMIC_ACQUIRE);
+   __atomic_store_n(&ctx->hdr->producer_pid, (uint32_t)getpid(), __ATOMIC_RELEASE);
+
+   if (verbose)
+      fprintf(stderr, "%s %s /dev/shm%s, %u records of %u bytes\n", TAG,
+	    reused ? "continuing" : "created", ctx->name, ctx->capacity,
+	    (unsigned)sizeof(struct shmring_tur_t));
+
+   return 0;
+}
+
+void rdr_shmring_append(struct rdr_shmring_ctx_t *ctx, const struct shmring_tur_t *rec)
+{
+   if (ctx->hdr == NULL)
+      return;
+
+   /* Readers must see the head of the previous record before the slot changes  */
+   __atomic_thread_fence(__ATOMIC_RELEASE);
+   ctx->records[ctx->head & ctx->mask] = *rec;
+   ctx->head += 1;
+   __atomic_store_n(&ctx->hdr->head, ctx->head, __ATOMIC_RELEASE);
+   ctx->appended += 1;
+}
+
+void rdr_shmring_destroy(struct rdr_shmring_ctx_t *ctx)
+{
+   if (ctx == NULL)
+      return;
+
+   /* The ring stays for the readers and the next start  */
+   if (ctx->hdr != NULL) {
+      uint32_t pid;
+      /* After an upgrade the new process already writes the ring under its pid  */
+      pid = (uint32_t)getpid();
+      __atomic_compare_exchange_n(&ctx->hdr->producer_pid, &pid, 0, 0,
+	    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+      munmap(ctx->hdr, ctx->map_size);
+   }
+   if (ctx->fd >= 0)
+      close(ctx->fd);
+   free(ctx->name);
+   free(ctx);
+}
+
+void rdr_shmring_print_stats(struct rdr_shmring_ctx_t *ctx, FILE *stream)
+{
+   assert(ctx);
+   assert(stream);
+
+   if (ctx->hdr == NULL)
+      return;
+
+   stats_print_header(stream, "rdr2netflow_shmring_records_total", "counter",
+	 "TURs written to the shared memory ring");
+   fprintf(stream, "rdr2netflow_shmring_records_total %llu\n", ctx->appended);
+   stats_print_header(stream, "rdr2netflow_shmring_capacity", "gauge",
+	 "Shared memory ring size in records");
+   fprintf(stream, "rdr2netflow_shmring_capacity %u\n", ctx->capacity);
+}
+
+int shmring_open(struct shmring_consumer_t *c, const char *name)
+{
+   struct stat st;
+   char shm_name[256];
+
+   assert(c);
+   assert(name);
+
+   memset(c, 0, sizeof(*c));
+   c->fd = -1;
+
+   snprintf(shm_name, sizeof(shm_name), "%s%s", name[0] == '/' ? "" : "/", name);
+   c->fd = shm_open(shm_name, O_RDONLY, 0);
+   if (c->fd < 0)
+      return -1;
+
+   if (fstat(c->fd, &st) < 0 || (st.st_size < SHMRING_HDR_SIZE)) {
+      errno = EINVAL;
+      goto failed;
+   }
+
+   c->map_size = st.st_size;
+   c->hdr = mmap(NULL, c->map_size, PROT_READ, MAP_SHARED, c->fd, 0);
+   if (c->hdr == MAP_FAILED) {
+      c->hdr = NULL;
+      goto failed;
+   }
+
+   if (c->hdr->magic != SHMRING_MAGIC
+	 || (c->hdr->version != SHMRING_VERSION)
+	 || (c->hdr->record_size != sizeof(struct shmring_tur_t))
+	 || (c->hdr->capacity == 0)
+	 || (ring_size(c->hdr->capacity) > c->map_size)) {
+      errno = EINVAL;
+      goto failed;
+   }
+
+   c->records = (const struct shmring_tur_t *)((const uint8_t *)c->hdr + SHMRING_HDR_SIZE);
+   c->capacity = c->hdr->capacity;
+   c->epoch = __atomic_load_n(&c->hdr->epoch, __ATOMIC_ACQUIRE);
+   c->pos = __atomic_load_n(&c->hdr->head, __ATOMIC_ACQUIRE);
+
+   return 0;
+
+failed:
+   shmring_close(c);
+   return -1;
+}
+
+void shmring_close(struct shmring_consumer_t *c)
+{
+   int saved_errno;
+
+   saved_errno = errno;
+   if (c->hdr != NULL)
+      munmap((void *)c->hdr, c->map_size);
+   if (c->fd >= 0)
+      close(c->fd);
+   c->hdr = NULL;
+   c->fd = -1;
+   errno = saved_errno;
+}
+
+ssize_t shmring_peek(struct shmring_consumer_t *c, const struct shmring_tur_t **recs, size_t max)
+{
+   uint64_t head, n, idx, skip;
+
+   c->peeked = 0;
+
+   if (__atomic_load_n(&c->hdr->closed, __ATOMIC_ACQUIRE)
+	 || (__atomic_load_n(&c->hdr->epoch, __ATOMIC_ACQUIRE) != c->epoch))
+      return -1;
+
+   head = __atomic_load_n(&c->hdr->head, __ATOMIC_ACQUIRE);
+   if (head - c->pos >= c->capacity) {
+      /* Overrun: continue from the middle of the ring, not at the writer  */
+      skip = head - c->pos - c->capacity / 2;
+      c->pos += skip;
+      c->lost += skip;
+   }
+
+   n = head - c->pos;
+   if (n == 0)
+      return 0;
+
+   idx = c->pos & (c->capacity - 1);
+   if (n > c->capacity - idx)
+      n = c->capacity - idx;
+   if (n > max)
+      n = max;
+
+   *recs = &c->records[idx];
+   c->peeked = n;
+
+   return (ssize_t)n;
+}
+
+size_t shmring_release(struct shmring_consumer_t *c)
+{
+   uint64_t head, torn;
+
+   /* Reads of the records are done before the head check  */
+   __atomic_thread_fence(__ATOMIC_ACQUIRE);
+   head = __atomic_load_n(&c->hdr->head, __ATOMIC_RELAXED);
+
+   torn = 0;
+   if (head - c->pos >= c->capacity) {
+      torn = head - c->capacity + 1 - c->pos;
+      if (torn > c->peeked)
+	 torn = c->peeked;
+   }
+
+   c->pos += c->peeked;
+   c->peeked = 0;
+   c->lost += torn;
+
+   return (size_t)torn;
+}
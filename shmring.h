@@ -0,0 +1,127 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _SHMRING_H
+#define _SHMRING_H
+
+#define RDR_SHMRING_DEFAULT_RECORDS (1024*1024)
+
+/*
+ * Shared memory ring of decoded TURs for consumers on the same host.
+ *
+ * POSIX shared memory object (/dev/shm/<name>): shmring_hdr_t, then
+ * capacity records of shmring_tur_t, capacity is a power of 2. There is
+ * one writer and any number of readers, each reader keeps its own
+ * position. The writer never waits: record N is stored in slot
+ * N % capacity, then head is set to N + 1. Slow readers lose records.
+ *
+ * A reader may use the records in place: a slot is valid while
+ * head < N + capacity, shmring_release() checks it after use.
+ */
+#define SHMRING_MAGIC 0x52445253 /* "RDRS"  */
+#define SHMRING_VERSION 1
+#define SHMRING_HDR_SIZE 128
+
+struct shmring_hdr_t {
+   uint32_t magic;
+   uint32_t version;
+   uint32_t record_size;
+   uint32_t capacity;
+   /* Changes when the writer reinitializes the ring  */
+   uint64_t epoch;
+   /* Writer pid, 0 when not running  */
+   uint32_t producer_pid;
+   /* The object was replaced by a new one, reopen it  */
+   uint32_t closed;
+   uint8_t pad[32];
+
+   /* Records written in this epoch, own cache line  */
+   uint64_t head __attribute__((aligned(64)));
+};
+
+/* TUR, addresses in network byte order, the rest in host byte order  */
+struct shmring_tur_t {
+   uint32_t sce_addr;
+   uint16_t sce_port;
+   uint8_t ip_protocol;
+   /* 0 - subscriber side, 1 - network side  */
+   uint8_t initiating_side;
+   uint32_t client_ip;
+   uint32_t server_ip;
+   uint16_t client_port;
+   uint16_t server_port;
+   uint32_t millisec_duration;
+   /* REPORT_TIME, unix seconds  */
+   uint64_t report_time;
+   uint64_t upstream_volume;
+   uint64_t downstream_volume;
+   /* Arrival time of the RDR, CLOCK_MONOTONIC us  */
+   uint64_t rcvd_us;
+   uint8_t pad[8];
+};
+
+/* Writer  */
+struct rdr_shmring_ctx_t *rdr_shmring_init();
+void rdr_shmring_destroy(struct rdr_shmring_ctx_t *ctx);
+int rdr_shmring_set_name(struct rdr_shmring_ctx_t *ctx, const char *name_records, FILE *err_stream);
+int rdr_shmring_is_enabled(struct rdr_shmring_ctx_t *ctx);
+
+int rdr_shmring_start(struct rdr_shmring_ctx_t *ctx, int verbose);
+void rdr_shmring_append(struct rdr_shmring_ctx_t *ctx, const struct shmring_tur_t *rec);
+void rdr_shmring_print_stats(struct rdr_shmring_ctx_t *ctx, FILE *stream);
+
+/* Reader  */
+struct shmring_consumer_t {
+   int fd;
+   const struct shmring_hdr_t *hdr;
+   const struct shmring_tur_t *records;
+   size_t map_size;
+   uint64_t capacity;
+   uint64_t epoch;
+   uint64_t pos;
+   /* Records returned by the last shmring_peek()  */
+   uint64_t peeked;
+   /* Overwritten before or while they were read  */
+   unsigned long long lost;
+};
+
+/* Attach to the ring, reading starts from the next written record  */
+int shmring_open(struct shmring_consumer_t *c, const char *name);
+void shmring_close(struct shmring_consumer_t *c);
+/*
+ * Up to max records in place, *recs is valid until shmring_release().
+ * Returns 0 if there are no new records, -1 if the ring was replaced
+ * (shmring_close() and shmring_open() again)
+ */
+ssize_t shmring_peek(struct shmring_consumer_t *c, const struct shmring_tur_t **recs, size_t max);
+/*
+ * Done with the records of the last shmring_peek(). Returns how many of
+ * the first of them were overwritten while in use, they should be
+ * discarded and are counted in lost
+ */
+size_t shmring_release(struct shmring_consumer_t *c);
+
+#endif /* _SHMRING_H  */
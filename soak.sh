@@ -0,0 +1,117 @@
+#!/bin/sh
+#
+# End-to-end soak test: rdrgen -> rdr2netflow -> nfsink over loopback.
+#
+# For each rate step rdrgen pushes a fixed-seed TUR stream for DURATION
+# seconds, nfsink verifies the exported datagrams and the step is marked
+# lossless when records == 2*turs, octets match and flow_seq has no gaps.
+#
+# Usage: ./soak.sh [rate ...]
+#
+# Environment: DURATION (default 5), CONNS (default 1), SEED (default 1),
+# RDR_PORT (default 10100), NF_PORT (default 9995), RCVBUF (default 8388608)
+
+DURATION=${DURATION:-5}
+CONNS=${CONNS:-1}
+SEED=${SEED:-1}
+RDR_PORT=${RDR_PORT:-10100}
+NF_PORT=${NF_PORT:-9995}
+RCVBUF=${RCVBUF:-8388608}
+RATES=${*:-"1000 5000 10000 20000 50000 100000 200000 0"}
+
+BINDIR=$(dirname "$0")
+TMPDIR=$(mktemp -d /tmp/rdrsoak.XXXXXX) || exit 1
+
+for b in rdr2netflow rdrgen nfsink; do
+   if [ ! -x "$BINDIR/$b" ]; then
+      echo "$BINDIR/$b not found, run make first" >&2
+      exit 1
+   fi
+done
+
+kv() {
+   # kv <key> <file>: value of key=value from the last line of the file
+   tail -n 1 "$2" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+
+sum_kv() {
+   # sum_kv <key> <file>: sum of key=value over all lines of the file
+   tr ' ' '\n' < "$2" | sed -n "s/^$1=//p" | awk '{ s += $1 } END { printf "%.0f", s }'
+}
+
+cpu_ticks() {
+   awk '{ print $14 + $15 }' /proc/$1/stat 2>/dev/null
+}
+
+mem_kb() {
+   sed -n "s/^$2:[[:space:]]*\([0-9]*\) kB/\1/p" /proc/$1/status 2>/dev/null
+}
+
+cleanup() {
+   [ -n "$SINK_PID" ] && kill $SINK_PID 2>/dev/null
+   [ -n "$CONV_PID" ] && kill $CONV_PID 2>/dev/null
+   wait 2>/dev/null
+   rm -rf "$TMPDIR"
+}
+trap cleanup EXIT INT TERM
+
+HZ=$(getconf CLK_TCK)
+
+"$BINDIR/rdr2netflow" -s 127.0.0.1 -p $RDR_PORT -d 127.0.0.1 -P $NF_PORT \
+   -b $RCVBUF -V 0 2> "$TMPDIR/rdr2netflow.log" &
+CONV_PID=$!
+sleep 0.5
+if ! kill -0 $CONV_PID 2>/dev/null; then
+   cat "$TMPDIR/rdr2netflow.log" >&2
+   exit 1
+fi
+
+printf "rate\tturs\tturs_per_s\trecords\tlost\tcpu_pct\trss_kb\tresult\n"
+
+MAX_LOSSLESS=0
+for rate in $RATES; do
+   "$BINDIR/nfsink" -p $NF_PORT -b $RCVBUF -t 2 > "$TMPDIR/sink.out" 2> "$TMPDIR/sink.log" &
+   SINK_PID=$!
+   sleep 0.2
+
+   cpu0=$(cpu_ticks $CONV_PID)
+   "$BINDIR/rdrgen" -d 127.0.0.1/$RDR_PORT -c $CONNS -r $rate -t $DURATION \
+      -S $SEED 2> "$TMPDIR/gen.out"
+   cpu1=$(cpu_ticks $CONV_PID)
+
+   wait $SINK_PID
+   SINK_PID=
+
+   turs=$(sum_kv turs "$TMPDIR/gen.out")
+   tur_octets=$(sum_kv tur_octets "$TMPDIR/gen.out")
+   seconds=$(kv seconds "$TMPDIR/gen.out")
+   records=$(kv records "$TMPDIR/sink.out")
+   octets=$(kv octets "$TMPDIR/sink.out")
+   seq_lost=$(kv lost "$TMPDIR/sink.out")
+   bad=$(kv bad "$TMPDIR/sink.out")
+   rss=$(mem_kb $CONV_PID VmRSS)
+
+   if [ -z "$turs" ] || [ -z "$records" ]; then
+      echo "step $rate: no results" >&2
+      cat "$TMPDIR/gen.out" "$TMPDIR/sink.out" "$TMPDIR/sink.log" >&2
+      exit 1
+   fi
+
+   lost=$((2 * turs - records))
+   turs_per_s=$(awk -v t=$turs -v s=$seconds 'BEGIN { printf "%.0f", (s > 0) ? t / s : 0 }')
+   cpu_pct=$(awk -v c=$((cpu1 - cpu0)) -v hz=$HZ -v s=$seconds \
+      'BEGIN { printf "%.1f", (s > 0) ? 100 * c / hz / s : 0 }')
+
+   if [ $lost -eq 0 ] && [ "$octets" = "$tur_octets" ] \
+	 && [ "$seq_lost" = "0" ] && [ "$bad" = "0" ]; then
+      result=ok
+      [ $turs_per_s -gt $MAX_LOSSLESS ] && MAX_LOSSLESS=$turs_per_s
+   else
+      result=LOSS
+   fi
+
+   printf "%s\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n" \
+      "$rate" "$turs" "$turs_per_s" "$records" "$lost" "$cpu_pct" "$rss" "$result"
+done
+
+echo "max_lossless_turs_per_s=$MAX_LOSSLESS rss_kb=$(mem_kb $CONV_PID VmRSS) hwm_kb=$(mem_kb $CONV_PID VmHWM)"
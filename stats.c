@@ -0,0 +1,597 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+#define MAX_CLIENTS 8
+#define CLIENT_TIMEOUT_S 5
+#define TAG "Stats:"
+
+struct stats_client_t {
+   int s;
+
+   enum {
+      C_FREE=0,
+      C_READING=1,
+      C_WRITING=2
+   } status;
+
+   time_t start_ts;
+
+   size_t rpos;
+   char rbuf[1024];
+
+   char *wbuf;
+   size_t wlen;
+   size_t wpos;
+};
+
+struct stats_srv_ctx_t {
+   char *hostname;
+   char *servname;
+
+   int s;
+   int verbose;
+
+   stats_print_f print_f;
+   void *print_arg;
+
+   struct stats_client_t clients[MAX_CLIENTS];
+};
+
+static void close_client(struct stats_client_t *c);
+static void accept_client(struct stats_srv_ctx_t *ctx);
+static void read_request(struct stats_srv_ctx_t *ctx, struct stats_client_t *c);
+static void prepare_response(struct stats_srv_ctx_t *ctx, struct stats_client_t *c);
+static void write_response(struct stats_srv_ctx_t *ctx, struct stats_client_t *c);
+
+struct stats_srv_ctx_t *stats_srv_init(stats_print_f print_f, void *print_arg)
+{
+   unsigned i;
+   struct stats_srv_ctx_t *ctx;
+
+   assert(print_f);
+
+   ctx = (struct stats_srv_ctx_t *)malloc(sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->hostname = NULL;
+   ctx->servname = NULL;
+   ctx->s = -1;
+   ctx->verbose = 0;
+   ctx->print_f = print_f;
+   ctx->print_arg = print_arg;
+   for (i=0; i < MAX_CLIENTS; ++i) {
+      ctx->clients[i].s = -1;
+      ctx->clients[i].status = C_FREE;
+      ctx->clients[i].wbuf = NULL;
+   }
+
+   return ctx;
+}
+
+void stats_srv_destroy(struct stats_srv_ctx_t *ctx)
+{
+   unsigned i;
+
+   if (ctx == NULL)
+      return;
+
+   for (i=0; i < MAX_CLIENTS; ++i)
+      close_client(&ctx->clients[i]);
+
+   if (ctx->s >= 0)
+      close(ctx->s);
+
+   free(ctx->hostname);
+   free(ctx->servname);
+   free(ctx);
+}
+
+int stats_srv_set_addr(struct stats_srv_ctx_t *ctx, const char *addrport, FILE *err_stream)
+{
+   char *hostname, *servname;
+
+   assert(ctx);
+   assert(addrport);
+
+   hostname = strdup(addrport);
+   if (hostname == NULL) {
+      if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+      return -1;
+   }
+
+   servname = strrchr(hostname, '/');
+   if (servname != NULL)
+      *servname++ = '\0';
+
+   if (servname == NULL || *servname == '\0')
+      servname = STATS_DEFAULT_PORT;
+   servname = strdup(servname);
+   if (servname == NULL) {
+      free(hostname);
+      if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+      return -1;
+   }
+
+   if (hostname[0] == '\0') {
+      free(hostname);
+      hostname = strdup(STATS_DEFAULT_HOST);
+      if (hostname == NULL) {
+	 free(servname);
+	 if (err_stream != NULL) fprintf(err_stream, "%s strdup() error\n", TAG);
+	 return -1;
+      }
+   }
+
+   free(ctx->hostname);
+   free(ctx->servname);
+   ctx->hostname = hostname;
+   ctx->servname = servname;
+
+   return 1;
+}
+
+int stats_srv_is_enabled(struct stats_srv_ctx_t *ctx)
+{
+   assert(ctx);
+   return ctx->servname != NULL;
+}
+
+int stats_srv_init_connection(struct stats_srv_ctx_t *ctx, int verbose)
+{
+   int error;
+   int flags;
+   struct addrinfo hints, *res;
+
+   assert(ctx);
+
+   ctx->verbose = verbose;
+
+   if (!stats_srv_is_enabled(ctx))
+      return 0;
+
+   memset(&hints, 0, sizeof(hints));
+   hints.ai_family = PF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE;
+   error = getaddrinfo(ctx->hostname, ctx->servname, &hints, &res);
+   if (error) {
+      fprintf(stderr, "%s getaddrinfo(%s/%s) error: %s\n",
+	    TAG, ctx->hostname, ctx->servname, gai_strerror(error));
+      return -1;
+   }
+
+   if (ctx->verbose)
+      fprintf(stderr, "%s HTTP metrics on %s/%s\n", TAG, ctx->hostname, ctx->servname);
+
+   ctx->s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+   if (ctx->s < 0) {
+      perror("socket() on stats socket error");
+      freeaddrinfo(res);
+      return -1;
+   }
+
+#ifdef SO_REUSEADDR
+   {
+      unsigned reuseaddr = !0;
+      if (setsockopt(ctx->s, SOL_SOCKET, SO_REUSEADDR, &reuseaddr, sizeof(reuseaddr)) < 0) {
+	 perror("setsockopt(SO_REUSEADDR) error");
+	 freeaddrinfo(res);
+	 return -1;
+      }
+   }
+#endif
+
+   if (bind(ctx->s, res->ai_addr, res->ai_addrlen) < 0) {
+      perror("bind() on stats socket error");
+      freeaddrinfo(res);
+      return -1;
+   }
+   freeaddrinfo(res);
+
+   if (listen(ctx->s, MAX_CLIENTS) < 0) {
+      perror("listen() on stats socket error");
+      return -1;
+   }
+
+   flags = fcntl(ctx->s, F_GETFL, 0);
+   fcntl(ctx->s, F_SETFL, flags | O_NONBLOCK);
+
+   return 1;
+}
+
+void stats_srv_close_connection(struct stats_srv_ctx_t *ctx)
+{
+   unsigned i;
+
+   assert(ctx);
+
+   for (i=0; i < MAX_CLIENTS; ++i)
+      close_client(&ctx->clients[i]);
+
+   if (ctx->s >= 0) {
+      close(ctx->s);
+      ctx->s = -1;
+   }
+}
+
+void stats_srv_on_select(struct stats_srv_ctx_t *ctx, fd_set *readfds, fd_set *writefds, int *maxfd)
+{
+   unsigned i;
+
+   assert(ctx);
+   assert(maxfd);
+
+   if (ctx->s < 0)
+      return;
+
+   FD_SET(ctx->s, readfds);
+   if (ctx->s > *maxfd)
+      *maxfd = ctx->s;
+
+   for (i=0; i < MAX_CLIENTS; ++i) {
+      struct stats_client_t *c = &ctx->clients[i];
+      switch (c->status) {
+	 case C_READING:
+	    FD_SET(c->s, readfds);
+	    break;
+	 case C_WRITING:
+	    FD_SET(c->s, writefds);
+	    break;
+	 case C_FREE:
+	 default:
+	    continue;
+      }
+      if (c->s > *maxfd)
+	 *maxfd = c->s;
+   }
+}
+
+int stats_srv_step(struct stats_srv_ctx_t *ctx, fd_set *readfds, fd_set *writefds)
+{
+   unsigned i;
+   time_t now;
+
+   assert(ctx);
+   assert(readfds);
+   assert(writefds);
+
+   if (ctx->s < 0)
+      return 0;
+
+   now = time(NULL);
+
+   for (i=0; i < MAX_CLIENTS; ++i) {
+      struct stats_client_t *c = &ctx->clients[i];
+      switch (c->status) {
+	 case C_READING:
+	    if (FD_ISSET(c->s, readfds))
+	       read_request(ctx, c);
+	    break;
+	 case C_WRITING:
+	    if (FD_ISSET(c->s, writefds))
+	       write_response(ctx, c);
+	    break;
+	 case C_FREE:
+	 default:
+	    break;
+      }
+
+      if ((c->status != C_FREE)
+	    && (now - c->start_ts > CLIENT_TIMEOUT_S)) {
+	 if (ctx->verbose > 1)
+	    fprintf(stderr, "%s client timeout\n", TAG);
+	 close_client(c);
+      }
+   }
+
+   if (FD_ISSET(ctx->s, readfds))
+      accept_client(ctx);
+
+   return 1;
+}
+
+void stats_print_header(FILE *stream, const char *name, const char *type, const char *help)
+{
+   assert(stream);
+   assert(name);
+
+   if (help != NULL)
+      fprintf(stream, "# HELP %s %s\n", name, help);
+   if (type != NULL)
+      fprintf(stream, "# TYPE %s %s\n", name, type);
+}
+
+void stats_hist_init(struct stats_hist_t *h)
+{
+   assert(h);
+   memset(h, 0, sizeof(*h));
+}
+
+static unsigned hist_bucket_idx(unsigned long long val)
+{
+   unsigned msb;
+   unsigned shift;
+
+   if (val < (1 << STATS_HIST_SUB_BITS))
+      return (unsigned)val;
+
+   msb = 63 - __builtin_clzll(val);
+   shift = msb - STATS_HIST_SUB_BITS;
+
+   return ((shift + 1) << STATS_HIST_SUB_BITS)
+      + (unsigned)((val >> shift) & ((1 << STATS_HIST_SUB_BITS) - 1));
+}
+
+/* Highest value that falls into the bucket  */
+static unsigned long long hist_bucket_max(unsigned idx)
+{
+   unsigned shift;
+
+   if (idx < (1 << STATS_HIST_SUB_BITS))
+      return idx;
+
+   shift = (idx >> STATS_HIST_SUB_BITS) - 1;
+
+   return ((((unsigned long long)1 << STATS_HIST_SUB_BITS)
+	    + (idx & ((1 << STATS_HIST_SUB_BITS) - 1))) << shift)
+      + (((unsigned long long)1 << shift) - 1);
+}
+
+void stats_hist_add(struct stats_hist_t *h, unsigned long long val)
+{
+   assert(h);
+
+   h->buckets[hist_bucket_idx(val)] += 1;
+   h->count += 1;
+   h->sum += val;
+   if (val > h->max)
+      h->max = val;
+}
+
+unsigned long long stats_hist_percentile(const struct stats_hist_t *h, double percentile)
+{
+   unsigned i;
+   unsigned long long rank, cnt;
+
+   assert(h);
+
+   if (h->count == 0)
+      return 0;
+
+   rank = (unsigned long long)(percentile / 100.0 * h->count + 0.5);
+   if (rank == 0)
+      rank = 1;
+
+   cnt = 0;
+   for (i=0; i < STATS_HIST_BUCKETS; ++i) {
+      cnt += h->buckets[i];
+      if (cnt >= rank)
+	 return hist_bucket_max(i) < h->max ? hist_bucket_max(i) : h->max;
+   }
+
+   return h->max;
+}
+
+void stats_hist_print(FILE *stream, const char *name, const char *help,
+      const struct stats_hist_t *h, double scale)
+{
+   unsigned i;
+   static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+   assert(stream);
+   assert(name);
+   assert(h);
+
+   stats_print_header(stream, name, "summary", help);
+   for (i=0; i < sizeof(quantiles)/sizeof(quantiles[0]); ++i) {
+      fprintf(stream, "%s{quantile=\"%g\"} %g\n", name, quantiles[i],
+	    scale * stats_hist_percentile(h, 100.0 * quantiles[i]));
+   }
+   fprintf(stream, "%s_sum %g\n", name, scale * h->sum);
+   fprintf(stream, "%s_count %llu\n", name, h->count);
+   fprintf(stream, "# TYPE %s_max gauge\n", name);
+   fprintf(stream, "%s_max %g\n", name, scale * h->max);
+}
+
+unsigned long long stats_monotonic_us(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void close_client(struct stats_client_t *c)
+{
+   assert(c);
+
+   if (c->s >= 0)
+      close(c->s);
+   free(c->wbuf);
+   c->s = -1;
+   c->wbuf = NULL;
+   c->status = C_FREE;
+}
+
+static void accept_client(struct stats_srv_ctx_t *ctx)
+{
+   int s;
+   int flags;
+   unsigned i;
+   struct stats_client_t *c;
+
+   s = accept(ctx->s, NULL, NULL);
+   if (s < 0) {
+      if (errno != EAGAIN && (errno != EINTR) && ctx->verbose)
+	 fprintf(stderr, "%s accept() error: %s\n", TAG, strerror(errno));
+      return;
+   }
+
+   c = NULL;
+   for (i=0; i < MAX_CLIENTS; ++i) {
+      if (ctx->clients[i].status == C_FREE) {
+	 c = &ctx->clients[i];
+	 break;
+      }
+   }
+
+   if (c == NULL) {
+      if (ctx->verbose > 1)
+	 fprintf(stderr, "%s too many clients\n", TAG);
+      close(s);
+      return;
+   }
+
+   flags = fcntl(s, F_GETFL, 0);
+   fcntl(s, F_SETFL, flags | O_NONBLOCK);
+
+   c->s = s;
+   c->status = C_READING;
+   c->start_ts = time(NULL);
+   c->rpos = 0;
+   c->wbuf = NULL;
+   c->wlen = c->wpos = 0;
+}
+
+static void read_request(struct stats_srv_ctx_t *ctx, struct stats_client_t *c)
+{
+   ssize_t rcvd;
+
+   assert(c->status == C_READING);
+
+   rcvd = read(c->s, &c->rbuf[c->rpos], sizeof(c->rbuf) - c->rpos - 1);
+   if (rcvd == 0) {
+      close_client(c);
+      return;
+   }
+   if (rcvd < 0) {
+      if (errno != EAGAIN && (errno != EINTR))
+	 close_client(c);
+      return;
+   }
+
+   c->rpos += rcvd;
+   c->rbuf[c->rpos] = '\0';
+
+   /* We do not care about headers and path: serve metrics on any GET  */
+   if ((strstr(c->rbuf, "\r\n\r\n") != NULL)
+	 || (strstr(c->rbuf, "\n\n") != NULL)
+	 || (c->rpos == sizeof(c->rbuf) - 1))
+      prepare_response(ctx, c);
+}
+
+static void prepare_response(struct stats_srv_ctx_t *ctx, struct stats_client_t *c)
+{
+   FILE *body_stream;
+   char *body;
+   size_t body_size;
+   char header[200];
+   int header_size;
+
+   body = NULL;
+   body_size = 0;
+
+   if (strncmp(c->rbuf, "GET ", 4) != 0) {
+      header_size = snprintf(header, sizeof(header),
+	    "HTTP/1.0 405 Method Not Allowed\r\n"
+	    "Connection: close\r\n\r\n");
+   }else {
+      body_stream = open_memstream(&body, &body_size);
+      if (body_stream == NULL) {
+	 if (ctx->verbose)
+	    fprintf(stderr, "%s open_memstream() error: %s\n", TAG, strerror(errno));
+	 close_client(c);
+	 return;
+      }
+      ctx->print_f(body_stream, ctx->print_arg);
+      fclose(body_stream);
+
+      header_size = snprintf(header, sizeof(header),
+	    "HTTP/1.0 200 OK\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Content-Length: %lu\r\n"
+	    "Connection: close\r\n\r\n",
+	    (unsigned long)body_size);
+   }
+
+   assert(header_size > 0 && (header_size < (int)sizeof(header)));
+
+   c->wbuf = (char *)malloc(header_size + body_size);
+   if (c->wbuf == NULL) {
+      free(body);
+      close_client(c);
+      return;
+   }
+   memcpy(c->wbuf, header, header_size);
+   if (body_size != 0)
+      memcpy(&c->wbuf[header_size], body, body_size);
+   free(body);
+
+   c->wlen = header_size + body_size;
+   c->wpos = 0;
+   c->status = C_WRITING;
+
+   write_response(ctx, c);
+}
+
+static void write_response(struct stats_srv_ctx_t *ctx, struct stats_client_t *c)
+{
+   ssize_t written;
+
+   assert(c->status == C_WRITING);
+
+   written = write(c->s, &c->wbuf[c->wpos], c->wlen - c->wpos);
+   if (written < 0) {
+      if (errno == EAGAIN || (errno == EINTR))
+	 return;
+      if (ctx->verbose > 1)
+	 fprintf(stderr, "%s write() error: %s\n", TAG, strerror(errno));
+      close_client(c);
+      return;
+   }
+
+   c->wpos += written;
+   if (c->wpos == c->wlen)
+      close_client(c);
+}
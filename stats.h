@@ -0,0 +1,101 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#define STATS_DEFAULT_HOST "127.0.0.1"
+#define STATS_DEFAULT_PORT "9100"
+
+#define STATS_CACHE_LINE_SIZE 64
+
+/*
+ * Prometheus text exposition over HTTP.
+ * print_f is called for every request and writes metrics to the stream
+ */
+typedef void (*stats_print_f)(FILE *stream, void *arg);
+
+struct stats_srv_ctx_t *stats_srv_init(stats_print_f print_f, void *print_arg);
+void stats_srv_destroy(struct stats_srv_ctx_t *ctx);
+int stats_srv_set_addr(struct stats_srv_ctx_t *ctx, const char *addrport, FILE *err_stream);
+int stats_srv_is_enabled(struct stats_srv_ctx_t *ctx);
+
+int stats_srv_init_connection(struct stats_srv_ctx_t *ctx, int verbose);
+/* Closes the listening socket and clients, stats_srv_init_connection() reopens it  */
+void stats_srv_close_connection(struct stats_srv_ctx_t *ctx);
+void stats_srv_on_select(struct stats_srv_ctx_t *ctx, fd_set *readfds, fd_set *writefds, int *maxfd);
+int stats_srv_step(struct stats_srv_ctx_t *ctx, fd_set *readfds, fd_set *writefds);
+
+/* Metric family header: # HELP / # TYPE lines  */
+void stats_print_header(FILE *stream, const char *name, const char *type, const char *help);
+
+/*
+ * Log-bucketed histogram (HDR-style): every power of two is divided into
+ * 2^STATS_HIST_SUB_BITS linear sub-buckets, so relative error of the
+ * reported values is below 1/2^STATS_HIST_SUB_BITS.
+ */
+#define STATS_HIST_SUB_BITS 3
+#define STATS_HIST_BUCKETS (64 << STATS_HIST_SUB_BITS)
+
+struct stats_hist_t {
+   unsigned long long count;
+   unsigned long long sum;
+   unsigned long long max;
+   unsigned long long buckets[STATS_HIST_BUCKETS];
+};
+
+void stats_hist_init(struct stats_hist_t *h);
+void stats_hist_add(struct stats_hist_t *h, unsigned long long val);
+unsigned long long stats_hist_percentile(const struct stats_hist_t *h, double percentile);
+
+/*
+ * Prometheus summary. Values are multiplied by scale on output
+ * (e.g. 1e-6 for histograms in microseconds)
+ */
+void stats_hist_print(FILE *stream, const char *name, const char *help,
+      const struct stats_hist_t *h, double scale);
+
+/* CLOCK_MONOTONIC in microseconds  */
+unsigned long long stats_monotonic_us(void);
+
+/* Cycle counter: TSC on x86, CLOCK_MONOTONIC nanoseconds elsewhere  */
+#if defined(__x86_64__) || defined(__i386__)
+#define STATS_CYCLES_UNIT "tsc"
+static inline unsigned long long stats_cycles(void)
+{
+   return __builtin_ia32_rdtsc();
+}
+#else
+#define STATS_CYCLES_UNIT "ns"
+static inline unsigned long long stats_cycles(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return 1000000000ull * ts.tv_sec + ts.tv_nsec;
+}
+#endif
+
+#endif /* _STATS_H  */
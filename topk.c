@@ -0,0 +1,552 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "topk.h"
+#include "stats.h"
+
+#define TAG "Top talkers:"
+
+#define TOPK_DIM_SUBSCRIBER 0
+#define TOPK_DIM_SERVER     1
+#define TOPK_DIM_SERVICE    2
+#define TOPK_DIMS           3
+
+/* SUBSCRIBER_ID is up to 64 chars, keys are whole 64-bit words  */
+#define TOPK_KEY_SIZE 72
+#define TOPK_KEY_MAX_WORDS (TOPK_KEY_SIZE / 8)
+
+static const char *const topk_dim_names[TOPK_DIMS] = {
+   "subscriber", "server", "service"
+};
+
+static const unsigned topk_dim_key_words[TOPK_DIMS] = {
+   TOPK_KEY_MAX_WORDS, 1, 1
+};
+
+struct topk_counter_t {
+   uint64_t octets;
+   /* Octets inherited on takeover: octets - error <= true count  */
+   uint64_t error;
+   uint32_t hash;
+   /* Position in the min-heap  */
+   uint32_t heap_pos;
+};
+
+/* Counter to sort at the end of the interval  */
+struct topk_rank_t {
+   uint64_t octets;
+   uint32_t idx;
+};
+
+struct topk_top_t {
+   char key[TOPK_KEY_SIZE];
+   uint64_t octets;
+   uint64_t error;
+};
+
+struct topk_sketch_t {
+   unsigned key_words;
+   unsigned cnt;
+   struct topk_counter_t *counters;
+   uint64_t *keys;
+   /* Counter indexes, min-heap by octets: the root is taken over  */
+   uint32_t *heap;
+   /* Counter index + 1, 0 - free slot. Linear probing, at most 50% load  */
+   uint32_t *slots;
+   unsigned slots_mask;
+
+   /* Top of the last interval  */
+   struct topk_top_t *top;
+   unsigned top_cnt;
+
+   unsigned long long takeovers;
+};
+
+struct rdr_topk_ctx_t {
+   unsigned k;
+   unsigned period;
+   unsigned counters_size;
+   int verbose;
+
+   struct topk_sketch_t dims[TOPK_DIMS];
+   struct topk_rank_t *order;
+
+   unsigned long long interval_start_us;
+   unsigned long long interval_turs;
+   unsigned long long interval_octets;
+
+   struct {
+      unsigned long long turs;
+      unsigned long long octets;
+      unsigned long long reports;
+   } stats;
+};
+
+struct rdr_topk_ctx_t *rdr_topk_init()
+{
+   struct rdr_topk_ctx_t *ctx;
+
+   ctx = (struct rdr_topk_ctx_t *)calloc(1, sizeof(*ctx));
+   if (ctx == NULL)
+      return NULL;
+
+   ctx->period = RDR_TOPK_DEFAULT_PERIOD;
+   ctx->counters_size = RDR_TOPK_DEFAULT_COUNTERS;
+
+   return ctx;
+}
+
+void rdr_topk_destroy(struct rdr_topk_ctx_t *ctx)
+{
+   unsigned i;
+
+   if (ctx == NULL)
+      return;
+
+   for (i=0; i < TOPK_DIMS; ++i) {
+      free(ctx->dims[i].counters);
+      free(ctx->dims[i].keys);
+      free(ctx->dims[i].heap);
+      free(ctx->dims[i].slots);
+      free(ctx->dims[i].top);
+   }
+   free(ctx->order);
+   free(ctx);
+}
+
+int rdr_topk_set_params(struct rdr_topk_ctx_t *ctx, const char *params, FILE *err_stream)
+{
+   unsigned long val;
+   char *endptr;
+
+   assert(ctx);
+   assert(params);
+
+   val = strtoul(params, &endptr, 10);
+   if (endptr == params || (val == 0) || (val > RDR_TOPK_MAX_K)
+	 || (*endptr != '\0' && (*endptr != '/'))) {
+      if (err_stream != NULL) fprintf(err_stream, "%s wrong k `%s`, expected 1-%u\n",
+	    TAG, params, RDR_TOPK_MAX_K);
+      return -1;
+   }
+   ctx->k = (unsigned)val;
+
+   if (*endptr == '/') {
+      params = endptr + 1;
+      val = strtoul(params, &endptr, 10);
+      if (endptr == params || (val == 0) || (val > 86400)
+	    || (*endptr != '\0' && (*endptr != '/'))) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong period `%s`\n", TAG, params);
+	 return -1;
+      }
+      ctx->period = (unsigned)val;
+   }
+
+   if (*endptr == '/') {
+      params = endptr + 1;
+      val = strtoul(params, &endptr, 10);
+      if (endptr == params || (*endptr != '\0') || (val < ctx->k) || (val > (1ul << 20))) {
+	 if (err_stream != NULL) fprintf(err_stream, "%s wrong number of counters `%s`\n", TAG, params);
+	 return -1;
+      }
+      ctx->counters_size = (unsigned)val;
+   }
+
+   if (ctx->counters_size < ctx->k)
+      ctx->counters_size = ctx->k;
+
+   return 0;
+}
+
+int rdr_topk_is_enabled(struct rdr_topk_ctx_t *ctx)
+{
+   return ctx->k != 0;
+}
+
+int rdr_topk_start(struct rdr_topk_ctx_t *ctx, int verbose)
+{
+   unsigned i, slots;
+   struct topk_sketch_t *sk;
+
+   assert(ctx);
+
+   ctx->verbose = verbose;
+   if (!rdr_topk_is_enabled(ctx))
+      return 0;
+
+   for (slots = 16; slots < 2 * ctx->counters_size; slots *= 2)
+      ;
+
+   for (i=0; i < TOPK_DIMS; ++i) {
+      sk = &ctx->dims[i];
+      sk->key_words = topk_dim_key_words[i];
+      sk->slots_mask = slots - 1;
+      sk->counters = calloc(ctx->counters_size, sizeof(*sk->counters));
+      sk->keys = calloc((size_t)ctx->counters_size * sk->key_words, sizeof(*sk->keys));
+      sk->heap = calloc(ctx->counters_size, sizeof(*sk->heap));
+      sk->slots = calloc(slots, sizeof(*sk->slots));
+      sk->top = calloc(ctx->k, sizeof(*sk->top));
+      if (sk->counters == NULL || (sk->keys == NULL) || (sk->heap == NULL)
+	    || (sk->slots == NULL) || (sk->top == NULL)) {
+	 fprintf(stderr, "%s calloc() error\n", TAG);
+	 return -1;
+      }
+   }
+   ctx->order = calloc(ctx->counters_size, sizeof(*ctx->order));
+   if (ctx->order == NULL) {
+      fprintf(stderr, "%s calloc() error\n", TAG);
+      return -1;
+   }
+
+   ctx->interval_start_us = stats_monotonic_us();
+
+   if (verbose)
+      fprintf(stderr, "%s top %u by octets every %u s, %u counters per dimension\n",
+	    TAG, ctx->k, ctx->period, ctx->counters_size);
+
+   return 0;
+}
+
+static inline uint32_t key_hash(const uint64_t *key, unsigned words)
+{
+   uint64_t h;
+   unsigned i;
+
+   h = 0xcbf29ce484222325ull;
+   for (i=0; i < words; ++i) {
+      h = (h ^ key[i]) * 0x100000001b3ull;
+      h ^= h >> 29;
+   }
+
+   return (uint32_t)(h ^ (h >> 32));
+}
+
+static inline uint64_t *counter_key(struct topk_sketch_t *sk, unsigned idx)
+{
+   return &sk->keys[(size_t)idx * sk->key_words];
+}
+
+static inline void heap_swap(struct topk_sketch_t *sk, unsigned a, unsigned b)
+{
+   uint32_t t;
+
+   t = sk->heap[a];
+   sk->heap[a] = sk->heap[b];
+   sk->heap[b] = t;
+   sk->counters[sk->heap[a]].heap_pos = a;
+   sk->counters[sk->heap[b]].heap_pos = b;
+}
+
+static void heap_up(struct topk_sketch_t *sk, unsigned pos)
+{
+   unsigned parent;
+
+   while (pos > 0) {
+      parent = (pos - 1) / 2;
+      if (sk->counters[sk->heap[parent]].octets <= sk->counters[sk->heap[pos]].octets)
+	 break;
+      heap_swap(sk, pos, parent);
+      pos = parent;
+   }
+}
+
+static void heap_down(struct topk_sketch_t *sk, unsigned pos)
+{
+   unsigned child, min;
+
+   for (;;) {
+      min = pos;
+      child = 2 * pos + 1;
+      if (child < sk->cnt
+	    && (sk->counters[sk->heap[child]].octets < sk->counters[sk->heap[min]].octets))
+	 min = child;
+      child += 1;
+      if (child < sk->cnt
+	    && (sk->counters[sk->heap[child]].octets < sk->counters[sk->heap[min]].octets))
+	 min = child;
+      if (min == pos)
+	 break;
+      heap_swap(sk, pos, min);
+      pos = min;
+   }
+}
+
+/* Backward shift deletion: no tombstones in the probe sequences  */
+static void slot_remove(struct topk_sketch_t *sk, unsigned idx)
+{
+   unsigned i, j, home;
+
+   for (i = sk->counters[idx].hash & sk->slots_mask; sk->slots[i] != idx + 1;
+	 i = (i + 1) & sk->slots_mask)
+      ;
+
+   for (j = (i + 1) & sk->slots_mask; sk->slots[j] != 0; j = (j + 1) & sk->slots_mask) {
+      home = sk->counters[sk->slots[j] - 1].hash & sk->slots_mask;
+      /* Entry at j may move to i only if its home is not within (i, j]  */
+      if (((j - home) & sk->slots_mask) >= ((j - i) & sk->slots_mask)) {
+	 sk->slots[i] = sk->slots[j];
+	 i = j;
+      }
+   }
+   sk->slots[i] = 0;
+}
+
+static void sketch_add(struct topk_sketch_t *sk, unsigned counters_size,
+      const uint64_t *key, uint64_t octets)
+{
+   struct topk_counter_t *c;
+   uint32_t hash, idx;
+   unsigned i;
+
+   hash = key_hash(key, sk->key_words);
+   for (i = hash & sk->slots_mask; sk->slots[i] != 0; i = (i + 1) & sk->slots_mask) {
+      idx = sk->slots[i] - 1;
+      if (sk->counters[idx].hash == hash
+	    && (memcmp(counter_key(sk, idx), key, sk->key_words * sizeof(*key)) == 0)) {
+	 c = &sk->counters[idx];
+	 c->octets += octets;
+	 heap_down(sk, c->heap_pos);
+	 return;
+      }
+   }
+
+   if (sk->cnt < counters_size) {
+      idx = sk->cnt++;
+      c = &sk->counters[idx];
+      c->octets = octets;
+      c->error = 0;
+      c->heap_pos = idx;
+      sk->heap[idx] = idx;
+      heap_up(sk, idx);
+   }else {
+      /* Take over the smallest counter  */
+      idx = sk->heap[0];
+      c = &sk->counters[idx];
+      slot_remove(sk, idx);
+      for (i = hash & sk->slots_mask; sk->slots[i] != 0; i = (i + 1) & sk->slots_mask)
+	 ;
+      c->error = c->octets;
+      c->octets += octets;
+      sk->takeovers += 1;
+      heap_down(sk, 0);
+   }
+
+   c->hash = hash;
+   memcpy(counter_key(sk, idx), key, sk->key_words * sizeof(*key));
+   sk->slots[i] = idx + 1;
+}
+
+void rdr_topk_add(struct rdr_topk_ctx_t *ctx, const struct rdr_topk_tur_t *tur)
+{
+   uint64_t key[TOPK_KEY_MAX_WORDS];
+
+   if (ctx->order == NULL)
+      return;
+
+   ctx->stats.turs += 1;
+   ctx->stats.octets += tur->octets;
+   ctx->interval_turs += 1;
+   ctx->interval_octets += tur->octets;
+
+   memset(key, 0, sizeof(key));
+   if (tur->subscriber_id != NULL)
+      strncpy((char *)key, tur->subscriber_id, sizeof(key) - 1);
+   sketch_add(&ctx->dims[TOPK_DIM_SUBSCRIBER], ctx->counters_size, key, tur->octets);
+
+   key[0] = tur->server_ip;
+   sketch_add(&ctx->dims[TOPK_DIM_SERVER], ctx->counters_size, key, tur->octets);
+
+   key[0] = (uint32_t)tur->service_id;
+   sketch_add(&ctx->dims[TOPK_DIM_SERVICE], ctx->counters_size, key, tur->octets);
+}
+
+int rdr_topk_report_due(struct rdr_topk_ctx_t *ctx, unsigned long long now_us)
+{
+   return ctx->order != NULL
+      && (now_us - ctx->interval_start_us >= 1000000ull * ctx->period);
+}
+
+static int cmp_rank_desc(const void *a, const void *b)
+{
+   uint64_t oa, ob;
+
+   oa = ((const struct topk_rank_t *)a)->octets;
+   ob = ((const struct topk_rank_t *)b)->octets;
+
+   return oa < ob ? 1 : (oa > ob ? -1 : 0);
+}
+
+static void format_key(unsigned dim, const uint64_t *key, char *buf, size_t size)
+{
+   struct in_addr addr;
+
+   switch (dim) {
+      case TOPK_DIM_SUBSCRIBER:
+	 snprintf(buf, size, "%s", (const char *)key);
+	 break;
+      case TOPK_DIM_SERVER:
+	 addr.s_addr = (in_addr_t)key[0];
+	 snprintf(buf, size, "%s", inet_ntoa(addr));
+	 break;
+      default:
+	 snprintf(buf, size, "%i", (int)(uint32_t)key[0]);
+	 break;
+   }
+}
+
+/* Keeps the top of the sketch and resets it  */
+static void sketch_close_interval(struct topk_sketch_t *sk, unsigned dim,
+      unsigned k, struct topk_rank_t *order)
+{
+   unsigned i;
+
+   for (i=0; i < sk->cnt; ++i) {
+      order[i].octets = sk->counters[i].octets;
+      order[i].idx = i;
+   }
+   qsort(order, sk->cnt, sizeof(*order), cmp_rank_desc);
+
+   sk->top_cnt = sk->cnt < k ? sk->cnt : k;
+   for (i=0; i < sk->top_cnt; ++i) {
+      format_key(dim, counter_key(sk, order[i].idx), sk->top[i].key, sizeof(sk->top[i].key));
+      sk->top[i].octets = order[i].octets;
+      sk->top[i].error = sk->counters[order[i].idx].error;
+   }
+
+   sk->cnt = 0;
+   memset(sk->slots, 0, (size_t)(sk->slots_mask + 1) * sizeof(*sk->slots));
+}
+
+void rdr_topk_report(struct rdr_topk_ctx_t *ctx, FILE *stream, unsigned long long now_us)
+{
+   unsigned i, j;
+   struct topk_sketch_t *sk;
+
+   if (ctx->order == NULL)
+      return;
+
+   for (i=0; i < TOPK_DIMS; ++i)
+      sketch_close_interval(&ctx->dims[i], i, ctx->k, ctx->order);
+
+   fprintf(stream, "%s %.1f s, %llu TURs, %llu octets\n"
+	 "%-10s %4s %-24s %20s %20s %7s\n",
+	 TAG, (now_us - ctx->interval_start_us) / 1e6,
+	 ctx->interval_turs, ctx->interval_octets,
+	 "dimension", "rank", "key", "octets", "error", "share");
+   for (i=0; i < TOPK_DIMS; ++i) {
+      sk = &ctx->dims[i];
+      for (j=0; j < sk->top_cnt; ++j) {
+	 fprintf(stream, "%-10s %4u %-24s %20llu %20llu %6.2f%%\n",
+	       topk_dim_names[i], j + 1, sk->top[j].key,
+	       (unsigned long long)sk->top[j].octets,
+	       (unsigned long long)sk->top[j].error,
+	       ctx->interval_octets ? 100.0 * sk->top[j].octets / ctx->interval_octets : 0.0);
+      }
+   }
+
+   ctx->stats.reports += 1;
+   ctx->interval_start_us = now_us;
+   ctx->interval_turs = 0;
+   ctx->interval_octets = 0;
+}
+
+/* Label value: \, " and newline are escaped  */
+static void print_label_value(FILE *stream, const char *val)
+{
+   for (; *val != '\0'; ++val) {
+      if (*val == '\\' || (*val == '"'))
+	 fputc('\\', stream);
+      if (*val == '\n')
+	 fputs("\\n", stream);
+      else
+	 fputc(*val, stream);
+   }
+}
+
+void rdr_topk_print_stats(struct rdr_topk_ctx_t *ctx, FILE *stream)
+{
+   unsigned i, j;
+   struct topk_sketch_t *sk;
+
+   assert(ctx);
+   assert(stream);
+
+   if (ctx->order == NULL)
+      return;
+
+#define PRINT_TOPK_METRIC(_name, _type, _help, _val) \
+   stats_print_header(stream, "rdr2netflow_topk_" _name, _type, _help); \
+   fprintf(stream, "rdr2netflow_topk_" _name " %llu\n", (unsigned long long)(_val));
+
+   PRINT_TOPK_METRIC("turs_total", "counter",
+	 "TURs counted by the heavy hitter sketches", ctx->stats.turs)
+   PRINT_TOPK_METRIC("octets_total", "counter",
+	 "TUR octets counted by the heavy hitter sketches", ctx->stats.octets)
+   PRINT_TOPK_METRIC("reports_total", "counter",
+	 "Completed top talker intervals", ctx->stats.reports)
+
+#undef PRINT_TOPK_METRIC
+
+   stats_print_header(stream, "rdr2netflow_topk_takeovers_total", "counter",
+	 "Keys that took over the smallest counter of a full sketch");
+   for (i=0; i < TOPK_DIMS; ++i)
+      fprintf(stream, "rdr2netflow_topk_takeovers_total{dimension=\"%s\"} %llu\n",
+	    topk_dim_names[i], ctx->dims[i].takeovers);
+
+   stats_print_header(stream, "rdr2netflow_topk_octets", "gauge",
+	 "Top talkers of the last interval, octets (overestimated by at most the error)");
+   for (i=0; i < TOPK_DIMS; ++i) {
+      sk = &ctx->dims[i];
+      for (j=0; j < sk->top_cnt; ++j) {
+	 fprintf(stream, "rdr2netflow_topk_octets{dimension=\"%s\",rank=\"%u\",key=\"",
+	       topk_dim_names[i], j + 1);
+	 print_label_value(stream, sk->top[j].key);
+	 fprintf(stream, "\"} %llu\n", (unsigned long long)sk->top[j].octets);
+      }
+   }
+
+   stats_print_header(stream, "rdr2netflow_topk_error_octets", "gauge",
+	 "Error bound of the top talkers of the last interval, octets");
+   for (i=0; i < TOPK_DIMS; ++i) {
+      sk = &ctx->dims[i];
+      for (j=0; j < sk->top_cnt; ++j) {
+	 fprintf(stream, "rdr2netflow_topk_error_octets{dimension=\"%s\",rank=\"%u\",key=\"",
+	       topk_dim_names[i], j + 1);
+	 print_label_value(stream, sk->top[j].key);
+	 fprintf(stream, "\"} %llu\n", (unsigned long long)sk->top[j].error);
+      }
+   }
+}
@@ -0,0 +1,69 @@
+/*-
+ * Copyright (c) 2012 Alexey Illarionov <littlesavage@rambler.ru>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+#ifndef _TOPK_H
+#define _TOPK_H
+
+#define RDR_TOPK_DEFAULT_K 10
+#define RDR_TOPK_DEFAULT_PERIOD 60
+#define RDR_TOPK_DEFAULT_COUNTERS 1024
+#define RDR_TOPK_MAX_K 100
+
+struct rdr_topk_tur_t {
+   const char *subscriber_id;
+   /* Network byte order  */
+   in_addr_t server_ip;
+   int service_id;
+   unsigned long long octets;
+};
+
+/*
+ * Heavy hitters by TUR octets: a space-saving sketch of a fixed number of
+ * counters per dimension (subscriber, server IP, service). A key that is
+ * not counted takes over the smallest counter and inherits its count as
+ * the error bound, so any key with more than total/counters octets in the
+ * interval is reported and the reported count exceeds the true one by at
+ * most the error.
+ *
+ * Every period the top k keys are written to the log, kept for the
+ * metrics and the sketches start over.
+ */
+struct rdr_topk_ctx_t *rdr_topk_init();
+void rdr_topk_destroy(struct rdr_topk_ctx_t *ctx);
+/* k[/sec[/counters]]  */
+int rdr_topk_set_params(struct rdr_topk_ctx_t *ctx, const char *params, FILE *err_stream);
+int rdr_topk_is_enabled(struct rdr_topk_ctx_t *ctx);
+
+int rdr_topk_start(struct rdr_topk_ctx_t *ctx, int verbose);
+void rdr_topk_add(struct rdr_topk_ctx_t *ctx, const struct rdr_topk_tur_t *tur);
+/* The period is over: time for rdr_topk_report()  */
+int rdr_topk_report_due(struct rdr_topk_ctx_t *ctx, unsigned long long now_us);
+/* Writes the top of the interval to the stream and resets the sketches  */
+void rdr_topk_report(struct rdr_topk_ctx_t *ctx, FILE *stream, unsigned long long now_us);
+void rdr_topk_print_stats(struct rdr_topk_ctx_t *ctx, FILE *stream);
+
+#endif /* _TOPK_H  */